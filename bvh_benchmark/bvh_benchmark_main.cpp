@@ -0,0 +1,671 @@
+/*
+
+Command line option example:
+(1) Benchmark the meshes bundled in data/
+(2) -res 1024 1024 -num-threads 8 path/to/a.obj path/to/b.obj
+(3) -out-of-core 100000 path/to/a.obj
+(4) -multi-hit 16
+
+EN: This program measures the CPU BVH library (common/bvh_builder.h) without any GPU.
+    Each mesh is built with every arity and builder setting,
+    then primary rays from a pinhole camera, diffuse bounce rays from the primary hits and
+    shadow rays from the primary hits to a point light are traced with a fixed seed.
+    The build time, the memory of the BVH, the peak memory of the build and the throughput of each ray set
+    are reported.
+    The hits of every setting are compared against the first one, so a regression in the builders or
+    the traversal shows up as mismatches and a non-zero exit code.
+    -out-of-core adds the out-of-core build with the given number of triangles per cluster,
+    streaming the mesh into a temporary cache file traced through its mapped view.
+    -multi-hit sets the number of hits gathered along the primary rays by the multi-hit traversal,
+    compared with re-launching the closest hit traversal (0 disables it).
+
+*/
+
+#include "../common/common_host.h"
+#include "../common/bvh_builder.h"
+#include <cstring>
+
+#if defined(HP_Platform_Windows_MSVC)
+void devPrintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char str[4096];
+    vsnprintf_s(str, sizeof(str), _TRUNCATE, fmt, args);
+    va_end(args);
+    OutputDebugString(str);
+}
+#endif
+
+
+
+struct BenchmarkMesh {
+    std::filesystem::path filePath;
+    std::vector<Point3D> positions;
+    // EN: One triangle list per object or group in the file. They share the positions.
+    std::vector<std::vector<shared::Triangle>> triangleGroups;
+    std::vector<bvh::Geometry> geometries;
+    AABB bounds;
+    uint32_t numTriangles;
+};
+
+// EN: Minimal OBJ reader for positions and faces only. Polygons are triangulated as fans.
+static bool loadObj(const std::filesystem::path &filePath, BenchmarkMesh* const mesh) {
+    std::ifstream ifs(filePath);
+    if (!ifs)
+        return false;
+
+    mesh->filePath = filePath;
+    mesh->positions.clear();
+    mesh->triangleGroups.clear();
+    mesh->triangleGroups.emplace_back();
+
+    std::string line;
+    std::vector<uint32_t> polygon;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        std::string tag;
+        iss >> tag;
+        if (tag == "v") {
+            Point3D p;
+            iss >> p.x >> p.y >> p.z;
+            mesh->positions.push_back(p);
+        }
+        else if (tag == "o" || tag == "g") {
+            if (!mesh->triangleGroups.back().empty())
+                mesh->triangleGroups.emplace_back();
+        }
+        else if (tag == "f") {
+            polygon.clear();
+            std::string vertex;
+            while (iss >> vertex) {
+                // EN: "p", "p/t", "p//n" or "p/t/n", negative indices are relative to the end.
+                const int64_t idx = std::stoll(vertex.substr(0, vertex.find('/')));
+                const int64_t numPositions = static_cast<int64_t>(mesh->positions.size());
+                const int64_t absIdx = idx < 0 ? numPositions + idx : idx - 1;
+                if (absIdx < 0 || absIdx >= numPositions) {
+                    hpprintf("%s: invalid vertex index %s.\n", filePath.string().c_str(), vertex.c_str());
+                    return false;
+                }
+                polygon.push_back(static_cast<uint32_t>(absIdx));
+            }
+            for (uint32_t i = 2; i < polygon.size(); ++i)
+                mesh->triangleGroups.back().push_back(shared::Triangle{ polygon[0], polygon[i - 1], polygon[i] });
+        }
+    }
+    if (mesh->triangleGroups.back().empty())
+        mesh->triangleGroups.pop_back();
+
+    mesh->bounds = AABB();
+    for (const Point3D &p : mesh->positions)
+        mesh->bounds.unify(p);
+
+    mesh->numTriangles = 0;
+    mesh->geometries.clear();
+    for (const std::vector<shared::Triangle> &triangles : mesh->triangleGroups) {
+        bvh::Geometry geom = {};
+        geom.vertices = mesh->positions.data();
+        geom.vertexStride = sizeof(mesh->positions[0]);
+        geom.vertexFormat = bvh::VertexFormat::Fp32x3;
+        geom.numVertices = static_cast<uint32_t>(mesh->positions.size());
+        geom.triangles = triangles.data();
+        geom.triangleStride = sizeof(triangles[0]);
+        geom.triangleFormat = bvh::TriangleFormat::UI32x3;
+        geom.numTriangles = static_cast<uint32_t>(triangles.size());
+        geom.preTransform = Matrix4x4();
+        mesh->geometries.push_back(geom);
+        mesh->numTriangles += geom.numTriangles;
+    }
+
+    return mesh->numTriangles > 0;
+}
+
+
+
+struct BuilderSetting {
+    bvh::GeometryBVHBuilder builder;
+    float splittingBudget;
+    uint32_t numTreeletOptimizationPasses;
+    const char* name;
+};
+
+static const BuilderSetting builderSettings[] = {
+    { bvh::GeometryBVHBuilder::SBVH, 0.3f, 0, "SBVH" },
+    { bvh::GeometryBVHBuilder::SBVH, 0.0f, 0, "SAH (no spatial splits)" },
+    { bvh::GeometryBVHBuilder::LBVH, 0.0f, 0, "LBVH" },
+    { bvh::GeometryBVHBuilder::LBVH, 0.0f, 3, "LBVH + Treelet Restructuring" },
+    { bvh::GeometryBVHBuilder::PLOC, 0.0f, 0, "PLOC" },
+    { bvh::GeometryBVHBuilder::PLOC, 0.0f, 3, "PLOC + Treelet Restructuring" },
+};
+
+struct RaySets {
+    std::vector<bvh::Ray> primaryRays;
+    std::vector<bvh::Ray> diffuseRays;
+    std::vector<bvh::Ray> shadowRays;
+};
+
+// EN: Hits of a setting, compared with the first setting of the same mesh.
+struct TraceResults {
+    std::vector<float> primaryDists;
+    std::vector<float> diffuseDists;
+    std::vector<uint8_t> shadowOcclusions;
+};
+
+struct BenchmarkOptions {
+    uint32_t imageWidth = 512;
+    uint32_t imageHeight = 512;
+    uint32_t numBuildThreads = 0;
+    uint32_t seed = 591731;
+    // EN: 0 disables the out-of-core setting.
+    uint32_t outOfCoreClusterSize = 0;
+    uint32_t maxNumMultiHits = 8;
+};
+
+template <uint32_t arity>
+static size_t calcMemorySize(const bvh::GeometryBVH<arity> &bvh) {
+    return
+        bvh.intNodes.size() * sizeof(bvh.intNodes[0]) +
+        bvh.triStorages.size() * sizeof(bvh.triStorages[0]) +
+        bvh.primRefs.size() * sizeof(bvh.primRefs[0]) +
+        bvh.parentPointers.size() * sizeof(bvh.parentPointers[0]) +
+        bvh.woopTris.size() * sizeof(bvh.woopTris[0]) +
+        bvh.woopTriBlocks4.size() * sizeof(bvh.woopTriBlocks4[0]) +
+        bvh.woopTriBlocks8.size() * sizeof(bvh.woopTriBlocks8[0]) +
+        bvh.leafTriBlockIndices.size() * sizeof(bvh.leafTriBlockIndices[0]);
+}
+
+static Point3D calcHitPoint(const bvh::Ray &ray, const shared::HitObject &hitObj) {
+    return ray.org + hitObj.dist * ray.dir;
+}
+
+static Vector3D calcGeometricNormal(const BenchmarkMesh &mesh, const shared::HitObject &hitObj) {
+    const shared::Triangle &tri = mesh.triangleGroups[hitObj.geomIndex][hitObj.primIndex];
+    const Point3D &pA = mesh.positions[tri.index0];
+    const Point3D &pB = mesh.positions[tri.index1];
+    const Point3D &pC = mesh.positions[tri.index2];
+    return normalize(cross(pB - pA, pC - pA));
+}
+
+// EN: The ray sets depend only on the mesh (and the seed), so every setting traces exactly the same rays.
+//     The secondary rays start from the primary hits computed with a reference BVH.
+template <uint32_t arity>
+static void generateRaySets(
+    const BenchmarkMesh &mesh, const bvh::GeometryBVH<arity> &refBvh, const BenchmarkOptions &options,
+    RaySets* const raySets) {
+    const uint32_t width = options.imageWidth;
+    const uint32_t height = options.imageHeight;
+    const float aspect = static_cast<float>(width) / height;
+    const float fovY = 45 * pi_v<float> / 180;
+
+    const Point3D sceneCenter = mesh.bounds.getCenter();
+    const float sceneRadius = 0.5f * length(mesh.bounds.maxP - mesh.bounds.minP);
+    const float rayOffset = 1e-5f * sceneRadius;
+
+    // EN: Look at the center from the front, slightly above, so that the whole mesh fits in the view.
+    const Point3D camPos = sceneCenter + sceneRadius / std::sin(0.5f * fovY) * normalize(Vector3D(0.3f, 0.4f, 1.0f));
+    const Vector3D camForward = normalize(sceneCenter - camPos);
+    const Vector3D camRight = normalize(cross(camForward, Vector3D(0, 1, 0)));
+    const Vector3D camUp = cross(camRight, camForward);
+
+    raySets->primaryRays.resize(width * height);
+    for (uint32_t ipy = 0; ipy < height; ++ipy) {
+        for (uint32_t ipx = 0; ipx < width; ++ipx) {
+            const float px = ipx + 0.5f;
+            const float py = ipy + 0.5f;
+            bvh::Ray &ray = raySets->primaryRays[width * ipy + ipx];
+            ray.org = camPos;
+            ray.dir = normalize(
+                aspect * std::tan(fovY * 0.5f) * (2 * px / width - 1) * camRight +
+                std::tan(fovY * 0.5f) * (1 - 2 * py / height) * camUp +
+                camForward);
+            ray.distMin = 0.0f;
+            ray.distMax = 1e+10f;
+        }
+    }
+
+    const Point3D lightPos = sceneCenter + 2 * sceneRadius * normalize(Vector3D(-0.5f, 1.0f, 0.3f));
+
+    std::mt19937 rng(options.seed);
+    std::uniform_real_distribution<float> u01;
+    raySets->diffuseRays.clear();
+    raySets->shadowRays.clear();
+    for (const bvh::Ray &primaryRay : raySets->primaryRays) {
+        const shared::HitObject hitObj = bvh::traverse(
+            refBvh, primaryRay.org, primaryRay.dir, primaryRay.distMin, primaryRay.distMax);
+        if (!hitObj.isHit())
+            continue;
+
+        Vector3D geomNormal = calcGeometricNormal(mesh, hitObj);
+        if (dot(geomNormal, primaryRay.dir) > 0)
+            geomNormal = -geomNormal;
+        const Point3D hitPoint = calcHitPoint(primaryRay, hitObj) + rayOffset * geomNormal;
+
+        Vector3D dir;
+        do {
+            dir = Vector3D(2 * u01(rng) - 1, 2 * u01(rng) - 1, 2 * u01(rng) - 1);
+        } while (dir.sqLength() > 1.0f || dir.sqLength() == 0.0f);
+        dir = normalize(normalize(dir) + geomNormal);
+
+        bvh::Ray diffuseRay;
+        diffuseRay.org = hitPoint;
+        diffuseRay.dir = dir;
+        diffuseRay.distMin = 0.0f;
+        diffuseRay.distMax = 1e+10f;
+        raySets->diffuseRays.push_back(diffuseRay);
+
+        const Vector3D toLight = lightPos - hitPoint;
+        bvh::Ray shadowRay;
+        shadowRay.org = hitPoint;
+        shadowRay.dir = normalize(toLight);
+        shadowRay.distMin = 0.0f;
+        shadowRay.distMax = length(toLight) * (1 - 1e-4f);
+        raySets->shadowRays.push_back(shadowRay);
+    }
+}
+
+// EN: Gather the first maxNumHits hits along each ray by the multi-hit traversal and by re-launching
+//     the closest hit traversal from each hit with an offset.
+//     The any-hit filter rejects every fourth triangle to emulate alpha testing.
+template <uint32_t arity>
+static void benchmarkMultiHit(
+    const bvh::GeometryBVH<arity> &bvh, const std::vector<bvh::Ray> &rays, const uint32_t maxNumHits) {
+    const bvh::AnyHitFilter isOpaque = []
+    (const shared::HitObject &hitObj) {
+        return hitObj.primIndex % 4 != 0;
+    };
+    std::vector<shared::HitObject> hitObjs(maxNumHits);
+    StopWatchHiRes sw;
+
+    uint64_t numMultiHits = 0;
+    sw.start();
+    for (const bvh::Ray &ray : rays) {
+        numMultiHits += bvh::traverseMultiHit(
+            bvh, ray.org, ray.dir, ray.distMin, ray.distMax, maxNumHits, hitObjs.data(), isOpaque);
+    }
+    const uint32_t multiHitIdx = sw.stop();
+
+    // EN: The offset skips hits at almost the same distance (e.g. on shared edges).
+    uint64_t numRelaunchHits = 0;
+    uint64_t numRelaunches = 0;
+    sw.start();
+    for (const bvh::Ray &ray : rays) {
+        float distMin = ray.distMin;
+        for (uint32_t numHits = 0; numHits < maxNumHits;) {
+            const shared::HitObject hitObj = bvh::traverse(bvh, ray.org, ray.dir, distMin, ray.distMax);
+            ++numRelaunches;
+            if (!hitObj.isHit())
+                break;
+            if (isOpaque(hitObj)) {
+                ++numHits;
+                ++numRelaunchHits;
+            }
+            distMin = hitObj.dist * (1 + 1e-5f);
+        }
+    }
+    const uint32_t relaunchIdx = sw.stop();
+
+    const auto calcMraysPerSec = [&](const size_t numRays, const uint32_t mIdx) {
+        return numRays / std::max(static_cast<double>(
+            sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds)), 1.0);
+    };
+    hpprintf(
+        "    %u hits/ray: multi-hit %7.2f [Mrays/s] (%llu hits), "
+        "re-launch %7.2f [Mrays/s] (%llu hits, %.2f traversals/ray)\n",
+        maxNumHits,
+        calcMraysPerSec(rays.size(), multiHitIdx), static_cast<unsigned long long>(numMultiHits),
+        calcMraysPerSec(rays.size(), relaunchIdx), static_cast<unsigned long long>(numRelaunchHits),
+        static_cast<double>(numRelaunches) / std::max<size_t>(rays.size(), 1));
+}
+
+template <uint32_t arity>
+static void runSetting(
+    const BenchmarkMesh &mesh, const BuilderSetting &setting, const BenchmarkOptions &options,
+    RaySets* const raySets, TraceResults* const results) {
+    bvh::GeometryBVHBuildConfig config = {};
+    config.splittingBudget = setting.splittingBudget;
+    config.intNodeTravCost = 1.2f;
+    config.primIntersectCost = 1.0f;
+    config.minNumPrimsPerLeaf = 1;
+    config.maxNumPrimsPerLeaf = 128;
+    config.numThreads = options.numBuildThreads;
+    config.builder = setting.builder;
+    config.numTreeletOptimizationPasses = setting.numTreeletOptimizationPasses;
+    config.leafTriangleFormat = bvh::LeafTriangleFormat::Raw;
+
+    StopWatchHiRes sw;
+
+    bvh::GeometryBVH<arity> bvh;
+    bvh::BuildMemoryStatistics memStats = {};
+    sw.start();
+    bvh::buildGeometryBVH(
+        mesh.geometries.data(), static_cast<uint32_t>(mesh.geometries.size()),
+        config, &bvh, &memStats);
+    const uint32_t buildIdx = sw.stop();
+
+    if (raySets->primaryRays.empty()) {
+        generateRaySets(mesh, bvh, options, raySets);
+        hpprintf(
+            "  (%zu primary, %zu diffuse, %zu shadow rays)\n",
+            raySets->primaryRays.size(), raySets->diffuseRays.size(), raySets->shadowRays.size());
+    }
+
+    const std::vector<bvh::Ray> &primaryRays = raySets->primaryRays;
+    results->primaryDists.resize(primaryRays.size());
+    sw.start();
+    for (uint32_t rayIdx = 0; rayIdx < primaryRays.size(); ++rayIdx) {
+        const bvh::Ray &ray = primaryRays[rayIdx];
+        results->primaryDists[rayIdx] =
+            bvh::traverse(bvh, ray.org, ray.dir, ray.distMin, ray.distMax).dist;
+    }
+    const uint32_t primaryIdx = sw.stop();
+
+    const std::vector<bvh::Ray> &diffuseRays = raySets->diffuseRays;
+    results->diffuseDists.resize(diffuseRays.size());
+    sw.start();
+    for (uint32_t rayIdx = 0; rayIdx < diffuseRays.size(); ++rayIdx) {
+        const bvh::Ray &ray = diffuseRays[rayIdx];
+        results->diffuseDists[rayIdx] =
+            bvh::traverse(bvh, ray.org, ray.dir, ray.distMin, ray.distMax).dist;
+    }
+    const uint32_t diffuseIdx = sw.stop();
+
+    const std::vector<bvh::Ray> &shadowRays = raySets->shadowRays;
+    results->shadowOcclusions.resize(shadowRays.size());
+    sw.start();
+    for (uint32_t rayIdx = 0; rayIdx < shadowRays.size(); ++rayIdx) {
+        const bvh::Ray &ray = shadowRays[rayIdx];
+        results->shadowOcclusions[rayIdx] =
+            bvh::occluded(bvh, ray.org, ray.dir, ray.distMin, ray.distMax);
+    }
+    const uint32_t shadowIdx = sw.stop();
+
+    const auto calcMraysPerSec = [&](const size_t numRays, const uint32_t mIdx) {
+        return numRays / std::max(static_cast<double>(
+            sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds)), 1.0);
+    };
+    hpprintf(
+        "  %u-ary %-28s: build %10.3f [ms], SAH %7.3f, %9.3f [MiB] (peak %9.3f [MiB]), "
+        "primary %7.2f, diffuse %7.2f, shadow %7.2f [Mrays/s]\n",
+        arity, setting.name,
+        sw.getMeasurement(buildIdx, StopWatchDurationType::Microseconds) * 1e-3,
+        bvh::calcSahCost(bvh, config.intNodeTravCost, config.primIntersectCost),
+        calcMemorySize(bvh) / (1024.0 * 1024.0),
+        memStats.peakMemorySize / (1024.0 * 1024.0),
+        calcMraysPerSec(primaryRays.size(), primaryIdx),
+        calcMraysPerSec(diffuseRays.size(), diffuseIdx),
+        calcMraysPerSec(shadowRays.size(), shadowIdx));
+
+    if (&setting == &builderSettings[0] && options.maxNumMultiHits > 0)
+        benchmarkMultiHit(bvh, primaryRays, options.maxNumMultiHits);
+}
+
+// EN: Same as the SBVH setting but streams the triangles into an out-of-core build.
+//     The mapped view has no occlusion query, so the shadow rays use the closest hit traversal.
+template <uint32_t arity>
+static void runOutOfCoreSetting(
+    const BenchmarkMesh &mesh, const BenchmarkOptions &options,
+    const RaySets &raySets, TraceResults* const results) {
+    const BuilderSetting &setting = builderSettings[0];
+    bvh::OutOfCoreBuildConfig config = {};
+    config.clusterBuildConfig.splittingBudget = setting.splittingBudget;
+    config.clusterBuildConfig.intNodeTravCost = 1.2f;
+    config.clusterBuildConfig.primIntersectCost = 1.0f;
+    config.clusterBuildConfig.minNumPrimsPerLeaf = 1;
+    config.clusterBuildConfig.maxNumPrimsPerLeaf = 128;
+    config.clusterBuildConfig.builder = setting.builder;
+    config.clusterBuildConfig.numTreeletOptimizationPasses = setting.numTreeletOptimizationPasses;
+    config.tempDirectory = std::filesystem::temp_directory_path();
+    config.maxNumTrianglesPerCluster = options.outOfCoreClusterSize;
+    config.numThreads = options.numBuildThreads;
+
+    uint32_t geomIdx = 0;
+    uint32_t primIdx = 0;
+    bvh::TriangleStream stream;
+    stream.rewind = [&]() {
+        geomIdx = 0;
+        primIdx = 0;
+    };
+    stream.readTriangles = [&]
+    (shared::TriangleStorage* const triStorages, const uint32_t maxNumTriangles) {
+        uint32_t numTris = 0;
+        while (numTris < maxNumTriangles && geomIdx < mesh.triangleGroups.size()) {
+            const std::vector<shared::Triangle> &triangles = mesh.triangleGroups[geomIdx];
+            if (primIdx == triangles.size()) {
+                ++geomIdx;
+                primIdx = 0;
+                continue;
+            }
+            const shared::Triangle &tri = triangles[primIdx];
+            shared::TriangleStorage &triStorage = triStorages[numTris++];
+            triStorage = {};
+            triStorage.pA = mesh.positions[tri.index0];
+            triStorage.pB = mesh.positions[tri.index1];
+            triStorage.pC = mesh.positions[tri.index2];
+            triStorage.geomIndex = geomIdx;
+            triStorage.primIndex = primIdx++;
+        }
+        return numTris;
+    };
+
+    const std::filesystem::path filePath =
+        config.tempDirectory / ("bvh_benchmark_" + std::to_string(arity) + ".bvhcache");
+    StopWatchHiRes sw;
+
+    sw.start();
+    const bool built = bvh::buildGeometryBVHOutOfCore<arity>(stream, config, filePath, 0, 0);
+    const uint32_t buildIdx = sw.stop();
+    bvh::MappedGeometryBVH<arity> mappedBvh;
+    if (!built || !mappedBvh.open(filePath, 0, 0))
+        throw std::runtime_error("Failed to build the out-of-core BVH.");
+    const bvh::GeometryBVHView<arity> &bvh = mappedBvh.getView();
+
+    const auto traceRays = [&]
+    (const std::vector<bvh::Ray> &rays, const auto &storeResult) {
+        sw.start();
+        for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+            const bvh::Ray &ray = rays[rayIdx];
+            storeResult(rayIdx, bvh::traverse(bvh, ray.org, ray.dir, ray.distMin, ray.distMax));
+        }
+        return sw.stop();
+    };
+    results->primaryDists.resize(raySets.primaryRays.size());
+    const uint32_t primaryIdx = traceRays(
+        raySets.primaryRays,
+        [&](const uint32_t rayIdx, const shared::HitObject &hitObj) {
+            results->primaryDists[rayIdx] = hitObj.dist;
+        });
+    results->diffuseDists.resize(raySets.diffuseRays.size());
+    const uint32_t diffuseIdx = traceRays(
+        raySets.diffuseRays,
+        [&](const uint32_t rayIdx, const shared::HitObject &hitObj) {
+            results->diffuseDists[rayIdx] = hitObj.dist;
+        });
+    results->shadowOcclusions.resize(raySets.shadowRays.size());
+    const uint32_t shadowIdx = traceRays(
+        raySets.shadowRays,
+        [&](const uint32_t rayIdx, const shared::HitObject &hitObj) {
+            results->shadowOcclusions[rayIdx] = hitObj.isHit();
+        });
+
+    const auto calcMraysPerSec = [&](const size_t numRays, const uint32_t mIdx) {
+        return numRays / std::max(static_cast<double>(
+            sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds)), 1.0);
+    };
+    hpprintf(
+        "  %u-ary %-28s: build %10.3f [ms], SAH %7.3f, %9.3f [MiB] (file), "
+        "primary %7.2f, diffuse %7.2f, shadow %7.2f [Mrays/s]\n",
+        arity, "SBVH (out-of-core)",
+        sw.getMeasurement(buildIdx, StopWatchDurationType::Microseconds) * 1e-3,
+        bvh.sahCostAtBuild,
+        std::filesystem::file_size(filePath) / (1024.0 * 1024.0),
+        calcMraysPerSec(raySets.primaryRays.size(), primaryIdx),
+        calcMraysPerSec(raySets.diffuseRays.size(), diffuseIdx),
+        calcMraysPerSec(raySets.shadowRays.size(), shadowIdx));
+
+    mappedBvh = bvh::MappedGeometryBVH<arity>();
+    std::error_code errorCode;
+    std::filesystem::remove(filePath, errorCode);
+}
+
+template <typename T>
+static uint32_t countMismatches(const std::vector<T> &values, const std::vector<T> &refValues) {
+    uint32_t numMismatches = 0;
+    for (uint32_t i = 0; i < values.size(); ++i) {
+        if (values[i] != refValues[i])
+            ++numMismatches;
+    }
+    return numMismatches;
+}
+
+// EN: Returns the number of settings whose hits differ from the first one.
+static uint32_t benchmarkMesh(const BenchmarkMesh &mesh, const BenchmarkOptions &options) {
+    hpprintf(
+        "%s: %u triangles in %zu geometries\n",
+        mesh.filePath.string().c_str(), mesh.numTriangles, mesh.geometries.size());
+
+    RaySets raySets;
+    TraceResults refResults;
+    bool hasRefResults = false;
+    uint32_t numFailedSettings = 0;
+    const auto compareResults = [&](TraceResults &results) {
+        if (!hasRefResults) {
+            refResults = std::move(results);
+            hasRefResults = true;
+            return;
+        }
+
+        const uint32_t numPrimaryMismatches = countMismatches(results.primaryDists, refResults.primaryDists);
+        const uint32_t numDiffuseMismatches = countMismatches(results.diffuseDists, refResults.diffuseDists);
+        const uint32_t numShadowMismatches =
+            countMismatches(results.shadowOcclusions, refResults.shadowOcclusions);
+        if (numPrimaryMismatches + numDiffuseMismatches + numShadowMismatches > 0) {
+            hpprintf(
+                "    Mismatches against the first setting: primary %u, diffuse %u, shadow %u\n",
+                numPrimaryMismatches, numDiffuseMismatches, numShadowMismatches);
+            ++numFailedSettings;
+        }
+    };
+    const auto runArity = [&]<uint32_t arity>() {
+        for (const BuilderSetting &setting : builderSettings) {
+            TraceResults results;
+            runSetting<arity>(mesh, setting, options, &raySets, &results);
+            compareResults(results);
+        }
+        if (options.outOfCoreClusterSize > 0) {
+            TraceResults results;
+            runOutOfCoreSetting<arity>(mesh, options, raySets, &results);
+            compareResults(results);
+        }
+    };
+    runArity.operator()<2>();
+    runArity.operator()<4>();
+    runArity.operator()<8>();
+
+    return numFailedSettings;
+}
+
+
+
+static void parseCommandline(
+    int32_t argc, const char* argv[],
+    BenchmarkOptions* const options, std::vector<std::filesystem::path>* const filePaths) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+
+        if (strncmp(arg, "-", 1) != 0) {
+            filePaths->push_back(arg);
+            continue;
+        }
+
+        if (strncmp(arg, "-res", 5) == 0) {
+            if (i + 2 >= argc) {
+                hpprintf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+            options->imageWidth = std::max(atoi(argv[i + 1]), 1);
+            options->imageHeight = std::max(atoi(argv[i + 2]), 1);
+            i += 2;
+        }
+        else if (strncmp(arg, "-num-threads", 13) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+            options->numBuildThreads = std::max(atoi(argv[i + 1]), 0);
+            i += 1;
+        }
+        else if (strncmp(arg, "-out-of-core", 13) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+            options->outOfCoreClusterSize = std::max(atoi(argv[i + 1]), 0);
+            i += 1;
+        }
+        else if (strncmp(arg, "-multi-hit", 11) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+            options->maxNumMultiHits = std::max(atoi(argv[i + 1]), 0);
+            i += 1;
+        }
+        else if (strncmp(arg, "-seed", 6) == 0) {
+            if (i + 1 >= argc) {
+                hpprintf("Invalid option.\n");
+                exit(EXIT_FAILURE);
+            }
+            options->seed = static_cast<uint32_t>(strtoul(argv[i + 1], nullptr, 10));
+            i += 1;
+        }
+        else {
+            hpprintf("Unknown option.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int32_t main(int32_t argc, const char* argv[]) try {
+    BenchmarkOptions options;
+    std::vector<std::filesystem::path> filePaths;
+    parseCommandline(argc, argv, &options, &filePaths);
+
+    if (filePaths.empty()) {
+        // EN: The build copies data/ next to bin/, the executable runs in bin/ or bin/<config>/.
+        const std::filesystem::path candidateDataDirs[] = {
+            "data", "../data", "../../data"
+        };
+        for (const std::filesystem::path &dataDir : candidateDataDirs) {
+            if (!std::filesystem::exists(dataDir / "teapot.obj"))
+                continue;
+            filePaths.push_back(dataDir / "stanford_bunny_309_faces.obj");
+            filePaths.push_back(dataDir / "teapot.obj");
+            filePaths.push_back(dataDir / "fabric_instantiated.obj");
+            break;
+        }
+        if (filePaths.empty()) {
+            hpprintf("data/ not found, specify OBJ files on the command line.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t numFailedSettings = 0;
+    for (const std::filesystem::path &filePath : filePaths) {
+        BenchmarkMesh mesh;
+        if (!loadObj(filePath, &mesh)) {
+            hpprintf("Failed to load %s.\n", filePath.string().c_str());
+            return EXIT_FAILURE;
+        }
+        numFailedSettings += benchmarkMesh(mesh, options);
+    }
+
+    if (numFailedSettings > 0) {
+        hpprintf("%u settings produced different hits.\n", numFailedSettings);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+catch (const std::exception &ex) {
+    hpprintf("Error: %s\n", ex.what());
+    return -1;
+}
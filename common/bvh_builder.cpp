@@ -1,5 +1,7 @@
 #include "bvh_builder.h"
 #include "common_host.h"
+#include <queue>
+#include <cstring>
 
 namespace bvh {
 
@@ -10,6 +12,8 @@ enum class PrimitiveType {
 
 
 
+class BuildMemoryTracker;
+
 template <PrimitiveType primType>
 struct BuilderInput;
 
@@ -22,6 +26,10 @@ struct BuilderInput<PrimitiveType::Geometric> {
     float primIntersectCost;
     uint32_t minNumPrimsPerLeaf : 16;
     uint32_t maxNumPrimsPerLeaf : 16;
+    uint32_t numThreads;
+    GeometryBVHBuilder builder;
+    uint32_t numTreeletOptimizationPasses;
+    BuildMemoryTracker* memTracker;
 };
 
 template <>
@@ -31,6 +39,8 @@ struct BuilderInput<PrimitiveType::Instance> {
     float rebraidingBudget;
     uint32_t minNumPrimsPerLeaf : 16;
     uint32_t maxNumPrimsPerLeaf : 16;
+    uint32_t numThreads;
+    BuildMemoryTracker* memTracker;
 };
 
 
@@ -173,14 +183,141 @@ struct TempInternalNode_T {
     } children[arity];
 };
 
+// EN: Parallel build parameters.
+//     Binning of a segment is split into chunks when the segment is large,
+//     and a sub-tree is handed to another thread when it has enough primitive references.
+constexpr uint32_t parallelBinningThreshold = 1 << 14;
+constexpr uint32_t binningGrainSize = 1 << 13;
+constexpr uint32_t parallelSubtreeThreshold = 1 << 10;
+constexpr uint32_t primRefInitGrainSize = 1 << 12;
+
+// EN: Accounts the large arrays of a build to report its peak memory.
+//     The builder allocates and releases them through the tracker, so the peak reflects their actual lifetimes.
+//     Small per-task arrays like stacks are not counted.
+class BuildMemoryTracker {
+    std::atomic<size_t> m_curSize;
+    std::atomic<size_t> m_peakSize;
+
+public:
+    BuildMemoryTracker() : m_curSize(0), m_peakSize(0) {}
+
+    void onAllocate(const size_t size) {
+        const size_t curSize = m_curSize.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peakSize = m_peakSize.load(std::memory_order_relaxed);
+        while (curSize > peakSize &&
+               !m_peakSize.compare_exchange_weak(peakSize, curSize, std::memory_order_relaxed));
+    }
+    void onRelease(const size_t size) {
+        m_curSize.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    template <typename T>
+    void allocate(std::vector<T>* const v, const size_t numElements) {
+        Assert(v->capacity() == 0, "The array is already allocated.");
+        v->resize(numElements);
+        onAllocate(sizeof(T) * v->capacity());
+    }
+    template <typename T>
+    void release(std::vector<T>* const v) {
+        onRelease(sizeof(T) * v->capacity());
+        std::vector<T>().swap(*v);
+    }
+
+    // EN: Accounts arrays whose lifetime is a scope.
+    class ScopedAllocation {
+        BuildMemoryTracker* m_memTracker;
+        size_t m_size;
+
+    public:
+        ScopedAllocation(BuildMemoryTracker* const memTracker, const size_t size) :
+            m_memTracker(memTracker), m_size(size) {
+            m_memTracker->onAllocate(m_size);
+        }
+        ~ScopedAllocation() {
+            m_memTracker->onRelease(m_size);
+        }
+    };
+
+    size_t getCurrentSize() const {
+        return m_curSize.load(std::memory_order_relaxed);
+    }
+    size_t getPeakSize() const {
+        return m_peakSize.load(std::memory_order_relaxed);
+    }
+};
+
+// EN: Array whose elements can be allocated concurrently and never move once allocated.
+//     Chunks are allocated on demand and can be released from the front once their elements are consumed.
+template <typename T, uint32_t log2ChunkSize = 10>
+class ConcurrentChunkedArray {
+    static constexpr uint32_t chunkSize = 1 << log2ChunkSize;
+
+    std::vector<std::atomic<T*>> m_chunks;
+    std::atomic<uint32_t> m_numElements;
+    std::mutex m_mutex;
+    BuildMemoryTracker* m_memTracker;
+    uint32_t m_numReleasedChunks;
+
+public:
+    ConcurrentChunkedArray(const uint32_t maxNumElements, BuildMemoryTracker* const memTracker) :
+        m_chunks((maxNumElements + chunkSize - 1) / chunkSize), m_numElements(0), m_memTracker(memTracker),
+        m_numReleasedChunks(0) {
+        for (std::atomic<T*> &chunk : m_chunks)
+            chunk = nullptr;
+    }
+    ~ConcurrentChunkedArray() {
+        releaseChunks(m_numElements.load() + chunkSize - 1);
+    }
+
+    uint32_t allocate() {
+        const uint32_t idx = m_numElements++;
+        const uint32_t chunkIdx = idx >> log2ChunkSize;
+        Assert_Release(chunkIdx < m_chunks.size(), "Too many elements.");
+        if (m_chunks[chunkIdx].load(std::memory_order_acquire) == nullptr) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_chunks[chunkIdx].load(std::memory_order_relaxed) == nullptr) {
+                m_chunks[chunkIdx].store(new T[chunkSize], std::memory_order_release);
+                m_memTracker->onAllocate(sizeof(T) * chunkSize);
+            }
+        }
+        return idx;
+    }
+
+    // EN: Release the chunks whose elements are all below the given index.
+    //     This is not thread-safe and the released elements must not be accessed anymore.
+    void releaseChunks(const uint32_t endIdx) {
+        const uint32_t numChunks = std::min(endIdx >> log2ChunkSize, static_cast<uint32_t>(m_chunks.size()));
+        for (; m_numReleasedChunks < numChunks; ++m_numReleasedChunks) {
+            T* const chunk = m_chunks[m_numReleasedChunks].exchange(nullptr);
+            if (chunk) {
+                delete[] chunk;
+                m_memTracker->onRelease(sizeof(T) * chunkSize);
+            }
+        }
+    }
+
+    uint32_t size() const {
+        return m_numElements.load();
+    }
+
+    T &operator[](const uint32_t idx) {
+        return m_chunks[idx >> log2ChunkSize].load(std::memory_order_acquire)[idx & (chunkSize - 1)];
+    }
+    const T &operator[](const uint32_t idx) const {
+        return m_chunks[idx >> log2ChunkSize].load(std::memory_order_acquire)[idx & (chunkSize - 1)];
+    }
+};
+
+// EN: Temporary internal nodes live in chunks so that the top-down builder can renumber them in place
+//     and the conversion to the final nodes can release them progressively.
+template <uint32_t arity>
+using TempInternalNodeArray = ConcurrentChunkedArray<TempInternalNode_T<arity>>;
+
 
 
 static void calcTriangleVertices(
-    const BuilderInput<PrimitiveType::Geometric> &buildInput,
-    const uint32_t geomIdx, const uint32_t primIdx,
+    const Geometry &geom, const uint32_t primIdx,
     Point3D* const pA, Point3D* const pB, Point3D* const pC) {
-    const Geometry &geom = buildInput.geometries[geomIdx];
-
     uint32_t tri[3];
     const auto triAddr = reinterpret_cast<uintptr_t>(geom.triangles) + geom.triangleStride * primIdx;
     if (geom.triangleFormat == TriangleFormat::UI32x3) {
@@ -207,36 +344,114 @@ static void calcTriangleVertices(
     *pC = geom.preTransform * ps[2];
 }
 
+static void calcTriangleVertices(
+    const BuilderInput<PrimitiveType::Geometric> &buildInput,
+    const uint32_t geomIdx, const uint32_t primIdx,
+    Point3D* const pA, Point3D* const pB, Point3D* const pC) {
+    calcTriangleVertices(buildInput.geometries[geomIdx], primIdx, pA, pB, pC);
+}
+
 
 
-static void findBestObjectSplit(
-    const std::span<PrimitiveReference> primRefs, const std::span<PrimSplitInfo> primSplitInfos,
-    const uint32_t numPrimRefs, const AABB &centAabb,
-    SplitInfo* const splitInfo) {
-    AABB binAabbs[numObjBins][3];
-    uint32_t binPrimCounts[numObjBins][3];
+struct ObjectBins {
+    AABB aabbs[numObjBins][3];
+    uint32_t primCounts[numObjBins][3];
 
-    // EN: Initialize bins.
-    for (int32_t binIdx = 0; binIdx < numObjBins; ++binIdx) {
-        for (int32_t dim = 0; dim < 3; ++dim) {
-            binAabbs[binIdx][dim] = AABB();
-            binPrimCounts[binIdx][dim] = 0;
+    ObjectBins() {
+        for (int32_t binIdx = 0; binIdx < numObjBins; ++binIdx) {
+            for (int32_t dim = 0; dim < 3; ++dim)
+                primCounts[binIdx][dim] = 0;
         }
     }
 
-    // EN: Perform binning.
-    for (uint32_t primRefIdx = 0; primRefIdx < numPrimRefs; ++primRefIdx) {
-        const PrimitiveReference &primRef = primRefs[primRefIdx];
-        PrimSplitInfo &primSplitInfo = primSplitInfos[primRefIdx];
-        const Point3D np = centAabb.normalize(primRef.box.getCenter());
-        const uint3 binIdx3D = min(make_uint3(numObjBins * np.toNative()), numObjBins - 1);
-        for (int32_t dim = 0; dim < 3; ++dim) {
-            const uint32_t binIdx = binIdx3D[dim];
-            binAabbs[binIdx][dim].unify(primRef.box);
-            ++binPrimCounts[binIdx][dim];
-            primSplitInfo.setBinIndex(dim, binIdx);
+    void merge(const ObjectBins &other) {
+        for (int32_t binIdx = 0; binIdx < numObjBins; ++binIdx) {
+            for (int32_t dim = 0; dim < 3; ++dim) {
+                aabbs[binIdx][dim].unify(other.aabbs[binIdx][dim]);
+                primCounts[binIdx][dim] += other.primCounts[binIdx][dim];
+            }
+        }
+    }
+};
+
+struct SpatialBins {
+    AABB aabbs[numSpaBins][3];
+    uint32_t primEntryCounts[numSpaBins][3];
+    uint32_t primExitCounts[numSpaBins][3];
+
+    SpatialBins() {
+        for (int32_t binIdx = 0; binIdx < numSpaBins; ++binIdx) {
+            for (int32_t dim = 0; dim < 3; ++dim) {
+                primEntryCounts[binIdx][dim] = 0;
+                primExitCounts[binIdx][dim] = 0;
+            }
+        }
+    }
+
+    void merge(const SpatialBins &other) {
+        for (int32_t binIdx = 0; binIdx < numSpaBins; ++binIdx) {
+            for (int32_t dim = 0; dim < 3; ++dim) {
+                aabbs[binIdx][dim].unify(other.aabbs[binIdx][dim]);
+                primEntryCounts[binIdx][dim] += other.primEntryCounts[binIdx][dim];
+                primExitCounts[binIdx][dim] += other.primExitCounts[binIdx][dim];
+            }
         }
     }
+};
+
+// EN: Bin the given range in chunks on multiple threads and merge the results.
+//     AABB union and counting are order-independent, so the result is identical to the serial binning.
+template <typename BinsType, typename BinFunc>
+static void performParallelBinning(
+    ThreadPool* const threadPool, const uint32_t numPrimRefs, const BinFunc &binFunc,
+    BinsType* const bins) {
+    if (threadPool == nullptr || numPrimRefs < parallelBinningThreshold) {
+        binFunc(0, numPrimRefs, bins);
+        return;
+    }
+
+    const uint32_t numChunks = (numPrimRefs + binningGrainSize - 1) / binningGrainSize;
+    std::vector<BinsType> chunkBins(numChunks);
+    parallelFor(
+        threadPool, 0, numChunks, 1,
+        [&](const uint32_t chunkBegin, const uint32_t chunkEnd) {
+        for (uint32_t chunkIdx = chunkBegin; chunkIdx < chunkEnd; ++chunkIdx) {
+            const uint32_t begin = chunkIdx * binningGrainSize;
+            const uint32_t end = std::min(begin + binningGrainSize, numPrimRefs);
+            binFunc(begin, end, &chunkBins[chunkIdx]);
+        }
+    });
+    for (uint32_t chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+        bins->merge(chunkBins[chunkIdx]);
+}
+
+
+
+static void findBestObjectSplit(
+    const std::span<PrimitiveReference> primRefs, const std::span<PrimSplitInfo> primSplitInfos,
+    const uint32_t numPrimRefs, const AABB &centAabb, ThreadPool* const threadPool,
+    SplitInfo* const splitInfo) {
+    // EN: Perform binning.
+    ObjectBins bins;
+    performParallelBinning(
+        threadPool, numPrimRefs,
+        [&](const uint32_t begin, const uint32_t end, ObjectBins* const dstBins) {
+        for (uint32_t primRefIdx = begin; primRefIdx < end; ++primRefIdx) {
+            const PrimitiveReference &primRef = primRefs[primRefIdx];
+            PrimSplitInfo &primSplitInfo = primSplitInfos[primRefIdx];
+            const Point3D np = centAabb.normalize(primRef.box.getCenter());
+            const uint3 binIdx3D = min(make_uint3(numObjBins * np.toNative()), numObjBins - 1);
+            for (int32_t dim = 0; dim < 3; ++dim) {
+                const uint32_t binIdx = binIdx3D[dim];
+                dstBins->aabbs[binIdx][dim].unify(primRef.box);
+                ++dstBins->primCounts[binIdx][dim];
+                primSplitInfo.setBinIndex(dim, binIdx);
+            }
+        }
+    },
+        &bins);
+    const auto &binAabbs = bins.aabbs;
+    const auto &binPrimCounts = bins.primCounts;
 
     // EN: Compute the AABB and the number of primitives for the right side of each split plane.
     AABB rightAabbs[numObjPlanes][3];
@@ -310,38 +525,35 @@ static void findBestObjectSplit(
 
 static void findBestSpatialSplit(
     const std::span<PrimitiveReference> primRefs,
-    const uint32_t numPrims, const AABB &geomAabb,
+    const uint32_t numPrims, const AABB &geomAabb, ThreadPool* const threadPool,
     SplitInfo* const splitInfo) {
-    AABB binAabbs[numSpaBins][3];
-    uint32_t binPrimEntryCounts[numSpaBins][3];
-    uint32_t binPrimExitCounts[numSpaBins][3];
     const Vector3D planePosCoeff = (geomAabb.maxP - geomAabb.minP) / numSpaBins;
 
-    // EN: Initialize bins.
-    for (int32_t binIdx = 0; binIdx < numSpaBins; ++binIdx) {
-        for (int32_t dim = 0; dim < 3; ++dim) {
-            binAabbs[binIdx][dim] = AABB();
-            binPrimEntryCounts[binIdx][dim] = 0;
-            binPrimExitCounts[binIdx][dim] = 0;
-        }
-    }
-
     // EN: Perform binning.
-    for (uint32_t primRefIdx = 0; primRefIdx < numPrims; ++primRefIdx) {
-        const PrimitiveReference &primRef = primRefs[primRefIdx];
-        const Point3D entryNp = geomAabb.normalize(primRef.box.minP);
-        const Point3D exitNp = geomAabb.normalize(primRef.box.maxP);
-        const uint3 entryBinIdx3D = min(make_uint3(numSpaBins * entryNp.toNative()), numSpaBins - 1);
-        const uint3 exitBinIdx3D = min(make_uint3(numSpaBins * exitNp.toNative()), numSpaBins - 1);
-        for (int32_t dim = 0; dim < 3; ++dim) {
-            const uint32_t entryBinIdx = entryBinIdx3D[dim];
-            const uint32_t exitBinIdx = exitBinIdx3D[dim];
-            for (int32_t binIdx = entryBinIdx; binIdx <= static_cast<int32_t>(exitBinIdx); ++binIdx)
-                binAabbs[binIdx][dim].unify(primRef.box);
-            ++binPrimEntryCounts[entryBinIdx][dim];
-            ++binPrimExitCounts[exitBinIdx][dim];
+    SpatialBins bins;
+    performParallelBinning(
+        threadPool, numPrims,
+        [&](const uint32_t begin, const uint32_t end, SpatialBins* const dstBins) {
+        for (uint32_t primRefIdx = begin; primRefIdx < end; ++primRefIdx) {
+            const PrimitiveReference &primRef = primRefs[primRefIdx];
+            const Point3D entryNp = geomAabb.normalize(primRef.box.minP);
+            const Point3D exitNp = geomAabb.normalize(primRef.box.maxP);
+            const uint3 entryBinIdx3D = min(make_uint3(numSpaBins * entryNp.toNative()), numSpaBins - 1);
+            const uint3 exitBinIdx3D = min(make_uint3(numSpaBins * exitNp.toNative()), numSpaBins - 1);
+            for (int32_t dim = 0; dim < 3; ++dim) {
+                const uint32_t entryBinIdx = entryBinIdx3D[dim];
+                const uint32_t exitBinIdx = exitBinIdx3D[dim];
+                for (int32_t binIdx = entryBinIdx; binIdx <= static_cast<int32_t>(exitBinIdx); ++binIdx)
+                    dstBins->aabbs[binIdx][dim].unify(primRef.box);
+                ++dstBins->primEntryCounts[entryBinIdx][dim];
+                ++dstBins->primExitCounts[exitBinIdx][dim];
+            }
         }
-    }
+    },
+        &bins);
+    const auto &binAabbs = bins.aabbs;
+    const auto &binPrimEntryCounts = bins.primEntryCounts;
+    const auto &binPrimExitCounts = bins.primExitCounts;
 
     // EN: Compute the AABB and the number of primitives for the right side of each split plane.
     AABB rightAabbs[numSpaPlanes][3];
@@ -647,325 +859,1299 @@ static void performSpatialSplit(
 
 
 template <uint32_t arity, PrimitiveType primType>
-static void buildBVH(
-    const BuilderInput<primType> &buildInput,
-    typename BVHAlias<arity, primType>::type* const bvh) {
+static void buildTemporaryBVHTopDown(
+    const BuilderInput<primType> &buildInput, const SplitTask &rootTask,
+    const float intTravCost, const float primIsectCost, ThreadPool* const threadPool,
+    TempInternalNodeArray<arity>* const tempIntNodes) {
     using TempInternalNode = TempInternalNode_T<arity>;
-    using InternalNode = shared::InternalNode_T<arity>;
 
-    uint32_t numInputPrimitives = 0;
-    std::vector<uint32_t> inputPrimOffsets;
-    if constexpr (primType == PrimitiveType::Geometric) {
-        inputPrimOffsets.resize(buildInput.numGeometries);
-        for (uint32_t geomIdx = 0; geomIdx < buildInput.numGeometries; ++geomIdx) {
-            const Geometry &geom = buildInput.geometries[geomIdx];
-            inputPrimOffsets[geomIdx] = numInputPrimitives;
-            numInputPrimitives += geom.numTriangles;
-        }
-    }
-    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-        (void)inputPrimOffsets;
-        numInputPrimitives = buildInput.numInstances;
-    }
+    const std::span<PrimitiveReference> primRefs = rootTask.primRefs;
+    const uint32_t numPrimRefsAllocated = static_cast<uint32_t>(primRefs.size());
+    const uint32_t minNumPrimsPerLeaf = buildInput.minNumPrimsPerLeaf;
+    const uint32_t maxNumPrimsPerLeaf = buildInput.maxNumPrimsPerLeaf;
+    const bool allowPrimRefIncrease = numPrimRefsAllocated > rootTask.numActualElems;
+    const float rootSA = rootTask.geomAabb.calcHalfSurfaceArea();
+
+    // EN: Sub-trees can be built on different threads, so temporary internal nodes are allocated
+    //     from a concurrent array.
+    TempInternalNodeArray<arity> &concurrentTempIntNodes = *tempIntNodes;
+    std::unique_ptr<TaskGroup> subtreeTaskGroup;
+    if (threadPool)
+        subtreeTaskGroup = std::make_unique<TaskGroup>(*threadPool);
+
+    std::function<void(const SplitTask &)> buildSubtree;
+    buildSubtree = [&](const SplitTask &subtreeRootTask) {
+        std::vector<SplitTask> stack;
+        stack.push_back(subtreeRootTask);
+
+        // EN: Build a temporary BVH using the top-down approach.
+        while (!stack.empty()) {
+            const SplitTask task = stack.back();
+            stack.pop_back();
+
+            // EN: Try to split the current segment until we get the full arity.
+            SplitTask children[arity];
+            children[0] = task;
+            uint32_t numChildren = 1;
+            while (numChildren < arity) {
+                // EN: Choose a child with the maximum surface area to split.
+                float maxArea = -INFINITY;
+                uint32_t slotToSplit = UINT32_MAX;
+                for (uint32_t slot = 0; slot < numChildren; ++slot) {
+                    const SplitTask &child = children[slot];
+                    if (!child.isSplittable)
+                        continue;
+                    const float area = child.geomAabb.calcHalfSurfaceArea();
+                    if (area > maxArea) {
+                        maxArea = area;
+                        slotToSplit = slot;
+                    }
+                }
+                if (slotToSplit == UINT32_MAX)
+                    break;
 
-    const auto extractGeomAndPrimIndex = [&inputPrimOffsets]
-    (const uint32_t inputPrimIdx,
-     uint32_t* const geomIdx, uint32_t* const primIdx) {
-        const uint32_t numGeoms = static_cast<uint32_t>(inputPrimOffsets.size());
-        *geomIdx = 0;
-        for (int d = nextPowerOf2(numGeoms) >> 1; d >= 1; d >>= 1) {
-            if (*geomIdx + d >= numGeoms)
+                SplitTask taskToSplit = children[slotToSplit];
+
+                const uint32_t numPrimRefsInSubSeg = taskToSplit.numActualElems;
+                const float geomSA = taskToSplit.geomAabb.calcHalfSurfaceArea();
+                const float leafCost = geomSA * numPrimRefsInSubSeg * primIsectCost;
+
+                // EN: Evaluate an object split cost.
+                SplitInfo splitInfo;
+                findBestObjectSplit(
+                    taskToSplit.primRefs, taskToSplit.primSplitInfos,
+                    numPrimRefsInSubSeg, taskToSplit.centAabb, threadPool,
+                    &splitInfo);
+                float splitCost = geomSA * intTravCost + splitInfo.cost * primIsectCost;
+                const bool objSplitSuccess = !std::isinf(splitInfo.cost);
+
+                if constexpr (primType == PrimitiveType::Geometric) {
+                    if (allowPrimRefIncrease && objSplitSuccess &&
+                        numPrimRefsInSubSeg < taskToSplit.primRefs.size()) {
+                        const AABB overlappedAabb = intersect(splitInfo.leftAabb, splitInfo.rightAabb);
+                        const float overlappedSA = overlappedAabb.isValid() ?
+                            overlappedAabb.calcHalfSurfaceArea() : 0.0f;
+                        constexpr float splittingThreshold = 1e-5f;
+                        if (overlappedSA / rootSA > splittingThreshold) {
+                            // EN: Evaluate a spatial split cost.
+                            SplitInfo spaSplitInfo;
+                            findBestSpatialSplit(
+                                taskToSplit.primRefs,
+                                numPrimRefsInSubSeg, taskToSplit.geomAabb, threadPool,
+                                &spaSplitInfo);
+                            const float spaSplitCost = geomSA * intTravCost + spaSplitInfo.cost * primIsectCost;
+                            if (spaSplitCost < splitCost) {
+                                splitInfo = spaSplitInfo;
+                                splitCost = spaSplitCost;
+                            }
+                        }
+                    }
+                }
+                else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+                    // EN: Instances are already opened by rebraiding, so there is no special split.
+                    (void)allowPrimRefIncrease;
+                    (void)rootSA;
+                }
+
+                // EN: When the leaf cost is less than the split cost, mark this sub-segment as non-splittable.
+                if (leafCost < splitCost &&
+                    numPrimRefsInSubSeg <= maxNumPrimsPerLeaf) {
+                    children[slotToSplit].isSplittable = false;
+                    continue;
+                }
+
+                // EN: Perform actual splitting on the current sub-segment based on the best split we found.
+                SplitTask leftTask, rightTask;
+                if (objSplitSuccess) {
+                    if (splitInfo.isSpecialSplit) {
+                        if constexpr (primType == PrimitiveType::Geometric) {
+                            performSpatialSplit(
+                                buildInput,
+                                taskToSplit, splitInfo,
+                                &leftTask, &rightTask);
+                        }
+                        else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+                            Assert_ShouldNotBeCalled();
+                        }
+                    }
+                    else {
+                        performObjectSplit(
+                            taskToSplit, splitInfo, minNumPrimsPerLeaf,
+                            &leftTask, &rightTask);
+                    }
+                }
+                else {
+                    // EN: When splitting failed, fall back to simple equal splitting.
+                    const uint32_t leftPrimCount = numPrimRefsInSubSeg / 2;
+                    const uint32_t rightPrimCount = numPrimRefsInSubSeg - leftPrimCount;
+                    const auto pred = [&leftPrimCount]
+                    (uint32_t idx) {
+                        return idx < leftPrimCount;
+                    };
+                    performPartition(
+                        taskToSplit, pred,
+                        minNumPrimsPerLeaf,
+                        leftPrimCount, rightPrimCount,
+                        &leftTask, &rightTask);
+                }
+                children[slotToSplit] = leftTask;
+                children[numChildren] = rightTask;
+
+                ++numChildren;
+            }
+
+            // EN: When the current segment ended with no splitting, make a leaf node.
+            if (numChildren == 1 && task.parentIndex != UINT32_MAX) {
+                TempInternalNode &parentNode = concurrentTempIntNodes[task.parentIndex];
+                typename TempInternalNode::Child &selfSlot = parentNode.children[task.slotInParent];
+                selfSlot.index = static_cast<uint32_t>(std::distance(
+                    primRefs.data(), task.primRefs.data()));
+                selfSlot.numLeaves = task.numActualElems;
                 continue;
-            if (inputPrimOffsets[*geomIdx + d] <= inputPrimIdx)
-                *geomIdx += d;
+            }
+
+            std::stable_sort(
+                children, children + numChildren,
+                [](const SplitTask &a, const SplitTask &b) {
+                return a.numActualElems > b.numActualElems;
+            });
+
+            // EN: Allocate an internal node and set the index to the parent.
+            const uint32_t intNodeIdx = concurrentTempIntNodes.allocate();
+            if (task.parentIndex != UINT32_MAX) {
+                TempInternalNode &parentNode = concurrentTempIntNodes[task.parentIndex];
+                typename TempInternalNode::Child &selfSlot = parentNode.children[task.slotInParent];
+                selfSlot.index = intNodeIdx;
+            }
+
+            // EN: Make the internal node.
+            //     A large sub-tree is handed to another thread. Note that the slot must be completed
+            //     before that because the child task writes back to it.
+            TempInternalNode &intNode = concurrentTempIntNodes[intNodeIdx];
+            for (uint32_t slot = 0; slot < numChildren; ++slot) {
+                SplitTask &childTask = children[slot];
+                typename TempInternalNode::Child &child = intNode.children[slot];
+                child.aabb = childTask.geomAabb;
+                if (childTask.isSplittable) {
+                    child.numLeaves = 0;
+
+                    childTask.parentIndex = intNodeIdx;
+                    childTask.slotInParent = slot;
+                    if (subtreeTaskGroup && childTask.numActualElems >= parallelSubtreeThreshold) {
+                        subtreeTaskGroup->run([&buildSubtree, childTask]() {
+                            buildSubtree(childTask);
+                        });
+                    }
+                    else {
+                        stack.push_back(childTask);
+                    }
+                }
+                else {
+                    child.index = static_cast<uint32_t>(std::distance(
+                        primRefs.data(), childTask.primRefs.data()));
+                    child.numLeaves = childTask.numActualElems;
+                    Assert(child.numLeaves > 0, "Invalid number of leaves as a leaf node.");
+                }
+            }
+            for (uint32_t slot = numChildren; slot < arity; ++slot) {
+                typename TempInternalNode::Child &child = intNode.children[slot];
+                child.aabb = AABB();
+                child.index = UINT32_MAX;
+                child.numLeaves = 0;
+            }
         }
-        *primIdx = inputPrimIdx - inputPrimOffsets[*geomIdx];
     };
+    buildSubtree(rootTask);
+    if (subtreeTaskGroup)
+        subtreeTaskGroup->wait();
+
+    // EN: Renumber the temporary internal nodes in the order of the depth-first traversal which is
+    //     the allocation order of the single-threaded build, so that the final BVH doesn't depend on
+    //     thread scheduling. The nodes are permuted in place to avoid a second copy of them.
+    const uint32_t numIntNodes = concurrentTempIntNodes.size();
+    {
+        std::vector<uint32_t> newIntNodeIndices;
+        buildInput.memTracker->allocate(&newIntNodeIndices, numIntNodes);
+        uint32_t numVisitedIntNodes = 0;
+        std::vector<uint32_t> stack;
+        stack.push_back(0);
+        while (!stack.empty()) {
+            const uint32_t srcIntNodeIdx = stack.back();
+            stack.pop_back();
+            newIntNodeIndices[srcIntNodeIdx] = numVisitedIntNodes++;
+            const TempInternalNode &intNode = concurrentTempIntNodes[srcIntNodeIdx];
+            for (uint32_t slot = 0; slot < arity; ++slot) {
+                const typename TempInternalNode::Child &child = intNode.children[slot];
+                if (child.index == UINT32_MAX)
+                    break;
+                if (child.numLeaves == 0)
+                    stack.push_back(child.index);
+            }
+        }
+        Assert(numVisitedIntNodes == numIntNodes, "Some internal nodes are unreachable.");
 
-    const uint32_t minNumPrimsPerLeaf = buildInput.minNumPrimsPerLeaf;
-    const uint32_t maxNumPrimsPerLeaf = buildInput.maxNumPrimsPerLeaf;
+        for (uint32_t intNodeIdx = 0; intNodeIdx < numIntNodes; ++intNodeIdx) {
+            TempInternalNode &intNode = concurrentTempIntNodes[intNodeIdx];
+            for (uint32_t slot = 0; slot < arity; ++slot) {
+                typename TempInternalNode::Child &child = intNode.children[slot];
+                if (child.index == UINT32_MAX)
+                    break;
+                if (child.numLeaves == 0)
+                    child.index = newIntNodeIndices[child.index];
+            }
+        }
 
-    uint32_t numPrimRefsAllocated;
-    float intTravCost;
-    float primIsectCost;
-    if constexpr (primType == PrimitiveType::Geometric) {
-        numPrimRefsAllocated = std::max(
-            numInputPrimitives,
-            static_cast<uint32_t>((1.0f + buildInput.splittingBudget) * numInputPrimitives));
-        intTravCost = buildInput.intNodeTravCost;
-        primIsectCost = buildInput.primIntersectCost;
-    }
-    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-        numPrimRefsAllocated = std::max(
-            numInputPrimitives,
-            static_cast<uint32_t>((1.0f + buildInput.rebraidingBudget) * numInputPrimitives));
-        intTravCost = 1.0f;
-        primIsectCost = 100.0f;
+        // EN: Follow each permutation cycle, marking moved nodes by mapping them to themselves.
+        for (uint32_t intNodeIdx = 0; intNodeIdx < numIntNodes; ++intNodeIdx) {
+            while (newIntNodeIndices[intNodeIdx] != intNodeIdx) {
+                const uint32_t dstIntNodeIdx = newIntNodeIndices[intNodeIdx];
+                std::swap(concurrentTempIntNodes[intNodeIdx], concurrentTempIntNodes[dstIntNodeIdx]);
+                std::swap(newIntNodeIndices[intNodeIdx], newIntNodeIndices[dstIntNodeIdx]);
+            }
+        }
+        buildInput.memTracker->release(&newIntNodeIndices);
     }
+}
 
-    // EN: Initialize primitive references.
-    std::vector<PrimitiveReference> primRefsMem(numPrimRefsAllocated);
-    std::vector<PrimSplitInfo> primSplitInfosMem(numPrimRefsAllocated);
-    std::span<PrimitiveReference> primRefs = primRefsMem;
-    std::span<PrimSplitInfo> primSplitInfos = primSplitInfosMem;
-    if constexpr (primType == PrimitiveType::Geometric) {
-        for (uint32_t inputPrimIdx = 0; inputPrimIdx < numInputPrimitives; ++inputPrimIdx) {
-            uint32_t geomIdx, primIdx;
-            extractGeomAndPrimIndex(inputPrimIdx, &geomIdx, &primIdx);
 
-            Point3D pA, pB, pC;
-            calcTriangleVertices(
-                buildInput, geomIdx, primIdx,
-                &pA, &pB, &pC);
 
-            PrimitiveReference primRef = {};
-            primRef.box.unify(pA).unify(pB).unify(pC);
-            primRef.geomIndex = geomIdx;
-            primRef.primIndex = primIdx;
-            primRefs[inputPrimIdx] = primRef;
+// EN: Binary tree made by the bottom-up builders before it is collapsed into the target arity.
+//     A child reference with binaryLeafFlag refers to a primitive reference, otherwise to another binary node.
+constexpr uint32_t binaryLeafFlag = 1u << 31;
+
+struct BinaryNode {
+    AABB aabb;
+    uint32_t children[2];
+};
+
+// EN: Collapse a binary tree into a temporary BVH with the target arity.
+//     Primitive references are reordered so that each binary sub-tree refers to a contiguous range,
+//     then sub-trees are turned into leaves based on the SAH cost.
+template <uint32_t arity>
+static void collapseBinaryTree(
+    const std::vector<BinaryNode> &binNodes, const uint32_t rootRef,
+    const uint32_t minNumPrimsPerLeaf, const uint32_t maxNumPrimsPerLeaf,
+    const float intTravCost, const float primIsectCost,
+    const std::span<PrimitiveReference> primRefs, BuildMemoryTracker* const memTracker,
+    TempInternalNodeArray<arity>* const tempIntNodes) {
+    using TempInternalNode = TempInternalNode_T<arity>;
+
+    struct SubtreeInfo {
+        float cost;
+        uint32_t primRefBegin;
+        uint32_t numPrimRefs : 31;
+        uint32_t makeLeaf : 1;
+    };
+
+    const uint32_t numBinNodes = static_cast<uint32_t>(binNodes.size());
+    const uint32_t numPrimRefs = numBinNodes + 1;
+
+    // EN: Visit binary nodes in pre-order (left child first) to determine the order of primitive references.
+    const BuildMemoryTracker::ScopedAllocation scopedAllocation(
+        memTracker, sizeof(uint32_t) * numPrimRefs + sizeof(SubtreeInfo) * numBinNodes);
+    std::vector<uint32_t> preOrderNodes;
+    memTracker->allocate(&preOrderNodes, numBinNodes);
+    std::vector<uint32_t> leafPositions(numPrimRefs);
+    {
+        uint32_t numVisitedBinNodes = 0;
+        uint32_t numVisitedPrimRefs = 0;
+        std::vector<uint32_t> stack;
+        stack.push_back(rootRef);
+        while (!stack.empty()) {
+            const uint32_t ref = stack.back();
+            stack.pop_back();
+            if (ref & binaryLeafFlag) {
+                const uint32_t primRefIdx = ref & ~binaryLeafFlag;
+                leafPositions[primRefIdx] = numVisitedPrimRefs++;
+                continue;
+            }
+            preOrderNodes[numVisitedBinNodes++] = ref;
+            const BinaryNode &binNode = binNodes[ref];
+            stack.push_back(binNode.children[1]);
+            stack.push_back(binNode.children[0]);
         }
-    }
-    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-        (void)extractGeomAndPrimIndex;
-        for (uint32_t instIdx = 0; instIdx < numInputPrimitives; ++instIdx) {
-            const Instance &inst = buildInput.instances[instIdx];
-            auto &blas = reinterpret_cast<const GeometryBVH<arity> &>(inst.bvhAddress);
-            const shared::InternalNode_T<arity> &rootNode = blas.intNodes[0];
+        Assert(numVisitedPrimRefs == numPrimRefs, "Some primitive references are unreachable.");
 
-            PrimitiveReference primRef = {};
-            primRef.box = inst.rotFromObj * rootNode.getAabb() + inst.transFromObj;
-            primRef.instIndex = instIdx;
-            primRef.nodeIndex = 0;
-            primRefs[instIdx] = primRef;
+        // EN: Move the primitive references to their positions in place by following the permutation cycles.
+        std::vector<bool> isMoved(numPrimRefs, false);
+        for (uint32_t primRefIdx = 0; primRefIdx < numPrimRefs; ++primRefIdx) {
+            if (isMoved[primRefIdx])
+                continue;
+            PrimitiveReference movedPrimRef = primRefs[primRefIdx];
+            uint32_t srcIdx = primRefIdx;
+            while (true) {
+                const uint32_t dstIdx = leafPositions[srcIdx];
+                isMoved[srcIdx] = true;
+                if (dstIdx == primRefIdx) {
+                    primRefs[primRefIdx] = movedPrimRef;
+                    break;
+                }
+                std::swap(movedPrimRef, primRefs[dstIdx]);
+                srcIdx = dstIdx;
+            }
         }
     }
 
-    std::vector<SplitTask> stack;
-
-    // EN: Set up the root task to initialize the top-down build.
-    {
-        SplitTask rootTask = {};
-        rootTask.geomAabb = AABB();
-        rootTask.centAabb = AABB();
-        for (uint32_t globalPrimIdx = 0; globalPrimIdx < numInputPrimitives; ++globalPrimIdx) {
-            const PrimitiveReference &primRef = primRefs[globalPrimIdx];
-            rootTask.geomAabb.unify(primRef.box);
-            rootTask.centAabb.unify(primRef.box.getCenter());
+    // EN: Compute the range and the SAH cost of each sub-tree from the bottom.
+    std::vector<SubtreeInfo> infos(numBinNodes);
+    const auto getSubtreeInfo = [&](const uint32_t ref) {
+        if (ref & binaryLeafFlag) {
+            const uint32_t primRefIdx = leafPositions[ref & ~binaryLeafFlag];
+            SubtreeInfo info;
+            info.cost = primRefs[primRefIdx].box.calcHalfSurfaceArea() * primIsectCost;
+            info.primRefBegin = primRefIdx;
+            info.numPrimRefs = 1;
+            info.makeLeaf = true;
+            return info;
         }
-        rootTask.primRefs = primRefs;
-        rootTask.primSplitInfos = primSplitInfos;
-        rootTask.numActualElems = numInputPrimitives;
-        rootTask.parentIndex = UINT32_MAX;
-        rootTask.slotInParent = 0;
-        rootTask.isSplittable = numInputPrimitives > 1;
-        stack.push_back(rootTask);
+        return infos[ref];
+    };
+    for (auto it = preOrderNodes.crbegin(); it != preOrderNodes.crend(); ++it) {
+        const BinaryNode &binNode = binNodes[*it];
+        const SubtreeInfo leftInfo = getSubtreeInfo(binNode.children[0]);
+        const SubtreeInfo rightInfo = getSubtreeInfo(binNode.children[1]);
+        const float area = binNode.aabb.calcHalfSurfaceArea();
+        SubtreeInfo &info = infos[*it];
+        info.primRefBegin = leftInfo.primRefBegin;
+        info.numPrimRefs = leftInfo.numPrimRefs + rightInfo.numPrimRefs;
+        const float leafCost = area * info.numPrimRefs * primIsectCost;
+        const float splitCost = area * intTravCost + leftInfo.cost + rightInfo.cost;
+        info.makeLeaf =
+            info.numPrimRefs <= maxNumPrimsPerLeaf &&
+            (info.numPrimRefs <= minNumPrimsPerLeaf || leafCost <= splitCost);
+        info.cost = info.makeLeaf ? leafCost : splitCost;
     }
+    memTracker->release(&preOrderNodes);
 
-    const bool allowPrimRefIncrease = numPrimRefsAllocated > numInputPrimitives;
-    const float rootSA = stack.back().geomAabb.calcHalfSurfaceArea();
-    std::vector<TempInternalNode> tempIntNodes;
+    const auto getAabb = [&](const uint32_t ref) {
+        if (ref & binaryLeafFlag)
+            return primRefs[leafPositions[ref & ~binaryLeafFlag]].box;
+        return binNodes[ref].aabb;
+    };
 
-    // EN: Build a temporary BVH using the top-down approach.
+    // EN: Make wide nodes from the top by repeatedly opening a child with the maximum surface area
+    //     in the same manner as the top-down builder.
+    struct CollapseTask {
+        uint32_t ref;
+        uint32_t parentIndex;
+        uint32_t slotInParent;
+    };
+    std::vector<CollapseTask> stack;
+    stack.push_back(CollapseTask{ rootRef, UINT32_MAX, 0 });
     while (!stack.empty()) {
-        const SplitTask task = stack.back();
+        const CollapseTask task = stack.back();
         stack.pop_back();
 
-        // EN: Try to split the current segment until we get the full arity.
-        SplitTask children[arity];
-        children[0] = task;
+        uint32_t childRefs[arity];
         uint32_t numChildren = 1;
+        childRefs[0] = task.ref;
         while (numChildren < arity) {
-            // EN: Choose a child with the maximum surface area to split.
             float maxArea = -INFINITY;
-            uint32_t slotToSplit = UINT32_MAX;
+            uint32_t slotToOpen = UINT32_MAX;
             for (uint32_t slot = 0; slot < numChildren; ++slot) {
-                const SplitTask &child = children[slot];
-                if (!child.isSplittable)
+                if (getSubtreeInfo(childRefs[slot]).makeLeaf)
                     continue;
-                const float area = child.geomAabb.calcHalfSurfaceArea();
+                const float area = getAabb(childRefs[slot]).calcHalfSurfaceArea();
                 if (area > maxArea) {
                     maxArea = area;
-                    slotToSplit = slot;
+                    slotToOpen = slot;
                 }
             }
-            if (slotToSplit == UINT32_MAX)
+            if (slotToOpen == UINT32_MAX)
                 break;
 
-            SplitTask taskToSplit = children[slotToSplit];
-
-            const uint32_t numPrimRefsInSubSeg = taskToSplit.numActualElems;
-            const float geomSA = taskToSplit.geomAabb.calcHalfSurfaceArea();
-            const float leafCost = geomSA * numPrimRefsInSubSeg * primIsectCost;
-
-            // EN: Evaluate an object split cost.
-            SplitInfo splitInfo;
-            findBestObjectSplit(
-                taskToSplit.primRefs, taskToSplit.primSplitInfos,
-                numPrimRefsInSubSeg, taskToSplit.centAabb,
-                &splitInfo);
-            float splitCost = geomSA * intTravCost + splitInfo.cost * primIsectCost;
-            const bool objSplitSuccess = !std::isinf(splitInfo.cost);
-
-            if constexpr (primType == PrimitiveType::Geometric) {
-                if (allowPrimRefIncrease && objSplitSuccess &&
-                    numPrimRefsInSubSeg < taskToSplit.primRefs.size()) {
-                    const AABB overlappedAabb = intersect(splitInfo.leftAabb, splitInfo.rightAabb);
-                    const float overlappedSA = overlappedAabb.isValid() ?
-                        overlappedAabb.calcHalfSurfaceArea() : 0.0f;
-                    constexpr float splittingThreshold = 1e-5f;
-                    if (overlappedSA / rootSA > splittingThreshold) {
-                        // EN: Evaluate a spatial split cost.
-                        SplitInfo spaSplitInfo;
-                        findBestSpatialSplit(
-                            taskToSplit.primRefs,
-                            numPrimRefsInSubSeg, taskToSplit.geomAabb,
-                            &spaSplitInfo);
-                        const float spaSplitCost = geomSA * intTravCost + spaSplitInfo.cost * primIsectCost;
-                        if (spaSplitCost < splitCost) {
-                            splitInfo = spaSplitInfo;
-                            splitCost = spaSplitCost;
-                        }
-                    }
-                }
-            }
-            else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-                Assert_NotImplemented();
-            }
+            const BinaryNode &binNode = binNodes[childRefs[slotToOpen]];
+            childRefs[slotToOpen] = binNode.children[0];
+            childRefs[numChildren] = binNode.children[1];
+            ++numChildren;
+        }
 
-            // EN: When the leaf cost is less than the split cost, mark this sub-segment as non-splittable.
-            if (leafCost < splitCost &&
-                numPrimRefsInSubSeg <= maxNumPrimsPerLeaf) {
-                children[slotToSplit].isSplittable = false;
-                continue;
-            }
+        std::stable_sort(
+            childRefs, childRefs + numChildren,
+            [&getSubtreeInfo](const uint32_t a, const uint32_t b) {
+            return getSubtreeInfo(a).numPrimRefs > getSubtreeInfo(b).numPrimRefs;
+        });
 
-            // EN: Perform actual splitting on the current sub-segment based on the best split we found.
-            SplitTask leftTask, rightTask;
-            if (objSplitSuccess) {
-                if (splitInfo.isSpecialSplit) {
-                    if constexpr (primType == PrimitiveType::Geometric) {
-                        performSpatialSplit(
-                            buildInput,
-                            taskToSplit, splitInfo,
-                            &leftTask, &rightTask);
-                    }
-                    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-                        Assert_NotImplemented();
-                    }
-                }
-                else {
-                    performObjectSplit(
-                        taskToSplit, splitInfo, minNumPrimsPerLeaf,
-                        &leftTask, &rightTask);
-                }
+        const uint32_t intNodeIdx = tempIntNodes->allocate();
+        if (task.parentIndex != UINT32_MAX)
+            (*tempIntNodes)[task.parentIndex].children[task.slotInParent].index = intNodeIdx;
+
+        TempInternalNode &intNode = (*tempIntNodes)[intNodeIdx];
+        for (uint32_t slot = 0; slot < numChildren; ++slot) {
+            const SubtreeInfo childInfo = getSubtreeInfo(childRefs[slot]);
+            typename TempInternalNode::Child &child = intNode.children[slot];
+            child.aabb = getAabb(childRefs[slot]);
+            if (childInfo.makeLeaf) {
+                child.index = childInfo.primRefBegin;
+                child.numLeaves = childInfo.numPrimRefs;
             }
             else {
-                // EN: When splitting failed, fall back to simple equal splitting.
-                const uint32_t leftPrimCount = numPrimRefsInSubSeg / 2;
-                const uint32_t rightPrimCount = numPrimRefsInSubSeg - leftPrimCount;
-                const auto pred = [&leftPrimCount]
-                (uint32_t idx) {
-                    return idx < leftPrimCount;
-                };
-                performPartition(
-                    taskToSplit, pred,
-                    minNumPrimsPerLeaf,
-                    leftPrimCount, rightPrimCount,
-                    &leftTask, &rightTask);
+                child.numLeaves = 0;
+                stack.push_back(CollapseTask{ childRefs[slot], intNodeIdx, slot });
             }
-            children[slotToSplit] = leftTask;
-            children[numChildren] = rightTask;
+        }
+        for (uint32_t slot = numChildren; slot < arity; ++slot) {
+            typename TempInternalNode::Child &child = intNode.children[slot];
+            child.aabb = AABB();
+            child.index = UINT32_MAX;
+            child.numLeaves = 0;
+        }
+    }
+}
 
-            ++numChildren;
+
+
+// EN: Morton code parameters for LBVH.
+//     30-bit codes (10 bits per axis) are enough for moderate inputs and halve the number of sorting passes,
+//     63-bit codes (21 bits per axis) are used for large inputs to avoid many duplicated codes.
+constexpr uint32_t maxNumPrimsFor30bitMortonCode = 1 << 20;
+constexpr uint32_t radixSortDigitBitWidth = 8;
+constexpr uint32_t radixSortGrainSize = 1 << 14;
+constexpr uint32_t lbvhGrainSize = 1 << 12;
+
+static inline uint32_t expandBitsForMortonCode(uint32_t v) {
+    v &= 0x0000'03FF;
+    v = (v | (v << 16)) & 0x0300'00FF;
+    v = (v | (v << 8)) & 0x0300'F00F;
+    v = (v | (v << 4)) & 0x030C'30C3;
+    v = (v | (v << 2)) & 0x0924'9249;
+    return v;
+}
+
+static inline uint64_t expandBitsForMortonCode(uint64_t v) {
+    v &= 0x0000'0000'001F'FFFF;
+    v = (v | (v << 32)) & 0x001F'0000'0000'FFFF;
+    v = (v | (v << 16)) & 0x001F'0000'FF00'00FF;
+    v = (v | (v << 8)) & 0x100F'00F0'0F00'F00F;
+    v = (v | (v << 4)) & 0x10C3'0C30'C30C'30C3;
+    v = (v | (v << 2)) & 0x1249'2492'4924'9249;
+    return v;
+}
+
+template <typename MortonCode>
+static inline MortonCode calcMortonCode(const Point3D &p, const AABB &centAabb) {
+    constexpr uint32_t numBitsPerAxis = sizeof(MortonCode) == 4 ? 10 : 21;
+    constexpr float maxCoord = static_cast<float>((1u << numBitsPerAxis) - 1);
+    const Vector3D extent = centAabb.maxP - centAabb.minP;
+    const auto quantize = [&](const float x, const float minX, const float ext) {
+        const float nx = ext > 0.0f ? (x - minX) / ext : 0.0f;
+        return static_cast<MortonCode>(std::min(std::max(nx * maxCoord + 0.5f, 0.0f), maxCoord));
+    };
+    const MortonCode qx = quantize(p.x, centAabb.minP.x, extent.x);
+    const MortonCode qy = quantize(p.y, centAabb.minP.y, extent.y);
+    const MortonCode qz = quantize(p.z, centAabb.minP.z, extent.z);
+    return
+        (expandBitsForMortonCode(qx) << 2) |
+        (expandBitsForMortonCode(qy) << 1) |
+        expandBitsForMortonCode(qz);
+}
+
+// EN: Parallel LSD radix sort of key-value pairs.
+//     Each pass counts digits per chunk and scatters in (digit, chunk) order, so the sort is stable and
+//     the result is independent of the number of threads.
+template <typename KeyType>
+static void radixSort(
+    ThreadPool* const threadPool, const uint32_t numKeyBits, BuildMemoryTracker* const memTracker,
+    std::vector<KeyType>* const keys, std::vector<uint32_t>* const values) {
+    constexpr uint32_t numBuckets = 1 << radixSortDigitBitWidth;
+    const uint32_t numElements = static_cast<uint32_t>(keys->size());
+    const uint32_t numChunks = (numElements + radixSortGrainSize - 1) / radixSortGrainSize;
+
+    const BuildMemoryTracker::ScopedAllocation scopedAllocation(
+        memTracker, (sizeof(KeyType) + sizeof(uint32_t)) * numElements + sizeof(uint32_t) * numChunks * numBuckets);
+    std::vector<KeyType> tempKeys(numElements);
+    std::vector<uint32_t> tempValues(numElements);
+    std::vector<uint32_t> chunkOffsets(numChunks * numBuckets);
+    for (uint32_t shift = 0; shift < numKeyBits; shift += radixSortDigitBitWidth) {
+        const auto getDigit = [shift](const KeyType key) {
+            return static_cast<uint32_t>((key >> shift) & (numBuckets - 1));
+        };
+
+        parallelFor(
+            threadPool, 0, numChunks, 1,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t chunkIdx = begin; chunkIdx < end; ++chunkIdx) {
+                uint32_t* const counts = &chunkOffsets[chunkIdx * numBuckets];
+                std::fill_n(counts, numBuckets, 0u);
+                const uint32_t elemEnd = std::min((chunkIdx + 1) * radixSortGrainSize, numElements);
+                for (uint32_t elemIdx = chunkIdx * radixSortGrainSize; elemIdx < elemEnd; ++elemIdx)
+                    ++counts[getDigit((*keys)[elemIdx])];
+            }
+        });
+
+        uint32_t offset = 0;
+        for (uint32_t bucketIdx = 0; bucketIdx < numBuckets; ++bucketIdx) {
+            for (uint32_t chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx) {
+                uint32_t &chunkOffset = chunkOffsets[chunkIdx * numBuckets + bucketIdx];
+                const uint32_t count = chunkOffset;
+                chunkOffset = offset;
+                offset += count;
+            }
+        }
+
+        parallelFor(
+            threadPool, 0, numChunks, 1,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t chunkIdx = begin; chunkIdx < end; ++chunkIdx) {
+                uint32_t* const offsets = &chunkOffsets[chunkIdx * numBuckets];
+                const uint32_t elemEnd = std::min((chunkIdx + 1) * radixSortGrainSize, numElements);
+                for (uint32_t elemIdx = chunkIdx * radixSortGrainSize; elemIdx < elemEnd; ++elemIdx) {
+                    const uint32_t dstIdx = offsets[getDigit((*keys)[elemIdx])]++;
+                    tempKeys[dstIdx] = (*keys)[elemIdx];
+                    tempValues[dstIdx] = (*values)[elemIdx];
+                }
+            }
+        });
+
+        keys->swap(tempKeys);
+        values->swap(tempValues);
+    }
+}
+
+// EN: Sort primitive references by the Morton codes of their centroids.
+template <typename MortonCode>
+static void sortPrimitiveReferencesByMortonCode(
+    ThreadPool* const threadPool, const AABB &centAabb, BuildMemoryTracker* const memTracker,
+    const std::span<PrimitiveReference> primRefs, std::vector<MortonCode>* const mortonCodes) {
+    constexpr uint32_t numMortonCodeBits = sizeof(MortonCode) == 4 ? 30 : 63;
+    const uint32_t numPrimRefs = static_cast<uint32_t>(primRefs.size());
+
+    memTracker->allocate(mortonCodes, numPrimRefs);
+    std::vector<uint32_t> sortedIndices;
+    memTracker->allocate(&sortedIndices, numPrimRefs);
+    parallelFor(
+        threadPool, 0, numPrimRefs, lbvhGrainSize,
+        [&](const uint32_t begin, const uint32_t end) {
+        for (uint32_t primRefIdx = begin; primRefIdx < end; ++primRefIdx) {
+            (*mortonCodes)[primRefIdx] = calcMortonCode<MortonCode>(
+                primRefs[primRefIdx].box.getCenter(), centAabb);
+            sortedIndices[primRefIdx] = primRefIdx;
         }
+    });
+    radixSort(threadPool, numMortonCodeBits, memTracker, mortonCodes, &sortedIndices);
 
-        // EN: When the current segment ended with no splitting, make a leaf node.
-        if (numChildren == 1 && task.parentIndex != UINT32_MAX) {
-            TempInternalNode &parentNode = tempIntNodes[task.parentIndex];
-            typename TempInternalNode::Child &selfSlot = parentNode.children[task.slotInParent];
-            selfSlot.index = static_cast<uint32_t>(std::distance(
-                primRefs.data(), task.primRefs.data()));
-            selfSlot.numLeaves = task.numActualElems;
+    // EN: Gather the primitive references in place by following the permutation cycles instead of
+    //     making a sorted copy. Gathered positions are marked by mapping them to themselves.
+    for (uint32_t primRefIdx = 0; primRefIdx < numPrimRefs; ++primRefIdx) {
+        if (sortedIndices[primRefIdx] == primRefIdx)
             continue;
+        const PrimitiveReference firstPrimRef = primRefs[primRefIdx];
+        uint32_t dstIdx = primRefIdx;
+        while (true) {
+            const uint32_t srcIdx = sortedIndices[dstIdx];
+            sortedIndices[dstIdx] = dstIdx;
+            if (srcIdx == primRefIdx) {
+                primRefs[dstIdx] = firstPrimRef;
+                break;
+            }
+            primRefs[dstIdx] = primRefs[srcIdx];
+            dstIdx = srcIdx;
         }
+    }
+    memTracker->release(&sortedIndices);
+}
 
-        std::stable_sort(
-            children, children + numChildren,
-            [](const SplitTask &a, const SplitTask &b) {
-            return a.numActualElems > b.numActualElems;
+// EN: Parameters for treelet restructuring.
+//     The minimum number of primitives for a treelet root doubles every pass so that later passes
+//     work on the upper levels of the tree.
+constexpr uint32_t maxTreeletSize = 7;
+constexpr uint32_t minNumPrimsForTreeletRoot = maxTreeletSize;
+
+// EN: Optimize a binary tree by restructuring treelets (Karras and Aila 2013).
+//     Nodes are processed from the bottom in parallel, and the topology of the treelet of each node
+//     is replaced with the one minimizing the SAH cost found by dynamic programming over subsets of the treelet leaves.
+//     Only nodes inside a treelet are rewritten, and a node is processed after its whole sub-tree is done,
+//     so the result is independent of thread scheduling.
+static void restructureTreelets(
+    ThreadPool* const threadPool, const uint32_t numPasses,
+    const uint32_t maxNumPrimsPerLeaf, const float intTravCost, const float primIsectCost,
+    const std::span<const PrimitiveReference> primRefs, const uint32_t rootRef,
+    BuildMemoryTracker* const memTracker, std::vector<BinaryNode>* const binNodes) {
+    constexpr uint32_t numSubsets = 1 << maxTreeletSize;
+
+    const uint32_t numBinNodes = static_cast<uint32_t>(binNodes->size());
+    const uint32_t numPrimRefs = static_cast<uint32_t>(primRefs.size());
+    if (numBinNodes == 0 || numPasses == 0)
+        return;
+
+    const BuildMemoryTracker::ScopedAllocation scopedAllocation(
+        memTracker,
+        (2 * sizeof(uint32_t) + sizeof(float) + sizeof(std::atomic<uint32_t>)) * numBinNodes +
+        sizeof(uint32_t) * numPrimRefs);
+    std::vector<uint32_t> binNodeParents(numBinNodes);
+    std::vector<uint32_t> leafParents(numPrimRefs);
+    std::vector<uint32_t> numPrimsInSubtrees(numBinNodes);
+    std::vector<float> subtreeCosts(numBinNodes);
+    std::vector<std::atomic<uint32_t>> arrivalCounters(numBinNodes);
+
+    const auto getAabb = [&](const uint32_t ref) -> const AABB & {
+        if (ref & binaryLeafFlag)
+            return primRefs[ref & ~binaryLeafFlag].box;
+        return (*binNodes)[ref].aabb;
+    };
+    const auto getNumPrims = [&](const uint32_t ref) {
+        return (ref & binaryLeafFlag) ? 1 : numPrimsInSubtrees[ref];
+    };
+    const auto getCost = [&](const uint32_t ref) {
+        if (ref & binaryLeafFlag)
+            return primRefs[ref & ~binaryLeafFlag].box.calcHalfSurfaceArea() * primIsectCost;
+        return subtreeCosts[ref];
+    };
+    const auto calcCost = [&](const float area, const uint32_t numPrims, const float childCostSum) {
+        const float splitCost = area * intTravCost + childCostSum;
+        if (numPrims > maxNumPrimsPerLeaf)
+            return splitCost;
+        return std::min(area * numPrims * primIsectCost, splitCost);
+    };
+
+    const auto restructure = [&](const uint32_t binNodeIdx) {
+        // EN: Form a treelet by repeatedly expanding the leaf with the maximum surface area.
+        uint32_t leafRefs[maxTreeletSize];
+        uint32_t intNodeIndices[maxTreeletSize - 2];
+        uint32_t numLeaves = 2;
+        uint32_t numIntNodes = 0;
+        leafRefs[0] = (*binNodes)[binNodeIdx].children[0];
+        leafRefs[1] = (*binNodes)[binNodeIdx].children[1];
+        while (numLeaves < maxTreeletSize) {
+            float maxArea = -INFINITY;
+            uint32_t leafIdxToExpand = UINT32_MAX;
+            for (uint32_t leafIdx = 0; leafIdx < numLeaves; ++leafIdx) {
+                if (leafRefs[leafIdx] & binaryLeafFlag)
+                    continue;
+                const float area = getAabb(leafRefs[leafIdx]).calcHalfSurfaceArea();
+                if (area > maxArea) {
+                    maxArea = area;
+                    leafIdxToExpand = leafIdx;
+                }
+            }
+            if (leafIdxToExpand == UINT32_MAX)
+                break;
+
+            const BinaryNode &binNode = (*binNodes)[leafRefs[leafIdxToExpand]];
+            intNodeIndices[numIntNodes++] = leafRefs[leafIdxToExpand];
+            leafRefs[leafIdxToExpand] = binNode.children[0];
+            leafRefs[numLeaves++] = binNode.children[1];
+        }
+        if (numLeaves < 3)
+            return;
+
+        // EN: Find the optimal topology for every subset of the treelet leaves.
+        AABB subsetAabbs[numSubsets];
+        float subsetCosts[numSubsets];
+        uint32_t subsetNumPrims[numSubsets];
+        uint8_t bestPartitions[numSubsets];
+        const uint32_t fullSet = (1 << numLeaves) - 1;
+        for (uint32_t subset = 1; subset <= fullSet; ++subset) {
+            const uint32_t lowestBit = subset & (~subset + 1);
+            if (subset == lowestBit) {
+                const uint32_t leafIdx = tzcnt(subset);
+                subsetAabbs[subset] = getAabb(leafRefs[leafIdx]);
+                subsetCosts[subset] = getCost(leafRefs[leafIdx]);
+                subsetNumPrims[subset] = getNumPrims(leafRefs[leafIdx]);
+                continue;
+            }
+            subsetAabbs[subset] = subsetAabbs[lowestBit];
+            subsetAabbs[subset].unify(subsetAabbs[subset & ~lowestBit]);
+            subsetNumPrims[subset] = subsetNumPrims[lowestBit] + subsetNumPrims[subset & ~lowestBit];
+
+            // EN: Enumerate partitions where the lowest leaf is on the left to avoid symmetric duplicates.
+            float minChildCostSum = INFINITY;
+            uint32_t bestPartition = 0;
+            for (uint32_t left = (subset - 1) & subset; left != 0; left = (left - 1) & subset) {
+                if ((left & lowestBit) == 0)
+                    continue;
+                const float childCostSum = subsetCosts[left] + subsetCosts[subset & ~left];
+                if (childCostSum < minChildCostSum) {
+                    minChildCostSum = childCostSum;
+                    bestPartition = left;
+                }
+            }
+            subsetCosts[subset] = calcCost(
+                subsetAabbs[subset].calcHalfSurfaceArea(), subsetNumPrims[subset], minChildCostSum);
+            bestPartitions[subset] = static_cast<uint8_t>(bestPartition);
+        }
+
+        // EN: Keep the current topology unless the new one is strictly better.
+        if (subsetCosts[fullSet] >= subtreeCosts[binNodeIdx])
+            return;
+
+        // EN: Rebuild the treelet reusing its internal nodes.
+        struct RebuildEntry {
+            uint32_t subset;
+            uint32_t binNodeIndex;
+        };
+        RebuildEntry stack[maxTreeletSize];
+        uint32_t stackSize = 0;
+        uint32_t numUsedIntNodes = 0;
+        stack[stackSize++] = RebuildEntry{ fullSet, binNodeIdx };
+        while (stackSize > 0) {
+            const RebuildEntry entry = stack[--stackSize];
+            const uint32_t childSubsets[2] = {
+                bestPartitions[entry.subset],
+                entry.subset & ~bestPartitions[entry.subset]
+            };
+            BinaryNode &binNode = (*binNodes)[entry.binNodeIndex];
+            binNode.aabb = subsetAabbs[entry.subset];
+            for (uint32_t childIdx = 0; childIdx < 2; ++childIdx) {
+                const uint32_t childSubset = childSubsets[childIdx];
+                if ((childSubset & (childSubset - 1)) == 0) {
+                    binNode.children[childIdx] = leafRefs[tzcnt(childSubset)];
+                }
+                else {
+                    const uint32_t childBinNodeIdx = intNodeIndices[numUsedIntNodes++];
+                    binNode.children[childIdx] = childBinNodeIdx;
+                    stack[stackSize++] = RebuildEntry{ childSubset, childBinNodeIdx };
+                }
+            }
+            numPrimsInSubtrees[entry.binNodeIndex] = subsetNumPrims[entry.subset];
+            subtreeCosts[entry.binNodeIndex] = subsetCosts[entry.subset];
+        }
+        Assert(numUsedIntNodes == numIntNodes, "Unexpected number of internal nodes in a treelet.");
+    };
+
+    for (uint32_t passIdx = 0; passIdx < numPasses; ++passIdx) {
+        const uint32_t minNumPrims = minNumPrimsForTreeletRoot << passIdx;
+
+        // EN: Compute parents since the previous pass changed the topology.
+        binNodeParents[rootRef & ~binaryLeafFlag] = UINT32_MAX;
+        parallelFor(
+            threadPool, 0, numBinNodes, lbvhGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t binNodeIdx = begin; binNodeIdx < end; ++binNodeIdx) {
+                arrivalCounters[binNodeIdx].store(0, std::memory_order_relaxed);
+                for (uint32_t childIdx = 0; childIdx < 2; ++childIdx) {
+                    const uint32_t childRef = (*binNodes)[binNodeIdx].children[childIdx];
+                    if (childRef & binaryLeafFlag)
+                        leafParents[childRef & ~binaryLeafFlag] = binNodeIdx;
+                    else
+                        binNodeParents[childRef] = binNodeIdx;
+                }
+            }
+        });
+
+        parallelFor(
+            threadPool, 0, numPrimRefs, lbvhGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t primRefIdx = begin; primRefIdx < end; ++primRefIdx) {
+                uint32_t binNodeIdx = leafParents[primRefIdx];
+                while (binNodeIdx != UINT32_MAX) {
+                    if (arrivalCounters[binNodeIdx].fetch_add(1, std::memory_order_acq_rel) == 0)
+                        break;
+
+                    const BinaryNode &binNode = (*binNodes)[binNodeIdx];
+                    numPrimsInSubtrees[binNodeIdx] =
+                        getNumPrims(binNode.children[0]) + getNumPrims(binNode.children[1]);
+                    subtreeCosts[binNodeIdx] = calcCost(
+                        binNode.aabb.calcHalfSurfaceArea(), numPrimsInSubtrees[binNodeIdx],
+                        getCost(binNode.children[0]) + getCost(binNode.children[1]));
+                    if (numPrimsInSubtrees[binNodeIdx] >= minNumPrims)
+                        restructure(binNodeIdx);
+
+                    binNodeIdx = binNodeParents[binNodeIdx];
+                }
+            }
         });
+    }
+}
+
 
-        // EN: Allocate an internal node and set the index to the parent.
-        const uint32_t intNodeIdx = static_cast<uint32_t>(tempIntNodes.size());
-        if (task.parentIndex != UINT32_MAX) {
-            TempInternalNode &parentNode = tempIntNodes[task.parentIndex];
-            typename TempInternalNode::Child &selfSlot = parentNode.children[task.slotInParent];
-            selfSlot.index = intNodeIdx;
+
+// EN: Build a temporary BVH as a linear BVH.
+//     Primitive references are sorted by the Morton codes of their centroids, then a binary radix tree is
+//     built in parallel (Karras 2012) and collapsed into the target arity.
+template <uint32_t arity, typename MortonCode>
+static void buildTemporaryBVHLinear(
+    const BuilderInput<PrimitiveType::Geometric> &buildInput, const SplitTask &rootTask,
+    const float intTravCost, const float primIsectCost, ThreadPool* const threadPool,
+    TempInternalNodeArray<arity>* const tempIntNodes) {
+    const std::span<PrimitiveReference> primRefs = rootTask.primRefs.subspan(0, rootTask.numActualElems);
+    const uint32_t numPrimRefs = static_cast<uint32_t>(primRefs.size());
+    BuildMemoryTracker* const memTracker = buildInput.memTracker;
+
+    std::vector<MortonCode> mortonCodes;
+    sortPrimitiveReferencesByMortonCode(threadPool, rootTask.centAabb, memTracker, primRefs, &mortonCodes);
+
+    // EN: Length of the common prefix between two keys. Duplicated codes are disambiguated by their indices.
+    const auto calcCommonPrefixLength = [&mortonCodes, numPrimRefs]
+    (const int64_t idxA, const int64_t idxB) -> int32_t {
+        if (idxB < 0 || idxB >= numPrimRefs)
+            return -1;
+        const MortonCode codeA = mortonCodes[idxA];
+        const MortonCode codeB = mortonCodes[idxB];
+        if (codeA != codeB)
+            return std::countl_zero(static_cast<MortonCode>(codeA ^ codeB));
+        return 8 * sizeof(MortonCode) +
+            std::countl_zero(static_cast<uint32_t>(idxA ^ idxB));
+    };
+
+    // EN: Build a binary radix tree. Internal node i has n - 1 counterparts and every node is built independently.
+    const uint32_t numBinNodes = numPrimRefs - 1;
+    std::vector<BinaryNode> binNodes;
+    std::vector<uint32_t> binNodeParents;
+    std::vector<uint32_t> leafParents;
+    memTracker->allocate(&binNodes, numBinNodes);
+    memTracker->allocate(&binNodeParents, numBinNodes);
+    memTracker->allocate(&leafParents, numPrimRefs);
+    parallelFor(
+        threadPool, 0, numBinNodes, lbvhGrainSize,
+        [&](const uint32_t begin, const uint32_t end) {
+        for (uint32_t binNodeIdx = begin; binNodeIdx < end; ++binNodeIdx) {
+            const int64_t i = binNodeIdx;
+
+            // EN: Determine the direction and the other end of the range.
+            const int64_t d =
+                calcCommonPrefixLength(i, i + 1) - calcCommonPrefixLength(i, i - 1) >= 0 ? 1 : -1;
+            const int32_t minPrefixLength = calcCommonPrefixLength(i, i - d);
+            int64_t maxLength = 2;
+            while (calcCommonPrefixLength(i, i + maxLength * d) > minPrefixLength)
+                maxLength <<= 1;
+            int64_t length = 0;
+            for (int64_t t = maxLength >> 1; t >= 1; t >>= 1) {
+                if (calcCommonPrefixLength(i, i + (length + t) * d) > minPrefixLength)
+                    length += t;
+            }
+            const int64_t j = i + length * d;
+
+            // EN: Find the split position by binary search.
+            const int32_t nodePrefixLength = calcCommonPrefixLength(i, j);
+            int64_t split = 0;
+            for (int64_t div = 2; ; div <<= 1) {
+                const int64_t t = (length + div - 1) / div;
+                if (calcCommonPrefixLength(i, i + (split + t) * d) > nodePrefixLength)
+                    split += t;
+                if (t <= 1)
+                    break;
+            }
+            const int64_t gamma = i + split * d + std::min<int64_t>(d, 0);
+
+            BinaryNode &binNode = binNodes[binNodeIdx];
+            const uint32_t leftIdx = static_cast<uint32_t>(gamma);
+            const uint32_t rightIdx = static_cast<uint32_t>(gamma + 1);
+            if (std::min(i, j) == gamma) {
+                binNode.children[0] = leftIdx | binaryLeafFlag;
+                leafParents[leftIdx] = binNodeIdx;
+            }
+            else {
+                binNode.children[0] = leftIdx;
+                binNodeParents[leftIdx] = binNodeIdx;
+            }
+            if (std::max(i, j) == gamma + 1) {
+                binNode.children[1] = rightIdx | binaryLeafFlag;
+                leafParents[rightIdx] = binNodeIdx;
+            }
+            else {
+                binNode.children[1] = rightIdx;
+                binNodeParents[rightIdx] = binNodeIdx;
+            }
         }
-        tempIntNodes.resize(tempIntNodes.size() + 1);
+    });
 
-        // EN: Make the internal node.
-        TempInternalNode &intNode = tempIntNodes[intNodeIdx];
-        for (uint32_t slot = 0; slot < numChildren; ++slot) {
-            SplitTask &childTask = children[slot];
-            typename TempInternalNode::Child &child = intNode.children[slot];
-            child.aabb = childTask.geomAabb;
-            if (childTask.isSplittable) {
-                childTask.parentIndex = intNodeIdx;
-                childTask.slotInParent = slot;
-                stack.push_back(childTask);
+    memTracker->release(&mortonCodes);
 
-                child.numLeaves = 0;
+    // EN: Compute bounding boxes from the leaves. The second thread that arrives at a node handles it.
+    {
+        const BuildMemoryTracker::ScopedAllocation scopedAllocation(
+            memTracker, sizeof(std::atomic<uint32_t>) * numBinNodes);
+        std::vector<std::atomic<uint32_t>> visitCounters(numBinNodes);
+        for (std::atomic<uint32_t> &counter : visitCounters)
+            counter.store(0, std::memory_order_relaxed);
+        parallelFor(
+            threadPool, 0, numPrimRefs, lbvhGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t primRefIdx = begin; primRefIdx < end; ++primRefIdx) {
+                uint32_t binNodeIdx = leafParents[primRefIdx];
+                while (true) {
+                    if (visitCounters[binNodeIdx].fetch_add(1, std::memory_order_acq_rel) == 0)
+                        break;
+                    BinaryNode &binNode = binNodes[binNodeIdx];
+                    binNode.aabb = AABB();
+                    for (uint32_t childIdx = 0; childIdx < 2; ++childIdx) {
+                        const uint32_t childRef = binNode.children[childIdx];
+                        if (childRef & binaryLeafFlag)
+                            binNode.aabb.unify(primRefs[childRef & ~binaryLeafFlag].box);
+                        else
+                            binNode.aabb.unify(binNodes[childRef].aabb);
+                    }
+                    if (binNodeIdx == 0)
+                        break;
+                    binNodeIdx = binNodeParents[binNodeIdx];
+                }
+            }
+        });
+    }
+    memTracker->release(&binNodeParents);
+    memTracker->release(&leafParents);
+
+    restructureTreelets(
+        threadPool, buildInput.numTreeletOptimizationPasses,
+        buildInput.maxNumPrimsPerLeaf, intTravCost, primIsectCost,
+        primRefs, 0, memTracker, &binNodes);
+
+    collapseBinaryTree<arity>(
+        binNodes, 0,
+        buildInput.minNumPrimsPerLeaf, buildInput.maxNumPrimsPerLeaf,
+        intTravCost, primIsectCost,
+        primRefs, memTracker, tempIntNodes);
+    memTracker->release(&binNodes);
+}
+
+
+
+// EN: Parameters for PLOC.
+//     Each cluster searches for its nearest neighbor within this radius in the Morton order.
+constexpr uint32_t plocSearchRadius = 16;
+constexpr uint32_t plocGrainSize = 1 << 10;
+
+// EN: Build a temporary BVH by Parallel Locally-Ordered Clustering (Meister and Bittner 2018).
+//     Starting from the Morton-ordered primitive references, each iteration merges the clusters that are
+//     mutually nearest neighbors within the search window. The distance is the surface area of the merged box,
+//     and ties are broken by the pair indices so that the result is independent of the number of threads.
+template <uint32_t arity>
+static void buildTemporaryBVHPloc(
+    const BuilderInput<PrimitiveType::Geometric> &buildInput, const SplitTask &rootTask,
+    const float intTravCost, const float primIsectCost, ThreadPool* const threadPool,
+    TempInternalNodeArray<arity>* const tempIntNodes) {
+    const std::span<PrimitiveReference> primRefs = rootTask.primRefs.subspan(0, rootTask.numActualElems);
+    const uint32_t numPrimRefs = static_cast<uint32_t>(primRefs.size());
+    BuildMemoryTracker* const memTracker = buildInput.memTracker;
+
+    if (numPrimRefs <= maxNumPrimsFor30bitMortonCode) {
+        std::vector<uint32_t> mortonCodes;
+        sortPrimitiveReferencesByMortonCode(threadPool, rootTask.centAabb, memTracker, primRefs, &mortonCodes);
+        memTracker->release(&mortonCodes);
+    }
+    else {
+        std::vector<uint64_t> mortonCodes;
+        sortPrimitiveReferencesByMortonCode(threadPool, rootTask.centAabb, memTracker, primRefs, &mortonCodes);
+        memTracker->release(&mortonCodes);
+    }
+
+    struct Cluster {
+        AABB aabb;
+        uint32_t ref;
+    };
+
+    const uint32_t numBinNodes = numPrimRefs - 1;
+    std::vector<BinaryNode> binNodes;
+    std::vector<Cluster> clusters;
+    std::vector<uint32_t> nearestNeighbors;
+    memTracker->allocate(&binNodes, numBinNodes);
+    memTracker->allocate(&clusters, numPrimRefs);
+    memTracker->allocate(&nearestNeighbors, numPrimRefs);
+    for (uint32_t primRefIdx = 0; primRefIdx < numPrimRefs; ++primRefIdx) {
+        Cluster &cluster = clusters[primRefIdx];
+        cluster.aabb = primRefs[primRefIdx].box;
+        cluster.ref = primRefIdx | binaryLeafFlag;
+    }
+
+    uint32_t numClusters = numPrimRefs;
+    uint32_t numAllocatedBinNodes = 0;
+    while (numClusters > 1) {
+        // EN: Find the nearest neighbor of each cluster.
+        parallelFor(
+            threadPool, 0, numClusters, plocGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t clusterIdx = begin; clusterIdx < end; ++clusterIdx) {
+                const AABB &aabb = clusters[clusterIdx].aabb;
+                const uint32_t searchBegin = clusterIdx > plocSearchRadius ? clusterIdx - plocSearchRadius : 0;
+                const uint32_t searchEnd = std::min(clusterIdx + plocSearchRadius + 1, numClusters);
+                float minDist = INFINITY;
+                uint32_t nearestIdx = UINT32_MAX;
+                for (uint32_t otherIdx = searchBegin; otherIdx < searchEnd; ++otherIdx) {
+                    if (otherIdx == clusterIdx)
+                        continue;
+                    AABB mergedAabb = aabb;
+                    mergedAabb.unify(clusters[otherIdx].aabb);
+                    const float dist = mergedAabb.calcHalfSurfaceArea();
+                    // EN: Among the candidates with the same distance, a lower index wins, which corresponds to
+                    //     the lexicographic order of the pair (min index, max index) for a fixed cluster.
+                    if (dist < minDist) {
+                        minDist = dist;
+                        nearestIdx = otherIdx;
+                    }
+                }
+                nearestNeighbors[clusterIdx] = nearestIdx;
+            }
+        });
+
+        // EN: Merge mutually nearest neighbors. The merged cluster takes the position of the lower index.
+        //     Clusters are compacted in place since a cluster is never written beyond the ones read so far,
+        //     except for the higher index of a merged pair which is read before being overwritten.
+        uint32_t numNextClusters = 0;
+        for (uint32_t clusterIdx = 0; clusterIdx < numClusters; ++clusterIdx) {
+            const uint32_t nearestIdx = nearestNeighbors[clusterIdx];
+            const bool isMerged = nearestNeighbors[nearestIdx] == clusterIdx;
+            if (isMerged && clusterIdx > nearestIdx)
+                continue;
+
+            Cluster nextCluster;
+            if (isMerged) {
+                const Cluster clusterA = clusters[clusterIdx];
+                const Cluster clusterB = clusters[nearestIdx];
+                const uint32_t binNodeIdx = numAllocatedBinNodes++;
+                BinaryNode &binNode = binNodes[binNodeIdx];
+                binNode.aabb = clusterA.aabb;
+                binNode.aabb.unify(clusterB.aabb);
+                binNode.children[0] = clusterA.ref;
+                binNode.children[1] = clusterB.ref;
+                nextCluster.aabb = binNode.aabb;
+                nextCluster.ref = binNodeIdx;
             }
             else {
-                child.index = static_cast<uint32_t>(std::distance(
-                    primRefs.data(), childTask.primRefs.data()));
-                child.numLeaves = childTask.numActualElems;
-                Assert(child.numLeaves > 0, "Invalid number of leaves as a leaf node.");
+                nextCluster = clusters[clusterIdx];
             }
+            clusters[numNextClusters++] = nextCluster;
         }
-        for (uint32_t slot = numChildren; slot < arity; ++slot) {
-            typename TempInternalNode::Child &child = intNode.children[slot];
-            child.aabb = AABB();
-            child.index = UINT32_MAX;
-            child.numLeaves = 0;
+        Assert(numNextClusters < numClusters, "PLOC made no progress.");
+
+        numClusters = numNextClusters;
+    }
+    Assert(numAllocatedBinNodes == numBinNodes, "Unexpected number of binary nodes.");
+    const uint32_t rootRef = clusters[0].ref;
+    memTracker->release(&clusters);
+    memTracker->release(&nearestNeighbors);
+
+    restructureTreelets(
+        threadPool, buildInput.numTreeletOptimizationPasses,
+        buildInput.maxNumPrimsPerLeaf, intTravCost, primIsectCost,
+        primRefs, rootRef, memTracker, &binNodes);
+
+    collapseBinaryTree<arity>(
+        binNodes, rootRef,
+        buildInput.minNumPrimsPerLeaf, buildInput.maxNumPrimsPerLeaf,
+        intTravCost, primIsectCost,
+        primRefs, memTracker, tempIntNodes);
+    memTracker->release(&binNodes);
+}
+
+
+
+template <uint32_t arity, PrimitiveType primType>
+static void buildBVH(
+    const BuilderInput<primType> &buildInput,
+    typename BVHAlias<arity, primType>::type* const bvh) {
+    using TempInternalNode = TempInternalNode_T<arity>;
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    uint32_t numInputPrimitives = 0;
+    std::vector<uint32_t> inputPrimOffsets;
+    if constexpr (primType == PrimitiveType::Geometric) {
+        inputPrimOffsets.resize(buildInput.numGeometries);
+        for (uint32_t geomIdx = 0; geomIdx < buildInput.numGeometries; ++geomIdx) {
+            const Geometry &geom = buildInput.geometries[geomIdx];
+            inputPrimOffsets[geomIdx] = numInputPrimitives;
+            numInputPrimitives += geom.numTriangles;
         }
     }
+    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+        (void)inputPrimOffsets;
+        numInputPrimitives = buildInput.numInstances;
+    }
 
-    // EN: Finished to build the temporary BVH, now we convert it to the final BVH.
+    const auto extractGeomAndPrimIndex = [&inputPrimOffsets]
+    (const uint32_t inputPrimIdx,
+     uint32_t* const geomIdx, uint32_t* const primIdx) {
+        const uint32_t numGeoms = static_cast<uint32_t>(inputPrimOffsets.size());
+        *geomIdx = 0;
+        for (int d = nextPowerOf2(numGeoms) >> 1; d >= 1; d >>= 1) {
+            if (*geomIdx + d >= numGeoms)
+                continue;
+            if (inputPrimOffsets[*geomIdx + d] <= inputPrimIdx)
+                *geomIdx += d;
+        }
+        *primIdx = inputPrimIdx - inputPrimOffsets[*geomIdx];
+    };
 
-    std::vector<shared::TriangleStorage> triStorages;
+    // EN: The bottom-up builders don't split primitives.
+    bool useBottomUpBuilder = false;
+    if constexpr (primType == PrimitiveType::Geometric)
+        useBottomUpBuilder = buildInput.builder != GeometryBVHBuilder::SBVH && numInputPrimitives > 1;
+
+    uint32_t numPrimRefsAllocated;
+    float intTravCost;
+    float primIsectCost;
     if constexpr (primType == PrimitiveType::Geometric) {
-        // EN: Create triangle storages.
-        triStorages.resize(numInputPrimitives);
-        for (uint32_t inputPrimIdx = 0; inputPrimIdx < numInputPrimitives; ++inputPrimIdx) {
-            uint32_t geomIdx, primIdx;
-            extractGeomAndPrimIndex(inputPrimIdx, &geomIdx, &primIdx);
+        numPrimRefsAllocated = useBottomUpBuilder ? numInputPrimitives : std::max(
+            numInputPrimitives,
+            static_cast<uint32_t>((1.0f + buildInput.splittingBudget) * numInputPrimitives));
+        intTravCost = buildInput.intNodeTravCost;
+        primIsectCost = buildInput.primIntersectCost;
+    }
+    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+        numPrimRefsAllocated = std::max(
+            numInputPrimitives,
+            static_cast<uint32_t>((1.0f + buildInput.rebraidingBudget) * numInputPrimitives));
+        intTravCost = 1.0f;
+        primIsectCost = 100.0f;
+    }
 
-            Point3D pA, pB, pC;
-            calcTriangleVertices(
-                buildInput, geomIdx, primIdx,
-                &pA, &pB, &pC);
+    // EN: Set up worker threads for the build. The calling thread also participates in the work.
+    std::unique_ptr<ThreadPool> threadPoolHolder;
+    ThreadPool* threadPool = nullptr;
+    if (buildInput.numThreads != 1) {
+        threadPoolHolder = std::make_unique<ThreadPool>(buildInput.numThreads);
+        if (threadPoolHolder->getNumThreads() > 1)
+            threadPool = threadPoolHolder.get();
+    }
 
-            shared::TriangleStorage &triStorage = triStorages[inputPrimIdx];
-            triStorage = {};
-            triStorage.pA = pA;
-            triStorage.pB = pB;
-            triStorage.pC = pC;
-            triStorage.geomIndex = geomIdx;
-            triStorage.primIndex = primIdx;
-        }
+    BuildMemoryTracker &memTracker = *buildInput.memTracker;
+
+    // EN: Initialize primitive references.
+    std::vector<PrimitiveReference> primRefsMem;
+    std::vector<PrimSplitInfo> primSplitInfosMem;
+    memTracker.allocate(&primRefsMem, numPrimRefsAllocated);
+    memTracker.allocate(&primSplitInfosMem, useBottomUpBuilder ? 0 : numPrimRefsAllocated);
+    std::span<PrimitiveReference> primRefs = primRefsMem;
+    std::span<PrimSplitInfo> primSplitInfos = primSplitInfosMem;
+    if constexpr (primType == PrimitiveType::Geometric) {
+        parallelFor(
+            threadPool, 0, numInputPrimitives, primRefInitGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t inputPrimIdx = begin; inputPrimIdx < end; ++inputPrimIdx) {
+                uint32_t geomIdx, primIdx;
+                extractGeomAndPrimIndex(inputPrimIdx, &geomIdx, &primIdx);
+
+                Point3D pA, pB, pC;
+                calcTriangleVertices(
+                    buildInput, geomIdx, primIdx,
+                    &pA, &pB, &pC);
+
+                PrimitiveReference primRef = {};
+                primRef.box.unify(pA).unify(pB).unify(pC);
+                primRef.geomIndex = geomIdx;
+                primRef.primIndex = primIdx;
+                primRefs[inputPrimIdx] = primRef;
+            }
+        });
     }
     else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-        (void)triStorages;
-        Assert_NotImplemented();
+        (void)extractGeomAndPrimIndex;
+        for (uint32_t instIdx = 0; instIdx < numInputPrimitives; ++instIdx) {
+            const Instance &inst = buildInput.instances[instIdx];
+            const auto &blas = *reinterpret_cast<const GeometryBVH<arity>*>(inst.bvhAddress);
+            const shared::InternalNode_T<arity> &rootNode = blas.intNodes[0];
+
+            PrimitiveReference primRef = {};
+            primRef.box = inst.rotFromObj * rootNode.getAabb() + inst.transFromObj;
+            primRef.instIndex = instIdx;
+            primRef.nodeIndex = 0;
+            primRefs[instIdx] = primRef;
+        }
+    }
+
+    // EN: Rebraiding: Open BLAS nodes of large instances into their child nodes within the budget,
+    //     so that the top-down build can separate overlapping instances at finer granularity.
+    //     An opened reference is replaced by references to the child nodes, so a node can be opened
+    //     only when all of its children are internal nodes.
+    uint32_t numInitialPrimRefs = numInputPrimitives;
+    if constexpr (primType == PrimitiveType::Instance) {
+        const auto getBlas = [&buildInput]
+        (const PrimitiveReference &primRef) -> const GeometryBVH<arity> & {
+            const Instance &inst = buildInput.instances[primRef.instIndex];
+            return *reinterpret_cast<const GeometryBVH<arity>*>(inst.bvhAddress);
+        };
+        const auto isOpenable = [&getBlas]
+        (const PrimitiveReference &primRef) {
+            const shared::InternalNode_T<arity> &node = getBlas(primRef).intNodes[primRef.nodeIndex];
+            uint32_t validMask = 0;
+            for (uint32_t slot = 0; slot < arity; ++slot) {
+                if (!node.getChildIsValid(slot))
+                    break;
+                validMask |= 1 << slot;
+            }
+            return validMask != 0 && node.internalMask == validMask;
+        };
+
+        using OpenCandidate = std::pair<float, uint32_t>;
+        std::priority_queue<OpenCandidate> candidates;
+        for (uint32_t primRefIdx = 0; primRefIdx < numInitialPrimRefs; ++primRefIdx) {
+            const PrimitiveReference &primRef = primRefs[primRefIdx];
+            if (isOpenable(primRef))
+                candidates.emplace(primRef.box.calcHalfSurfaceArea(), primRefIdx);
+        }
+        while (!candidates.empty()) {
+            const uint32_t primRefIdx = candidates.top().second;
+            candidates.pop();
+
+            const PrimitiveReference primRef = primRefs[primRefIdx];
+            const Instance &inst = buildInput.instances[primRef.instIndex];
+            const shared::InternalNode_T<arity> &node = getBlas(primRef).intNodes[primRef.nodeIndex];
+            const uint32_t numChildren = popcnt(node.internalMask);
+            if (numInitialPrimRefs + numChildren - 1 > numPrimRefsAllocated)
+                continue;
+
+            for (uint32_t slot = 0; slot < numChildren; ++slot) {
+                PrimitiveReference childPrimRef = {};
+                childPrimRef.box = inst.rotFromObj * node.getChildAabb(slot) + inst.transFromObj;
+                childPrimRef.instIndex = primRef.instIndex;
+                childPrimRef.nodeIndex = node.intNodeChildBaseIndex + node.getInternalChildNumber(slot);
+                const uint32_t dstPrimRefIdx = slot == 0 ? primRefIdx : numInitialPrimRefs++;
+                primRefs[dstPrimRefIdx] = childPrimRef;
+                if (isOpenable(childPrimRef))
+                    candidates.emplace(childPrimRef.box.calcHalfSurfaceArea(), dstPrimRefIdx);
+            }
+        }
+    }
+
+    // EN: Set up the root task to initialize the top-down build.
+    SplitTask rootTask = {};
+    {
+        rootTask.geomAabb = AABB();
+        rootTask.centAabb = AABB();
+        for (uint32_t globalPrimIdx = 0; globalPrimIdx < numInitialPrimRefs; ++globalPrimIdx) {
+            const PrimitiveReference &primRef = primRefs[globalPrimIdx];
+            rootTask.geomAabb.unify(primRef.box);
+            rootTask.centAabb.unify(primRef.box.getCenter());
+        }
+        rootTask.primRefs = primRefs;
+        rootTask.primSplitInfos = primSplitInfos;
+        rootTask.numActualElems = numInitialPrimRefs;
+        rootTask.parentIndex = UINT32_MAX;
+        rootTask.slotInParent = 0;
+        rootTask.isSplittable = numInitialPrimRefs > 1;
+    }
+
+    // EN: Build a temporary BVH.
+    //     The number of internal nodes never exceeds the number of primitive references.
+    TempInternalNodeArray<arity> tempIntNodes(std::max(numPrimRefsAllocated, 1u), &memTracker);
+    if constexpr (primType == PrimitiveType::Geometric) {
+        if (buildInput.builder == GeometryBVHBuilder::PLOC && useBottomUpBuilder) {
+            buildTemporaryBVHPloc<arity>(
+                buildInput, rootTask,
+                intTravCost, primIsectCost, threadPool,
+                &tempIntNodes);
+        }
+        else if (buildInput.builder == GeometryBVHBuilder::LBVH && useBottomUpBuilder) {
+            if (numInitialPrimRefs <= maxNumPrimsFor30bitMortonCode)
+                buildTemporaryBVHLinear<arity, uint32_t>(
+                    buildInput, rootTask,
+                    intTravCost, primIsectCost, threadPool,
+                    &tempIntNodes);
+            else
+                buildTemporaryBVHLinear<arity, uint64_t>(
+                    buildInput, rootTask,
+                    intTravCost, primIsectCost, threadPool,
+                    &tempIntNodes);
+        }
     }
+    if (!useBottomUpBuilder) {
+        buildTemporaryBVHTopDown<arity, primType>(
+            buildInput, rootTask,
+            intTravCost, primIsectCost, threadPool,
+            &tempIntNodes);
+    }
+    const uint32_t numIntNodes = tempIntNodes.size();
 
-    const uint32_t numIntNodes = static_cast<uint32_t>(tempIntNodes.size());
+    // EN: Finished to build the temporary BVH, now we convert it to the final BVH.
+    //     The conversion is staged so that each temporary array is released as soon as it is consumed,
+    //     and the triangle storages are created last when only the final arrays are alive.
+    memTracker.release(&primSplitInfosMem);
 
     // EN: Compute mapping from the temporary BVH to the final BVH.
-    std::vector<uint32_t> dstIntNodeIndices(numIntNodes);
-    std::vector<uint32_t> leafChildBlockIndices(numIntNodes);
+    std::vector<uint32_t> dstIntNodeIndices;
+    std::vector<uint32_t> leafChildBlockIndices;
+    memTracker.allocate(&dstIntNodeIndices, numIntNodes);
+    memTracker.allocate(&leafChildBlockIndices, numIntNodes);
     dstIntNodeIndices[0] = 0;
     uint32_t intChildBlockIdx = 1; // EN: Root is always at 0.
     uint32_t leafChildBlockIdx = 0;
@@ -992,43 +2178,82 @@ static void buildBVH(
     std::vector<std::vector<uint32_t>> primToPrimRefMap(numInputPrimitives);
 #endif
 
-    // EN: Create internal nodes and primitive references.
+    // EN: Create primitive references.
+    //     An instance BVH has instance references directly as leaves instead.
     const uint32_t numFinalPrimRefs = leafChildBlockIdx;
-    std::vector<InternalNode> dstIntNodes(numIntNodes);
-    std::vector<shared::PrimitiveReference> dstPrimRefs(numFinalPrimRefs);
-    std::vector<shared::ParentPointer> parentPointers(numIntNodes);
-    parentPointers[0] = shared::ParentPointer(0xFFFF'FFFF);
+    std::vector<shared::PrimitiveReference> dstPrimRefs;
+    std::vector<shared::InstanceReference> dstInstRefs;
+    if constexpr (primType == PrimitiveType::Geometric)
+        memTracker.allocate(&dstPrimRefs, numFinalPrimRefs);
+    else /*if constexpr (primType == PrimitiveType::Instance)*/
+        memTracker.allocate(&dstInstRefs, numFinalPrimRefs);
     for (uint32_t srcIntNodeIdx = 0; srcIntNodeIdx < numIntNodes; ++srcIntNodeIdx) {
-        const uint32_t dstIntNodeIdx = dstIntNodeIndices[srcIntNodeIdx];
         const TempInternalNode &srcIntNode = tempIntNodes[srcIntNodeIdx];
-        InternalNode &dstIntNode = dstIntNodes[dstIntNodeIdx];
-
-        AABB quantAabb;
-        uint32_t internalMask = 0;
-        uint32_t firstIntChildSlot = UINT32_MAX;
         uint32_t primRefOffset = leafChildBlockIndices[srcIntNodeIdx];
-        uint32_t numValidChilren = 0;
         for (uint32_t slot = 0; slot < arity; ++slot) {
             const typename TempInternalNode::Child &srcChild = srcIntNode.children[slot];
             if (srcChild.index == UINT32_MAX)
                 break;
 
-            ++numValidChilren;
-            quantAabb.unify(srcChild.aabb);
             if (srcChild.numLeaves > 0) {
                 for (uint32_t primRefIdx = 0; primRefIdx < srcChild.numLeaves; ++primRefIdx) {
                     const PrimitiveReference &srcPrimRef = primRefs[srcChild.index + primRefIdx];
-                    shared::PrimitiveReference &dstPrimRef = dstPrimRefs[primRefOffset + primRefIdx];
-                    dstPrimRef.storageIndex = inputPrimOffsets[srcPrimRef.geomIndex] + srcPrimRef.primIndex;
-                    dstPrimRef.isLeafEnd = primRefIdx == srcChild.numLeaves - 1;
+                    if constexpr (primType == PrimitiveType::Geometric) {
+                        shared::PrimitiveReference &dstPrimRef = dstPrimRefs[primRefOffset + primRefIdx];
+                        dstPrimRef.storageIndex = inputPrimOffsets[srcPrimRef.geomIndex] + srcPrimRef.primIndex;
+                        dstPrimRef.isLeafEnd = primRefIdx == srcChild.numLeaves - 1;
 
 #if defined(_DEBUG)
-                    primToPrimRefMap[dstPrimRef.storageIndex].push_back(srcChild.index + primRefIdx);
+                        primToPrimRefMap[dstPrimRef.storageIndex].push_back(srcChild.index + primRefIdx);
 #endif
+                    }
+                    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+                        const Instance &inst = buildInput.instances[srcPrimRef.instIndex];
+                        shared::InstanceReference &dstInstRef = dstInstRefs[primRefOffset + primRefIdx];
+                        dstInstRef = {};
+                        dstInstRef.rotFromObj = inst.rotFromObj;
+                        dstInstRef.transFromObj = inst.transFromObj;
+                        dstInstRef.rotToObj = invert(inst.rotFromObj);
+                        dstInstRef.transToObj = -(dstInstRef.rotToObj * inst.transFromObj);
+                        dstInstRef.bvhAddress = inst.bvhAddress;
+                        dstInstRef.nodeIndex = srcPrimRef.nodeIndex;
+                        dstInstRef.instanceIndex = srcPrimRef.instIndex;
+                        dstInstRef.userData = inst.userData;
+                    }
                 }
                 primRefOffset += srcChild.numLeaves;
             }
-            else {
+        }
+    }
+    // EN: The debug visualization below still needs the temporary primitive references.
+#if !(ENABLE_VDB && defined(_DEBUG))
+    memTracker.release(&primRefsMem);
+#endif
+
+    // EN: Create internal nodes.
+    //     Chunks of the temporary internal nodes are released once converted.
+    std::vector<InternalNode> dstIntNodes;
+    std::vector<shared::ParentPointer> parentPointers;
+    memTracker.allocate(&dstIntNodes, numIntNodes);
+    memTracker.allocate(&parentPointers, numIntNodes);
+    parentPointers[0] = shared::ParentPointer(0xFFFF'FFFF);
+    for (uint32_t srcIntNodeIdx = 0; srcIntNodeIdx < numIntNodes; ++srcIntNodeIdx) {
+        const uint32_t dstIntNodeIdx = dstIntNodeIndices[srcIntNodeIdx];
+        const TempInternalNode &srcIntNode = tempIntNodes[srcIntNodeIdx];
+        InternalNode &dstIntNode = dstIntNodes[dstIntNodeIdx];
+
+        AABB quantAabb;
+        uint32_t internalMask = 0;
+        uint32_t firstIntChildSlot = UINT32_MAX;
+        uint32_t numValidChilren = 0;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            const typename TempInternalNode::Child &srcChild = srcIntNode.children[slot];
+            if (srcChild.index == UINT32_MAX)
+                break;
+
+            ++numValidChilren;
+            quantAabb.unify(srcChild.aabb);
+            if (srcChild.numLeaves == 0) {
                 internalMask |= 1 << slot;
                 if (firstIntChildSlot == UINT32_MAX)
                     firstIntChildSlot = slot;
@@ -1068,6 +2293,40 @@ static void buildBVH(
                 dstIntNode.setInvalidChildBox(slot);
             }
         }
+
+        tempIntNodes.releaseChunks(srcIntNodeIdx + 1);
+    }
+    memTracker.release(&dstIntNodeIndices);
+    memTracker.release(&leafChildBlockIndices);
+
+    std::vector<shared::TriangleStorage> triStorages;
+    if constexpr (primType == PrimitiveType::Geometric) {
+        // EN: Create triangle storages.
+        memTracker.allocate(&triStorages, numInputPrimitives);
+        parallelFor(
+            threadPool, 0, numInputPrimitives, primRefInitGrainSize,
+            [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t inputPrimIdx = begin; inputPrimIdx < end; ++inputPrimIdx) {
+                uint32_t geomIdx, primIdx;
+                extractGeomAndPrimIndex(inputPrimIdx, &geomIdx, &primIdx);
+
+                Point3D pA, pB, pC;
+                calcTriangleVertices(
+                    buildInput, geomIdx, primIdx,
+                    &pA, &pB, &pC);
+
+                shared::TriangleStorage &triStorage = triStorages[inputPrimIdx];
+                triStorage = {};
+                triStorage.pA = pA;
+                triStorage.pB = pB;
+                triStorage.pC = pC;
+                triStorage.geomIndex = geomIdx;
+                triStorage.primIndex = primIdx;
+            }
+        });
+    }
+    else /*if constexpr (primType == PrimitiveType::Instance)*/ {
+        (void)triStorages;
     }
 
     // Debug Visualization
@@ -1110,9 +2369,9 @@ static void buildBVH(
         bvh->totalNumPrims = numInputPrimitives;
     } 
     else /*if constexpr (primType == PrimitiveType::Instance)*/ {
-        Assert_NotImplemented();
-        bvh->numInsts = numInputPrimitives;
+        bvh->instRefs = std::move(dstInstRefs);
         bvh->parentPointers = std::move(parentPointers);
+        bvh->numInsts = numInputPrimitives;
     }
 }
 
@@ -1121,7 +2380,8 @@ static void buildBVH(
 template <uint32_t arity>
 void buildGeometryBVH(
     const Geometry* const geoms, const uint32_t numGeoms,
-    const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh) {
+    const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh,
+    BuildMemoryStatistics* const memStats) {
     BuilderInput<PrimitiveType::Geometric> input = {};
     input.geometries = geoms;
     input.numGeometries = numGeoms;
@@ -1130,536 +2390,4036 @@ void buildGeometryBVH(
     input.primIntersectCost = config.primIntersectCost;
     input.minNumPrimsPerLeaf = config.minNumPrimsPerLeaf;
     input.maxNumPrimsPerLeaf = config.maxNumPrimsPerLeaf;
+    input.numThreads = config.numThreads;
+    input.builder = config.builder;
+    input.numTreeletOptimizationPasses = config.numTreeletOptimizationPasses;
+    BuildMemoryTracker memTracker;
+    input.memTracker = &memTracker;
     buildBVH<arity, PrimitiveType::Geometric>(input, bvh);
+    bvh->sahCostAtBuild = calcSahCost(*bvh, config.intNodeTravCost, config.primIntersectCost);
+    precomputeLeafTriangles(config.leafTriangleFormat, bvh);
+    memTracker.onAllocate(
+        sizeof(bvh->woopTris[0]) * bvh->woopTris.capacity() +
+        sizeof(bvh->woopTriBlocks4[0]) * bvh->woopTriBlocks4.capacity() +
+        sizeof(bvh->woopTriBlocks8[0]) * bvh->woopTriBlocks8.capacity() +
+        sizeof(bvh->leafTriBlockIndices[0]) * bvh->leafTriBlockIndices.capacity());
+
+    if (memStats) {
+        memStats->peakMemorySize = memTracker.getPeakSize();
+        memStats->outputMemorySize = memTracker.getCurrentSize();
+    }
 }
 
 template void buildGeometryBVH<2>(
     const Geometry* const geoms, const uint32_t numGeoms,
-    const GeometryBVHBuildConfig &config, GeometryBVH<2>* const bvh);
+    const GeometryBVHBuildConfig &config, GeometryBVH<2>* const bvh,
+    BuildMemoryStatistics* const memStats);
 template void buildGeometryBVH<4>(
     const Geometry* const geoms, const uint32_t numGeoms,
-    const GeometryBVHBuildConfig &config, GeometryBVH<4>* const bvh);
+    const GeometryBVHBuildConfig &config, GeometryBVH<4>* const bvh,
+    BuildMemoryStatistics* const memStats);
 template void buildGeometryBVH<8>(
     const Geometry* const geoms, const uint32_t numGeoms,
-    const GeometryBVHBuildConfig &config, GeometryBVH<8>* const bvh);
+    const GeometryBVHBuildConfig &config, GeometryBVH<8>* const bvh,
+    BuildMemoryStatistics* const memStats);
 
 
 
 template <uint32_t arity>
-void buildInstanceBVH(
-    const Instance* const insts, const uint32_t numInsts,
-    const InstanceBVHBuildConfig &config, InstanceBVH<arity>* const bvh) {
-    BuilderInput<PrimitiveType::Instance> input = {};
-    input.instances = insts;
-    input.numInstances = numInsts;
-    input.rebraidingBudget = config.rebraidingBudget;
-    input.minNumPrimsPerLeaf = 1;
-    input.maxNumPrimsPerLeaf = 1;
-    buildBVH<arity, PrimitiveType::Instance>(input, bvh);
-}
-
-template void buildInstanceBVH<2>(
-    const Instance* const insts, const uint32_t numInsts,
-    const InstanceBVHBuildConfig &config, InstanceBVH<2>* const bvh);
-template void buildInstanceBVH<4>(
-    const Instance* const insts, const uint32_t numInsts,
-    const InstanceBVHBuildConfig &config, InstanceBVH<4>* const bvh);
-template void buildInstanceBVH<8>(
-    const Instance* const insts, const uint32_t numInsts,
-    const InstanceBVHBuildConfig &config, InstanceBVH<8>* const bvh);
-
+float calcSahCost(
+    const GeometryBVH<arity> &bvh, const float intNodeTravCost, const float primIntersectCost) {
+    using InternalNode = shared::InternalNode_T<arity>;
 
+    if (bvh.intNodes.empty())
+        return 0.0f;
 
-#define SWAP(A, B)\
-    if (keys[A] > keys[B]) {\
-        stc::swap(keys[A], keys[B]);\
-        stc::swap(values[A], values[B]);\
+    float cost = 0.0f;
+    for (const InternalNode &intNode : bvh.intNodes) {
+        cost += intNode.getAabb().calcHalfSurfaceArea() * intNodeTravCost;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot))
+                break;
+            if (!intNode.getChildIsLeaf(slot))
+                continue;
+            uint32_t numPrims = 0;
+            uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+            while (true) {
+                ++numPrims;
+                if (bvh.primRefs[primRefIdx++].isLeafEnd)
+                    break;
+            }
+            cost += intNode.getChildAabb(slot).calcHalfSurfaceArea() * numPrims * primIntersectCost;
+        }
     }
 
-template <typename KeyType, typename ValueType>
-static inline void sort(KeyType (&keys)[2], ValueType (&values)[2]) {
-    SWAP(0, 1);
+    return cost / bvh.intNodes[0].getAabb().calcHalfSurfaceArea();
 }
 
-template <typename KeyType, typename ValueType>
-static inline void sort(KeyType (&keys)[4], ValueType (&values)[4]) {
-    SWAP(0, 2); SWAP(1, 3);
-    SWAP(0, 1); SWAP(2, 3);
-    SWAP(1, 2);
+template float calcSahCost<2>(
+    const GeometryBVH<2> &bvh, const float intNodeTravCost, const float primIntersectCost);
+template float calcSahCost<4>(
+    const GeometryBVH<4> &bvh, const float intNodeTravCost, const float primIntersectCost);
+template float calcSahCost<8>(
+    const GeometryBVH<8> &bvh, const float intNodeTravCost, const float primIntersectCost);
+
+
+
+// EN: The inverse of [pB - pA, pC - pA, n] is given by the cross products of the columns divided by
+//     the determinant |n|^2. Computed in double since thin triangles make the matrix ill-conditioned.
+//     A degenerate triangle gets a zero transform which never reports a hit (the distance becomes NaN).
+static WoopTriangle makeWoopTriangle(const shared::TriangleStorage &triStorage) {
+    using Vector3Dd = Vector3D_T<double, false>;
+    const Vector3Dd pA(triStorage.pA.x, triStorage.pA.y, triStorage.pA.z);
+    const Vector3Dd eAB = Vector3Dd(triStorage.pB.x, triStorage.pB.y, triStorage.pB.z) - pA;
+    const Vector3Dd eAC = Vector3Dd(triStorage.pC.x, triStorage.pC.y, triStorage.pC.z) - pA;
+    const Vector3Dd n = cross(eAB, eAC);
+    const double det = dot(n, n);
+
+    WoopTriangle ret = {};
+    if (det == 0.0 || !std::isfinite(det))
+        return ret;
+    const Vector3Dd rows[3] = {
+        cross(eAC, n) / det,
+        cross(n, eAB) / det,
+        n / det,
+    };
+    for (uint32_t rowIdx = 0; rowIdx < 3; ++rowIdx) {
+        const Vector3Dd &row = rows[rowIdx];
+        ret.rows[rowIdx][0] = static_cast<float>(row.x);
+        ret.rows[rowIdx][1] = static_cast<float>(row.y);
+        ret.rows[rowIdx][2] = static_cast<float>(row.z);
+        ret.rows[rowIdx][3] = static_cast<float>(-dot(row, pA));
+    }
+    return ret;
 }
 
-template <typename KeyType, typename ValueType>
-static inline void sort(KeyType (&keys)[8], ValueType (&values)[8]) {
-    SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
-    SWAP(0, 4); SWAP(1, 5); SWAP(2, 6); SWAP(3, 7);
-    SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
-    SWAP(2, 4); SWAP(3, 5);
-    SWAP(1, 4); SWAP(3, 6);
-    SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
+template <uint32_t width>
+static void buildWoopTriangleBlocks(
+    const std::vector<shared::TriangleStorage> &triStorages,
+    const std::vector<shared::PrimitiveReference> &primRefs,
+    std::vector<WoopTriangleBlock<width>>* const blocks, std::vector<uint32_t>* const leafTriBlockIndices) {
+    blocks->clear();
+    leafTriBlockIndices->resize(primRefs.size());
+    uint32_t leafStartIdx = 0;
+    for (uint32_t primRefIdx = 0; primRefIdx < primRefs.size(); ++primRefIdx) {
+        const shared::PrimitiveReference &primRef = primRefs[primRefIdx];
+        const uint32_t idxInLeaf = primRefIdx - leafStartIdx;
+        if (idxInLeaf == 0)
+            (*leafTriBlockIndices)[primRefIdx] = static_cast<uint32_t>(blocks->size());
+        else
+            (*leafTriBlockIndices)[primRefIdx] = UINT32_MAX;
+
+        const uint32_t lane = idxInLeaf % width;
+        if (lane == 0)
+            blocks->push_back({});
+        WoopTriangleBlock<width> &block = blocks->back();
+        const WoopTriangle woopTri = makeWoopTriangle(triStorages[primRef.storageIndex]);
+        for (uint32_t rowIdx = 0; rowIdx < 3; ++rowIdx) {
+            for (uint32_t i = 0; i < 4; ++i)
+                block.rows[rowIdx][i][lane] = woopTri.rows[rowIdx][i];
+        }
+        block.storageIndices[lane] = primRef.storageIndex;
+        block.numTriangles = lane + 1;
+        if (primRef.isLeafEnd) {
+            block.isLeafEnd = true;
+            leafStartIdx = primRefIdx + 1;
+        }
+    }
 }
 
-#undef SWAP
-
-#define SWAP_ORDER(A, B, W)\
-    if (keys[A] > keys[B]) {\
-        stc::swap(keys[A], keys[B]);\
-        constexpr uint32_t mask = (1 << W) - 1;\
-        const uint32_t offsetA = A * W;\
-        const uint32_t offsetB = B * W;\
-        const uint32_t vA = (*values >> offsetA) & mask;\
-        const uint32_t vB = (*values >> offsetB) & mask;\
-        *values &= ~(mask << offsetA);\
-        *values |= (vB << offsetA);\
-        *values &= ~(mask << offsetB);\
-        *values |= (vA << offsetB);\
+template <uint32_t arity>
+void precomputeLeafTriangles(const LeafTriangleFormat format, GeometryBVH<arity>* const bvh) {
+    bvh->leafTriangleFormat = format;
+    bvh->woopTris.clear();
+    bvh->woopTriBlocks4.clear();
+    bvh->woopTriBlocks8.clear();
+    bvh->leafTriBlockIndices.clear();
+
+    if (format == LeafTriangleFormat::Woop) {
+        bvh->woopTris.resize(bvh->primRefs.size());
+        for (uint32_t primRefIdx = 0; primRefIdx < bvh->primRefs.size(); ++primRefIdx) {
+            const shared::PrimitiveReference &primRef = bvh->primRefs[primRefIdx];
+            bvh->woopTris[primRefIdx] = makeWoopTriangle(bvh->triStorages[primRef.storageIndex]);
+        }
+    }
+    else if (format == LeafTriangleFormat::WoopSoA4) {
+        buildWoopTriangleBlocks(bvh->triStorages, bvh->primRefs, &bvh->woopTriBlocks4, &bvh->leafTriBlockIndices);
+    }
+    else if (format == LeafTriangleFormat::WoopSoA8) {
+        buildWoopTriangleBlocks(bvh->triStorages, bvh->primRefs, &bvh->woopTriBlocks8, &bvh->leafTriBlockIndices);
     }
-
-template <typename KeyType>
-static inline void sortOrder(KeyType (&keys)[2], uint32_t* const values) {
-    SWAP_ORDER(0, 1, 1);
 }
 
-template <typename KeyType>
-static inline void sortOrder(KeyType (&keys)[4], uint32_t* const values) {
-    SWAP_ORDER(0, 2, 2); SWAP_ORDER(1, 3, 2);
-    SWAP_ORDER(0, 1, 2); SWAP_ORDER(2, 3, 2);
-    SWAP_ORDER(1, 2, 2);
-}
+template void precomputeLeafTriangles<2>(const LeafTriangleFormat format, GeometryBVH<2>* const bvh);
+template void precomputeLeafTriangles<4>(const LeafTriangleFormat format, GeometryBVH<4>* const bvh);
+template void precomputeLeafTriangles<8>(const LeafTriangleFormat format, GeometryBVH<8>* const bvh);
 
-template <typename KeyType>
-static inline void sortOrder(KeyType (&keys)[8], uint32_t* const values) {
-    SWAP_ORDER(0, 2, 3); SWAP_ORDER(1, 3, 3); SWAP_ORDER(4, 6, 3); SWAP_ORDER(5, 7, 3);
-    SWAP_ORDER(0, 4, 3); SWAP_ORDER(1, 5, 3); SWAP_ORDER(2, 6, 3); SWAP_ORDER(3, 7, 3);
-    SWAP_ORDER(0, 1, 3); SWAP_ORDER(2, 3, 3); SWAP_ORDER(4, 5, 3); SWAP_ORDER(6, 7, 3);
-    SWAP_ORDER(2, 4, 3); SWAP_ORDER(3, 5, 3);
-    SWAP_ORDER(1, 4, 3); SWAP_ORDER(3, 6, 3);
-    SWAP_ORDER(1, 2, 3); SWAP_ORDER(3, 4, 3); SWAP_ORDER(5, 6, 3);
+
+
+// EN: Internal node indices in BFS order from the root. Reverse iteration visits children before parents.
+template <uint32_t arity>
+static std::vector<uint32_t> calcIntNodeBfsOrder(const GeometryBVH<arity> &bvh) {
+    std::vector<uint32_t> bfsOrder;
+    if (bvh.intNodes.empty())
+        return bfsOrder;
+    bfsOrder.reserve(bvh.intNodes.size());
+    bfsOrder.push_back(0);
+    for (uint32_t i = 0; i < bfsOrder.size(); ++i) {
+        const shared::InternalNode_T<arity> &intNode = bvh.intNodes[bfsOrder[i]];
+        const uint32_t numIntChildren = popcnt(intNode.internalMask);
+        for (uint32_t nthIntChild = 0; nthIntChild < numIntChildren; ++nthIntChild)
+            bfsOrder.push_back(intNode.intNodeChildBaseIndex + nthIntChild);
+    }
+    Assert_Release(bfsOrder.size() == bvh.intNodes.size(), "Some internal nodes are unreachable.");
+    return bfsOrder;
 }
 
-#undef SWAP_ORDER
+template <uint32_t arity>
+void reorderGeometryBVH(
+    const NodeOrder order, const uint32_t* const intNodeAccessCounts, GeometryBVH<arity>* const bvh) {
+    using InternalNode = shared::InternalNode_T<arity>;
 
-static bool testRayVsTriangle(
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    const Point3D &pA, const Point3D &pB, const Point3D &pC,
-    float* const hitDist, Normal3D* const hitNormal, float* const bcB, float* const bcC) {
-    const Vector3D eAB = pB - pA;
-    const Vector3D eCA = pA - pC;
-    *hitNormal = static_cast<Normal3D>(cross(eCA, eAB));
+    Assert_Release(
+        order != NodeOrder::AccessFrequency || intNodeAccessCounts,
+        "Access counts are required for NodeOrder::AccessFrequency.");
 
-    const Vector3D e = (1.0f / dot(*hitNormal, rayDir)) * (pA - rayOrg);
-    const Vector3D i = cross(rayDir, e);
+    const uint32_t numIntNodes = static_cast<uint32_t>(bvh->intNodes.size());
+    if (numIntNodes == 0)
+        return;
 
-    *bcB = dot(i, eCA);
-    *bcC = dot(i, eAB);
-    *hitDist = dot(*hitNormal, e);
+    const auto getNumLeafPrimRefs = [&](const InternalNode &intNode) {
+        uint32_t numPrimRefs = 0;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot))
+                break;
+            if (!intNode.getChildIsLeaf(slot))
+                continue;
+            uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+            uint32_t numLeafPrimRefs = 0;
+            while (true) {
+                ++numLeafPrimRefs;
+                if (bvh->primRefs[primRefIdx++].isLeafEnd)
+                    break;
+            }
+            numPrimRefs = std::max(intNode.getLeafOffset(slot) + numLeafPrimRefs, numPrimRefs);
+        }
+        return numPrimRefs;
+    };
 
-    return
-        ((*hitDist < distMax) && (*hitDist > distMin)
-         && (*bcB >= 0.0f) && (*bcC >= 0.0f) && (*bcB + *bcC <= 1));
-}
+    // EN: Weight of each node to decide which child to lay out first.
+    //     The subtree size counts both nodes and primitive references, accumulated in reverse BFS order.
+    std::vector<uint64_t> weights(numIntNodes);
+    if (order == NodeOrder::SubtreeSize) {
+        const std::vector<uint32_t> bfsOrder = calcIntNodeBfsOrder(*bvh);
+        for (uint32_t i = numIntNodes; i > 0; --i) {
+            const uint32_t intNodeIdx = bfsOrder[i - 1];
+            const InternalNode &intNode = bvh->intNodes[intNodeIdx];
+            uint64_t weight = 1 + getNumLeafPrimRefs(intNode);
+            const uint32_t numIntChildren = popcnt(intNode.internalMask);
+            for (uint32_t nthIntChild = 0; nthIntChild < numIntChildren; ++nthIntChild)
+                weight += weights[intNode.intNodeChildBaseIndex + nthIntChild];
+            weights[intNodeIdx] = weight;
+        }
+    }
+    else {
+        for (uint32_t intNodeIdx = 0; intNodeIdx < numIntNodes; ++intNodeIdx)
+            weights[intNodeIdx] = intNodeAccessCounts[intNodeIdx];
+    }
 
-template <uint32_t arity>
-inline shared::HitObject __traverse(
-    const GeometryBVH<arity> &bvh,
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    TraversalStatistics* const stats, const bool debugPrint) {
-    using namespace shared;
-    using InternalNode = InternalNode_T<arity>;
+    // EN: Depth-first layout of sibling blocks. Each block is placed when its parent is expanded,
+    //     then the children are expanded from the heaviest one.
+    //     Pushing the children in ascending weight order pops the heaviest one first.
+    std::vector<uint32_t> newIndices(numIntNodes, UINT32_MAX);
+    std::vector<uint32_t> oldIndices(numIntNodes, UINT32_MAX);
+    uint32_t numPlacedNodes = 0;
+    newIndices[0] = numPlacedNodes;
+    oldIndices[numPlacedNodes++] = 0;
+    std::vector<uint32_t> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const uint32_t intNodeIdx = stack.back();
+        stack.pop_back();
+        const InternalNode &intNode = bvh->intNodes[intNodeIdx];
+        const uint32_t numIntChildren = popcnt(intNode.internalMask);
+        if (numIntChildren == 0)
+            continue;
 
-    HitObject ret = {};
-    ret.dist = distMax;
-    ret.instIndex = UINT32_MAX;
-    ret.instUserData = 0;
-    ret.geomIndex = UINT32_MAX;
-    ret.primIndex = UINT32_MAX;
-    ret.bcA = NAN;
-    ret.bcB = NAN;
-    ret.bcC = NAN;
+        uint32_t children[arity];
+        for (uint32_t nthIntChild = 0; nthIntChild < numIntChildren; ++nthIntChild) {
+            const uint32_t childIdx = intNode.intNodeChildBaseIndex + nthIntChild;
+            Assert(newIndices[childIdx] == UINT32_MAX, "The node has already been placed.");
+            newIndices[childIdx] = numPlacedNodes;
+            oldIndices[numPlacedNodes++] = childIdx;
+            children[nthIntChild] = childIdx;
+        }
+        std::stable_sort(
+            children, children + numIntChildren,
+            [&](const uint32_t a, const uint32_t b) {
+            return weights[a] < weights[b];
+        });
+        stack.insert(stack.end(), children, children + numIntChildren);
+    }
+    Assert_Release(numPlacedNodes == numIntNodes, "Some internal nodes are unreachable.");
+
+    // EN: Move the nodes and the leaf blocks of primitive references in the new node order.
+    //     Triangle storages follow the first reference to them.
+    std::vector<InternalNode> newIntNodes(numIntNodes);
+    std::vector<shared::PrimitiveReference> newPrimRefs;
+    newPrimRefs.reserve(bvh->primRefs.size());
+    std::vector<uint32_t> newStorageIndices(bvh->triStorages.size(), UINT32_MAX);
+    std::vector<shared::TriangleStorage> newTriStorages;
+    newTriStorages.reserve(bvh->triStorages.size());
+    std::vector<shared::ParentPointer> newParentPointers(numIntNodes);
+    newParentPointers[0] = shared::ParentPointer(0xFFFF'FFFF);
+    for (uint32_t newIdx = 0; newIdx < numIntNodes; ++newIdx) {
+        const InternalNode &srcIntNode = bvh->intNodes[oldIndices[newIdx]];
+        InternalNode &dstIntNode = newIntNodes[newIdx];
+        dstIntNode = srcIntNode;
+
+        if (srcIntNode.intNodeChildBaseIndex != UINT32_MAX)
+            dstIntNode.intNodeChildBaseIndex = newIndices[srcIntNode.intNodeChildBaseIndex];
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!srcIntNode.getChildIsValid(slot))
+                break;
+            if (srcIntNode.getChildIsLeaf(slot))
+                continue;
+            const uint32_t newChildIdx = dstIntNode.intNodeChildBaseIndex + srcIntNode.getInternalChildNumber(slot);
+            newParentPointers[newChildIdx] = shared::ParentPointer(newIdx, slot);
+        }
 
-    if (stats) {
-        stats->numAabbTests = 0;
-        stats->numTriTests = 0;
+        const uint32_t numLeafPrimRefs = getNumLeafPrimRefs(srcIntNode);
+        if (numLeafPrimRefs == 0)
+            continue;
+        dstIntNode.leafBaseIndex = static_cast<uint32_t>(newPrimRefs.size());
+        for (uint32_t i = 0; i < numLeafPrimRefs; ++i) {
+            shared::PrimitiveReference primRef = bvh->primRefs[srcIntNode.leafBaseIndex + i];
+            uint32_t &newStorageIdx = newStorageIndices[primRef.storageIndex];
+            if (newStorageIdx == UINT32_MAX) {
+                newStorageIdx = static_cast<uint32_t>(newTriStorages.size());
+                newTriStorages.push_back(bvh->triStorages[primRef.storageIndex]);
+            }
+            primRef.storageIndex = newStorageIdx;
+            newPrimRefs.push_back(primRef);
+        }
+    }
+    Assert_Release(newPrimRefs.size() == bvh->primRefs.size(), "Primitive references are not covered by leaves.");
+    for (uint32_t storageIdx = 0; storageIdx < bvh->triStorages.size(); ++storageIdx) {
+        if (newStorageIndices[storageIdx] == UINT32_MAX)
+            newTriStorages.push_back(bvh->triStorages[storageIdx]);
     }
 
-#define USE_COMPRESSED_STACK 1
+    bvh->intNodes = std::move(newIntNodes);
+    bvh->primRefs = std::move(newPrimRefs);
+    bvh->triStorages = std::move(newTriStorages);
+    bvh->parentPointers = std::move(newParentPointers);
+    precomputeLeafTriangles(bvh->leafTriangleFormat, bvh);
+}
 
-    double sumStackAccessDepth = 0.0;
-    uint32_t numStackAccesses = 0;
-    int32_t maxStackDepth = -1;
-    uint32_t numIterations = 0;
-    const int32_t fastStackDepthLimit = stats ? stats->fastStackDepthLimit : 0;
-    uint32_t stackMemoryAccessAmount = 0;
+template void reorderGeometryBVH<2>(
+    const NodeOrder order, const uint32_t* const intNodeAccessCounts, GeometryBVH<2>* const bvh);
+template void reorderGeometryBVH<4>(
+    const NodeOrder order, const uint32_t* const intNodeAccessCounts, GeometryBVH<4>* const bvh);
+template void reorderGeometryBVH<8>(
+    const NodeOrder order, const uint32_t* const intNodeAccessCounts, GeometryBVH<8>* const bvh);
+
+
+
+// EN: Area of the part of a triangle inside a box by clipping against the six planes (Sutherland-Hodgman).
+static float calcClippedTriangleArea(
+    const Point3D &pA, const Point3D &pB, const Point3D &pC, const AABB &box) {
+    // EN: Each plane adds at most one vertex.
+    Point3D polygons[2][9];
+    polygons[0][0] = pA;
+    polygons[0][1] = pB;
+    polygons[0][2] = pC;
+    uint32_t numVertices = 3;
+    uint32_t curIdx = 0;
+    for (uint32_t dim = 0; dim < 3; ++dim) {
+        for (uint32_t side = 0; side < 2; ++side) {
+            const Point3D* const srcPolygon = polygons[curIdx];
+            Point3D* const dstPolygon = polygons[curIdx ^ 1];
+            const auto calcSignedDist = [&](const Point3D &p) {
+                return side == 0 ? p[dim] - box.minP[dim] : box.maxP[dim] - p[dim];
+            };
+            uint32_t numDstVertices = 0;
+            for (uint32_t vIdx = 0; vIdx < numVertices; ++vIdx) {
+                const Point3D &p0 = srcPolygon[vIdx];
+                const Point3D &p1 = srcPolygon[(vIdx + 1) % numVertices];
+                const float d0 = calcSignedDist(p0);
+                const float d1 = calcSignedDist(p1);
+                if (d0 >= 0.0f)
+                    dstPolygon[numDstVertices++] = p0;
+                if ((d0 >= 0.0f) != (d1 >= 0.0f))
+                    dstPolygon[numDstVertices++] = p0 + (d0 / (d0 - d1)) * (p1 - p0);
+            }
+            numVertices = numDstVertices;
+            curIdx ^= 1;
+            if (numVertices < 3)
+                return 0.0f;
+        }
+    }
 
-#if USE_COMPRESSED_STACK
-    static constexpr uint32_t orderBitWidth = tzcntConst(arity);
-    static constexpr uint32_t orderMask = (1 << orderBitWidth) - 1;
+    const Point3D* const polygon = polygons[curIdx];
+    Vector3D sumCross(0.0f);
+    for (uint32_t vIdx = 1; vIdx + 1 < numVertices; ++vIdx)
+        sumCross += cross(polygon[vIdx] - polygon[0], polygon[vIdx + 1] - polygon[0]);
+    return 0.5f * length(sumCross);
+}
 
-    union Entry {
-        struct {
-            uint32_t baseIndex : 31;
-            uint32_t isLeafGroup : 1;
-            uint32_t orderInfo : 28;
-            uint32_t numItems : 4;
-        };
-        uint32_t asUInts[2];
+template <uint32_t arity>
+GeometryBVHAnalysis analyze(const GeometryBVH<arity> &bvh, const GeometryBVHBuildConfig &config) {
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    GeometryBVHAnalysis ret = {};
+    ret.arity = arity;
+    ret.numIntNodes = static_cast<uint32_t>(bvh.intNodes.size());
+    ret.numPrimRefs = static_cast<uint32_t>(bvh.primRefs.size());
+    ret.numTriStorages = static_cast<uint32_t>(bvh.triStorages.size());
+    ret.splitDuplicationRatio = ret.numTriStorages > 0 ?
+        static_cast<float>(ret.numPrimRefs) / ret.numTriStorages : 0.0f;
+    ret.intNodesMemorySize = sizeof(bvh.intNodes[0]) * bvh.intNodes.size();
+    ret.triStoragesMemorySize = sizeof(bvh.triStorages[0]) * bvh.triStorages.size();
+    ret.primRefsMemorySize = sizeof(bvh.primRefs[0]) * bvh.primRefs.size();
+    ret.parentPointersMemorySize = sizeof(bvh.parentPointers[0]) * bvh.parentPointers.size();
+    ret.leafTrianglesMemorySize =
+        sizeof(bvh.woopTris[0]) * bvh.woopTris.size() +
+        sizeof(bvh.woopTriBlocks4[0]) * bvh.woopTriBlocks4.size() +
+        sizeof(bvh.woopTriBlocks8[0]) * bvh.woopTriBlocks8.size() +
+        sizeof(bvh.leafTriBlockIndices[0]) * bvh.leafTriBlockIndices.size();
+    if (bvh.intNodes.empty())
+        return ret;
+
+    ret.sahCost = calcSahCost(bvh, config.intNodeTravCost, config.primIntersectCost);
+
+    struct Leaf {
+        AABB aabb;
+        uint32_t intNodeIndex;
+        uint32_t slot;
+        uint32_t primRefBaseIndex;
+        uint32_t numPrimRefs;
     };
 
-    Entry stack[32];
-    uint8_t leafOffsets[arity];
-    int32_t stackIdx = 0;
-    Entry curGroup = { 0, 0, 0, 1 };
+    const std::vector<uint32_t> bfsOrder = calcIntNodeBfsOrder(bvh);
+    std::vector<uint32_t> depths(ret.numIntNodes);
+    std::vector<Leaf> leaves;
+    depths[0] = 0;
+    for (const uint32_t intNodeIdx : bfsOrder) {
+        const InternalNode &intNode = bvh.intNodes[intNodeIdx];
+        const uint32_t depth = depths[intNodeIdx];
+        if (ret.intNodeDepthHistogram.size() <= depth)
+            ret.intNodeDepthHistogram.resize(depth + 1, 0);
+        ++ret.intNodeDepthHistogram[depth];
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot))
+                break;
+            if (!intNode.getChildIsLeaf(slot)) {
+                depths[intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot)] = depth + 1;
+                continue;
+            }
 
-    const auto push = [&]() {
-        if (stats) {
-            sumStackAccessDepth += stackIdx;
-            ++numStackAccesses;
-            maxStackDepth = std::max(stackIdx, maxStackDepth);
-            if (stackIdx > fastStackDepthLimit)
-                stackMemoryAccessAmount += sizeof(Entry);
-        }
-        stack[stackIdx++] = curGroup;
-        if (debugPrint) {
-            hpprintf("Push (%u): %u - [", stackIdx, curGroup.baseIndex);
-            for (uint32_t i = 0; i < curGroup.numItems; ++i)
-                hpprintf(
-                    "%u%s",
-                    (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
-                    i + 1 < curGroup.numItems ? ", " : "");
-            hpprintf("]\n");
+            Leaf leaf;
+            leaf.aabb = intNode.getChildAabb(slot);
+            leaf.intNodeIndex = intNodeIdx;
+            leaf.slot = slot;
+            leaf.primRefBaseIndex = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+            leaf.numPrimRefs = 0;
+            while (true) {
+                if (bvh.primRefs[leaf.primRefBaseIndex + leaf.numPrimRefs++].isLeafEnd)
+                    break;
+            }
+            leaves.push_back(leaf);
+
+            if (ret.leafSizeHistogram.size() <= leaf.numPrimRefs)
+                ret.leafSizeHistogram.resize(leaf.numPrimRefs + 1, 0);
+            ++ret.leafSizeHistogram[leaf.numPrimRefs];
+            if (ret.leafDepthHistogram.size() <= depth + 1)
+                ret.leafDepthHistogram.resize(depth + 2, 0);
+            ++ret.leafDepthHistogram[depth + 1];
         }
-    };
+    }
+    ret.numLeaves = static_cast<uint32_t>(leaves.size());
+
+    // EN: Exact boxes bottom-up. Triangle bounds of a leaf are clipped by the quantized box
+    //     since spatial splits make leaf boxes smaller than their triangles.
+    std::vector<AABB> exactIntNodeAabbs(ret.numIntNodes);
+    double sumExactCost = 0.0;
+    double sumQuantizationAreaOverhead = 0.0;
+    uint32_t numQuantizedBoxes = 0;
+    for (uint32_t i = ret.numIntNodes; i > 0; --i) {
+        const uint32_t intNodeIdx = bfsOrder[i - 1];
+        const InternalNode &intNode = bvh.intNodes[intNodeIdx];
+        AABB nodeAabb;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot))
+                break;
+            const AABB quantAabb = intNode.getChildAabb(slot);
+            AABB exactAabb;
+            if (intNode.getChildIsLeaf(slot)) {
+                uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+                uint32_t numPrimRefs = 0;
+                while (true) {
+                    const shared::PrimitiveReference &primRef = bvh.primRefs[primRefIdx++];
+                    const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+                    exactAabb.unify(triStorage.pA).unify(triStorage.pB).unify(triStorage.pC);
+                    ++numPrimRefs;
+                    if (primRef.isLeafEnd)
+                        break;
+                }
+                exactAabb.intersect(quantAabb);
+                sumExactCost += exactAabb.calcHalfSurfaceArea() * numPrimRefs * config.primIntersectCost;
+            }
+            else {
+                exactAabb = exactIntNodeAabbs[intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot)];
+            }
+            nodeAabb.unify(exactAabb);
+
+            const float exactArea = exactAabb.calcHalfSurfaceArea();
+            if (exactArea > 0.0f) {
+                const float overhead = quantAabb.calcHalfSurfaceArea() / exactArea - 1.0f;
+                sumQuantizationAreaOverhead += overhead;
+                ret.maxQuantizationAreaOverhead = std::max(overhead, ret.maxQuantizationAreaOverhead);
+                ++numQuantizedBoxes;
+            }
+        }
+        exactIntNodeAabbs[intNodeIdx] = nodeAabb;
+        sumExactCost += nodeAabb.calcHalfSurfaceArea() * config.intNodeTravCost;
+    }
+    // EN: Normalized by the same root area as sahCost so that the two are comparable.
+    ret.sahCostExact = static_cast<float>(sumExactCost / bvh.intNodes[0].getAabb().calcHalfSurfaceArea());
+    ret.avgQuantizationAreaOverhead = numQuantizedBoxes > 0 ?
+        static_cast<float>(sumQuantizationAreaOverhead / numQuantizedBoxes) : 0.0f;
+
+    // EN: EPO over internal node boxes followed by leaf boxes.
+    //     Each box queries the BVH for leaves overlapping it while skipping its own subtree.
+    //     A triangle is clipped by the box of the referencing leaf as well so that parts of a triangle split into
+    //     multiple leaves are not counted twice.
+    std::unique_ptr<ThreadPool> threadPoolHolder;
+    ThreadPool* threadPool = nullptr;
+    if (config.numThreads != 1) {
+        threadPoolHolder = std::make_unique<ThreadPool>(config.numThreads);
+        if (threadPoolHolder->getNumThreads() > 1)
+            threadPool = threadPoolHolder.get();
+    }
+
+    const uint32_t numBoxes = ret.numIntNodes + ret.numLeaves;
+    std::vector<double> weightedOverlapAreas(numBoxes, 0.0);
+    std::vector<double> leafTriangleAreas(ret.numLeaves, 0.0);
+    parallelFor(
+        threadPool, 0, numBoxes, 64,
+        [&](const uint32_t begin, const uint32_t end) {
+        std::vector<uint32_t> stack;
+        for (uint32_t boxIdx = begin; boxIdx < end; ++boxIdx) {
+            AABB box;
+            uint32_t skipIntNodeIdx = UINT32_MAX;
+            const Leaf* skipLeaf = nullptr;
+            float cost;
+            if (boxIdx < ret.numIntNodes) {
+                box = bvh.intNodes[boxIdx].getAabb();
+                skipIntNodeIdx = boxIdx;
+                cost = config.intNodeTravCost;
+            }
+            else {
+                const Leaf &leaf = leaves[boxIdx - ret.numIntNodes];
+                box = leaf.aabb;
+                skipLeaf = &leaf;
+                cost = leaf.numPrimRefs * config.primIntersectCost;
+
+                double triArea = 0.0;
+                for (uint32_t i = 0; i < leaf.numPrimRefs; ++i) {
+                    const shared::PrimitiveReference &primRef = bvh.primRefs[leaf.primRefBaseIndex + i];
+                    const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+                    triArea += calcClippedTriangleArea(triStorage.pA, triStorage.pB, triStorage.pC, leaf.aabb);
+                }
+                leafTriangleAreas[boxIdx - ret.numIntNodes] = triArea;
+            }
+
+            double overlapArea = 0.0;
+            stack.clear();
+            stack.push_back(0);
+            while (!stack.empty()) {
+                const uint32_t intNodeIdx = stack.back();
+                stack.pop_back();
+                if (intNodeIdx == skipIntNodeIdx)
+                    continue;
+                const InternalNode &intNode = bvh.intNodes[intNodeIdx];
+                for (uint32_t slot = 0; slot < arity; ++slot) {
+                    if (!intNode.getChildIsValid(slot))
+                        break;
+                    AABB overlapAabb = intNode.getChildAabb(slot);
+                    overlapAabb.intersect(box);
+                    if (!overlapAabb.isValid())
+                        continue;
+                    if (!intNode.getChildIsLeaf(slot)) {
+                        stack.push_back(intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot));
+                        continue;
+                    }
+                    if (skipLeaf && skipLeaf->intNodeIndex == intNodeIdx && skipLeaf->slot == slot)
+                        continue;
+                    uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+                    while (true) {
+                        const shared::PrimitiveReference &primRef = bvh.primRefs[primRefIdx++];
+                        const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+                        overlapArea += calcClippedTriangleArea(
+                            triStorage.pA, triStorage.pB, triStorage.pC, overlapAabb);
+                        if (primRef.isLeafEnd)
+                            break;
+                    }
+                }
+            }
+            weightedOverlapAreas[boxIdx] = cost * overlapArea;
+        }
+    });
+
+    double sumWeightedOverlapArea = 0.0;
+    for (const double area : weightedOverlapAreas)
+        sumWeightedOverlapArea += area;
+    double totalTriangleArea = 0.0;
+    for (const double area : leafTriangleAreas)
+        totalTriangleArea += area;
+    ret.epo = totalTriangleArea > 0.0 ? static_cast<float>(sumWeightedOverlapArea / totalTriangleArea) : 0.0f;
+
+    return ret;
+}
+
+template GeometryBVHAnalysis analyze<2>(const GeometryBVH<2> &bvh, const GeometryBVHBuildConfig &config);
+template GeometryBVHAnalysis analyze<4>(const GeometryBVH<4> &bvh, const GeometryBVHBuildConfig &config);
+template GeometryBVHAnalysis analyze<8>(const GeometryBVH<8> &bvh, const GeometryBVHBuildConfig &config);
+
+std::string toJson(const GeometryBVHAnalysis &analysis, const GeometryBVHBuildConfig &config) {
+    std::string ret;
+    char buf[256];
+    const auto appendf = [&](const char* fmt, auto... args) {
+        snprintf(buf, sizeof(buf), fmt, args...);
+        ret += buf;
+    };
+    // EN: JSON has no representation for non-finite numbers.
+    const auto appendFloat = [&](const char* key, const float value, const bool last = false) {
+        if (std::isfinite(value))
+            appendf("    \"%s\": %.9g%s\n", key, value, last ? "" : ",");
+        else
+            appendf("    \"%s\": null%s\n", key, last ? "" : ",");
+    };
+    const auto appendHistogram = [&](const char* key, const std::vector<uint32_t> &histogram, const bool last) {
+        appendf("    \"%s\": [", key);
+        for (uint32_t i = 0; i < histogram.size(); ++i)
+            appendf(i > 0 ? ", %u" : "%u", histogram[i]);
+        appendf("]%s\n", last ? "" : ",");
+    };
+
+    const char* builderName =
+        config.builder == GeometryBVHBuilder::SBVH ? "SBVH" :
+        config.builder == GeometryBVHBuilder::LBVH ? "LBVH" :
+        config.builder == GeometryBVHBuilder::PLOC ? "PLOC" :
+        "unknown";
+    const char* leafTriangleFormatName =
+        config.leafTriangleFormat == LeafTriangleFormat::Raw ? "Raw" :
+        config.leafTriangleFormat == LeafTriangleFormat::Woop ? "Woop" :
+        config.leafTriangleFormat == LeafTriangleFormat::WoopSoA4 ? "WoopSoA4" :
+        config.leafTriangleFormat == LeafTriangleFormat::WoopSoA8 ? "WoopSoA8" :
+        "unknown";
+
+    ret += "{\n";
+    ret += "  \"config\": {\n";
+    appendf("    \"arity\": %u,\n", analysis.arity);
+    appendf("    \"builder\": \"%s\",\n", builderName);
+    appendFloat("splittingBudget", config.splittingBudget);
+    appendFloat("intNodeTravCost", config.intNodeTravCost);
+    appendFloat("primIntersectCost", config.primIntersectCost);
+    appendf("    \"minNumPrimsPerLeaf\": %u,\n", config.minNumPrimsPerLeaf);
+    appendf("    \"maxNumPrimsPerLeaf\": %u,\n", config.maxNumPrimsPerLeaf);
+    appendf("    \"numTreeletOptimizationPasses\": %u,\n", config.numTreeletOptimizationPasses);
+    appendf("    \"leafTriangleFormat\": \"%s\"\n", leafTriangleFormatName);
+    ret += "  },\n";
+
+    ret += "  \"counts\": {\n";
+    appendf("    \"intNodes\": %u,\n", analysis.numIntNodes);
+    appendf("    \"leaves\": %u,\n", analysis.numLeaves);
+    appendf("    \"primRefs\": %u,\n", analysis.numPrimRefs);
+    appendf("    \"triStorages\": %u\n", analysis.numTriStorages);
+    ret += "  },\n";
+
+    ret += "  \"quality\": {\n";
+    appendFloat("sahCost", analysis.sahCost);
+    appendFloat("sahCostExact", analysis.sahCostExact);
+    appendFloat("epo", analysis.epo);
+    appendFloat("splitDuplicationRatio", analysis.splitDuplicationRatio);
+    appendFloat("avgQuantizationAreaOverhead", analysis.avgQuantizationAreaOverhead);
+    appendFloat("maxQuantizationAreaOverhead", analysis.maxQuantizationAreaOverhead, true);
+    ret += "  },\n";
+
+    ret += "  \"histograms\": {\n";
+    appendHistogram("leafSize", analysis.leafSizeHistogram, false);
+    appendHistogram("leafDepth", analysis.leafDepthHistogram, false);
+    appendHistogram("intNodeDepth", analysis.intNodeDepthHistogram, true);
+    ret += "  },\n";
+
+    const size_t totalMemorySize =
+        analysis.intNodesMemorySize + analysis.triStoragesMemorySize + analysis.primRefsMemorySize +
+        analysis.parentPointersMemorySize + analysis.leafTrianglesMemorySize;
+    ret += "  \"memory\": {\n";
+    appendf("    \"intNodes\": %llu,\n", static_cast<unsigned long long>(analysis.intNodesMemorySize));
+    appendf("    \"triStorages\": %llu,\n", static_cast<unsigned long long>(analysis.triStoragesMemorySize));
+    appendf("    \"primRefs\": %llu,\n", static_cast<unsigned long long>(analysis.primRefsMemorySize));
+    appendf("    \"parentPointers\": %llu,\n", static_cast<unsigned long long>(analysis.parentPointersMemorySize));
+    appendf("    \"leafTriangles\": %llu,\n", static_cast<unsigned long long>(analysis.leafTrianglesMemorySize));
+    appendf("    \"total\": %llu\n", static_cast<unsigned long long>(totalMemorySize));
+    ret += "  }\n";
+    ret += "}\n";
+
+    return ret;
+}
+
+
+
+template <uint32_t arity>
+float refitGeometryBVH(
+    const Geometry* const geoms, const uint32_t numGeoms,
+    const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh) {
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    Assert_Release(numGeoms == bvh->numGeoms, "The number of geometries doesn't match the BVH.");
+
+    BuilderInput<PrimitiveType::Geometric> buildInput = {};
+    buildInput.geometries = geoms;
+    buildInput.numGeometries = numGeoms;
+
+    std::unique_ptr<ThreadPool> threadPoolHolder;
+    ThreadPool* threadPool = nullptr;
+    if (config.numThreads != 1) {
+        threadPoolHolder = std::make_unique<ThreadPool>(config.numThreads);
+        if (threadPoolHolder->getNumThreads() > 1)
+            threadPool = threadPoolHolder.get();
+    }
+
+    // EN: Update triangle vertices.
+    const uint32_t numTriStorages = static_cast<uint32_t>(bvh->triStorages.size());
+    parallelFor(
+        threadPool, 0, numTriStorages, primRefInitGrainSize,
+        [&](const uint32_t begin, const uint32_t end) {
+        for (uint32_t storageIdx = begin; storageIdx < end; ++storageIdx) {
+            shared::TriangleStorage &triStorage = bvh->triStorages[storageIdx];
+            Assert(triStorage.primIndex < geoms[triStorage.geomIndex].numTriangles,
+                   "The number of triangles doesn't match the BVH.");
+            calcTriangleVertices(
+                buildInput, triStorage.geomIndex, triStorage.primIndex,
+                &triStorage.pA, &triStorage.pB, &triStorage.pC);
+        }
+    });
+
+    // EN: Refit internal nodes from the bottom to the root.
+    //     Each path starts from a node without internal children and proceeds to the parent
+    //     only when it is the last one arriving there, so that every node is processed after all of its children.
+    //     Exact node boxes are kept aside to avoid accumulating the quantization error toward the root.
+    const uint32_t numIntNodes = static_cast<uint32_t>(bvh->intNodes.size());
+    std::vector<AABB> intNodeAabbs(numIntNodes);
+    std::vector<std::atomic<uint32_t>> arrivalCounters(numIntNodes);
+    std::vector<uint32_t> bottomIntNodeIndices;
+    for (uint32_t intNodeIdx = 0; intNodeIdx < numIntNodes; ++intNodeIdx) {
+        arrivalCounters[intNodeIdx].store(0, std::memory_order_relaxed);
+        if (bvh->intNodes[intNodeIdx].internalMask == 0)
+            bottomIntNodeIndices.push_back(intNodeIdx);
+    }
+
+    const auto refitNode = [&](const uint32_t intNodeIdx) {
+        InternalNode &intNode = bvh->intNodes[intNodeIdx];
+        AABB childAabbs[arity];
+        uint32_t numChildren = 0;
+        AABB nodeAabb;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot))
+                break;
+            AABB &childAabb = childAabbs[slot];
+            if (intNode.getChildIsLeaf(slot)) {
+                uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+                while (true) {
+                    const shared::PrimitiveReference &primRef = bvh->primRefs[primRefIdx++];
+                    const shared::TriangleStorage &triStorage = bvh->triStorages[primRef.storageIndex];
+                    childAabb.unify(triStorage.pA).unify(triStorage.pB).unify(triStorage.pC);
+                    if (primRef.isLeafEnd)
+                        break;
+                }
+            }
+            else {
+                childAabb = intNodeAabbs[intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot)];
+            }
+            nodeAabb.unify(childAabb);
+            ++numChildren;
+        }
+
+        intNode.setQuantizationAabb(nodeAabb);
+        for (uint32_t slot = 0; slot < numChildren; ++slot)
+            intNode.setChildAabb(slot, childAabbs[slot]);
+        intNodeAabbs[intNodeIdx] = nodeAabb;
+    };
+
+    parallelFor(
+        threadPool, 0, static_cast<uint32_t>(bottomIntNodeIndices.size()), 64,
+        [&](const uint32_t begin, const uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t intNodeIdx = bottomIntNodeIndices[i];
+            while (true) {
+                refitNode(intNodeIdx);
+                if (intNodeIdx == 0)
+                    break;
+                intNodeIdx = bvh->parentPointers[intNodeIdx].index;
+                const uint32_t numIntChildren = popcnt(bvh->intNodes[intNodeIdx].internalMask);
+                if (arrivalCounters[intNodeIdx].fetch_add(1, std::memory_order_acq_rel) + 1 < numIntChildren)
+                    break;
+            }
+        }
+    });
+
+    precomputeLeafTriangles(bvh->leafTriangleFormat, bvh);
+
+    const float sahCost = calcSahCost(*bvh, config.intNodeTravCost, config.primIntersectCost);
+    return sahCost / bvh->sahCostAtBuild;
+}
+
+template float refitGeometryBVH<2>(
+    const Geometry* const geoms, const uint32_t numGeoms,
+    const GeometryBVHBuildConfig &config, GeometryBVH<2>* const bvh);
+template float refitGeometryBVH<4>(
+    const Geometry* const geoms, const uint32_t numGeoms,
+    const GeometryBVHBuildConfig &config, GeometryBVH<4>* const bvh);
+template float refitGeometryBVH<8>(
+    const Geometry* const geoms, const uint32_t numGeoms,
+    const GeometryBVHBuildConfig &config, GeometryBVH<8>* const bvh);
+
+
+
+// EN: Binary layout of a BVH cache file.
+//     Bump the version whenever the layout of the file or the node structures changes.
+constexpr char bvhCacheMagic[8] = { 'G', 'F', 'X', 'B', 'V', 'H', '\0', '\0' };
+constexpr uint32_t bvhCacheVersion = 1;
+constexpr uint32_t bvhCacheSectionAlignment = 64;
+
+struct GeometryBVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t arity;
+    uint64_t configHash;
+    uint64_t sourceHash;
+    uint32_t numGeoms;
+    uint32_t totalNumPrims;
+    float sahCostAtBuild;
+    uint32_t numIntNodes;
+    uint32_t numTriStorages;
+    uint32_t numPrimRefs;
+    uint32_t numParentPointers;
+    uint32_t __padding;
+    uint64_t intNodesOffset;
+    uint64_t triStoragesOffset;
+    uint64_t primRefsOffset;
+    uint64_t parentPointersOffset;
+    uint64_t fileSize;
+};
+
+uint64_t calcFileHash(const std::filesystem::path &filePath) {
+    std::ifstream ifs(filePath, std::ios::in | std::ios::binary);
+    if (!ifs.is_open())
+        return 0;
+
+    uint64_t hash = calcHash(nullptr, 0);
+    std::vector<char> buffer(1 << 16);
+    while (ifs) {
+        ifs.read(buffer.data(), buffer.size());
+        hash = calcHash(buffer.data(), static_cast<size_t>(ifs.gcount()), hash);
+    }
+    return hash;
+}
+
+uint64_t calcConfigHash(const GeometryBVHBuildConfig &config) {
+    uint64_t hash = calcHash(&bvhCacheVersion, sizeof(bvhCacheVersion));
+    hash = calcHash(&config.splittingBudget, sizeof(config.splittingBudget), hash);
+    hash = calcHash(&config.intNodeTravCost, sizeof(config.intNodeTravCost), hash);
+    hash = calcHash(&config.primIntersectCost, sizeof(config.primIntersectCost), hash);
+    hash = calcHash(&config.minNumPrimsPerLeaf, sizeof(config.minNumPrimsPerLeaf), hash);
+    hash = calcHash(&config.maxNumPrimsPerLeaf, sizeof(config.maxNumPrimsPerLeaf), hash);
+    hash = calcHash(&config.builder, sizeof(config.builder), hash);
+    hash = calcHash(&config.numTreeletOptimizationPasses, sizeof(config.numTreeletOptimizationPasses), hash);
+    return hash;
+}
+
+// EN: Header of a cache file with the section offsets derived from the section sizes.
+template <uint32_t arity>
+static GeometryBVHCacheHeader makeGeometryBVHCacheHeader(
+    const uint32_t numGeoms, const uint32_t totalNumPrims, const float sahCostAtBuild,
+    const uint32_t numIntNodes, const uint32_t numTriStorages,
+    const uint32_t numPrimRefs, const uint32_t numParentPointers,
+    const uint64_t configHash, const uint64_t sourceHash) {
+    GeometryBVHCacheHeader header = {};
+    std::copy_n(bvhCacheMagic, sizeof(bvhCacheMagic), header.magic);
+    header.version = bvhCacheVersion;
+    header.arity = arity;
+    header.configHash = configHash;
+    header.sourceHash = sourceHash;
+    header.numGeoms = numGeoms;
+    header.totalNumPrims = totalNumPrims;
+    header.sahCostAtBuild = sahCostAtBuild;
+    header.numIntNodes = numIntNodes;
+    header.numTriStorages = numTriStorages;
+    header.numPrimRefs = numPrimRefs;
+    header.numParentPointers = numParentPointers;
+    header.intNodesOffset = alignUp(sizeof(header), bvhCacheSectionAlignment);
+    header.triStoragesOffset = alignUp(
+        header.intNodesOffset + sizeof(shared::InternalNode_T<arity>) * header.numIntNodes,
+        bvhCacheSectionAlignment);
+    header.primRefsOffset = alignUp(
+        header.triStoragesOffset + sizeof(shared::TriangleStorage) * header.numTriStorages,
+        bvhCacheSectionAlignment);
+    header.parentPointersOffset = alignUp(
+        header.primRefsOffset + sizeof(shared::PrimitiveReference) * header.numPrimRefs,
+        bvhCacheSectionAlignment);
+    header.fileSize = header.parentPointersOffset + sizeof(shared::ParentPointer) * header.numParentPointers;
+    return header;
+}
+
+// EN: Write to a temporary file first so that other processes never see a partially written cache.
+//     The temporary file has a random name so that concurrent writers of the same cache don't mix their contents.
+static bool writeFileViaTemporary(
+    const std::filesystem::path &filePath, const std::function<bool(std::ofstream &ofs)> &writeContents) {
+    std::error_code errorCode;
+    if (filePath.has_parent_path())
+        std::filesystem::create_directories(filePath.parent_path(), errorCode);
+    std::random_device randomDevice;
+    char tempSuffix[32];
+    snprintf(tempSuffix, sizeof(tempSuffix), ".%08x%08x.tmp", randomDevice(), randomDevice());
+    std::filesystem::path tempFilePath = filePath;
+    tempFilePath += tempSuffix;
+    {
+        std::ofstream ofs(tempFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open())
+            return false;
+        if (!writeContents(ofs) || !ofs) {
+            ofs.close();
+            std::filesystem::remove(tempFilePath, errorCode);
+            return false;
+        }
+    }
+    std::filesystem::rename(tempFilePath, filePath, errorCode);
+    if (errorCode) {
+        std::filesystem::remove(tempFilePath, errorCode);
+        return false;
+    }
+
+    return true;
+}
+
+template <uint32_t arity>
+bool writeGeometryBVHCache(
+    const std::filesystem::path &filePath, const GeometryBVH<arity> &bvh,
+    const uint64_t configHash, const uint64_t sourceHash) {
+    const GeometryBVHCacheHeader header = makeGeometryBVHCacheHeader<arity>(
+        bvh.numGeoms, bvh.totalNumPrims, bvh.sahCostAtBuild,
+        static_cast<uint32_t>(bvh.intNodes.size()), static_cast<uint32_t>(bvh.triStorages.size()),
+        static_cast<uint32_t>(bvh.primRefs.size()), static_cast<uint32_t>(bvh.parentPointers.size()),
+        configHash, sourceHash);
+
+    std::vector<uint8_t> fileData(header.fileSize, 0);
+    std::memcpy(fileData.data(), &header, sizeof(header));
+    std::memcpy(
+        fileData.data() + header.intNodesOffset, bvh.intNodes.data(),
+        sizeof(bvh.intNodes[0]) * header.numIntNodes);
+    std::memcpy(
+        fileData.data() + header.triStoragesOffset, bvh.triStorages.data(),
+        sizeof(bvh.triStorages[0]) * header.numTriStorages);
+    std::memcpy(
+        fileData.data() + header.primRefsOffset, bvh.primRefs.data(),
+        sizeof(bvh.primRefs[0]) * header.numPrimRefs);
+    std::memcpy(
+        fileData.data() + header.parentPointersOffset, bvh.parentPointers.data(),
+        sizeof(bvh.parentPointers[0]) * header.numParentPointers);
+
+    return writeFileViaTemporary(
+        filePath,
+        [&fileData](std::ofstream &ofs) {
+            ofs.write(reinterpret_cast<const char*>(fileData.data()), fileData.size());
+            return true;
+        });
+}
+
+template bool writeGeometryBVHCache<2>(
+    const std::filesystem::path &filePath, const GeometryBVH<2> &bvh,
+    const uint64_t configHash, const uint64_t sourceHash);
+template bool writeGeometryBVHCache<4>(
+    const std::filesystem::path &filePath, const GeometryBVH<4> &bvh,
+    const uint64_t configHash, const uint64_t sourceHash);
+template bool writeGeometryBVHCache<8>(
+    const std::filesystem::path &filePath, const GeometryBVH<8> &bvh,
+    const uint64_t configHash, const uint64_t sourceHash);
+
+template <uint32_t arity>
+bool MappedGeometryBVH<arity>::open(
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash) {
+    m_view = {};
+    if (!m_file.open(filePath))
+        return false;
+    const uint8_t* const data = m_file.getData();
+    const size_t size = m_file.getSize();
+
+    // EN: Validate the header.
+    GeometryBVHCacheHeader header;
+    if (size < sizeof(header)) {
+        m_file.close();
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    const auto sectionIsValid = [&](const uint64_t offset, const uint64_t numElems, const uint64_t elemSize) {
+        return offset % bvhCacheSectionAlignment == 0 && offset + numElems * elemSize <= size;
+    };
+    const bool isValid =
+        std::equal(bvhCacheMagic, bvhCacheMagic + sizeof(bvhCacheMagic), header.magic) &&
+        header.version == bvhCacheVersion &&
+        header.arity == arity &&
+        header.configHash == configHash &&
+        header.sourceHash == sourceHash &&
+        header.fileSize == size &&
+        sectionIsValid(header.intNodesOffset, header.numIntNodes, sizeof(shared::InternalNode_T<arity>)) &&
+        sectionIsValid(header.triStoragesOffset, header.numTriStorages, sizeof(shared::TriangleStorage)) &&
+        sectionIsValid(header.primRefsOffset, header.numPrimRefs, sizeof(shared::PrimitiveReference)) &&
+        sectionIsValid(header.parentPointersOffset, header.numParentPointers, sizeof(shared::ParentPointer));
+    if (!isValid) {
+        m_file.close();
+        return false;
+    }
+
+    m_view.intNodes = std::span(
+        reinterpret_cast<const shared::InternalNode_T<arity>*>(data + header.intNodesOffset),
+        header.numIntNodes);
+    m_view.triStorages = std::span(
+        reinterpret_cast<const shared::TriangleStorage*>(data + header.triStoragesOffset),
+        header.numTriStorages);
+    m_view.primRefs = std::span(
+        reinterpret_cast<const shared::PrimitiveReference*>(data + header.primRefsOffset),
+        header.numPrimRefs);
+    m_view.parentPointers = std::span(
+        reinterpret_cast<const shared::ParentPointer*>(data + header.parentPointersOffset),
+        header.numParentPointers);
+    m_view.numGeoms = header.numGeoms;
+    m_view.totalNumPrims = header.totalNumPrims;
+    m_view.sahCostAtBuild = header.sahCostAtBuild;
+
+    return true;
+}
+
+template class MappedGeometryBVH<2>;
+template class MappedGeometryBVH<4>;
+template class MappedGeometryBVH<8>;
+
+
+
+// EN: Triangles of a cluster spilled to a file during the out-of-core build.
+struct SpilledCluster {
+    std::filesystem::path filePath;
+    AABB geomAabb;
+    AABB centAabb;
+    uint32_t numTriangles = 0;
+};
+
+// EN: Temporary files of an out-of-core build in a directory unique to the build, removed at destruction.
+class SpillFileSet {
+    std::filesystem::path m_directory;
+    uint32_t m_numCreatedFiles;
+
+public:
+    SpillFileSet(const std::filesystem::path &parentDirectory) : m_numCreatedFiles(0) {
+        const auto now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        const uint64_t id = calcHash(&now, sizeof(now), std::hash<std::thread::id>()(std::this_thread::get_id()));
+        char name[32];
+        snprintf(name, sizeof(name), "bvh_ooc_%016llx", static_cast<unsigned long long>(id));
+        m_directory = parentDirectory / name;
+        std::error_code errorCode;
+        if (!std::filesystem::create_directories(m_directory, errorCode))
+            m_directory.clear();
+    }
+    ~SpillFileSet() {
+        if (m_directory.empty())
+            return;
+        std::error_code errorCode;
+        std::filesystem::remove_all(m_directory, errorCode);
+    }
+    SpillFileSet(const SpillFileSet &) = delete;
+    SpillFileSet &operator=(const SpillFileSet &) = delete;
+
+    bool isValid() const {
+        return !m_directory.empty();
+    }
+    std::filesystem::path create() {
+        char name[32];
+        snprintf(name, sizeof(name), "%08u.bin", m_numCreatedFiles++);
+        return m_directory / name;
+    }
+    void remove(const std::filesystem::path &filePath) {
+        std::error_code errorCode;
+        std::filesystem::remove(filePath, errorCode);
+    }
+};
+
+using TriangleReader = std::function<uint32_t(shared::TriangleStorage* triStorages, uint32_t maxNumTriangles)>;
+
+static constexpr uint32_t outOfCoreReadBatchSize = 4096;
+// EN: Triangles buffered per cell before appending them to the spill file of the cell.
+static constexpr uint32_t outOfCoreSpillBatchSize = 256;
+
+static TriangleReader makeSpillFileReader(std::ifstream* const ifs) {
+    return [ifs]
+    (shared::TriangleStorage* const triStorages, const uint32_t maxNumTriangles) {
+        ifs->read(reinterpret_cast<char*>(triStorages), sizeof(triStorages[0]) * maxNumTriangles);
+        return static_cast<uint32_t>(ifs->gcount() / sizeof(triStorages[0]));
+    };
+}
+
+static AABB calcTriangleAabb(const shared::TriangleStorage &triStorage) {
+    AABB ret;
+    ret.unify(triStorage.pA).unify(triStorage.pB).unify(triStorage.pC);
+    return ret;
+}
+
+static bool appendToSpillFile(
+    const std::filesystem::path &filePath, const shared::TriangleStorage* const triStorages, const size_t numTriangles) {
+    std::ofstream ofs(filePath, std::ios::out | std::ios::binary | std::ios::app);
+    ofs.write(reinterpret_cast<const char*>(triStorages), sizeof(triStorages[0]) * numTriangles);
+    return static_cast<bool>(ofs);
+}
+
+// EN: Bin the triangles by their centroids into gridRes^3 cells over centAabb
+//     and spill each non-empty cell into its own file.
+//     Only the files of the cells being flushed are open, so a large grid doesn't run out of file handles.
+static bool spillTrianglesToGridCells(
+    const TriangleReader &readTriangles, const AABB &centAabb, const uint32_t gridRes,
+    SpillFileSet* const spillFiles, std::vector<SpilledCluster>* const clusters) {
+    struct Cell {
+        std::vector<shared::TriangleStorage> buffer;
+        SpilledCluster cluster;
+    };
+    std::vector<Cell> cells(gridRes * gridRes * gridRes);
+    const auto flush = [spillFiles]
+    (Cell &cell) {
+        if (cell.cluster.filePath.empty())
+            cell.cluster.filePath = spillFiles->create();
+        const bool success = appendToSpillFile(cell.cluster.filePath, cell.buffer.data(), cell.buffer.size());
+        cell.buffer.clear();
+        return success;
+    };
+    const auto calcCellCoord = [gridRes]
+    (const float x) {
+        return static_cast<uint32_t>(std::min(std::max(0.0f, x) * gridRes, gridRes - 1.0f));
+    };
+
+    std::vector<shared::TriangleStorage> batch(outOfCoreReadBatchSize);
+    while (const uint32_t numTris = readTriangles(batch.data(), outOfCoreReadBatchSize)) {
+        for (uint32_t i = 0; i < numTris; ++i) {
+            const shared::TriangleStorage &triStorage = batch[i];
+            const AABB triAabb = calcTriangleAabb(triStorage);
+            const Point3D centroid = triAabb.getCenter();
+            const Point3D np = centAabb.normalize(centroid);
+            const uint32_t cellIdx =
+                (calcCellCoord(np.z) * gridRes + calcCellCoord(np.y)) * gridRes + calcCellCoord(np.x);
+            Cell &cell = cells[cellIdx];
+            cell.buffer.push_back(triStorage);
+            cell.cluster.geomAabb.unify(triAabb);
+            cell.cluster.centAabb.unify(centroid);
+            ++cell.cluster.numTriangles;
+            if (cell.buffer.size() == outOfCoreSpillBatchSize && !flush(cell))
+                return false;
+        }
+    }
+
+    for (Cell &cell : cells) {
+        if (cell.cluster.numTriangles == 0)
+            continue;
+        if (!cell.buffer.empty() && !flush(cell))
+            return false;
+        clusters->push_back(std::move(cell.cluster));
+    }
+
+    return true;
+}
+
+// EN: Split the triangles into chunks in the order of the source.
+//     Used when the centroids of a cluster can't be separated spatially.
+static bool spillTrianglesInChunks(
+    const TriangleReader &readTriangles, const uint32_t maxNumTrianglesPerChunk,
+    SpillFileSet* const spillFiles, std::vector<SpilledCluster>* const clusters) {
+    std::vector<shared::TriangleStorage> batch(outOfCoreReadBatchSize);
+    SpilledCluster chunk;
+    while (const uint32_t numTris = readTriangles(batch.data(), outOfCoreReadBatchSize)) {
+        for (uint32_t i = 0; i < numTris;) {
+            if (chunk.numTriangles == maxNumTrianglesPerChunk) {
+                clusters->push_back(std::move(chunk));
+                chunk = SpilledCluster();
+            }
+            if (chunk.filePath.empty())
+                chunk.filePath = spillFiles->create();
+            const uint32_t numToWrite = std::min(numTris - i, maxNumTrianglesPerChunk - chunk.numTriangles);
+            if (!appendToSpillFile(chunk.filePath, &batch[i], numToWrite))
+                return false;
+            for (uint32_t j = i; j < i + numToWrite; ++j) {
+                const AABB triAabb = calcTriangleAabb(batch[j]);
+                chunk.geomAabb.unify(triAabb);
+                chunk.centAabb.unify(triAabb.getCenter());
+            }
+            chunk.numTriangles += numToWrite;
+            i += numToWrite;
+        }
+    }
+    if (chunk.numTriangles > 0)
+        clusters->push_back(std::move(chunk));
+
+    return true;
+}
+
+// EN: Top-level node over the clusters, a child refers to either another top-level node or a cluster.
+template <uint32_t arity>
+struct OutOfCoreTopNode {
+    static constexpr uint32_t clusterFlag = 1u << 31;
+    uint32_t childRefs[arity];
+    uint32_t numChildren;
+};
+
+// EN: Build the top-level tree over clusterIndices[begin, end) by SAH splits weighted with the triangle counts
+//     until the node is filled. clusterIndices is reordered in place so that it ends up in the order of the leaves.
+template <uint32_t arity>
+static uint32_t buildOutOfCoreTopNodes(
+    const std::vector<SpilledCluster> &clusters, const uint32_t begin, const uint32_t end,
+    std::vector<uint32_t>* const clusterIndices, std::vector<OutOfCoreTopNode<arity>>* const topNodes) {
+    const auto calcGroupAabb = [&]
+    (const uint32_t groupBegin, const uint32_t groupEnd) {
+        AABB ret;
+        for (uint32_t i = groupBegin; i < groupEnd; ++i)
+            ret.unify(clusters[(*clusterIndices)[i]].geomAabb);
+        return ret;
+    };
+    const auto sortByAxis = [&]
+    (const uint32_t groupBegin, const uint32_t groupEnd, const uint32_t axis) {
+        std::sort(
+            clusterIndices->begin() + groupBegin, clusterIndices->begin() + groupEnd,
+            [&clusters, axis](const uint32_t a, const uint32_t b) {
+                return clusters[a].geomAabb.getCenter()[axis] < clusters[b].geomAabb.getCenter()[axis];
+            });
+    };
+
+    std::vector<std::pair<uint32_t, uint32_t>> groups = { { begin, end } };
+    std::vector<float> rightCosts;
+    while (groups.size() < arity) {
+        // EN: Split the largest group with multiple clusters.
+        uint32_t groupIdxToSplit = UINT32_MAX;
+        float maxArea = -1.0f;
+        for (uint32_t groupIdx = 0; groupIdx < groups.size(); ++groupIdx) {
+            const auto [groupBegin, groupEnd] = groups[groupIdx];
+            if (groupEnd - groupBegin < 2)
+                continue;
+            const float area = calcGroupAabb(groupBegin, groupEnd).calcHalfSurfaceArea();
+            if (area > maxArea) {
+                maxArea = area;
+                groupIdxToSplit = groupIdx;
+            }
+        }
+        if (groupIdxToSplit == UINT32_MAX)
+            break;
+
+        const auto [groupBegin, groupEnd] = groups[groupIdxToSplit];
+        const uint32_t numInGroup = groupEnd - groupBegin;
+        float bestCost = INFINITY;
+        uint32_t bestAxis = 0;
+        uint32_t bestNumLeft = numInGroup / 2;
+        rightCosts.resize(numInGroup);
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            sortByAxis(groupBegin, groupEnd, axis);
+            AABB rightAabb;
+            uint64_t numRightTris = 0;
+            for (uint32_t i = numInGroup - 1; i > 0; --i) {
+                const SpilledCluster &cluster = clusters[(*clusterIndices)[groupBegin + i]];
+                rightAabb.unify(cluster.geomAabb);
+                numRightTris += cluster.numTriangles;
+                rightCosts[i] = rightAabb.calcHalfSurfaceArea() * numRightTris;
+            }
+            AABB leftAabb;
+            uint64_t numLeftTris = 0;
+            for (uint32_t numLeft = 1; numLeft < numInGroup; ++numLeft) {
+                const SpilledCluster &cluster = clusters[(*clusterIndices)[groupBegin + numLeft - 1]];
+                leftAabb.unify(cluster.geomAabb);
+                numLeftTris += cluster.numTriangles;
+                const float cost = leftAabb.calcHalfSurfaceArea() * numLeftTris + rightCosts[numLeft];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestNumLeft = numLeft;
+                }
+            }
+        }
+        sortByAxis(groupBegin, groupEnd, bestAxis);
+        groups[groupIdxToSplit] = { groupBegin, groupBegin + bestNumLeft };
+        groups.insert(groups.begin() + groupIdxToSplit + 1, { groupBegin + bestNumLeft, groupEnd });
+    }
+
+    const uint32_t topNodeIdx = static_cast<uint32_t>(topNodes->size());
+    topNodes->push_back(OutOfCoreTopNode<arity>{});
+    const uint32_t numChildren = static_cast<uint32_t>(groups.size());
+    for (uint32_t slot = 0; slot < numChildren; ++slot) {
+        const auto [groupBegin, groupEnd] = groups[slot];
+        const uint32_t childRef = groupEnd - groupBegin == 1 ?
+            ((*clusterIndices)[groupBegin] | OutOfCoreTopNode<arity>::clusterFlag) :
+            buildOutOfCoreTopNodes(clusters, groupBegin, groupEnd, clusterIndices, topNodes);
+        (*topNodes)[topNodeIdx].childRefs[slot] = childRef;
+    }
+    (*topNodes)[topNodeIdx].numChildren = numChildren;
+
+    return topNodeIdx;
+}
+
+// EN: In-memory build of a spilled cluster. The triangles are given as a single geometry without index sharing,
+//     then the original geometry and primitive indices are restored in the triangle storages.
+template <uint32_t arity>
+static bool buildSpilledCluster(
+    const SpilledCluster &cluster, const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh) {
+    std::vector<shared::TriangleStorage> triStorages(cluster.numTriangles);
+    {
+        std::ifstream ifs(cluster.filePath, std::ios::in | std::ios::binary);
+        ifs.read(reinterpret_cast<char*>(triStorages.data()), sizeof(triStorages[0]) * triStorages.size());
+        if (!ifs)
+            return false;
+    }
+
+    std::vector<Point3D> vertices(3 * cluster.numTriangles);
+    std::vector<uint32_t> triangles(3 * cluster.numTriangles);
+    for (uint32_t triIdx = 0; triIdx < cluster.numTriangles; ++triIdx) {
+        const shared::TriangleStorage &triStorage = triStorages[triIdx];
+        vertices[3 * triIdx + 0] = triStorage.pA;
+        vertices[3 * triIdx + 1] = triStorage.pB;
+        vertices[3 * triIdx + 2] = triStorage.pC;
+        for (uint32_t i = 0; i < 3; ++i)
+            triangles[3 * triIdx + i] = 3 * triIdx + i;
+    }
+
+    Geometry geom = {};
+    geom.vertices = vertices.data();
+    geom.vertexStride = sizeof(vertices[0]);
+    geom.vertexFormat = VertexFormat::Fp32x3;
+    geom.numVertices = static_cast<uint32_t>(vertices.size());
+    geom.triangles = triangles.data();
+    geom.triangleStride = sizeof(triangles[0]) * 3;
+    geom.triangleFormat = TriangleFormat::UI32x3;
+    geom.numTriangles = cluster.numTriangles;
+    geom.preTransform = Matrix4x4();
+    buildGeometryBVH(&geom, 1, config, bvh);
+
+    for (shared::TriangleStorage &triStorage : bvh->triStorages) {
+        const shared::TriangleStorage &srcTriStorage = triStorages[triStorage.primIndex];
+        triStorage.geomIndex = srcTriStorage.geomIndex;
+        triStorage.primIndex = srcTriStorage.primIndex;
+    }
+
+    return true;
+}
+
+template <typename T>
+static bool writeSection(std::ofstream &ofs, const T* const data, const size_t numElements) {
+    ofs.write(reinterpret_cast<const char*>(data), sizeof(data[0]) * numElements);
+    return static_cast<bool>(ofs);
+}
+
+static bool appendFileContents(const std::filesystem::path &srcFilePath, std::ofstream &ofs) {
+    std::ifstream ifs(srcFilePath, std::ios::in | std::ios::binary);
+    if (!ifs.is_open())
+        return false;
+    std::vector<char> buffer(1 << 20);
+    while (ifs) {
+        ifs.read(buffer.data(), buffer.size());
+        ofs.write(buffer.data(), ifs.gcount());
+    }
+    return ifs.eof() && static_cast<bool>(ofs);
+}
+
+template <uint32_t arity>
+bool buildGeometryBVHOutOfCore(
+    const TriangleStream &stream, const OutOfCoreBuildConfig &config,
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash) {
+    using InternalNode = shared::InternalNode_T<arity>;
+    using TopNode = OutOfCoreTopNode<arity>;
+
+    Assert_Release(config.maxNumTrianglesPerCluster > 0, "maxNumTrianglesPerCluster must be positive.");
+
+    // EN: The first pass computes the bounds of the centroids for binning.
+    AABB centAabb;
+    uint64_t numTotalTriangles = 0;
+    uint32_t numGeoms = 0;
+    {
+        stream.rewind();
+        std::vector<shared::TriangleStorage> batch(outOfCoreReadBatchSize);
+        while (const uint32_t numTris = stream.readTriangles(batch.data(), outOfCoreReadBatchSize)) {
+            for (uint32_t i = 0; i < numTris; ++i) {
+                centAabb.unify(calcTriangleAabb(batch[i]).getCenter());
+                numGeoms = std::max(batch[i].geomIndex + 1, numGeoms);
+            }
+            numTotalTriangles += numTris;
+        }
+    }
+    if (numTotalTriangles == 0)
+        return false;
+    Assert_Release(numTotalTriangles < (1u << 31), "Too many triangles for the primitive references.");
+
+    SpillFileSet spillFiles(config.tempDirectory);
+    if (!spillFiles.isValid())
+        return false;
+
+    // EN: The second pass bins the triangles into a grid with a few cells per cluster.
+    //     Then oversized cells (in dense regions) are binned again recursively until every cluster fits in the limit.
+    std::vector<SpilledCluster> clusters;
+    {
+        const uint64_t numMinClusters =
+            (numTotalTriangles + config.maxNumTrianglesPerCluster - 1) / config.maxNumTrianglesPerCluster;
+        const uint32_t gridRes = numMinClusters == 1 ? 1 :
+            std::min(static_cast<uint32_t>(std::ceil(std::cbrt(4.0 * numMinClusters))), 16u);
+        std::vector<SpilledCluster> pendingClusters;
+        stream.rewind();
+        if (!spillTrianglesToGridCells(stream.readTriangles, centAabb, gridRes, &spillFiles, &pendingClusters))
+            return false;
+
+        while (!pendingClusters.empty()) {
+            SpilledCluster cluster = std::move(pendingClusters.back());
+            pendingClusters.pop_back();
+            if (cluster.numTriangles <= config.maxNumTrianglesPerCluster) {
+                clusters.push_back(std::move(cluster));
+                continue;
+            }
+
+            std::vector<SpilledCluster> subClusters;
+            {
+                std::ifstream ifs(cluster.filePath, std::ios::in | std::ios::binary);
+                if (!spillTrianglesToGridCells(
+                    makeSpillFileReader(&ifs), cluster.centAabb, 2, &spillFiles, &subClusters))
+                    return false;
+            }
+            // EN: All the centroids fell into a single cell (they are almost the same).
+            if (subClusters.size() == 1) {
+                spillFiles.remove(subClusters[0].filePath);
+                subClusters.clear();
+                std::ifstream ifs(cluster.filePath, std::ios::in | std::ios::binary);
+                if (!spillTrianglesInChunks(
+                    makeSpillFileReader(&ifs), config.maxNumTrianglesPerCluster, &spillFiles, &subClusters))
+                    return false;
+            }
+            spillFiles.remove(cluster.filePath);
+            std::move(subClusters.begin(), subClusters.end(), std::back_inserter(pendingClusters));
+        }
+    }
+    const uint32_t numClusters = static_cast<uint32_t>(clusters.size());
+
+    // EN: Build the top-level tree and order the clusters by its leaves for locality.
+    std::vector<TopNode> topNodes;
+    if (numClusters > 1) {
+        std::vector<uint32_t> clusterIndices(numClusters);
+        for (uint32_t clusterIdx = 0; clusterIdx < numClusters; ++clusterIdx)
+            clusterIndices[clusterIdx] = clusterIdx;
+        buildOutOfCoreTopNodes(clusters, 0, numClusters, &clusterIndices, &topNodes);
+
+        std::vector<uint32_t> newClusterIndices(numClusters);
+        std::vector<SpilledCluster> orderedClusters(numClusters);
+        for (uint32_t i = 0; i < numClusters; ++i) {
+            newClusterIndices[clusterIndices[i]] = i;
+            orderedClusters[i] = std::move(clusters[clusterIndices[i]]);
+        }
+        clusters = std::move(orderedClusters);
+        for (TopNode &topNode : topNodes) {
+            for (uint32_t slot = 0; slot < topNode.numChildren; ++slot) {
+                uint32_t &childRef = topNode.childRefs[slot];
+                if (childRef & TopNode::clusterFlag)
+                    childRef = newClusterIndices[childRef & ~TopNode::clusterFlag] | TopNode::clusterFlag;
+            }
+        }
+    }
+    const uint32_t numTopNodes = static_cast<uint32_t>(topNodes.size());
+
+    // EN: The top-level nodes and the roots of the clusters come first in the breadth-first order
+    //     so that the children of each top-level node are contiguous.
+    //     The remaining nodes of each cluster follow in the order of the clusters.
+    const uint32_t numTopSlots = numTopNodes + numClusters;
+    std::vector<InternalNode> topSlotNodes(numTopSlots);
+    std::vector<shared::ParentPointer> topSlotParentPointers(numTopSlots, shared::ParentPointer(0xFFFF'FFFF));
+    std::vector<uint32_t> topNodeSlots(numTopNodes);
+    std::vector<uint32_t> topNodeChildBaseSlots(numTopNodes);
+    std::vector<uint32_t> clusterRootSlots(numClusters, 0);
+    if (numTopNodes > 0) {
+        topNodeSlots[0] = 0;
+        uint32_t nextSlot = 1;
+        std::vector<uint32_t> bfsQueue = { 0 };
+        for (uint32_t queueIdx = 0; queueIdx < bfsQueue.size(); ++queueIdx) {
+            const uint32_t topNodeIdx = bfsQueue[queueIdx];
+            const TopNode &topNode = topNodes[topNodeIdx];
+            topNodeChildBaseSlots[topNodeIdx] = nextSlot;
+            for (uint32_t slot = 0; slot < topNode.numChildren; ++slot) {
+                const uint32_t childSlot = nextSlot++;
+                const uint32_t childRef = topNode.childRefs[slot];
+                if (childRef & TopNode::clusterFlag) {
+                    clusterRootSlots[childRef & ~TopNode::clusterFlag] = childSlot;
+                }
+                else {
+                    topNodeSlots[childRef] = childSlot;
+                    bfsQueue.push_back(childRef);
+                }
+                topSlotParentPointers[childSlot] = shared::ParentPointer(topNodeSlots[topNodeIdx], slot);
+            }
+        }
+    }
+
+    std::unique_ptr<ThreadPool> threadPoolHolder;
+    ThreadPool* threadPool = nullptr;
+    if (config.numThreads != 1) {
+        threadPoolHolder = std::make_unique<ThreadPool>(config.numThreads);
+        if (threadPoolHolder->getNumThreads() > 1)
+            threadPool = threadPoolHolder.get();
+    }
+    const uint32_t numThreads = threadPool ? threadPool->getNumThreads() : 1;
+
+    GeometryBVHBuildConfig clusterConfig = config.clusterBuildConfig;
+    clusterConfig.numThreads = 1;
+    clusterConfig.leafTriangleFormat = LeafTriangleFormat::Raw;
+
+    // EN: Build the clusters in parallel, a batch of one cluster per thread at a time to bound the memory,
+    //     relocate their indices into the combined BVH and spill them into the files of the sections.
+    const std::filesystem::path intNodesFilePath = spillFiles.create();
+    const std::filesystem::path triStoragesFilePath = spillFiles.create();
+    const std::filesystem::path primRefsFilePath = spillFiles.create();
+    const std::filesystem::path parentPointersFilePath = spillFiles.create();
+    uint32_t numBodyNodes = 0;
+    uint32_t numTriStorages = 0;
+    uint32_t numPrimRefs = 0;
+    double clusterCost = 0.0;
+    {
+        std::ofstream intNodesFile(intNodesFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::ofstream triStoragesFile(triStoragesFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::ofstream primRefsFile(primRefsFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::ofstream parentPointersFile(parentPointersFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+
+        std::vector<GeometryBVH<arity>> clusterBvhs(numThreads);
+        std::vector<uint8_t> clusterBuildSucceeded(numThreads);
+        for (uint32_t batchBegin = 0; batchBegin < numClusters; batchBegin += numThreads) {
+            const uint32_t batchEnd = std::min(batchBegin + numThreads, numClusters);
+            parallelFor(
+                threadPool, batchBegin, batchEnd, 1,
+                [&](const uint32_t begin, const uint32_t end) {
+                for (uint32_t clusterIdx = begin; clusterIdx < end; ++clusterIdx) {
+                    clusterBuildSucceeded[clusterIdx - batchBegin] = buildSpilledCluster(
+                        clusters[clusterIdx], clusterConfig, &clusterBvhs[clusterIdx - batchBegin]);
+                }
+            });
+
+            for (uint32_t clusterIdx = batchBegin; clusterIdx < batchEnd; ++clusterIdx) {
+                if (!clusterBuildSucceeded[clusterIdx - batchBegin])
+                    return false;
+                GeometryBVH<arity> &bvh = clusterBvhs[clusterIdx - batchBegin];
+                const uint32_t numIntNodes = static_cast<uint32_t>(bvh.intNodes.size());
+                Assert(numIntNodes > 0, "A cluster BVH should have the root.");
+
+                // EN: The root goes to its top slot and a body node j to bodyBaseIndex + j - 1.
+                const uint32_t rootSlot = clusterRootSlots[clusterIdx];
+                const uint32_t bodyBaseIndex = numTopSlots + numBodyNodes;
+                const auto relocateNodeIndex = [&](const uint32_t index) {
+                    return index == 0 ? rootSlot : bodyBaseIndex + index - 1;
+                };
+                for (InternalNode &intNode : bvh.intNodes) {
+                    if (intNode.intNodeChildBaseIndex != UINT32_MAX)
+                        intNode.intNodeChildBaseIndex = relocateNodeIndex(intNode.intNodeChildBaseIndex);
+                    if (intNode.leafBaseIndex != UINT32_MAX)
+                        intNode.leafBaseIndex += numPrimRefs;
+                }
+                for (shared::PrimitiveReference &primRef : bvh.primRefs)
+                    primRef.storageIndex += numTriStorages;
+                for (uint32_t intNodeIdx = 1; intNodeIdx < numIntNodes; ++intNodeIdx) {
+                    shared::ParentPointer &parentPointer = bvh.parentPointers[intNodeIdx];
+                    parentPointer.index = relocateNodeIndex(parentPointer.index);
+                }
+
+                topSlotNodes[rootSlot] = bvh.intNodes[0];
+                if (!writeSection(intNodesFile, bvh.intNodes.data() + 1, numIntNodes - 1) ||
+                    !writeSection(triStoragesFile, bvh.triStorages.data(), bvh.triStorages.size()) ||
+                    !writeSection(primRefsFile, bvh.primRefs.data(), bvh.primRefs.size()) ||
+                    !writeSection(parentPointersFile, bvh.parentPointers.data() + 1, numIntNodes - 1))
+                    return false;
+
+                clusterCost += static_cast<double>(bvh.sahCostAtBuild) *
+                    bvh.intNodes[0].getAabb().calcHalfSurfaceArea();
+                numBodyNodes += numIntNodes - 1;
+                numTriStorages += static_cast<uint32_t>(bvh.triStorages.size());
+                numPrimRefs += static_cast<uint32_t>(bvh.primRefs.size());
+                bvh = GeometryBVH<arity>();
+                spillFiles.remove(clusters[clusterIdx].filePath);
+            }
+        }
+    }
+    Assert_Release(numTopSlots + numBodyNodes < (1u << 29), "Too many nodes for the parent pointers.");
+
+    // EN: Fill the top-level nodes bottom-up from the boxes of the cluster roots.
+    //     Children are created after their parent, so the reverse order visits the children first.
+    double topCost = 0.0;
+    for (int32_t topNodeIdx = static_cast<int32_t>(numTopNodes) - 1; topNodeIdx >= 0; --topNodeIdx) {
+        const TopNode &topNode = topNodes[topNodeIdx];
+        const uint32_t childBaseSlot = topNodeChildBaseSlots[topNodeIdx];
+        AABB aabb;
+        for (uint32_t slot = 0; slot < topNode.numChildren; ++slot)
+            aabb.unify(topSlotNodes[childBaseSlot + slot].getAabb());
+
+        InternalNode &intNode = topSlotNodes[topNodeSlots[topNodeIdx]];
+        intNode.setQuantizationAabb(aabb);
+        intNode.internalMask = (1 << topNode.numChildren) - 1;
+        intNode.intNodeChildBaseIndex = childBaseSlot;
+        intNode.leafBaseIndex = UINT32_MAX;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (slot < topNode.numChildren) {
+                intNode.setChildAabb(slot, topSlotNodes[childBaseSlot + slot].getAabb());
+                intNode.setChildMeta(slot, typename InternalNode::ChildMeta());
+            }
+            else {
+                intNode.setInvalidChildBox(slot);
+            }
+        }
+        topCost += static_cast<double>(intNode.getAabb().calcHalfSurfaceArea()) *
+            config.clusterBuildConfig.intNodeTravCost;
+    }
+    const float sahCost = static_cast<float>(
+        (topCost + clusterCost) / topSlotNodes[0].getAabb().calcHalfSurfaceArea());
+
+    // EN: Assemble the cache file from the top slots in memory and the spilled sections.
+    const uint32_t numIntNodes = numTopSlots + numBodyNodes;
+    const GeometryBVHCacheHeader header = makeGeometryBVHCacheHeader<arity>(
+        numGeoms, static_cast<uint32_t>(numTotalTriangles), sahCost,
+        numIntNodes, numTriStorages, numPrimRefs, numIntNodes,
+        configHash, sourceHash);
+    return writeFileViaTemporary(
+        filePath,
+        [&](std::ofstream &ofs) {
+        uint64_t curOffset = 0;
+        const auto padTo = [&](const uint64_t offset) {
+            const std::vector<char> zeros(offset - curOffset, 0);
+            ofs.write(zeros.data(), zeros.size());
+            curOffset = offset;
+        };
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        curOffset += sizeof(header);
+
+        padTo(header.intNodesOffset);
+        writeSection(ofs, topSlotNodes.data(), numTopSlots);
+        if (!appendFileContents(intNodesFilePath, ofs))
+            return false;
+        curOffset += sizeof(InternalNode) * numIntNodes;
+
+        padTo(header.triStoragesOffset);
+        if (!appendFileContents(triStoragesFilePath, ofs))
+            return false;
+        curOffset += sizeof(shared::TriangleStorage) * numTriStorages;
+
+        padTo(header.primRefsOffset);
+        if (!appendFileContents(primRefsFilePath, ofs))
+            return false;
+        curOffset += sizeof(shared::PrimitiveReference) * numPrimRefs;
+
+        padTo(header.parentPointersOffset);
+        writeSection(ofs, topSlotParentPointers.data(), numTopSlots);
+        return appendFileContents(parentPointersFilePath, ofs);
+    });
+}
+
+template bool buildGeometryBVHOutOfCore<2>(
+    const TriangleStream &stream, const OutOfCoreBuildConfig &config,
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash);
+template bool buildGeometryBVHOutOfCore<4>(
+    const TriangleStream &stream, const OutOfCoreBuildConfig &config,
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash);
+template bool buildGeometryBVHOutOfCore<8>(
+    const TriangleStream &stream, const OutOfCoreBuildConfig &config,
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash);
+
+
+
+template <uint32_t arity>
+void buildInstanceBVH(
+    const Instance* const insts, const uint32_t numInsts,
+    const InstanceBVHBuildConfig &config, InstanceBVH<arity>* const bvh,
+    BuildMemoryStatistics* const memStats) {
+    BuilderInput<PrimitiveType::Instance> input = {};
+    input.instances = insts;
+    input.numInstances = numInsts;
+    input.rebraidingBudget = config.rebraidingBudget;
+    input.minNumPrimsPerLeaf = 1;
+    input.maxNumPrimsPerLeaf = 1;
+    input.numThreads = config.numThreads;
+    BuildMemoryTracker memTracker;
+    input.memTracker = &memTracker;
+    buildBVH<arity, PrimitiveType::Instance>(input, bvh);
+
+    if (memStats) {
+        memStats->peakMemorySize = memTracker.getPeakSize();
+        memStats->outputMemorySize = memTracker.getCurrentSize();
+    }
+}
+
+template void buildInstanceBVH<2>(
+    const Instance* const insts, const uint32_t numInsts,
+    const InstanceBVHBuildConfig &config, InstanceBVH<2>* const bvh,
+    BuildMemoryStatistics* const memStats);
+template void buildInstanceBVH<4>(
+    const Instance* const insts, const uint32_t numInsts,
+    const InstanceBVHBuildConfig &config, InstanceBVH<4>* const bvh,
+    BuildMemoryStatistics* const memStats);
+template void buildInstanceBVH<8>(
+    const Instance* const insts, const uint32_t numInsts,
+    const InstanceBVHBuildConfig &config, InstanceBVH<8>* const bvh,
+    BuildMemoryStatistics* const memStats);
+
+
+
+#define SWAP(A, B)\
+    if (keys[A] > keys[B]) {\
+        stc::swap(keys[A], keys[B]);\
+        stc::swap(values[A], values[B]);\
+    }
+
+template <typename KeyType, typename ValueType>
+static inline void sort(KeyType (&keys)[2], ValueType (&values)[2]) {
+    SWAP(0, 1);
+}
+
+template <typename KeyType, typename ValueType>
+static inline void sort(KeyType (&keys)[4], ValueType (&values)[4]) {
+    SWAP(0, 2); SWAP(1, 3);
+    SWAP(0, 1); SWAP(2, 3);
+    SWAP(1, 2);
+}
+
+template <typename KeyType, typename ValueType>
+static inline void sort(KeyType (&keys)[8], ValueType (&values)[8]) {
+    SWAP(0, 2); SWAP(1, 3); SWAP(4, 6); SWAP(5, 7);
+    SWAP(0, 4); SWAP(1, 5); SWAP(2, 6); SWAP(3, 7);
+    SWAP(0, 1); SWAP(2, 3); SWAP(4, 5); SWAP(6, 7);
+    SWAP(2, 4); SWAP(3, 5);
+    SWAP(1, 4); SWAP(3, 6);
+    SWAP(1, 2); SWAP(3, 4); SWAP(5, 6);
+}
+
+#undef SWAP
+
+#define SWAP_ORDER(A, B, W)\
+    if (keys[A] > keys[B]) {\
+        stc::swap(keys[A], keys[B]);\
+        constexpr uint32_t mask = (1 << W) - 1;\
+        const uint32_t offsetA = A * W;\
+        const uint32_t offsetB = B * W;\
+        const uint32_t vA = (*values >> offsetA) & mask;\
+        const uint32_t vB = (*values >> offsetB) & mask;\
+        *values &= ~(mask << offsetA);\
+        *values |= (vB << offsetA);\
+        *values &= ~(mask << offsetB);\
+        *values |= (vA << offsetB);\
+    }
+
+template <typename KeyType>
+static inline void sortOrder(KeyType (&keys)[2], uint32_t* const values) {
+    SWAP_ORDER(0, 1, 1);
+}
+
+template <typename KeyType>
+static inline void sortOrder(KeyType (&keys)[4], uint32_t* const values) {
+    SWAP_ORDER(0, 2, 2); SWAP_ORDER(1, 3, 2);
+    SWAP_ORDER(0, 1, 2); SWAP_ORDER(2, 3, 2);
+    SWAP_ORDER(1, 2, 2);
+}
+
+template <typename KeyType>
+static inline void sortOrder(KeyType (&keys)[8], uint32_t* const values) {
+    SWAP_ORDER(0, 2, 3); SWAP_ORDER(1, 3, 3); SWAP_ORDER(4, 6, 3); SWAP_ORDER(5, 7, 3);
+    SWAP_ORDER(0, 4, 3); SWAP_ORDER(1, 5, 3); SWAP_ORDER(2, 6, 3); SWAP_ORDER(3, 7, 3);
+    SWAP_ORDER(0, 1, 3); SWAP_ORDER(2, 3, 3); SWAP_ORDER(4, 5, 3); SWAP_ORDER(6, 7, 3);
+    SWAP_ORDER(2, 4, 3); SWAP_ORDER(3, 5, 3);
+    SWAP_ORDER(1, 4, 3); SWAP_ORDER(3, 6, 3);
+    SWAP_ORDER(1, 2, 3); SWAP_ORDER(3, 4, 3); SWAP_ORDER(5, 6, 3);
+}
+
+#undef SWAP_ORDER
+
+static bool testRayVsTriangle(
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const Point3D &pA, const Point3D &pB, const Point3D &pC,
+    float* const hitDist, Normal3D* const hitNormal, float* const bcB, float* const bcC) {
+    const Vector3D eAB = pB - pA;
+    const Vector3D eCA = pA - pC;
+    *hitNormal = static_cast<Normal3D>(cross(eCA, eAB));
+
+    const Vector3D e = (1.0f / dot(*hitNormal, rayDir)) * (pA - rayOrg);
+    const Vector3D i = cross(rayDir, e);
+
+    *bcB = dot(i, eCA);
+    *bcC = dot(i, eAB);
+    *hitDist = dot(*hitNormal, e);
+
+    return
+        ((*hitDist < distMax) && (*hitDist > distMin)
+         && (*bcB >= 0.0f) && (*bcC >= 0.0f) && (*bcB + *bcC <= 1));
+}
+
+// EN: Child AABB intersection of a compressed node using SIMD, selected at compile time per arity.
+//     AVX2 handles 8-wide nodes and SSE4.1 handles 4-wide nodes. Other cases use the scalar path.
+#if defined(__AVX2__)
+#   define BVH_TRAVERSAL_USE_AVX2 1
+#else
+#   define BVH_TRAVERSAL_USE_AVX2 0
+#endif
+#if defined(__AVX__) || defined(__SSE4_1__)
+#   define BVH_TRAVERSAL_USE_SSE4 1
+#else
+#   define BVH_TRAVERSAL_USE_SSE4 0
+#endif
+
+template <uint32_t arity>
+static constexpr bool simdNodeIntersectionIsAvailable =
+    std::is_same_v<shared::InternalNode_T<arity>, shared::CompressedInternalNode_T<arity>> &&
+    ((arity == 8 && BVH_TRAVERSAL_USE_AVX2) || (arity == 4 && BVH_TRAVERSAL_USE_SSE4));
+
+// EN: Build the order info from the keys sorted in ascending order.
+//     The lowest bits of each key hold the slot, leaf children come first since their MSB is 0.
+template <uint32_t arity>
+static inline void buildOrderInfo(
+    const shared::InternalNode_T<arity> &intNode, const uint32_t* const sortedKeys, const uint32_t numHits,
+    uint32_t* const orderInfo) {
+    constexpr uint32_t orderBitWidth = tzcntConst(arity);
+    constexpr uint32_t orderMask = (1 << orderBitWidth) - 1;
+    *orderInfo = 0;
+    for (uint32_t i = 0; i < numHits; ++i) {
+        const uint32_t slot = sortedKeys[i] & orderMask;
+        const uint32_t value = intNode.getChildIsLeaf(slot) ? slot : intNode.getInternalChildNumber(slot);
+        *orderInfo |= value << (orderBitWidth * i);
+    }
+}
+
+#if BVH_TRAVERSAL_USE_AVX2
+// EN: Bitonic sorting network for 8 keys in a register.
+//     Each step compares every lane with the lane at XOR distance and the blend mask selects lanes taking max.
+static inline __m256i sortKeys8(__m256i keys) {
+    const auto xor1 = [](const __m256i v) { return _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)); };
+    const auto xor2 = [](const __m256i v) { return _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)); };
+    const auto xor4 = [](const __m256i v) { return _mm256_permute2x128_si256(v, v, 0x01); };
+
+#define CMP_SWAP(Permute, MaxLanes)\
+    do {\
+        const __m256i partner = Permute(keys);\
+        keys = _mm256_blend_epi32(\
+            _mm256_min_epu32(keys, partner), _mm256_max_epu32(keys, partner), MaxLanes);\
+    } while (0)
+
+    CMP_SWAP(xor1, 0x66);
+    CMP_SWAP(xor2, 0x3C);
+    CMP_SWAP(xor1, 0x5A);
+    CMP_SWAP(xor4, 0xF0);
+    CMP_SWAP(xor2, 0xCC);
+    CMP_SWAP(xor1, 0xAA);
+
+#undef CMP_SWAP
+
+    return keys;
+}
+
+// EN: Slab test of all the children. Returns the mask of the hit children.
+static inline uint32_t testChildAabbsSimd(
+    const shared::CompressedInternalNode_T<8> &intNode,
+    const Point3D &rayOrg, const Vector3D &invRayDir, const float distMin, const float distMax,
+    __m256* const hitDistMins, __m256* const hitDistMaxs, uint32_t* const numAabbTests) {
+    const __m256i qMinXs = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(intNode.childQMinXs)));
+    const __m256i qMaxXs = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(intNode.childQMaxXs)));
+    const __m256i invalidMinXs = _mm256_cmpeq_epi32(qMinXs, _mm256_set1_epi32(255));
+    const __m256i invalidMaxXs = _mm256_cmpeq_epi32(qMaxXs, _mm256_setzero_si256());
+    const uint32_t validMask =
+        ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(invalidMinXs, invalidMaxXs))) & 0xFF;
+    *numAabbTests += popcnt(validMask);
+
+    // EN: Slab test for each axis. The near/far distances are reduced with NaN-ignoring order
+    //     (the second operand of min/max is returned for NaN) to match the scalar path using fmin/fmax.
+    *hitDistMins = _mm256_set1_ps(distMin);
+    *hitDistMaxs = _mm256_set1_ps(distMax);
+    const auto testSlab = [&]
+    (const uint8_t* const qMins, const uint8_t* const qMaxs,
+     const uint8_t expScale, const float origin, const float rayOrgAxis, const float invRayDirAxis) {
+        const __m256 scale = _mm256_set1_ps(std::bit_cast<float>(static_cast<uint32_t>(expScale) << 23));
+        const __m256 originV = _mm256_set1_ps(origin);
+        const __m256 rayOrgV = _mm256_set1_ps(rayOrgAxis);
+        const __m256 invRayDirV = _mm256_set1_ps(invRayDirAxis);
+        const __m256 minPs = _mm256_add_ps(originV, _mm256_mul_ps(_mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(qMins)))), scale));
+        const __m256 maxPs = _mm256_add_ps(originV, _mm256_mul_ps(_mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(qMaxs)))), scale));
+        const __m256 tNears = _mm256_mul_ps(_mm256_sub_ps(minPs, rayOrgV), invRayDirV);
+        const __m256 tFars = _mm256_mul_ps(_mm256_sub_ps(maxPs, rayOrgV), invRayDirV);
+        *hitDistMins = _mm256_max_ps(_mm256_min_ps(tNears, tFars), *hitDistMins);
+        *hitDistMins = _mm256_max_ps(_mm256_min_ps(tFars, tNears), *hitDistMins);
+        *hitDistMaxs = _mm256_min_ps(_mm256_max_ps(tNears, tFars), *hitDistMaxs);
+        *hitDistMaxs = _mm256_min_ps(_mm256_max_ps(tFars, tNears), *hitDistMaxs);
+    };
+    testSlab(
+        intNode.childQMinXs, intNode.childQMaxXs, intNode.quantBoxExpScaleX,
+        intNode.quantBoxOrigin.x, rayOrg.x, invRayDir.x);
+    testSlab(
+        intNode.childQMinYs, intNode.childQMaxYs, intNode.quantBoxExpScaleY,
+        intNode.quantBoxOrigin.y, rayOrg.y, invRayDir.y);
+    testSlab(
+        intNode.childQMinZs, intNode.childQMaxZs, intNode.quantBoxExpScaleZ,
+        intNode.quantBoxOrigin.z, rayOrg.z, invRayDir.z);
+
+    const __m256 hits = _mm256_and_ps(
+        _mm256_cmp_ps(*hitDistMins, *hitDistMaxs, _CMP_LE_OQ),
+        _mm256_cmp_ps(*hitDistMaxs, _mm256_setzero_ps(), _CMP_GT_OQ));
+    return _mm256_movemask_ps(hits) & validMask;
+}
+
+static inline void intersectChildAabbsSimd(
+    const shared::CompressedInternalNode_T<8> &intNode,
+    const Point3D &rayOrg, const Vector3D &invRayDir, const float distMin, const float distMax,
+    uint32_t* const orderInfo, uint32_t* const numLeafHits, uint32_t* const numIntHits,
+    uint32_t* const numAabbTests) {
+    __m256 hitDistMins, hitDistMaxs;
+    const uint32_t hitMask = testChildAabbsSimd(
+        intNode, rayOrg, invRayDir, distMin, distMax, &hitDistMins, &hitDistMaxs, numAabbTests);
+    *numLeafHits = popcnt(hitMask & ~intNode.internalMask);
+    *numIntHits = popcnt(hitMask & intNode.internalMask);
+    if (hitMask == 0) {
+        *orderInfo = 0;
+        return;
+    }
+    if ((hitMask & (hitMask - 1)) == 0) {
+        const uint32_t slot = tzcnt(hitMask);
+        *orderInfo = intNode.getChildIsLeaf(slot) ? slot : intNode.getInternalChildNumber(slot);
+        return;
+    }
+
+    // EN: Same key as the scalar path except that the lowest bits hold the slot.
+    //     Missed children get the max key to be compacted to the end by the sort.
+    const __m256i dists = _mm256_castps_si256(
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_add_ps(hitDistMins, hitDistMaxs)));
+    const __m256i orderedDists = _mm256_xor_si256(
+        dists, _mm256_or_si256(_mm256_srai_epi32(dists, 31), _mm256_set1_epi32(0x8000'0000)));
+    const __m256i slots = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i internalFlags = _mm256_slli_epi32(
+        _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(intNode.internalMask), slots), _mm256_set1_epi32(1)),
+        31);
+    __m256i keys = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_srli_epi32(orderedDists, 1), _mm256_set1_epi32(0x7FFF'FFF8)),
+            internalFlags),
+        slots);
+    const __m256i hitLanes = _mm256_cmpgt_epi32(
+        _mm256_and_si256(_mm256_set1_epi32(hitMask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)),
+        _mm256_setzero_si256());
+    keys = _mm256_or_si256(keys, _mm256_andnot_si256(hitLanes, _mm256_set1_epi32(-1)));
+    keys = sortKeys8(keys);
+
+    alignas(32) uint32_t sortedKeys[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(sortedKeys), keys);
+    buildOrderInfo(intNode, sortedKeys, popcnt(hitMask), orderInfo);
+}
+#endif
+
+#if BVH_TRAVERSAL_USE_SSE4
+// EN: Bitonic sorting network for 4 keys in a register.
+static inline __m128i sortKeys4(__m128i keys) {
+#define CMP_SWAP(ShuffleImm, MaxLanes16)\
+    do {\
+        const __m128i partner = _mm_shuffle_epi32(keys, ShuffleImm);\
+        keys = _mm_blend_epi16(_mm_min_epu32(keys, partner), _mm_max_epu32(keys, partner), MaxLanes16);\
+    } while (0)
+
+    CMP_SWAP(_MM_SHUFFLE(2, 3, 0, 1), 0x3C);
+    CMP_SWAP(_MM_SHUFFLE(1, 0, 3, 2), 0xF0);
+    CMP_SWAP(_MM_SHUFFLE(2, 3, 0, 1), 0xCC);
+
+#undef CMP_SWAP
+
+    return keys;
+}
+
+// EN: Slab test of all the children. Returns the mask of the hit children.
+static inline uint32_t testChildAabbsSimd(
+    const shared::CompressedInternalNode_T<4> &intNode,
+    const Point3D &rayOrg, const Vector3D &invRayDir, const float distMin, const float distMax,
+    __m128* const hitDistMins, __m128* const hitDistMaxs, uint32_t* const numAabbTests) {
+    const auto loadQuantized = [](const uint8_t* const qs) {
+        int32_t packed;
+        std::memcpy(&packed, qs, sizeof(packed));
+        return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+    };
+
+    const __m128i qMinXs = loadQuantized(intNode.childQMinXs);
+    const __m128i qMaxXs = loadQuantized(intNode.childQMaxXs);
+    const __m128i invalidMinXs = _mm_cmpeq_epi32(qMinXs, _mm_set1_epi32(255));
+    const __m128i invalidMaxXs = _mm_cmpeq_epi32(qMaxXs, _mm_setzero_si128());
+    const uint32_t validMask =
+        ~_mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(invalidMinXs, invalidMaxXs))) & 0xF;
+    *numAabbTests += popcnt(validMask);
+
+    // EN: See the 8-wide version for the NaN handling.
+    *hitDistMins = _mm_set1_ps(distMin);
+    *hitDistMaxs = _mm_set1_ps(distMax);
+    const auto testSlab = [&]
+    (const uint8_t* const qMins, const uint8_t* const qMaxs,
+     const uint8_t expScale, const float origin, const float rayOrgAxis, const float invRayDirAxis) {
+        const __m128 scale = _mm_set1_ps(std::bit_cast<float>(static_cast<uint32_t>(expScale) << 23));
+        const __m128 originV = _mm_set1_ps(origin);
+        const __m128 rayOrgV = _mm_set1_ps(rayOrgAxis);
+        const __m128 invRayDirV = _mm_set1_ps(invRayDirAxis);
+        const __m128 minPs = _mm_add_ps(originV, _mm_mul_ps(_mm_cvtepi32_ps(loadQuantized(qMins)), scale));
+        const __m128 maxPs = _mm_add_ps(originV, _mm_mul_ps(_mm_cvtepi32_ps(loadQuantized(qMaxs)), scale));
+        const __m128 tNears = _mm_mul_ps(_mm_sub_ps(minPs, rayOrgV), invRayDirV);
+        const __m128 tFars = _mm_mul_ps(_mm_sub_ps(maxPs, rayOrgV), invRayDirV);
+        *hitDistMins = _mm_max_ps(_mm_min_ps(tNears, tFars), *hitDistMins);
+        *hitDistMins = _mm_max_ps(_mm_min_ps(tFars, tNears), *hitDistMins);
+        *hitDistMaxs = _mm_min_ps(_mm_max_ps(tNears, tFars), *hitDistMaxs);
+        *hitDistMaxs = _mm_min_ps(_mm_max_ps(tFars, tNears), *hitDistMaxs);
+    };
+    testSlab(
+        intNode.childQMinXs, intNode.childQMaxXs, intNode.quantBoxExpScaleX,
+        intNode.quantBoxOrigin.x, rayOrg.x, invRayDir.x);
+    testSlab(
+        intNode.childQMinYs, intNode.childQMaxYs, intNode.quantBoxExpScaleY,
+        intNode.quantBoxOrigin.y, rayOrg.y, invRayDir.y);
+    testSlab(
+        intNode.childQMinZs, intNode.childQMaxZs, intNode.quantBoxExpScaleZ,
+        intNode.quantBoxOrigin.z, rayOrg.z, invRayDir.z);
+
+    const __m128 hits = _mm_and_ps(
+        _mm_cmple_ps(*hitDistMins, *hitDistMaxs),
+        _mm_cmpgt_ps(*hitDistMaxs, _mm_setzero_ps()));
+    return _mm_movemask_ps(hits) & validMask;
+}
+
+static inline void intersectChildAabbsSimd(
+    const shared::CompressedInternalNode_T<4> &intNode,
+    const Point3D &rayOrg, const Vector3D &invRayDir, const float distMin, const float distMax,
+    uint32_t* const orderInfo, uint32_t* const numLeafHits, uint32_t* const numIntHits,
+    uint32_t* const numAabbTests) {
+    __m128 hitDistMins, hitDistMaxs;
+    const uint32_t hitMask = testChildAabbsSimd(
+        intNode, rayOrg, invRayDir, distMin, distMax, &hitDistMins, &hitDistMaxs, numAabbTests);
+    *numLeafHits = popcnt(hitMask & ~intNode.internalMask);
+    *numIntHits = popcnt(hitMask & intNode.internalMask);
+    if (hitMask == 0) {
+        *orderInfo = 0;
+        return;
+    }
+    if ((hitMask & (hitMask - 1)) == 0) {
+        const uint32_t slot = tzcnt(hitMask);
+        *orderInfo = intNode.getChildIsLeaf(slot) ? slot : intNode.getInternalChildNumber(slot);
+        return;
+    }
+
+    const __m128i dists = _mm_castps_si128(
+        _mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(hitDistMins, hitDistMaxs)));
+    const __m128i orderedDists = _mm_xor_si128(
+        dists, _mm_or_si128(_mm_srai_epi32(dists, 31), _mm_set1_epi32(0x8000'0000)));
+    const __m128i slots = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i slotBits = _mm_setr_epi32(1, 2, 4, 8);
+    const __m128i internalLanes = _mm_cmpgt_epi32(
+        _mm_and_si128(_mm_set1_epi32(intNode.internalMask), slotBits), _mm_setzero_si128());
+    __m128i keys = _mm_or_si128(
+        _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(orderedDists, 1), _mm_set1_epi32(0x7FFF'FFFC)),
+            _mm_slli_epi32(internalLanes, 31)),
+        slots);
+    const __m128i hitLanes = _mm_cmpgt_epi32(
+        _mm_and_si128(_mm_set1_epi32(hitMask), slotBits), _mm_setzero_si128());
+    keys = _mm_or_si128(keys, _mm_andnot_si128(hitLanes, _mm_set1_epi32(-1)));
+    keys = sortKeys4(keys);
+
+    alignas(16) uint32_t sortedKeys[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(sortedKeys), keys);
+    buildOrderInfo(intNode, sortedKeys, popcnt(hitMask), orderInfo);
+}
+#endif
+
+// EN: Cheaper variant for occlusion queries. Skips the normal and the barycentric outputs
+//     and rejects by the barycentric coordinates before computing the distance.
+static inline bool testRayVsTriangleOcclusion(
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const Point3D &pA, const Point3D &pB, const Point3D &pC) {
+    const Vector3D eAB = pB - pA;
+    const Vector3D eCA = pA - pC;
+    const Vector3D vOA = pA - rayOrg;
+    const Vector3D i = cross(rayDir, vOA);
+    const Vector3D n = cross(eCA, eAB);
+    const float recDet = 1.0f / dot(n, rayDir);
+    const float bcB = dot(i, eCA) * recDet;
+    const float bcC = dot(i, eAB) * recDet;
+    if (!(bcB >= 0.0f && bcC >= 0.0f && bcB + bcC <= 1))
+        return false;
+    const float hitDist = dot(n, vOA) * recDet;
+    return hitDist < distMax && hitDist > distMin;
+}
+
+static inline bool testRayVsWoopTriangle(
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const WoopTriangle &woopTri,
+    float* const hitDist, float* const bcB, float* const bcC) {
+    // EN: The same operation order as the SIMD kernels.
+    const auto transformPoint = [&](const float row[4]) {
+        return ((row[3] + row[0] * rayOrg.x) + row[1] * rayOrg.y) + row[2] * rayOrg.z;
+    };
+    const auto transformVector = [&](const float row[4]) {
+        return (row[0] * rayDir.x + row[1] * rayDir.y) + row[2] * rayDir.z;
+    };
+    *hitDist = -transformPoint(woopTri.rows[2]) / transformVector(woopTri.rows[2]);
+    if (!(*hitDist < distMax && *hitDist > distMin))
+        return false;
+    *bcB = transformPoint(woopTri.rows[0]) + *hitDist * transformVector(woopTri.rows[0]);
+    *bcC = transformPoint(woopTri.rows[1]) + *hitDist * transformVector(woopTri.rows[1]);
+    return *bcB >= 0.0f && *bcC >= 0.0f && *bcB + *bcC <= 1;
+}
+
+// EN: Test all the triangles in a SoA block and returns the lane of the closest hit or -1.
+//     Empty lanes have zero transforms and never hit.
+template <uint32_t width>
+static inline int32_t testRayVsWoopTriangleBlock(
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const WoopTriangleBlock<width> &block,
+    float* const hitDist, float* const bcB, float* const bcC) {
+#if BVH_TRAVERSAL_USE_AVX2
+    if constexpr (width == 8) {
+        const __m256 orgX = _mm256_set1_ps(rayOrg.x);
+        const __m256 orgY = _mm256_set1_ps(rayOrg.y);
+        const __m256 orgZ = _mm256_set1_ps(rayOrg.z);
+        const __m256 dirX = _mm256_set1_ps(rayDir.x);
+        const __m256 dirY = _mm256_set1_ps(rayDir.y);
+        const __m256 dirZ = _mm256_set1_ps(rayDir.z);
+        const auto transformPoint = [&](const float (&row)[4][width]) {
+            __m256 ret = _mm256_load_ps(row[3]);
+            ret = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(row[0]), orgX), ret);
+            ret = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(row[1]), orgY), ret);
+            return _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(row[2]), orgZ), ret);
+        };
+        const auto transformVector = [&](const float (&row)[4][width]) {
+            __m256 ret = _mm256_mul_ps(_mm256_load_ps(row[0]), dirX);
+            ret = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(row[1]), dirY), ret);
+            return _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(row[2]), dirZ), ret);
+        };
+        const __m256 ts = _mm256_div_ps(
+            _mm256_sub_ps(_mm256_setzero_ps(), transformPoint(block.rows[2])), transformVector(block.rows[2]));
+        const __m256 us = _mm256_add_ps(
+            transformPoint(block.rows[0]), _mm256_mul_ps(ts, transformVector(block.rows[0])));
+        const __m256 vs = _mm256_add_ps(
+            transformPoint(block.rows[1]), _mm256_mul_ps(ts, transformVector(block.rows[1])));
+        __m256 hitMask = _mm256_and_ps(
+            _mm256_cmp_ps(ts, _mm256_set1_ps(distMax), _CMP_LT_OQ),
+            _mm256_cmp_ps(ts, _mm256_set1_ps(distMin), _CMP_GT_OQ));
+        hitMask = _mm256_and_ps(hitMask, _mm256_cmp_ps(us, _mm256_setzero_ps(), _CMP_GE_OQ));
+        hitMask = _mm256_and_ps(hitMask, _mm256_cmp_ps(vs, _mm256_setzero_ps(), _CMP_GE_OQ));
+        hitMask = _mm256_and_ps(
+            hitMask, _mm256_cmp_ps(_mm256_add_ps(us, vs), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+        uint32_t mask = _mm256_movemask_ps(hitMask);
+        if (mask == 0)
+            return -1;
+
+        alignas(32) float hitDists[width];
+        alignas(32) float hitBcBs[width];
+        alignas(32) float hitBcCs[width];
+        _mm256_store_ps(hitDists, ts);
+        _mm256_store_ps(hitBcBs, us);
+        _mm256_store_ps(hitBcCs, vs);
+        int32_t hitLane = -1;
+        *hitDist = distMax;
+        for (; mask; mask &= mask - 1) {
+            const uint32_t lane = tzcnt(mask);
+            if (hitDists[lane] < *hitDist) {
+                *hitDist = hitDists[lane];
+                hitLane = lane;
+            }
+        }
+        *bcB = hitBcBs[hitLane];
+        *bcC = hitBcCs[hitLane];
+        return hitLane;
+    }
+#endif
+#if BVH_TRAVERSAL_USE_SSE4
+    if constexpr (width == 4) {
+        const __m128 orgX = _mm_set1_ps(rayOrg.x);
+        const __m128 orgY = _mm_set1_ps(rayOrg.y);
+        const __m128 orgZ = _mm_set1_ps(rayOrg.z);
+        const __m128 dirX = _mm_set1_ps(rayDir.x);
+        const __m128 dirY = _mm_set1_ps(rayDir.y);
+        const __m128 dirZ = _mm_set1_ps(rayDir.z);
+        const auto transformPoint = [&](const float (&row)[4][width]) {
+            __m128 ret = _mm_load_ps(row[3]);
+            ret = _mm_add_ps(_mm_mul_ps(_mm_load_ps(row[0]), orgX), ret);
+            ret = _mm_add_ps(_mm_mul_ps(_mm_load_ps(row[1]), orgY), ret);
+            return _mm_add_ps(_mm_mul_ps(_mm_load_ps(row[2]), orgZ), ret);
+        };
+        const auto transformVector = [&](const float (&row)[4][width]) {
+            __m128 ret = _mm_mul_ps(_mm_load_ps(row[0]), dirX);
+            ret = _mm_add_ps(_mm_mul_ps(_mm_load_ps(row[1]), dirY), ret);
+            return _mm_add_ps(_mm_mul_ps(_mm_load_ps(row[2]), dirZ), ret);
+        };
+        const __m128 ts = _mm_div_ps(
+            _mm_sub_ps(_mm_setzero_ps(), transformPoint(block.rows[2])), transformVector(block.rows[2]));
+        const __m128 us = _mm_add_ps(
+            transformPoint(block.rows[0]), _mm_mul_ps(ts, transformVector(block.rows[0])));
+        const __m128 vs = _mm_add_ps(
+            transformPoint(block.rows[1]), _mm_mul_ps(ts, transformVector(block.rows[1])));
+        __m128 hitMask = _mm_and_ps(
+            _mm_cmplt_ps(ts, _mm_set1_ps(distMax)),
+            _mm_cmpgt_ps(ts, _mm_set1_ps(distMin)));
+        hitMask = _mm_and_ps(hitMask, _mm_cmpge_ps(us, _mm_setzero_ps()));
+        hitMask = _mm_and_ps(hitMask, _mm_cmpge_ps(vs, _mm_setzero_ps()));
+        hitMask = _mm_and_ps(hitMask, _mm_cmple_ps(_mm_add_ps(us, vs), _mm_set1_ps(1.0f)));
+        uint32_t mask = _mm_movemask_ps(hitMask);
+        if (mask == 0)
+            return -1;
+
+        alignas(16) float hitDists[width];
+        alignas(16) float hitBcBs[width];
+        alignas(16) float hitBcCs[width];
+        _mm_store_ps(hitDists, ts);
+        _mm_store_ps(hitBcBs, us);
+        _mm_store_ps(hitBcCs, vs);
+        int32_t hitLane = -1;
+        *hitDist = distMax;
+        for (; mask; mask &= mask - 1) {
+            const uint32_t lane = tzcnt(mask);
+            if (hitDists[lane] < *hitDist) {
+                *hitDist = hitDists[lane];
+                hitLane = lane;
+            }
+        }
+        *bcB = hitBcBs[hitLane];
+        *bcC = hitBcCs[hitLane];
+        return hitLane;
+    }
+#endif
+
+    int32_t hitLane = -1;
+    float curDistMax = distMax;
+    for (uint32_t lane = 0; lane < block.numTriangles; ++lane) {
+        WoopTriangle woopTri;
+        for (uint32_t rowIdx = 0; rowIdx < 3; ++rowIdx) {
+            for (uint32_t i = 0; i < 4; ++i)
+                woopTri.rows[rowIdx][i] = block.rows[rowIdx][i][lane];
+        }
+        float laneHitDist, laneBcB, laneBcC;
+        if (testRayVsWoopTriangle(
+            rayOrg, rayDir, distMin, curDistMax, woopTri,
+            &laneHitDist, &laneBcB, &laneBcC)) {
+            curDistMax = laneHitDist;
+            *hitDist = laneHitDist;
+            *bcB = laneBcB;
+            *bcC = laneBcC;
+            hitLane = lane;
+        }
+    }
+    return hitLane;
+}
+
+struct TraversalContext {
+    TraversalStatistics* stats;
+    double sumStackAccessDepth;
+    uint32_t numStackAccesses;
+    int32_t maxStackDepth;
+    int32_t fastStackDepthLimit;
+    uint32_t stackMemoryAccessAmount;
+    uint32_t* intNodeAccessCounts;
+    std::vector<uint32_t>* intNodeAccessTrace;
+
+    TraversalContext(TraversalStatistics* const _stats) :
+        stats(_stats),
+        sumStackAccessDepth(0.0), numStackAccesses(0), maxStackDepth(-1),
+        fastStackDepthLimit(_stats ? _stats->fastStackDepthLimit : 0),
+        stackMemoryAccessAmount(0),
+        intNodeAccessCounts(_stats ? _stats->intNodeAccessCounts : nullptr),
+        intNodeAccessTrace(_stats ? _stats->intNodeAccessTrace : nullptr) {
+        if (stats) {
+            stats->numAabbTests = 0;
+            stats->numTriTests = 0;
+        }
+    }
+
+    void finalize() const {
+        if (stats) {
+            stats->avgStackAccessDepth = numStackAccesses > 0 ?
+                static_cast<float>(sumStackAccessDepth / numStackAccesses) : 0.0f;
+            stats->maxStackDepth = maxStackDepth;
+            stats->stackMemoryAccessAmount = stackMemoryAccessAmount;
+        }
+    }
+};
+
+// EN: Traverse the hierarchy from the given node.
+//     leafFunc(leafIndex) tests a single item in a leaf, may shrink curDistMax and returns whether the item is
+//     the end of the leaf. baseStackDepth is the depth of the stack already used by the caller
+//     (e.g. the top-level traversal), it only affects the statistics.
+template <uint32_t arity, typename LeafFunc>
+inline void __traverseNodes(
+    const shared::InternalNode_T<arity>* const intNodes, const uint32_t rootNodeIndex,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float &curDistMax,
+    const int32_t baseStackDepth, TraversalContext* const context, const bool debugPrint,
+    LeafFunc &leafFunc) {
+    using namespace shared;
+    using InternalNode = InternalNode_T<arity>;
+
+    TraversalStatistics* const stats = context->stats;
+    [[maybe_unused]] const Vector3D invRayDir = 1.0f / rayDir;
+
+#define USE_COMPRESSED_STACK 1
+
+    uint32_t numIterations = 0;
+
+#if USE_COMPRESSED_STACK
+    static constexpr uint32_t orderBitWidth = tzcntConst(arity);
+    static constexpr uint32_t orderMask = (1 << orderBitWidth) - 1;
+
+    union Entry {
+        struct {
+            uint32_t baseIndex : 31;
+            uint32_t isLeafGroup : 1;
+            uint32_t orderInfo : 28;
+            uint32_t numItems : 4;
+        };
+        uint32_t asUInts[2];
+    };
+
+    Entry stack[32];
+    uint8_t leafOffsets[arity];
+    int32_t stackIdx = 0;
+    Entry curGroup = { rootNodeIndex, 0, 0, 1 };
+
+    const auto push = [&]() {
+        if (stats) {
+            const int32_t depth = baseStackDepth + stackIdx;
+            context->sumStackAccessDepth += depth;
+            ++context->numStackAccesses;
+            context->maxStackDepth = std::max(depth, context->maxStackDepth);
+            if (depth > context->fastStackDepthLimit)
+                context->stackMemoryAccessAmount += sizeof(Entry);
+        }
+        stack[stackIdx++] = curGroup;
+        if (debugPrint) {
+            hpprintf("Push (%u): %u - [", stackIdx, curGroup.baseIndex);
+            for (uint32_t i = 0; i < curGroup.numItems; ++i)
+                hpprintf(
+                    "%u%s",
+                    (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
+                    i + 1 < curGroup.numItems ? ", " : "");
+            hpprintf("]\n");
+        }
+    };
     const auto pop = [&]() {
         curGroup = stack[--stackIdx];
         if (stats) {
-            sumStackAccessDepth += stackIdx;
-            ++numStackAccesses;
-            if (stackIdx > fastStackDepthLimit)
-                stackMemoryAccessAmount += sizeof(Entry);
+            const int32_t depth = baseStackDepth + stackIdx;
+            context->sumStackAccessDepth += depth;
+            ++context->numStackAccesses;
+            if (depth > context->fastStackDepthLimit)
+                context->stackMemoryAccessAmount += sizeof(Entry);
+        }
+        if (debugPrint) {
+            hpprintf("Pop (%u): %u - [", stackIdx, curGroup.baseIndex);
+            for (uint32_t i = 0; i < curGroup.numItems; ++i)
+                hpprintf(
+                    "%u%s",
+                    (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
+                    i + 1 < curGroup.numItems ? ", " : "");
+            hpprintf("]\n");
+        }
+    };
+
+    while (true) {
+        if (curGroup.numItems == 0) {
+            if (stackIdx == 0)
+                break;
+            pop();
+        }
+
+        ++numIterations;
+
+        Entry curTriGroup = {};
+        if (curGroup.isLeafGroup) {
+            curTriGroup = curGroup;
+            curGroup.numItems = 0;
+        }
+        else {
+            // Get the closest node.
+            Assert(curGroup.numItems > 0, "No items anymore.");
+            const uint32_t nodeIdx = curGroup.baseIndex + (curGroup.orderInfo & orderMask);
+            curGroup.orderInfo >>= orderBitWidth;
+            --curGroup.numItems;
+            const InternalNode &intNode = intNodes[nodeIdx];
+            if (context->intNodeAccessCounts)
+                ++context->intNodeAccessCounts[nodeIdx];
+            if (context->intNodeAccessTrace)
+                context->intNodeAccessTrace->push_back(nodeIdx);
+            if (debugPrint)
+                hpprintf(
+                    "Int %u: %u, %u\n",
+                    nodeIdx, intNode.intNodeChildBaseIndex, intNode.leafBaseIndex);
+
+            // Intersect child AABBs.
+            uint32_t orderInfo = 0;
+            uint32_t numIntHits = 0;
+            uint32_t numLeafHits = 0;
+            bool childrenIntersected = false;
+            if constexpr (simdNodeIntersectionIsAvailable<arity>) {
+                // EN: The scalar path is kept for the debug output.
+                if (!debugPrint) {
+                    uint32_t numAabbTests = 0;
+                    intersectChildAabbsSimd(
+                        intNode, rayOrg, invRayDir, distMin, curDistMax,
+                        &orderInfo, &numLeafHits, &numIntHits, &numAabbTests);
+                    if (stats)
+                        stats->numAabbTests += numAabbTests;
+                    childrenIntersected = true;
+                }
+            }
+            if (!childrenIntersected) {
+                uint32_t keys[arity];
+                for (uint32_t slot = 0; slot < arity; ++slot) {
+                    if (!intNode.getChildIsValid(slot)) {
+                        for (; slot < arity; ++slot)
+                            keys[slot] = floatToOrderedUInt(INFINITY);
+                        break;
+                    }
+
+                    if (stats)
+                        ++stats->numAabbTests;
+                    const AABB &aabb = intNode.getChildAabb(slot);
+                    float hitDistMin, hitDistMax;
+                    if (aabb.intersect(rayOrg, rayDir, distMin, curDistMax, &hitDistMin, &hitDistMax)) {
+                        bool const isLeaf = intNode.getChildIsLeaf(slot);
+                        const float dist = 0.5f * (hitDistMin + hitDistMax);
+                        keys[slot] = (floatToOrderedUInt(dist) >> 1) | (!isLeaf << 31);
+                        if (isLeaf) {
+                            orderInfo |= (slot << (orderBitWidth * slot));
+                            ++numLeafHits;
+                            if (debugPrint)
+                                hpprintf("  %u: %g, leaf\n", slot, dist);
+                        }
+                        else {
+                            const uint32_t nthIntChild = intNode.getInternalChildNumber(slot);
+                            orderInfo |= (nthIntChild << (orderBitWidth * slot));
+                            ++numIntHits;
+                            if (debugPrint)
+                                hpprintf("  %u: %g, %u th int child\n", slot, dist, nthIntChild);
+                        }
+                    }
+                    else {
+                        keys[slot] = floatToOrderedUInt(INFINITY);
+                    }
+                }
+
+                if (numIntHits + numLeafHits > 0)
+                    sortOrder(keys, &orderInfo);
+            }
+
+            // Create a triangle group if any leaf hit.
+            if (numLeafHits > 0) {
+                curTriGroup.numItems = numLeafHits;
+                curTriGroup.baseIndex = intNode.leafBaseIndex;
+                curTriGroup.isLeafGroup = true;
+                curTriGroup.orderInfo = orderInfo;
+
+                //#pragma unroll
+                for (uint32_t slot = 0; slot < arity; ++slot)
+                    leafOffsets[slot] = intNode.childMetas[slot].getLeafOffset();
+
+                if (debugPrint) {
+                    hpprintf("  Order (Leaf): [");
+                    for (uint32_t i = 0; i < curTriGroup.numItems; ++i)
+                        hpprintf(
+                            "%u%s",
+                            (curTriGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
+                            i + 1 < curTriGroup.numItems ? ", " : "");
+                    hpprintf("]\n");
+                }
+            }
+
+            // Create a node group if any internal node child hit.
+            if (numIntHits > 0) {
+                if (curGroup.numItems > 0)
+                    push();
+
+                curGroup.numItems = numIntHits;
+                curGroup.baseIndex = intNode.intNodeChildBaseIndex;
+                curGroup.isLeafGroup = false;
+                curGroup.orderInfo = orderInfo >> (orderBitWidth * numLeafHits);
+
+                if (debugPrint) {
+                    hpprintf("  Order (Int): [");
+                    for (uint32_t i = 0; i < curGroup.numItems; ++i)
+                        hpprintf(
+                            "%u th%s",
+                            (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
+                            i + 1 < curGroup.numItems ? ", " : "");
+                    hpprintf("]\n");
+                }
+            }
         }
-        if (debugPrint) {
-            hpprintf("Pop (%u): %u - [", stackIdx, curGroup.baseIndex);
-            for (uint32_t i = 0; i < curGroup.numItems; ++i)
+
+        // Intersect a leaf item.
+        // TODO: Loop over a primitive chain and dynamic postponing for better SIMD utilization (on GPU).
+        if (curTriGroup.numItems > 0) {
+            const uint32_t slot = curTriGroup.orderInfo & orderMask;
+            const uint32_t leafIdx = curTriGroup.baseIndex + leafOffsets[slot]++;
+            const bool isLeafEnd = leafFunc(leafIdx, baseStackDepth + stackIdx);
+            if (isLeafEnd) {
+                curTriGroup.orderInfo >>= orderBitWidth;
+                --curTriGroup.numItems;
+            }
+
+            if (curTriGroup.numItems > 0) {
+                if (curGroup.numItems > 0)
+                    push();
+                curGroup = curTriGroup;
+            }
+        }
+    }
+#else
+    union Entry {
+        struct {
+            uint32_t index : 31;
+            uint32_t isLeaf : 1;
+        };
+        uint32_t asUInt;
+    };
+
+    Entry stack[64];
+    int32_t stackIdx = 0;
+    Entry curEntry = { rootNodeIndex, 0 };
+    while (true) {
+        if (curEntry.asUInt == UINT32_MAX) {
+            if (stackIdx == 0)
+                break;
+            curEntry = stack[--stackIdx];
+            if (stats) {
+                const int32_t depth = baseStackDepth + stackIdx;
+                context->sumStackAccessDepth += depth;
+                ++context->numStackAccesses;
+                if (depth > context->fastStackDepthLimit)
+                    context->stackMemoryAccessAmount += sizeof(Entry);
+            }
+            if (debugPrint)
+                hpprintf("Pop (%u)\n", stackIdx);
+        }
+
+        ++numIterations;
+
+        if (curEntry.isLeaf) {
+            const bool isLeafEnd = leafFunc(curEntry.index, baseStackDepth + stackIdx);
+            if (isLeafEnd)
+                curEntry.asUInt = UINT32_MAX;
+            else
+                ++curEntry.index;
+            continue;
+        }
+
+        const InternalNode &intNode = intNodes[curEntry.index];
+        if (debugPrint)
+            hpprintf(
+                "Int %u: %u, %u\n",
+                curEntry.index, intNode.intNodeChildBaseIndex, intNode.leafBaseIndex);
+
+        uint32_t keys[arity];
+        Entry entries[arity];
+        uint32_t numHits = 0;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot)) {
+                for (; slot < arity; ++slot)
+                    keys[slot] = floatToOrderedUInt(INFINITY);
+                break;
+            }
+
+            if (stats)
+                ++stats->numAabbTests;
+            const AABB &aabb = intNode.getChildAabb(slot);
+            float hitDistMin, hitDistMax;
+            if (aabb.intersect(rayOrg, rayDir, distMin, curDistMax, &hitDistMin, &hitDistMax)) {
+                Entry entry;
+                entry.isLeaf = intNode.getChildIsLeaf(slot);
+                const float dist = 0.5f * (hitDistMin + hitDistMax);
+                if (entry.isLeaf) {
+                    entry.index = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+                    if (debugPrint)
+                        hpprintf("  %u: %g, leaf\n", slot, dist);
+                }
+                else {
+                    const uint32_t nthIntChild = intNode.getInternalChildNumber(slot);
+                    entry.index = intNode.intNodeChildBaseIndex + nthIntChild;
+                    if (debugPrint)
+                        hpprintf("  %u: %g, %u th int child\n", slot, dist, nthIntChild);
+                }
+                entries[slot] = entry;
+                keys[slot] = (floatToOrderedUInt(dist) >> 1) | (!entry.isLeaf << 31);
+                ++numHits;
+            }
+            else {
+                keys[slot] = floatToOrderedUInt(INFINITY);
+            }
+        }
+
+        curEntry.asUInt = UINT32_MAX;
+        if (numHits > 0) {
+            sort(keys, entries);
+            for (uint32_t i = numHits - 1; i > 0; --i) {
+                if (stats) {
+                    const int32_t depth = baseStackDepth + stackIdx;
+                    context->sumStackAccessDepth += depth;
+                    ++context->numStackAccesses;
+                    if (depth > context->fastStackDepthLimit)
+                        context->stackMemoryAccessAmount += sizeof(Entry);
+                }
+                stack[stackIdx++] = entries[i];
+                if (debugPrint)
+                    hpprintf("Push (%u)\n", stackIdx);
+            }
+            if (stats)
+                context->maxStackDepth = std::max(baseStackDepth + stackIdx - 1, context->maxStackDepth);
+            curEntry = entries[0];
+        }
+    }
+#endif
+}
+
+static inline shared::HitObject makeMissHitObject(const float distMax) {
+    shared::HitObject ret = {};
+    ret.dist = distMax;
+    ret.instIndex = UINT32_MAX;
+    ret.instUserData = 0;
+    ret.geomIndex = UINT32_MAX;
+    ret.primIndex = UINT32_MAX;
+    ret.bcA = NAN;
+    ret.bcB = NAN;
+    ret.bcC = NAN;
+    return ret;
+}
+
+// EN: Traverse a geometry BVH from the given node and update the hit object when a closer hit is found.
+//     BVHType is either GeometryBVH or GeometryBVHView, the latter has only the raw leaf triangles.
+template <uint32_t arity, template <uint32_t> typename BVHType>
+inline void __traverseGeometry(
+    const BVHType<arity> &bvh, const uint32_t rootNodeIndex,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin,
+    const int32_t baseStackDepth, TraversalContext* const context, const bool debugPrint,
+    shared::HitObject* const hitObj) {
+    constexpr bool hasPrecomputedLeafTris = std::is_same_v<BVHType<arity>, GeometryBVH<arity>>;
+    TraversalStatistics* const stats = context->stats;
+
+    // EN: Test all the blocks of a leaf at once and report the leaf end.
+    const auto testLeafBlocks = [&]
+    <uint32_t width>
+    (const std::vector<WoopTriangleBlock<width>> &blocks, const uint32_t primRefIdx, uint32_t blockIdx) {
+        while (true) {
+            const WoopTriangleBlock<width> &block = blocks[blockIdx++];
+            if (stats)
+                stats->numTriTests += block.numTriangles;
+            float hitDist;
+            float hitBcB, hitBcC;
+            const int32_t hitLane = testRayVsWoopTriangleBlock(
+                rayOrg, rayDir, distMin, hitObj->dist, block,
+                &hitDist, &hitBcB, &hitBcC);
+            if (hitLane >= 0) {
+                const shared::TriangleStorage &triStorage = bvh.triStorages[block.storageIndices[hitLane]];
+                hitObj->dist = hitDist;
+                hitObj->geomIndex = triStorage.geomIndex;
+                hitObj->primIndex = triStorage.primIndex;
+                hitObj->bcA = 1.0f - (hitBcB + hitBcC);
+                hitObj->bcB = hitBcB;
+                hitObj->bcC = hitBcC;
+            }
+            if (debugPrint)
                 hpprintf(
-                    "%u%s",
-                    (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
-                    i + 1 < curGroup.numItems ? ", " : "");
-            hpprintf("]\n");
+                    "Leaf %u: block %u: %s (%g)\n",
+                    primRefIdx, blockIdx - 1, hitLane >= 0 ? "hit" : "miss",
+                    hitLane >= 0 ? hitObj->dist : INFINITY);
+            if (block.isLeafEnd)
+                break;
+        }
+        return true;
+    };
+
+    const auto testLeafItem = [&]
+    (const uint32_t primRefIdx, const int32_t /*stackDepth*/) {
+        LeafTriangleFormat leafTriFormat = LeafTriangleFormat::Raw;
+        if constexpr (hasPrecomputedLeafTris) {
+            leafTriFormat = bvh.leafTriangleFormat;
+            if (leafTriFormat == LeafTriangleFormat::WoopSoA8)
+                return testLeafBlocks(bvh.woopTriBlocks8, primRefIdx, bvh.leafTriBlockIndices[primRefIdx]);
+            if (leafTriFormat == LeafTriangleFormat::WoopSoA4)
+                return testLeafBlocks(bvh.woopTriBlocks4, primRefIdx, bvh.leafTriBlockIndices[primRefIdx]);
         }
+
+        if (stats)
+            ++stats->numTriTests;
+        const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
+        const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+        float hitDist;
+        float hitBcB, hitBcC;
+        bool hit;
+        if (leafTriFormat == LeafTriangleFormat::Woop) {
+            if constexpr (hasPrecomputedLeafTris) {
+                hit = testRayVsWoopTriangle(
+                    rayOrg, rayDir, distMin, hitObj->dist,
+                    bvh.woopTris[primRefIdx],
+                    &hitDist, &hitBcB, &hitBcC);
+            }
+        }
+        else {
+            Normal3D hitNormal;
+            hit = testRayVsTriangle(
+                rayOrg, rayDir, distMin, hitObj->dist,
+                triStorage.pA, triStorage.pB, triStorage.pC,
+                &hitDist, &hitNormal, &hitBcB, &hitBcC);
+        }
+        if (hit) {
+            hitObj->dist = hitDist;
+            hitObj->geomIndex = triStorage.geomIndex;
+            hitObj->primIndex = triStorage.primIndex;
+            hitObj->bcA = 1.0f - (hitBcB + hitBcC);
+            hitObj->bcB = hitBcB;
+            hitObj->bcC = hitBcC;
+        }
+        if (debugPrint)
+            hpprintf(
+                "Leaf %u: tri %u: %s (%g)\n",
+                primRefIdx, primRef.storageIndex, hit ? "hit" : "miss",
+                hit ? hitObj->dist : INFINITY);
+        return static_cast<bool>(primRef.isLeafEnd);
+    };
+
+    __traverseNodes(
+        bvh.intNodes.data(), rootNodeIndex,
+        rayOrg, rayDir, distMin, hitObj->dist,
+        baseStackDepth, context, debugPrint,
+        testLeafItem);
+}
+
+template <uint32_t arity, template <uint32_t> typename BVHType>
+inline shared::HitObject __traverse(
+    const BVHType<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint) {
+    shared::HitObject ret = makeMissHitObject(distMax);
+    TraversalContext context(stats);
+    __traverseGeometry(
+        bvh, 0,
+        rayOrg, rayDir, distMin,
+        0, &context, debugPrint,
+        &ret);
+    context.finalize();
+
+    return ret;
+}
+
+template <uint32_t arity>
+inline shared::HitObject __traverse(
+    const InstanceBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint) {
+    shared::HitObject ret = makeMissHitObject(distMax);
+    TraversalContext context(stats);
+    // EN: Node indices of the TLAS and the BLASes would be mixed up.
+    context.intNodeAccessCounts = nullptr;
+    context.intNodeAccessTrace = nullptr;
+
+    // EN: Transform the ray into the object space of an instance and continue the traversal in the BLAS
+    //     from the node the instance reference points to.
+    //     The direction is not normalized, so the hit distance is shared between the spaces.
+    const auto testLeafItem = [&]
+    (const uint32_t instRefIdx, const int32_t stackDepth) {
+        const shared::InstanceReference &instRef = bvh.instRefs[instRefIdx];
+        const auto &blas = *reinterpret_cast<const GeometryBVH<arity>*>(instRef.bvhAddress);
+        const Point3D rayOrgInObj = instRef.rotToObj * rayOrg + instRef.transToObj;
+        const Vector3D rayDirInObj = instRef.rotToObj * rayDir;
+        if (debugPrint)
+            hpprintf("Inst %u: node %u\n", instRef.instanceIndex, instRef.nodeIndex);
+        const float prevDist = ret.dist;
+        __traverseGeometry(
+            blas, instRef.nodeIndex,
+            rayOrgInObj, rayDirInObj, distMin,
+            stackDepth, &context, debugPrint,
+            &ret);
+        if (ret.dist < prevDist) {
+            ret.instIndex = instRef.instanceIndex;
+            ret.instUserData = instRef.userData;
+        }
+        return true;
+    };
+
+    __traverseNodes(
+        bvh.intNodes.data(), 0,
+        rayOrg, rayDir, distMin, ret.dist,
+        0, &context, debugPrint,
+        testLeafItem);
+    context.finalize();
+
+    return ret;
+}
+
+// Workaround for Intellisense.
+// https://developercommunity.visualstudio.com/t/The-provide-sample-template-arguments-f/10564187
+template <uint32_t arity>
+shared::HitObject traverse(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint) {
+    return __traverse(
+        bvh,
+        rayOrg, rayDir, distMin, distMax,
+        stats, debugPrint);
+}
+
+template shared::HitObject traverse<2>(
+    const GeometryBVH<2> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<4>(
+    const GeometryBVH<4> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<8>(
+    const GeometryBVH<8> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+
+template <uint32_t arity>
+shared::HitObject traverse(
+    const GeometryBVHView<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint) {
+    return __traverse(
+        bvh,
+        rayOrg, rayDir, distMin, distMax,
+        stats, debugPrint);
+}
+
+template shared::HitObject traverse<2>(
+    const GeometryBVHView<2> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<4>(
+    const GeometryBVHView<4> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<8>(
+    const GeometryBVHView<8> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+
+template <uint32_t arity>
+shared::HitObject traverse(
+    const InstanceBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint) {
+    return __traverse(
+        bvh,
+        rayOrg, rayDir, distMin, distMax,
+        stats, debugPrint);
+}
+
+template shared::HitObject traverse<2>(
+    const InstanceBVH<2> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<4>(
+    const InstanceBVH<4> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+template shared::HitObject traverse<8>(
+    const InstanceBVH<8> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats, const bool debugPrint);
+
+
+
+// EN: Rays of a packet in SoA layout.
+//     Lanes without a ray have a negative distMax so that they never hit anything.
+template <uint32_t packetSize>
+struct RayPacket {
+    float orgXs[packetSize];
+    float orgYs[packetSize];
+    float orgZs[packetSize];
+    float invDirXs[packetSize];
+    float invDirYs[packetSize];
+    float invDirZs[packetSize];
+    float distMins[packetSize];
+    float distMaxs[packetSize];
+};
+
+// EN: Conservative bounds of the packet for interval arithmetic culling.
+//     Only valid when the direction signs of all the rays agree for each axis.
+struct PacketFrustum {
+    Point3D orgMin;
+    Point3D orgMax;
+    Vector3D invDirMin;
+    Vector3D invDirMax;
+    float distMin;
+    bool isValid;
+
+    // EN: Returns true if no ray in the packet can hit the box.
+    bool cull(const AABB &aabb, const float distMax) const {
+        const auto calcNearFar = []
+        (const float bMin, const float bMax, const float oMin, const float oMax,
+         const float iMin, const float iMax,
+         float* const nearLo, float* const farHi) {
+            if (iMin >= 0.0f) {
+                const float aLo = bMin - oMax;
+                const float bHi = bMax - oMin;
+                *nearLo = aLo * (aLo >= 0.0f ? iMin : iMax);
+                *farHi = bHi * (bHi >= 0.0f ? iMax : iMin);
+            }
+            else {
+                const float aHi = bMax - oMin;
+                const float bLo = bMin - oMax;
+                *nearLo = aHi * (aHi >= 0.0f ? iMin : iMax);
+                *farHi = bLo * (bLo <= 0.0f ? iMin : iMax);
+            }
+        };
+        float nearLoX, farHiX;
+        float nearLoY, farHiY;
+        float nearLoZ, farHiZ;
+        calcNearFar(aabb.minP.x, aabb.maxP.x, orgMin.x, orgMax.x, invDirMin.x, invDirMax.x, &nearLoX, &farHiX);
+        calcNearFar(aabb.minP.y, aabb.maxP.y, orgMin.y, orgMax.y, invDirMin.y, invDirMax.y, &nearLoY, &farHiY);
+        calcNearFar(aabb.minP.z, aabb.maxP.z, orgMin.z, orgMax.z, invDirMin.z, invDirMax.z, &nearLoZ, &farHiZ);
+        const float nearLo = std::fmax(std::fmax(std::fmax(nearLoX, nearLoY), nearLoZ), distMin);
+        const float farHi = std::fmin(std::fmin(std::fmin(farHiX, farHiY), farHiZ), distMax);
+        return nearLo > farHi || farHi <= 0.0f;
+    }
+};
+
+static constexpr uint32_t singleRayFallbackThreshold = 2;
+
+template <uint32_t arity, uint32_t packetSize>
+static void __traversePacket(
+    const GeometryBVH<arity> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats) {
+    static_assert(packetSize == 4 || packetSize == 8 || packetSize == 16, "Unsupported packet size.");
+    Assert(numRays <= packetSize, "Too many rays for the packet: %u", numRays);
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    TraversalContext context(stats);
+
+    RayPacket<packetSize> packet;
+    PacketFrustum frustum;
+    frustum.orgMin = Point3D(INFINITY);
+    frustum.orgMax = Point3D(-INFINITY);
+    frustum.invDirMin = Vector3D(INFINITY);
+    frustum.invDirMax = Vector3D(-INFINITY);
+    frustum.distMin = INFINITY;
+    frustum.isValid = numRays > 0;
+    for (uint32_t i = 0; i < packetSize; ++i) {
+        const Ray &ray = rays[i < numRays ? i : 0];
+        const Vector3D invDir = 1.0f / ray.dir;
+        packet.orgXs[i] = ray.org.x;
+        packet.orgYs[i] = ray.org.y;
+        packet.orgZs[i] = ray.org.z;
+        packet.invDirXs[i] = invDir.x;
+        packet.invDirYs[i] = invDir.y;
+        packet.invDirZs[i] = invDir.z;
+        packet.distMins[i] = ray.distMin;
+        packet.distMaxs[i] = i < numRays ? ray.distMax : -INFINITY;
+        if (i >= numRays)
+            continue;
+        hitObjs[i] = makeMissHitObject(ray.distMax);
+        frustum.orgMin = min(frustum.orgMin, ray.org);
+        frustum.orgMax = max(frustum.orgMax, ray.org);
+        frustum.invDirMin = min(frustum.invDirMin, invDir);
+        frustum.invDirMax = max(frustum.invDirMax, invDir);
+        frustum.distMin = std::fmin(frustum.distMin, ray.distMin);
+    }
+    // EN: The interval arithmetic requires finite inverse directions with the same sign in each axis.
+    frustum.isValid &=
+        frustum.invDirMin.allFinite() && frustum.invDirMax.allFinite() &&
+        (frustum.invDirMin.x >= 0.0f || frustum.invDirMax.x < 0.0f) &&
+        (frustum.invDirMin.y >= 0.0f || frustum.invDirMax.y < 0.0f) &&
+        (frustum.invDirMin.z >= 0.0f || frustum.invDirMax.z < 0.0f);
+
+    const auto calcPacketDistMax = [&]() {
+        float ret = -INFINITY;
+        for (uint32_t i = 0; i < numRays; ++i)
+            ret = std::fmax(packet.distMaxs[i], ret);
+        return ret;
+    };
+
+    struct Entry {
+        uint32_t index : 31;
+        uint32_t isLeaf : 1;
+        uint32_t rayMask;
     };
 
+    Entry stack[64];
+    int32_t stackIdx = 0;
+    Entry curEntry = { 0, 0, (1u << numRays) - 1 };
+    bool hasCurEntry = numRays > 0;
     while (true) {
-        if (curGroup.numItems == 0) {
+        if (!hasCurEntry) {
             if (stackIdx == 0)
                 break;
-            pop();
+            curEntry = stack[--stackIdx];
+        }
+        hasCurEntry = false;
+
+        if (curEntry.isLeaf) {
+            for (uint32_t primRefIdx = curEntry.index; ; ++primRefIdx) {
+                const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
+                const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+                for (uint32_t rayMask = curEntry.rayMask; rayMask; rayMask &= rayMask - 1) {
+                    const uint32_t rayIdx = tzcnt(rayMask);
+                    const Ray &ray = rays[rayIdx];
+                    shared::HitObject &hitObj = hitObjs[rayIdx];
+                    if (stats)
+                        ++stats->numTriTests;
+                    float hitDist;
+                    float hitBcB, hitBcC;
+                    Normal3D hitNormal;
+                    const bool hit = testRayVsTriangle(
+                        ray.org, ray.dir, ray.distMin, hitObj.dist,
+                        triStorage.pA, triStorage.pB, triStorage.pC,
+                        &hitDist, &hitNormal, &hitBcB, &hitBcC);
+                    if (hit) {
+                        hitObj.dist = hitDist;
+                        hitObj.geomIndex = triStorage.geomIndex;
+                        hitObj.primIndex = triStorage.primIndex;
+                        hitObj.bcA = 1.0f - (hitBcB + hitBcC);
+                        hitObj.bcB = hitBcB;
+                        hitObj.bcC = hitBcC;
+                        packet.distMaxs[rayIdx] = hitDist;
+                    }
+                }
+                if (primRef.isLeafEnd)
+                    break;
+            }
+            continue;
+        }
+
+        // EN: Continue with the single-ray traversal once few rays remain active in the subtree
+        //     since the packet no longer amortizes the node visit.
+        if (static_cast<uint32_t>(popcnt(curEntry.rayMask)) <= singleRayFallbackThreshold) {
+            for (uint32_t rayMask = curEntry.rayMask; rayMask; rayMask &= rayMask - 1) {
+                const uint32_t rayIdx = tzcnt(rayMask);
+                const Ray &ray = rays[rayIdx];
+                __traverseGeometry(
+                    bvh, curEntry.index,
+                    ray.org, ray.dir, ray.distMin,
+                    stackIdx, &context, false,
+                    &hitObjs[rayIdx]);
+                packet.distMaxs[rayIdx] = hitObjs[rayIdx].dist;
+            }
+            continue;
+        }
+
+        const InternalNode &intNode = bvh.intNodes[curEntry.index];
+        const float packetDistMax = frustum.isValid ? calcPacketDistMax() : 0.0f;
+
+        // EN: Test each child box against the frustum first, then against each active ray.
+        //     The children are ordered by the average hit distance of the rays hitting them.
+        float keys[arity];
+        Entry entries[arity];
+        uint32_t numHits = 0;
+        for (uint32_t slot = 0; slot < arity; ++slot) {
+            if (!intNode.getChildIsValid(slot)) {
+                for (; slot < arity; ++slot)
+                    keys[slot] = INFINITY;
+                break;
+            }
+
+            keys[slot] = INFINITY;
+            const AABB aabb = intNode.getChildAabb(slot);
+            if (frustum.isValid && frustum.cull(aabb, packetDistMax))
+                continue;
+
+            // EN: Written with comparisons instead of fmin/fmax so that the compiler can vectorize the loop.
+            //     Taking both operand orders ignores NaNs in the same way as fmin/fmax in the single-ray path.
+            uint32_t hitMask = 0;
+            float sumDist = 0.0f;
+            for (uint32_t i = 0; i < packetSize; ++i) {
+                float hitDistMin = packet.distMins[i];
+                float hitDistMax = packet.distMaxs[i];
+                const auto updateSlab = [&]
+                (const float tNear, const float tFar) {
+                    const float nearA = tNear < tFar ? tNear : tFar;
+                    const float nearB = tFar < tNear ? tFar : tNear;
+                    const float farA = tNear > tFar ? tNear : tFar;
+                    const float farB = tFar > tNear ? tFar : tNear;
+                    hitDistMin = nearA > hitDistMin ? nearA : hitDistMin;
+                    hitDistMin = nearB > hitDistMin ? nearB : hitDistMin;
+                    hitDistMax = farA < hitDistMax ? farA : hitDistMax;
+                    hitDistMax = farB < hitDistMax ? farB : hitDistMax;
+                };
+                updateSlab(
+                    (aabb.minP.x - packet.orgXs[i]) * packet.invDirXs[i],
+                    (aabb.maxP.x - packet.orgXs[i]) * packet.invDirXs[i]);
+                updateSlab(
+                    (aabb.minP.y - packet.orgYs[i]) * packet.invDirYs[i],
+                    (aabb.maxP.y - packet.orgYs[i]) * packet.invDirYs[i]);
+                updateSlab(
+                    (aabb.minP.z - packet.orgZs[i]) * packet.invDirZs[i],
+                    (aabb.maxP.z - packet.orgZs[i]) * packet.invDirZs[i]);
+                const bool hit = hitDistMin <= hitDistMax && hitDistMax > 0.0f;
+                hitMask |= static_cast<uint32_t>(hit) << i;
+                sumDist += hit ? 0.5f * (hitDistMin + hitDistMax) : 0.0f;
+            }
+            if (stats)
+                stats->numAabbTests += popcnt(curEntry.rayMask);
+            hitMask &= curEntry.rayMask;
+            if (hitMask == 0)
+                continue;
+
+            Entry entry;
+            entry.isLeaf = intNode.getChildIsLeaf(slot);
+            entry.index = entry.isLeaf ?
+                intNode.leafBaseIndex + intNode.getLeafOffset(slot) :
+                intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot);
+            entry.rayMask = hitMask;
+            entries[slot] = entry;
+            keys[slot] = sumDist / popcnt(hitMask);
+            ++numHits;
+        }
+
+        if (numHits > 0) {
+            sort(keys, entries);
+            Assert(stackIdx + numHits - 1 <= lengthof(stack), "Packet traversal stack overflow.");
+            for (uint32_t i = numHits - 1; i > 0; --i)
+                stack[stackIdx++] = entries[i];
+            if (stats)
+                context.maxStackDepth = std::max(stackIdx, context.maxStackDepth);
+            curEntry = entries[0];
+            hasCurEntry = true;
+        }
+    }
+    context.finalize();
+}
+
+template <uint32_t arity, uint32_t packetSize>
+void traversePacket(
+    const GeometryBVH<arity> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats) {
+    __traversePacket<arity, packetSize>(bvh, rays, numRays, hitObjs, stats);
+}
+
+#define INSTANTIATE_TRAVERSE_PACKET(arity, packetSize)\
+    template void traversePacket<arity, packetSize>(\
+        const GeometryBVH<arity> &bvh,\
+        const Ray* const rays, const uint32_t numRays,\
+        shared::HitObject* const hitObjs, TraversalStatistics* const stats)
+
+INSTANTIATE_TRAVERSE_PACKET(2, 4);
+INSTANTIATE_TRAVERSE_PACKET(2, 8);
+INSTANTIATE_TRAVERSE_PACKET(2, 16);
+INSTANTIATE_TRAVERSE_PACKET(4, 4);
+INSTANTIATE_TRAVERSE_PACKET(4, 8);
+INSTANTIATE_TRAVERSE_PACKET(4, 16);
+INSTANTIATE_TRAVERSE_PACKET(8, 4);
+INSTANTIATE_TRAVERSE_PACKET(8, 8);
+INSTANTIATE_TRAVERSE_PACKET(8, 16);
+
+#undef INSTANTIATE_TRAVERSE_PACKET
+
+static constexpr uint32_t streamPacketSize = 16;
+
+template <uint32_t arity>
+void traverseStream(
+    const GeometryBVH<arity> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats) {
+    const auto calcOctant = [](const Vector3D &dir) {
+        return (std::signbit(dir.x) ? 1 : 0) | (std::signbit(dir.y) ? 2 : 0) | (std::signbit(dir.z) ? 4 : 0);
+    };
+
+    // EN: Stable counting sort of the rays by direction octant.
+    uint32_t octantOffsets[9] = {};
+    for (uint32_t rayIdx = 0; rayIdx < numRays; ++rayIdx)
+        ++octantOffsets[calcOctant(rays[rayIdx].dir) + 1];
+    for (uint32_t octant = 0; octant < 8; ++octant)
+        octantOffsets[octant + 1] += octantOffsets[octant];
+    std::vector<uint32_t> sortedRayIndices(numRays);
+    {
+        uint32_t writeOffsets[8];
+        std::copy_n(octantOffsets, 8, writeOffsets);
+        for (uint32_t rayIdx = 0; rayIdx < numRays; ++rayIdx)
+            sortedRayIndices[writeOffsets[calcOctant(rays[rayIdx].dir)]++] = rayIdx;
+    }
+
+    TraversalStatistics packetStats = {};
+    if (stats) {
+        packetStats.fastStackDepthLimit = stats->fastStackDepthLimit;
+        stats->numAabbTests = 0;
+        stats->numTriTests = 0;
+        stats->avgStackAccessDepth = 0.0f;
+        stats->maxStackDepth = -1;
+        stats->stackMemoryAccessAmount = 0;
+    }
+
+    // EN: Packets don't straddle octants so that the frustum culling is always available.
+    Ray packetRays[streamPacketSize];
+    shared::HitObject packetHitObjs[streamPacketSize];
+    for (uint32_t octant = 0; octant < 8; ++octant) {
+        for (uint32_t offset = octantOffsets[octant]; offset < octantOffsets[octant + 1];
+             offset += streamPacketSize) {
+            const uint32_t numPacketRays = std::min(octantOffsets[octant + 1] - offset, streamPacketSize);
+            for (uint32_t i = 0; i < numPacketRays; ++i)
+                packetRays[i] = rays[sortedRayIndices[offset + i]];
+            __traversePacket<arity, streamPacketSize>(
+                bvh, packetRays, numPacketRays, packetHitObjs, stats ? &packetStats : nullptr);
+            for (uint32_t i = 0; i < numPacketRays; ++i)
+                hitObjs[sortedRayIndices[offset + i]] = packetHitObjs[i];
+            if (stats) {
+                stats->numAabbTests += packetStats.numAabbTests;
+                stats->numTriTests += packetStats.numTriTests;
+                stats->maxStackDepth = std::max(packetStats.maxStackDepth, stats->maxStackDepth);
+            }
+        }
+    }
+}
+
+template void traverseStream<2>(
+    const GeometryBVH<2> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats);
+template void traverseStream<4>(
+    const GeometryBVH<4> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats);
+template void traverseStream<8>(
+    const GeometryBVH<8> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats);
+
+
+template <uint32_t arity>
+static bool __occluded(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats) {
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    TraversalContext context(stats);
+    [[maybe_unused]] const Vector3D invRayDir = 1.0f / rayDir;
+
+    // EN: Leaf children are tested as soon as they are found and internal children are visited in any order
+    //     since any hit ends the traversal.
+    const auto testLeaf = [&]
+    (const uint32_t leafIdx) {
+        for (uint32_t primRefIdx = leafIdx; ; ++primRefIdx) {
+            const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
+            const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+            if (stats)
+                ++stats->numTriTests;
+            if (testRayVsTriangleOcclusion(
+                rayOrg, rayDir, distMin, distMax,
+                triStorage.pA, triStorage.pB, triStorage.pC))
+                return true;
+            if (primRef.isLeafEnd)
+                return false;
+        }
+    };
+
+    uint32_t stack[64 * (arity - 1) + 1];
+    int32_t stackIdx = 0;
+    stack[stackIdx++] = 0;
+    bool occluded = false;
+    while (stackIdx > 0 && !occluded) {
+        const InternalNode &intNode = bvh.intNodes[stack[--stackIdx]];
+
+        uint32_t hitMask = 0;
+        bool childrenIntersected = false;
+        if constexpr (simdNodeIntersectionIsAvailable<arity>) {
+            uint32_t numAabbTests = 0;
+            if constexpr (arity == 8) {
+                __m256 hitDistMins, hitDistMaxs;
+                hitMask = testChildAabbsSimd(
+                    intNode, rayOrg, invRayDir, distMin, distMax, &hitDistMins, &hitDistMaxs, &numAabbTests);
+            }
+            else {
+                __m128 hitDistMins, hitDistMaxs;
+                hitMask = testChildAabbsSimd(
+                    intNode, rayOrg, invRayDir, distMin, distMax, &hitDistMins, &hitDistMaxs, &numAabbTests);
+            }
+            if (stats)
+                stats->numAabbTests += numAabbTests;
+            childrenIntersected = true;
+        }
+        if (!childrenIntersected) {
+            for (uint32_t slot = 0; slot < arity; ++slot) {
+                if (!intNode.getChildIsValid(slot))
+                    break;
+                if (stats)
+                    ++stats->numAabbTests;
+                if (intNode.getChildAabb(slot).intersect(rayOrg, rayDir, distMin, distMax))
+                    hitMask |= 1 << slot;
+            }
+        }
+
+        for (uint32_t leafMask = hitMask & ~intNode.internalMask; leafMask; leafMask &= leafMask - 1) {
+            const uint32_t slot = tzcnt(leafMask);
+            if (testLeaf(intNode.leafBaseIndex + intNode.getLeafOffset(slot))) {
+                occluded = true;
+                break;
+            }
+        }
+        for (uint32_t intMask = hitMask & intNode.internalMask; intMask && !occluded; intMask &= intMask - 1) {
+            const uint32_t slot = tzcnt(intMask);
+            Assert(stackIdx < lengthof(stack), "Occlusion traversal stack overflow.");
+            stack[stackIdx++] = intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot);
+        }
+        if (stats)
+            context.maxStackDepth = std::max(stackIdx, context.maxStackDepth);
+    }
+    context.finalize();
+
+    return occluded;
+}
+
+template <uint32_t arity>
+bool occluded(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats) {
+    return __occluded(bvh, rayOrg, rayDir, distMin, distMax, stats);
+}
+
+template bool occluded<2>(
+    const GeometryBVH<2> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats);
+template bool occluded<4>(
+    const GeometryBVH<4> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats);
+template bool occluded<8>(
+    const GeometryBVH<8> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats);
+
+
+
+template <uint32_t arity>
+uint32_t traverseMultiHit(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const uint32_t maxNumHits, shared::HitObject* const hitObjs,
+    const AnyHitFilter &anyHitFilter, TraversalStatistics* const stats) {
+    Assert(maxNumHits > 0, "maxNumHits must be positive.");
+
+    TraversalContext context(stats);
+    context.intNodeAccessCounts = nullptr;
+    context.intNodeAccessTrace = nullptr;
+
+    // EN: The ray is shortened to the farthest buffered hit once the buffer is full,
+    //     culling the nodes and triangles behind it like the closest hit traversal does with a single hit.
+    uint32_t numHits = 0;
+    float cullDist = distMax;
+
+    const auto testLeafItem = [&]
+    (const uint32_t primRefIdx, const int32_t /*stackDepth*/) {
+        if (stats)
+            ++stats->numTriTests;
+        const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
+        const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+        float hitDist;
+        float hitBcB, hitBcC;
+        Normal3D hitNormal;
+        if (!testRayVsTriangle(
+            rayOrg, rayDir, distMin, cullDist,
+            triStorage.pA, triStorage.pB, triStorage.pC,
+            &hitDist, &hitNormal, &hitBcB, &hitBcC))
+            return static_cast<bool>(primRef.isLeafEnd);
+
+        // EN: A triangle referenced from multiple leaves (spatial splits) is reported once.
+        //     An evicted hit can't come back since it is not closer than the cull distance.
+        for (uint32_t hitIdx = 0; hitIdx < numHits; ++hitIdx) {
+            if (hitObjs[hitIdx].primIndex == triStorage.primIndex &&
+                hitObjs[hitIdx].geomIndex == triStorage.geomIndex)
+                return static_cast<bool>(primRef.isLeafEnd);
+        }
+
+        shared::HitObject hitObj = makeMissHitObject(hitDist);
+        hitObj.geomIndex = triStorage.geomIndex;
+        hitObj.primIndex = triStorage.primIndex;
+        hitObj.bcA = 1.0f - (hitBcB + hitBcC);
+        hitObj.bcB = hitBcB;
+        hitObj.bcC = hitBcC;
+        if (anyHitFilter && !anyHitFilter(hitObj))
+            return static_cast<bool>(primRef.isLeafEnd);
+
+        // EN: Insert into the buffer sorted by distance, overwriting the farthest hit when the buffer is full.
+        uint32_t hitIdx = numHits < maxNumHits ? numHits++ : maxNumHits - 1;
+        while (hitIdx > 0 && hitObjs[hitIdx - 1].dist > hitObj.dist) {
+            hitObjs[hitIdx] = hitObjs[hitIdx - 1];
+            --hitIdx;
+        }
+        hitObjs[hitIdx] = hitObj;
+        if (numHits == maxNumHits)
+            cullDist = hitObjs[maxNumHits - 1].dist;
+
+        return static_cast<bool>(primRef.isLeafEnd);
+    };
+
+    __traverseNodes(
+        bvh.intNodes.data(), 0,
+        rayOrg, rayDir, distMin, cullDist,
+        0, &context, false,
+        testLeafItem);
+    context.finalize();
+
+    return numHits;
+}
+
+template uint32_t traverseMultiHit<2>(
+    const GeometryBVH<2> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const uint32_t maxNumHits, shared::HitObject* const hitObjs,
+    const AnyHitFilter &anyHitFilter, TraversalStatistics* const stats);
+template uint32_t traverseMultiHit<4>(
+    const GeometryBVH<4> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const uint32_t maxNumHits, shared::HitObject* const hitObjs,
+    const AnyHitFilter &anyHitFilter, TraversalStatistics* const stats);
+template uint32_t traverseMultiHit<8>(
+    const GeometryBVH<8> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const uint32_t maxNumHits, shared::HitObject* const hitObjs,
+    const AnyHitFilter &anyHitFilter, TraversalStatistics* const stats);
+
+
+
+template <uint32_t arity, uint32_t shortStackSize>
+shared::HitObject traverseWithShortStack(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats) {
+    using InternalNode = shared::InternalNode_T<arity>;
+
+    shared::HitObject ret = makeMissHitObject(distMax);
+    TraversalContext context(stats);
+
+    // EN: The entry distance ignoring the current max distance is the order key.
+    const auto testChild = [&]
+    (const InternalNode &intNode, const uint32_t slot, float* const entryDist) {
+        if (stats)
+            ++stats->numAabbTests;
+        const AABB &aabb = intNode.getChildAabb(slot);
+        float hitDistMax;
+        return aabb.intersect(rayOrg, rayDir, distMin, INFINITY, entryDist, &hitDistMax);
+    };
+    const auto testLeafItem = [&]
+    (const uint32_t primRefIdx) {
+        if (stats)
+            ++stats->numTriTests;
+        const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
+        const shared::TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
+        float hitDist;
+        float hitBcB, hitBcC;
+        Normal3D hitNormal;
+        const bool hit = testRayVsTriangle(
+            rayOrg, rayDir, distMin, ret.dist,
+            triStorage.pA, triStorage.pB, triStorage.pC,
+            &hitDist, &hitNormal, &hitBcB, &hitBcC);
+        if (hit) {
+            ret.dist = hitDist;
+            ret.geomIndex = triStorage.geomIndex;
+            ret.primIndex = triStorage.primIndex;
+            ret.bcA = 1.0f - (hitBcB + hitBcC);
+            ret.bcB = hitBcB;
+            ret.bcC = hitBcC;
+        }
+        return static_cast<bool>(primRef.isLeafEnd);
+    };
+
+    shared::ShortStackTraversalStatistics shortStackStats = {};
+    shared::traverseWithShortStack<arity, shortStackSize>(
+        bvh.intNodes.data(), bvh.parentPointers.data(), 0,
+        ret.dist, testChild, testLeafItem,
+        stats ? &shortStackStats : nullptr);
+
+    // EN: Memory traffic beyond the short stack consists of parent pointer fetches and node refetches.
+    if (stats) {
+        context.maxStackDepth = shortStackSize;
+        context.stackMemoryAccessAmount =
+            shortStackStats.numParentPointerAccesses * sizeof(shared::ParentPointer) +
+            shortStackStats.numNodeRevisits * sizeof(InternalNode);
+    }
+    context.finalize();
+
+    return ret;
+}
+
+#define INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(arity, shortStackSize)\
+    template shared::HitObject traverseWithShortStack<arity, shortStackSize>(\
+        const GeometryBVH<arity> &bvh,\
+        const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,\
+        TraversalStatistics* const stats)
+
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(2, 1);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(2, 2);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(2, 4);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(2, 8);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(4, 1);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(4, 2);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(4, 4);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(4, 8);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(8, 1);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(8, 2);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(8, 4);
+INSTANTIATE_TRAVERSE_WITH_SHORT_STACK(8, 8);
+
+#undef INSTANTIATE_TRAVERSE_WITH_SHORT_STACK
+
+
+
+DynamicGeometryBVH::DynamicGeometryBVH(const DynamicGeometryBVHConfig &config) :
+    m_config(config), m_rootIndex(UINT32_MAX), m_numPrims(0), m_numMutationsSinceOptimization(0) {
+}
+
+uint32_t DynamicGeometryBVH::allocateNode() {
+    if (!m_freeNodeIndices.empty()) {
+        const uint32_t nodeIdx = m_freeNodeIndices.back();
+        m_freeNodeIndices.pop_back();
+        return nodeIdx;
+    }
+    m_nodes.emplace_back();
+    return static_cast<uint32_t>(m_nodes.size() - 1);
+}
+
+void DynamicGeometryBVH::freeNode(const uint32_t nodeIdx) {
+    Node &node = m_nodes[nodeIdx];
+    node.aabb = AABB();
+    node.parentIndex = UINT32_MAX;
+    node.childIndices[0] = UINT32_MAX;
+    node.childIndices[1] = UINT32_MAX;
+    node.geomIndex = UINT32_MAX;
+    node.primIndex = UINT32_MAX;
+    m_freeNodeIndices.push_back(nodeIdx);
+}
+
+// EN: Branch and bound search for the sibling minimizing the SAH cost increase of the insertion.
+//     The cost of making a node the sibling is the area of the new parent plus the area increase of
+//     all the ancestors (the induced cost). A subtree is skipped when even the insertion box itself
+//     added to the induced cost of its root can't beat the best cost.
+uint32_t DynamicGeometryBVH::findBestSibling(const AABB &aabb) const {
+    const float insertArea = aabb.calcHalfSurfaceArea();
+
+    using Candidate = std::pair<float, uint32_t>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+    candidates.emplace(0.0f, m_rootIndex);
+    uint32_t bestSiblingIdx = m_rootIndex;
+    float bestCost = INFINITY;
+    while (!candidates.empty()) {
+        const auto [inducedCost, nodeIdx] = candidates.top();
+        candidates.pop();
+        if (inducedCost + insertArea >= bestCost)
+            break;
+
+        const Node &node = m_nodes[nodeIdx];
+        const float unitedArea = AABB(node.aabb).unify(aabb).calcHalfSurfaceArea();
+        const float cost = unitedArea + inducedCost;
+        if (cost < bestCost) {
+            bestCost = cost;
+            bestSiblingIdx = nodeIdx;
+        }
+
+        if (node.isLeaf())
+            continue;
+        const float childInducedCost = cost - node.aabb.calcHalfSurfaceArea();
+        if (childInducedCost + insertArea < bestCost) {
+            candidates.emplace(childInducedCost, node.childIndices[0]);
+            candidates.emplace(childInducedCost, node.childIndices[1]);
+        }
+    }
+
+    return bestSiblingIdx;
+}
+
+// EN: Insert a leaf or a subtree using the given unused node as its new parent.
+void DynamicGeometryBVH::insertNode(const uint32_t nodeIdx, const uint32_t newParentIdx) {
+    if (m_rootIndex == UINT32_MAX) {
+        m_nodes[nodeIdx].parentIndex = UINT32_MAX;
+        m_rootIndex = nodeIdx;
+        freeNode(newParentIdx);
+        return;
+    }
+
+    const uint32_t siblingIdx = findBestSibling(m_nodes[nodeIdx].aabb);
+    const uint32_t oldParentIdx = m_nodes[siblingIdx].parentIndex;
+
+    Node &newParent = m_nodes[newParentIdx];
+    newParent.aabb = AABB(m_nodes[siblingIdx].aabb).unify(m_nodes[nodeIdx].aabb);
+    newParent.parentIndex = oldParentIdx;
+    newParent.childIndices[0] = siblingIdx;
+    newParent.childIndices[1] = nodeIdx;
+    newParent.geomIndex = UINT32_MAX;
+    newParent.primIndex = UINT32_MAX;
+    m_nodes[siblingIdx].parentIndex = newParentIdx;
+    m_nodes[nodeIdx].parentIndex = newParentIdx;
+
+    if (oldParentIdx == UINT32_MAX) {
+        m_rootIndex = newParentIdx;
+    }
+    else {
+        Node &oldParent = m_nodes[oldParentIdx];
+        oldParent.childIndices[oldParent.childIndices[0] == siblingIdx ? 0 : 1] = newParentIdx;
+        refitAncestors(oldParentIdx);
+    }
+}
+
+// EN: Detach a leaf or a subtree from the tree. Its parent is replaced by the sibling and returned unused.
+uint32_t DynamicGeometryBVH::detachNode(const uint32_t nodeIdx) {
+    const uint32_t parentIdx = m_nodes[nodeIdx].parentIndex;
+    Assert(parentIdx != UINT32_MAX, "The root can't be detached.");
+    const Node &parent = m_nodes[parentIdx];
+    const uint32_t siblingIdx = parent.childIndices[parent.childIndices[0] == nodeIdx ? 1 : 0];
+    const uint32_t grandParentIdx = parent.parentIndex;
+
+    m_nodes[siblingIdx].parentIndex = grandParentIdx;
+    if (grandParentIdx == UINT32_MAX) {
+        m_rootIndex = siblingIdx;
+    }
+    else {
+        Node &grandParent = m_nodes[grandParentIdx];
+        grandParent.childIndices[grandParent.childIndices[0] == parentIdx ? 0 : 1] = siblingIdx;
+        refitAncestors(grandParentIdx);
+    }
+    m_nodes[nodeIdx].parentIndex = UINT32_MAX;
+
+    return parentIdx;
+}
+
+// EN: Swap a child with a grandchild under the other child when it reduces the area of that child.
+//     The box of the node itself doesn't change.
+void DynamicGeometryBVH::rotate(const uint32_t nodeIdx) {
+    const Node &node = m_nodes[nodeIdx];
+    if (node.isLeaf())
+        return;
+
+    float bestAreaDiff = 0.0f;
+    uint32_t bestUncleSlot = UINT32_MAX;
+    uint32_t bestGrandChildSlot = UINT32_MAX;
+    for (uint32_t uncleSlot = 0; uncleSlot < 2; ++uncleSlot) {
+        const Node &uncle = m_nodes[node.childIndices[uncleSlot]];
+        const Node &child = m_nodes[node.childIndices[1 - uncleSlot]];
+        if (child.isLeaf())
+            continue;
+        const float childArea = child.aabb.calcHalfSurfaceArea();
+        for (uint32_t grandChildSlot = 0; grandChildSlot < 2; ++grandChildSlot) {
+            const Node &otherGrandChild = m_nodes[child.childIndices[1 - grandChildSlot]];
+            const float areaDiff =
+                AABB(uncle.aabb).unify(otherGrandChild.aabb).calcHalfSurfaceArea() - childArea;
+            if (areaDiff < bestAreaDiff) {
+                bestAreaDiff = areaDiff;
+                bestUncleSlot = uncleSlot;
+                bestGrandChildSlot = grandChildSlot;
+            }
         }
+    }
+    if (bestUncleSlot == UINT32_MAX)
+        return;
+
+    const uint32_t uncleIdx = node.childIndices[bestUncleSlot];
+    const uint32_t childIdx = node.childIndices[1 - bestUncleSlot];
+    Node &child = m_nodes[childIdx];
+    const uint32_t grandChildIdx = child.childIndices[bestGrandChildSlot];
+
+    m_nodes[nodeIdx].childIndices[bestUncleSlot] = grandChildIdx;
+    m_nodes[grandChildIdx].parentIndex = nodeIdx;
+    child.childIndices[bestGrandChildSlot] = uncleIdx;
+    m_nodes[uncleIdx].parentIndex = childIdx;
+    child.aabb = AABB(m_nodes[child.childIndices[0]].aabb).unify(m_nodes[child.childIndices[1]].aabb);
+}
+
+void DynamicGeometryBVH::refitAncestors(uint32_t nodeIdx) {
+    while (nodeIdx != UINT32_MAX) {
+        Node &node = m_nodes[nodeIdx];
+        node.aabb = AABB(m_nodes[node.childIndices[0]].aabb).unify(m_nodes[node.childIndices[1]].aabb);
+        rotate(nodeIdx);
+        nodeIdx = node.parentIndex;
+    }
+}
 
-        ++numIterations;
+void DynamicGeometryBVH::countMutation() {
+    if (m_config.optimizationInterval == 0)
+        return;
+    if (++m_numMutationsSinceOptimization < m_config.optimizationInterval)
+        return;
+    const uint32_t numIntNodes = m_numPrims > 0 ? m_numPrims - 1 : 0;
+    optimize(std::max(static_cast<uint32_t>(m_config.optimizationRatio * numIntNodes), 1u));
+}
 
-        Entry curTriGroup = {};
-        if (curGroup.isLeafGroup) {
-            curTriGroup = curGroup;
-            curGroup.numItems = 0;
-        }
-        else {
-            // Get the closest node.
-            Assert(curGroup.numItems > 0, "No items anymore.");
-            const uint32_t nodeIdx = curGroup.baseIndex + (curGroup.orderInfo & orderMask);
-            curGroup.orderInfo >>= orderBitWidth;
-            --curGroup.numItems;
-            const InternalNode &intNode = bvh.intNodes[nodeIdx];
-            if (debugPrint)
-                hpprintf(
-                    "Int %u: %u, %u\n",
-                    nodeIdx, intNode.intNodeChildBaseIndex, intNode.leafBaseIndex);
+uint32_t DynamicGeometryBVH::addGeometry(const Geometry &geom, const bool insertPrimitives) {
+    uint32_t geomIdx;
+    if (!m_freeGeomSlotIndices.empty()) {
+        geomIdx = m_freeGeomSlotIndices.back();
+        m_freeGeomSlotIndices.pop_back();
+    }
+    else {
+        geomIdx = static_cast<uint32_t>(m_geomSlots.size());
+        m_geomSlots.emplace_back();
+    }
 
-            // Intersect child AABBs.
-            uint32_t keys[arity];
-            uint32_t orderInfo = 0;
-            uint32_t numIntHits = 0;
-            uint32_t numLeafHits = 0;
-            for (uint32_t slot = 0; slot < arity; ++slot) {
-                if (!intNode.getChildIsValid(slot)) {
-                    for (; slot < arity; ++slot)
-                        keys[slot] = floatToOrderedUInt(INFINITY);
-                    break;
-                }
+    GeometrySlot &slot = m_geomSlots[geomIdx];
+    slot.geom = geom;
+    slot.leafIndices.assign(geom.numTriangles, UINT32_MAX);
+    slot.isUsed = true;
 
-                if (stats)
-                    ++stats->numAabbTests;
-                const AABB &aabb = intNode.getChildAabb(slot);
-                float hitDistMin, hitDistMax;
-                if (aabb.intersect(rayOrg, rayDir, distMin, ret.dist, &hitDistMin, &hitDistMax)) {
-                    bool const isLeaf = intNode.getChildIsLeaf(slot);
-                    const float dist = 0.5f * (hitDistMin + hitDistMax);
-                    keys[slot] = (floatToOrderedUInt(dist) >> 1) | (!isLeaf << 31);
-                    if (isLeaf) {
-                        orderInfo |= (slot << (orderBitWidth * slot));
-                        ++numLeafHits;
-                        if (debugPrint)
-                            hpprintf("  %u: %g, leaf\n", slot, dist);
-                    }
-                    else {
-                        const uint32_t nthIntChild = intNode.getInternalChildNumber(slot);
-                        orderInfo |= (nthIntChild << (orderBitWidth * slot));
-                        ++numIntHits;
-                        if (debugPrint)
-                            hpprintf("  %u: %g, %u th int child\n", slot, dist, nthIntChild);
-                    }
-                }
-                else {
-                    keys[slot] = floatToOrderedUInt(INFINITY);
-                }
-            }
+    if (insertPrimitives) {
+        for (uint32_t primIdx = 0; primIdx < geom.numTriangles; ++primIdx)
+            insertPrimitive(geomIdx, primIdx);
+    }
 
-            if (numIntHits + numLeafHits > 0)
-                sortOrder(keys, &orderInfo);
+    return geomIdx;
+}
 
-            // Create a triangle group if any leaf hit.
-            if (numLeafHits > 0) {
-                curTriGroup.numItems = numLeafHits;
-                curTriGroup.baseIndex = intNode.leafBaseIndex;
-                curTriGroup.isLeafGroup = true;
-                curTriGroup.orderInfo = orderInfo;
+void DynamicGeometryBVH::removeGeometry(const uint32_t geomIndex) {
+    Assert_Release(geomIndex < m_geomSlots.size() && m_geomSlots[geomIndex].isUsed, "Invalid geometry index.");
+    GeometrySlot &slot = m_geomSlots[geomIndex];
+    for (uint32_t primIdx = 0; primIdx < slot.geom.numTriangles; ++primIdx) {
+        if (slot.leafIndices[primIdx] != UINT32_MAX)
+            removePrimitive(geomIndex, primIdx);
+    }
+    slot.leafIndices.clear();
+    slot.leafIndices.shrink_to_fit();
+    slot.isUsed = false;
+    m_freeGeomSlotIndices.push_back(geomIndex);
+}
 
-                //#pragma unroll
-                for (uint32_t slot = 0; slot < arity; ++slot)
-                    leafOffsets[slot] = intNode.childMetas[slot].getLeafOffset();
+void DynamicGeometryBVH::insertPrimitive(const uint32_t geomIndex, const uint32_t primIndex) {
+    Assert_Release(geomIndex < m_geomSlots.size() && m_geomSlots[geomIndex].isUsed, "Invalid geometry index.");
+    GeometrySlot &slot = m_geomSlots[geomIndex];
+    Assert_Release(primIndex < slot.geom.numTriangles, "Invalid primitive index.");
+    Assert_Release(slot.leafIndices[primIndex] == UINT32_MAX, "The primitive is already in the BVH.");
+
+    Point3D pA, pB, pC;
+    calcTriangleVertices(slot.geom, primIndex, &pA, &pB, &pC);
+
+    const uint32_t leafIdx = allocateNode();
+    const uint32_t newParentIdx = allocateNode();
+    Node &leaf = m_nodes[leafIdx];
+    leaf.aabb = AABB();
+    leaf.aabb.unify(pA).unify(pB).unify(pC);
+    leaf.parentIndex = UINT32_MAX;
+    leaf.childIndices[0] = UINT32_MAX;
+    leaf.childIndices[1] = UINT32_MAX;
+    leaf.geomIndex = geomIndex;
+    leaf.primIndex = primIndex;
+    insertNode(leafIdx, newParentIdx);
+
+    slot.leafIndices[primIndex] = leafIdx;
+    ++m_numPrims;
+    countMutation();
+}
 
-                if (debugPrint) {
-                    hpprintf("  Order (Leaf): [");
-                    for (uint32_t i = 0; i < curTriGroup.numItems; ++i)
-                        hpprintf(
-                            "%u%s",
-                            (curTriGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
-                            i + 1 < curTriGroup.numItems ? ", " : "");
-                    hpprintf("]\n");
-                }
-            }
+void DynamicGeometryBVH::removePrimitive(const uint32_t geomIndex, const uint32_t primIndex) {
+    Assert_Release(geomIndex < m_geomSlots.size() && m_geomSlots[geomIndex].isUsed, "Invalid geometry index.");
+    GeometrySlot &slot = m_geomSlots[geomIndex];
+    Assert_Release(primIndex < slot.geom.numTriangles, "Invalid primitive index.");
+    const uint32_t leafIdx = slot.leafIndices[primIndex];
+    Assert_Release(leafIdx != UINT32_MAX, "The primitive isn't in the BVH.");
+
+    if (leafIdx == m_rootIndex)
+        m_rootIndex = UINT32_MAX;
+    else
+        freeNode(detachNode(leafIdx));
+    freeNode(leafIdx);
+
+    slot.leafIndices[primIndex] = UINT32_MAX;
+    --m_numPrims;
+    countMutation();
+}
 
-            // Create a node group if any internal node child hit.
-            if (numIntHits > 0) {
-                if (curGroup.numItems > 0)
-                    push();
+void DynamicGeometryBVH::updatePrimitive(const uint32_t geomIndex, const uint32_t primIndex) {
+    Assert_Release(geomIndex < m_geomSlots.size() && m_geomSlots[geomIndex].isUsed, "Invalid geometry index.");
+    GeometrySlot &slot = m_geomSlots[geomIndex];
+    Assert_Release(primIndex < slot.geom.numTriangles, "Invalid primitive index.");
+    const uint32_t leafIdx = slot.leafIndices[primIndex];
+    Assert_Release(leafIdx != UINT32_MAX, "The primitive isn't in the BVH.");
 
-                curGroup.numItems = numIntHits;
-                curGroup.baseIndex = intNode.intNodeChildBaseIndex;
-                curGroup.isLeafGroup = false;
-                curGroup.orderInfo = orderInfo >> (orderBitWidth * numLeafHits);
+    Point3D pA, pB, pC;
+    calcTriangleVertices(slot.geom, primIndex, &pA, &pB, &pC);
+    AABB aabb;
+    aabb.unify(pA).unify(pB).unify(pC);
 
-                if (debugPrint) {
-                    hpprintf("  Order (Int): [");
-                    for (uint32_t i = 0; i < curGroup.numItems; ++i)
-                        hpprintf(
-                            "%u th%s",
-                            (curGroup.orderInfo >> (orderBitWidth * i)) & orderMask,
-                            i + 1 < curGroup.numItems ? ", " : "");
-                    hpprintf("]\n");
-                }
-            }
-        }
+    // EN: Reinsert the leaf since the old location may be far from optimal for the new box.
+    m_nodes[leafIdx].aabb = aabb;
+    if (leafIdx != m_rootIndex)
+        insertNode(leafIdx, detachNode(leafIdx));
+}
 
-        // Intersect a triangle.
-        // TODO: Loop over a primitive chain and dynamic postponing for better SIMD utilization (on GPU).
-        if (curTriGroup.numItems > 0) {
-            const uint32_t slot = curTriGroup.orderInfo & orderMask;
-            const uint32_t primRefIdx = curTriGroup.baseIndex + leafOffsets[slot]++;
-            if (stats)
-                ++stats->numTriTests;
-            const shared::PrimitiveReference primRef = bvh.primRefs[primRefIdx];
-            const TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
-            float hitDist;
-            float hitBcB, hitBcC;
-            Normal3D hitNormal;
-            const bool hit = testRayVsTriangle(
-                rayOrg, rayDir, distMin, ret.dist,
-                triStorage.pA, triStorage.pB, triStorage.pC,
-                &hitDist, &hitNormal, &hitBcB, &hitBcC);
-            if (hit) {
-                ret.dist = hitDist;
-                ret.geomIndex = triStorage.geomIndex;
-                ret.primIndex = triStorage.primIndex;
-                ret.bcA = 1.0f - (hitBcB + hitBcC);
-                ret.bcB = hitBcB;
-                ret.bcC = hitBcC;
-            }
-            if (primRef.isLeafEnd) {
-                curTriGroup.orderInfo >>= orderBitWidth;
-                --curTriGroup.numItems;
-            }
-            if (debugPrint)
-                hpprintf(
-                    "Leaf %u: tri %u: %s (%g)\n",
-                    primRefIdx, primRef.storageIndex, hit ? "hit" : "miss",
-                    hit ? ret.dist : INFINITY);
+uint32_t DynamicGeometryBVH::optimize(const uint32_t maxNumReinsertions) {
+    m_numMutationsSinceOptimization = 0;
+    if (m_rootIndex == UINT32_MAX || m_nodes[m_rootIndex].isLeaf())
+        return 0;
+
+    // EN: Inefficiency of a node is the product of its area and the ratios of its area to the minimum and
+    //     the sum of the child areas. Nodes with a large box poorly fitting their children come first.
+    using Candidate = std::pair<double, uint32_t>;
+    std::vector<Candidate> candidates;
+    for (uint32_t nodeIdx = 0; nodeIdx < m_nodes.size(); ++nodeIdx) {
+        const Node &node = m_nodes[nodeIdx];
+        if (node.isLeaf() || nodeIdx == m_rootIndex)
+            continue;
+        const double area = node.aabb.calcHalfSurfaceArea();
+        const double areaA = m_nodes[node.childIndices[0]].aabb.calcHalfSurfaceArea();
+        const double areaB = m_nodes[node.childIndices[1]].aabb.calcHalfSurfaceArea();
+        const double minArea = std::max(std::min(areaA, areaB), 1e-20);
+        const double sumArea = std::max(areaA + areaB, 1e-20);
+        candidates.emplace_back(area * area / minArea * area / sumArea, nodeIdx);
+    }
+    const uint32_t numReinsertions = std::min(maxNumReinsertions, static_cast<uint32_t>(candidates.size()));
+    std::partial_sort(
+        candidates.begin(), candidates.begin() + numReinsertions, candidates.end(),
+        std::greater<Candidate>());
+
+    // EN: Remove each node with its parent and reinsert the two children reusing the two nodes as new parents.
+    //     Nodes of later candidates may have been moved or recycled by earlier reinsertions,
+    //     which is harmless as long as they are still internal nodes other than the root.
+    uint32_t numReinserted = 0;
+    for (uint32_t i = 0; i < numReinsertions; ++i) {
+        const uint32_t nodeIdx = candidates[i].second;
+        const Node &node = m_nodes[nodeIdx];
+        if (node.isLeaf() || node.geomIndex != UINT32_MAX || nodeIdx == m_rootIndex)
+            continue;
+        const uint32_t childIdxA = node.childIndices[0];
+        const uint32_t childIdxB = node.childIndices[1];
+        const uint32_t parentIdx = detachNode(nodeIdx);
+        insertNode(childIdxA, nodeIdx);
+        insertNode(childIdxB, parentIdx);
+        ++numReinserted;
+    }
 
-            if (curTriGroup.numItems > 0) {
-                if (curGroup.numItems > 0)
-                    push();
-                curGroup = curTriGroup;
-            }
+    return numReinserted;
+}
+
+float DynamicGeometryBVH::calcSahCost() const {
+    if (m_rootIndex == UINT32_MAX)
+        return 0.0f;
+
+    float cost = 0.0f;
+    std::vector<uint32_t> stack;
+    stack.push_back(m_rootIndex);
+    while (!stack.empty()) {
+        const Node &node = m_nodes[stack.back()];
+        stack.pop_back();
+        if (node.isLeaf()) {
+            cost += node.aabb.calcHalfSurfaceArea() * m_config.primIntersectCost;
+            continue;
         }
+        cost += node.aabb.calcHalfSurfaceArea() * m_config.intNodeTravCost;
+        stack.push_back(node.childIndices[0]);
+        stack.push_back(node.childIndices[1]);
     }
-#else
-    union Entry {
-        struct {
-            uint32_t index : 31;
-            uint32_t isLeaf : 1;
-        };
-        uint32_t asUInt;
-    };
 
-    Entry stack[64];
-    int32_t stackIdx = 0;
-    Entry curEntry = { 0, 0 };
-    while (true) {
-        if (curEntry.asUInt == UINT32_MAX) {
-            if (stackIdx == 0)
-                break;
-            curEntry = stack[--stackIdx];
-            if (stats) {
-                sumStackAccessDepth += stackIdx;
-                ++numStackAccesses;
-                if (stackIdx > fastStackDepthLimit)
-                    stackMemoryAccessAmount += sizeof(Entry);
-            }
-            if (debugPrint)
-                hpprintf("Pop (%u)\n", stackIdx);
-        }
+    return cost / m_nodes[m_rootIndex].aabb.calcHalfSurfaceArea();
+}
 
-        ++numIterations;
+static inline bool testRayVsAabb(
+    const Point3D &rayOrg, const Vector3D &invRayDir, const float distMin, const float distMax,
+    const AABB &aabb, float* const hitDistMin) {
+    const float tx0 = (aabb.minP.x - rayOrg.x) * invRayDir.x;
+    const float tx1 = (aabb.maxP.x - rayOrg.x) * invRayDir.x;
+    const float ty0 = (aabb.minP.y - rayOrg.y) * invRayDir.y;
+    const float ty1 = (aabb.maxP.y - rayOrg.y) * invRayDir.y;
+    const float tz0 = (aabb.minP.z - rayOrg.z) * invRayDir.z;
+    const float tz1 = (aabb.maxP.z - rayOrg.z) * invRayDir.z;
+    *hitDistMin = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), distMin });
+    const float hitDistMax = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1), distMax });
+    return *hitDistMin <= hitDistMax;
+}
 
-        if (curEntry.isLeaf) {
+shared::HitObject DynamicGeometryBVH::traverse(
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats) const {
+    shared::HitObject ret = makeMissHitObject(distMax);
+    if (m_rootIndex == UINT32_MAX)
+        return ret;
+
+    const Vector3D invRayDir = 1.0f / rayDir;
+    float rootHitDist;
+    if (stats)
+        ++stats->numAabbTests;
+    if (!testRayVsAabb(rayOrg, invRayDir, distMin, distMax, m_nodes[m_rootIndex].aabb, &rootHitDist))
+        return ret;
+
+    // EN: The tree depth isn't bounded, so the stack is a vector reused by each thread.
+    thread_local std::vector<std::pair<float, uint32_t>> stack;
+    stack.clear();
+    stack.emplace_back(rootHitDist, m_rootIndex);
+    while (!stack.empty()) {
+        const auto [hitDistMin, nodeIdx] = stack.back();
+        stack.pop_back();
+        if (hitDistMin >= ret.dist)
+            continue;
+
+        const Node &node = m_nodes[nodeIdx];
+        if (node.isLeaf()) {
+            Point3D pA, pB, pC;
+            calcTriangleVertices(m_geomSlots[node.geomIndex].geom, node.primIndex, &pA, &pB, &pC);
             if (stats)
                 ++stats->numTriTests;
-            const shared::PrimitiveReference primRef = bvh.primRefs[curEntry.index];
-            const TriangleStorage &triStorage = bvh.triStorages[primRef.storageIndex];
             float hitDist;
             float hitBcB, hitBcC;
             Normal3D hitNormal;
-            const bool hit = testRayVsTriangle(
+            if (testRayVsTriangle(
                 rayOrg, rayDir, distMin, ret.dist,
-                triStorage.pA, triStorage.pB, triStorage.pC,
-                &hitDist, &hitNormal, &hitBcB, &hitBcC);
-            if (hit) {
+                pA, pB, pC,
+                &hitDist, &hitNormal, &hitBcB, &hitBcC)) {
                 ret.dist = hitDist;
-                ret.geomIndex = triStorage.geomIndex;
-                ret.primIndex = triStorage.primIndex;
+                ret.geomIndex = node.geomIndex;
+                ret.primIndex = node.primIndex;
                 ret.bcA = 1.0f - (hitBcB + hitBcC);
                 ret.bcB = hitBcB;
                 ret.bcC = hitBcC;
             }
-            if (debugPrint)
-                hpprintf(
-                    "Leaf %u: tri %u: %s (%g)\n",
-                    curEntry.index, primRef.storageIndex, hit ? "hit" : "miss",
-                    hit ? ret.dist : INFINITY);
-            if (primRef.isLeafEnd)
-                curEntry.asUInt = UINT32_MAX;
-            else
-                ++curEntry.index;
             continue;
         }
 
-        const InternalNode &intNode = bvh.intNodes[curEntry.index];
-        if (debugPrint)
-            hpprintf(
-                "Int %u: %u, %u\n",
-                curEntry.index, intNode.intNodeChildBaseIndex, intNode.leafBaseIndex);
+        // EN: Push the farther child first to visit the nearer one next.
+        float childHitDists[2];
+        bool childHits[2];
+        for (uint32_t slot = 0; slot < 2; ++slot) {
+            childHits[slot] = testRayVsAabb(
+                rayOrg, invRayDir, distMin, ret.dist,
+                m_nodes[node.childIndices[slot]].aabb, &childHitDists[slot]);
+        }
+        if (stats)
+            stats->numAabbTests += 2;
+        const uint32_t nearSlot = childHits[0] && childHits[1] && childHitDists[1] < childHitDists[0] ? 1 : 0;
+        for (uint32_t i = 0; i < 2; ++i) {
+            const uint32_t slot = i == 0 ? 1 - nearSlot : nearSlot;
+            if (childHits[slot])
+                stack.emplace_back(childHitDists[slot], node.childIndices[slot]);
+        }
+        if (stats)
+            stats->maxStackDepth = std::max(static_cast<int32_t>(stack.size()), stats->maxStackDepth);
+    }
 
-        uint32_t keys[arity];
-        Entry entries[arity];
-        uint32_t numHits = 0;
-        for (uint32_t slot = 0; slot < arity; ++slot) {
-            if (!intNode.getChildIsValid(slot)) {
-                for (; slot < arity; ++slot)
-                    keys[slot] = floatToOrderedUInt(INFINITY);
-                break;
-            }
+    return ret;
+}
 
-            if (stats)
-                ++stats->numAabbTests;
-            const AABB &aabb = intNode.getChildAabb(slot);
-            float hitDistMin, hitDistMax;
-            if (aabb.intersect(rayOrg, rayDir, distMin, ret.dist, &hitDistMin, &hitDistMax)) {
-                Entry entry;
-                entry.isLeaf = intNode.getChildIsLeaf(slot);
-                const float dist = 0.5f * (hitDistMin + hitDistMax);
-                if (entry.isLeaf) {
-                    entry.index = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
-                    if (debugPrint)
-                        hpprintf("  %u: %g, leaf\n", slot, dist);
-                }
-                else {
-                    const uint32_t nthIntChild = intNode.getInternalChildNumber(slot);
-                    entry.index = intNode.intNodeChildBaseIndex + nthIntChild;
-                    if (debugPrint)
-                        hpprintf("  %u: %g, %u th int child\n", slot, dist, nthIntChild);
-                }
-                entries[slot] = entry;
-                keys[slot] = (floatToOrderedUInt(dist) >> 1) | (!entry.isLeaf << 31);
-                ++numHits;
-            }
-            else {
-                keys[slot] = floatToOrderedUInt(INFINITY);
-            }
-        }
 
-        curEntry.asUInt = UINT32_MAX;
-        if (numHits > 0) {
-            sort(keys, entries);
-            for (uint32_t i = numHits - 1; i > 0; --i) {
-                if (stats) {
-                    sumStackAccessDepth += stackIdx;
-                    ++numStackAccesses;
-                    if (stackIdx > fastStackDepthLimit)
-                        stackMemoryAccessAmount += sizeof(Entry);
+
+static inline uint32_t calcMortonCode2D(const uint32_t x, const uint32_t y) {
+    const auto expandBits = [](uint32_t v) {
+        v &= 0x0000'FFFF;
+        v = (v | (v << 8)) & 0x00FF'00FF;
+        v = (v | (v << 4)) & 0x0F0F'0F0F;
+        v = (v | (v << 2)) & 0x3333'3333;
+        v = (v | (v << 1)) & 0x5555'5555;
+        return v;
+    };
+    return (expandBits(y) << 1) | expandBits(x);
+}
+
+template <uint32_t arity>
+void renderTiled(
+    const GeometryBVH<arity> &bvh, const TiledRenderConfig &config,
+    TiledRenderStatistics* const stats) {
+    Assert_Release(config.generateRay && config.shadePixel, "Ray generation and shading functions must be set.");
+
+    const uint32_t tileSize = config.tileSize > 0 ? config.tileSize : 16;
+    const uint32_t numTilesX = (config.width + tileSize - 1) / tileSize;
+    const uint32_t numTilesY = (config.height + tileSize - 1) / tileSize;
+    const uint32_t numTiles = numTilesX * numTilesY;
+    Assert_Release(numTilesX <= (1 << 16) && numTilesY <= (1 << 16), "Too many tiles.");
+
+    std::vector<uint32_t> tileOrder(numTiles);
+    std::vector<uint32_t> tileMortonCodes(numTiles);
+    for (uint32_t tileIdx = 0; tileIdx < numTiles; ++tileIdx) {
+        tileOrder[tileIdx] = tileIdx;
+        tileMortonCodes[tileIdx] = calcMortonCode2D(tileIdx % numTilesX, tileIdx / numTilesX);
+    }
+    std::sort(
+        tileOrder.begin(), tileOrder.end(),
+        [&tileMortonCodes](const uint32_t a, const uint32_t b) {
+            return tileMortonCodes[a] < tileMortonCodes[b];
+        });
+
+    std::unique_ptr<ThreadPool> threadPoolHolder;
+    ThreadPool* threadPool = nullptr;
+    if (config.numThreads != 1) {
+        threadPoolHolder = std::make_unique<ThreadPool>(config.numThreads);
+        if (threadPoolHolder->getNumThreads() > 1)
+            threadPool = threadPoolHolder.get();
+    }
+
+    // EN: Each tile is written by a single thread, so no synchronization is needed until the merge.
+    std::vector<TiledRenderStatistics> tileStats(stats ? numTiles : 0);
+    std::mutex progressMutex;
+    uint32_t numFinishedTiles = 0;
+    parallelFor(
+        threadPool, 0, numTiles, 1,
+        [&](const uint32_t orderBegin, const uint32_t orderEnd) {
+        for (uint32_t orderIdx = orderBegin; orderIdx < orderEnd; ++orderIdx) {
+            const uint32_t tileIdx = tileOrder[orderIdx];
+            RenderTile tile;
+            tile.x = tileIdx % numTilesX * tileSize;
+            tile.y = tileIdx / numTilesX * tileSize;
+            tile.width = std::min(tileSize, config.width - tile.x);
+            tile.height = std::min(tileSize, config.height - tile.y);
+
+            TiledRenderStatistics curTileStats = {};
+            curTileStats.maxMaxStackDepth = -1;
+            curTileStats.maxAvgStackAccessDepth = -INFINITY;
+            for (uint32_t py = tile.y; py < tile.y + tile.height; ++py) {
+                for (uint32_t px = tile.x; px < tile.x + tile.width; ++px) {
+                    const Ray ray = config.generateRay(px, py);
+                    TraversalStatistics travStats = {};
+                    travStats.fastStackDepthLimit = config.fastStackDepthLimit;
+                    const shared::HitObject hitObj = traverse(
+                        bvh, ray.org, ray.dir, ray.distMin, ray.distMax,
+                        stats ? &travStats : nullptr);
+                    config.shadePixel(px, py, ray, hitObj, travStats);
+
+                    if (stats) {
+                        ++curTileStats.numRays;
+                        curTileStats.numHits += hitObj.isHit();
+                        curTileStats.numAabbTests += travStats.numAabbTests;
+                        curTileStats.numTriTests += travStats.numTriTests;
+                        curTileStats.sumMaxStackDepth += travStats.maxStackDepth;
+                        curTileStats.maxMaxStackDepth =
+                            std::max(travStats.maxStackDepth, curTileStats.maxMaxStackDepth);
+                        curTileStats.sumAvgStackAccessDepth += travStats.avgStackAccessDepth;
+                        curTileStats.maxAvgStackAccessDepth =
+                            std::max(travStats.avgStackAccessDepth, curTileStats.maxAvgStackAccessDepth);
+                        curTileStats.stackMemoryAccessAmount += travStats.stackMemoryAccessAmount;
+                    }
                 }
-                stack[stackIdx++] = entries[i];
-                if (debugPrint)
-                    hpprintf("Push (%u)\n", stackIdx);
             }
             if (stats)
-                maxStackDepth = std::max(stackIdx - 1, maxStackDepth);
-            curEntry = entries[0];
+                tileStats[tileIdx] = curTileStats;
+
+            if (config.onTileFinished) {
+                std::lock_guard<std::mutex> lock(progressMutex);
+                ++numFinishedTiles;
+                config.onTileFinished(tile, numFinishedTiles, numTiles);
+            }
         }
-    }
-#endif
+    });
 
     if (stats) {
-        stats->avgStackAccessDepth = numStackAccesses > 0 ?
-            static_cast<float>(sumStackAccessDepth / numStackAccesses) : 0.0f;
-        stats->maxStackDepth = maxStackDepth;
-        stats->stackMemoryAccessAmount = stackMemoryAccessAmount;
+        *stats = {};
+        stats->maxMaxStackDepth = -1;
+        stats->maxAvgStackAccessDepth = -INFINITY;
+        for (const TiledRenderStatistics &curTileStats : tileStats) {
+            stats->numRays += curTileStats.numRays;
+            stats->numHits += curTileStats.numHits;
+            stats->numAabbTests += curTileStats.numAabbTests;
+            stats->numTriTests += curTileStats.numTriTests;
+            stats->sumMaxStackDepth += curTileStats.sumMaxStackDepth;
+            stats->maxMaxStackDepth = std::max(curTileStats.maxMaxStackDepth, stats->maxMaxStackDepth);
+            stats->sumAvgStackAccessDepth += curTileStats.sumAvgStackAccessDepth;
+            stats->maxAvgStackAccessDepth =
+                std::max(curTileStats.maxAvgStackAccessDepth, stats->maxAvgStackAccessDepth);
+            stats->stackMemoryAccessAmount += curTileStats.stackMemoryAccessAmount;
+        }
     }
-
-    return ret;
-}
-
-// Workaround for Intellisense.
-// https://developercommunity.visualstudio.com/t/The-provide-sample-template-arguments-f/10564187
-template <uint32_t arity>
-shared::HitObject traverse(
-    const GeometryBVH<arity> &bvh,
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    TraversalStatistics* const stats, const bool debugPrint) {
-    return __traverse(
-        bvh,
-        rayOrg, rayDir, distMin, distMax,
-        stats, debugPrint);
 }
 
-template shared::HitObject traverse<2>(
-    const GeometryBVH<2> &bvh,
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    TraversalStatistics* const stats, const bool debugPrint);
-template shared::HitObject traverse<4>(
-    const GeometryBVH<4> &bvh,
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    TraversalStatistics* const stats, const bool debugPrint);
-template shared::HitObject traverse<8>(
-    const GeometryBVH<8> &bvh,
-    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
-    TraversalStatistics* const stats, const bool debugPrint);
+template void renderTiled<2>(
+    const GeometryBVH<2> &bvh, const TiledRenderConfig &config,
+    TiledRenderStatistics* const stats);
+template void renderTiled<4>(
+    const GeometryBVH<4> &bvh, const TiledRenderConfig &config,
+    TiledRenderStatistics* const stats);
+template void renderTiled<8>(
+    const GeometryBVH<8> &bvh, const TiledRenderConfig &config,
+    TiledRenderStatistics* const stats);
 
 }
@@ -1,9 +1,42 @@
 #pragma once
 
 #include "common_shared.h"
+#include "mapped_file.h"
+#include <span>
+#include <filesystem>
+#include <functional>
 
 namespace bvh {
 
+// EN: Representation of leaf triangles used by the CPU traversal in addition to the raw triStorages.
+enum class LeafTriangleFormat {
+    // EN: Raw vertices only. The compact default.
+    Raw = 0,
+    // EN: Woop's unit triangle transform precomputed per primitive reference (+48 B per reference).
+    //     Saves the edge setup of each test.
+    Woop,
+    // EN: Woop transforms of each leaf packed into 4 or 8-wide SoA blocks aligned to cache lines
+    //     (+256 B / +448 B per block and 4 B per reference), each block is tested by one SIMD kernel.
+    //     Empty lanes of the last block of a leaf are wasted, so this pays off with large leaves.
+    WoopSoA4,
+    WoopSoA8,
+};
+
+// EN: Rows of the affine transform into the space where the triangle is pA + x * (pB - pA) + y * (pC - pA)
+//     and z is the distance along the normal, giving bcB, bcC and the plane distance.
+struct WoopTriangle {
+    float rows[3][4];
+};
+static_assert(sizeof(WoopTriangle) == 48, "Unexpected sizeof(WoopTriangle)");
+
+template <uint32_t width>
+struct alignas(64) WoopTriangleBlock {
+    float rows[3][4][width];
+    uint32_t storageIndices[width];
+    uint32_t numTriangles : 31;
+    uint32_t isLeafEnd : 1;
+};
+
 template <uint32_t arity>
 struct GeometryBVH {
     std::vector<shared::InternalNode_T<arity>> intNodes;
@@ -12,6 +45,18 @@ struct GeometryBVH {
     std::vector<shared::ParentPointer> parentPointers;
     uint32_t numGeoms;
     uint32_t totalNumPrims;
+    // EN: Normalized SAH cost right after the build, used to measure degradation by refitting.
+    float sahCostAtBuild;
+
+    // EN: Optional precomputed leaf triangles, see precomputeLeafTriangles().
+    LeafTriangleFormat leafTriangleFormat = LeafTriangleFormat::Raw;
+    // EN: Per primitive reference for LeafTriangleFormat::Woop.
+    std::vector<WoopTriangle> woopTris;
+    // EN: For the SoA formats. The blocks of a leaf are contiguous and the first block is given by
+    //     leafTriBlockIndices at the index of the first primitive reference of the leaf.
+    std::vector<WoopTriangleBlock<4>> woopTriBlocks4;
+    std::vector<WoopTriangleBlock<8>> woopTriBlocks8;
+    std::vector<uint32_t> leafTriBlockIndices;
 };
 
 enum class VertexFormat {
@@ -35,19 +80,226 @@ struct Geometry {
     Matrix4x4 preTransform;
 };
 
+enum class GeometryBVHBuilder {
+    // EN: Top-down SAH builder with spatial splits (governed by splittingBudget).
+    SBVH = 0,
+    // EN: Linear BVH built from sorted Morton codes. Much faster to build but lower quality.
+    //     splittingBudget is ignored.
+    LBVH,
+    // EN: Bottom-up builder by parallel locally-ordered clustering.
+    //     Quality is close to SBVH without spatial splits at a fraction of the build time.
+    //     splittingBudget is ignored.
+    PLOC,
+};
+
 struct GeometryBVHBuildConfig {
     float splittingBudget;
     float intNodeTravCost;
     float primIntersectCost;
     uint32_t minNumPrimsPerLeaf;
     uint32_t maxNumPrimsPerLeaf;
+    // EN: Number of threads used for the build including the calling thread.
+    //     0 means the number of hardware threads. The result doesn't depend on this value.
+    uint32_t numThreads;
+    GeometryBVHBuilder builder;
+    // EN: Number of treelet restructuring passes applied to the intermediate binary tree of the bottom-up builders
+    //     (LBVH and PLOC). 0 disables it. More passes improve the quality at the cost of build time.
+    uint32_t numTreeletOptimizationPasses;
+    // EN: Doesn't affect the tree, so this is not part of the config hash.
+    LeafTriangleFormat leafTriangleFormat;
+};
+
+// EN: Memory used by a build in bytes, covering the builder's large arrays and the output BVH
+//     but not the input geometries.
+struct BuildMemoryStatistics {
+    size_t peakMemorySize;
+    size_t outputMemorySize;
 };
 
 template <uint32_t arity>
 void buildGeometryBVH(
+    const Geometry* const geoms, const uint32_t numGeoms,
+    const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh,
+    BuildMemoryStatistics* const memStats = nullptr);
+
+// EN: SAH cost of a built BVH normalized by the surface area of the root.
+//     This allows comparing the quality of BVHs made by different builders.
+template <uint32_t arity>
+float calcSahCost(
+    const GeometryBVH<arity> &bvh, const float intNodeTravCost, const float primIntersectCost);
+
+// EN: Refit the BVH to deformed geometries with the same topology as the ones used for the build.
+//     The tree structure is kept and only triangle vertices and node boxes are updated.
+//     Returns the ratio of the SAH cost to the one right after the build,
+//     a large value means that a full rebuild is worth it.
+template <uint32_t arity>
+float refitGeometryBVH(
     const Geometry* const geoms, const uint32_t numGeoms,
     const GeometryBVHBuildConfig &config, GeometryBVH<arity>* const bvh);
 
+// EN: (Re)compute the precomputed leaf triangles of the given format from the raw triangle storages.
+//     The build and refitting do this by themselves. The BVH cache stores the raw format only,
+//     so call this after copying a cached BVH.
+template <uint32_t arity>
+void precomputeLeafTriangles(const LeafTriangleFormat format, GeometryBVH<arity>* const bvh);
+
+enum class NodeOrder {
+    // EN: Depth-first layout descending into the child with the larger subtree first.
+    SubtreeSize = 0,
+    // EN: Depth-first layout descending into the more frequently visited child first,
+    //     using per-node visit counts measured by traversal (TraversalStatistics::intNodeAccessCounts).
+    AccessFrequency,
+};
+
+// EN: Post-pass to reorder the internal nodes for cache locality while keeping each sibling block contiguous.
+//     Primitive references follow the new node order and triangle storages follow their first reference.
+//     Nodes are indexed by the old order in intNodeAccessCounts.
+//     Instance BVHs refer to node indices of the BLAS, so reorder a BVH before building instance BVHs on top of it.
+template <uint32_t arity>
+void reorderGeometryBVH(
+    const NodeOrder order, const uint32_t* const intNodeAccessCounts, GeometryBVH<arity>* const bvh);
+
+struct GeometryBVHAnalysis {
+    uint32_t arity;
+    uint32_t numIntNodes;
+    uint32_t numLeaves;
+    uint32_t numPrimRefs;
+    uint32_t numTriStorages;
+    // EN: Costs normalized by the root surface area. The exact variant uses unquantized boxes,
+    //     so the difference is the cost of the 8-bit quantization.
+    float sahCost;
+    float sahCostExact;
+    // EN: End-point overlap: cost weighted surface area of triangles (clipped by their leaf boxes)
+    //     inside boxes of nodes they don't belong to, normalized by the total triangle area.
+    float epo;
+    // EN: numPrimRefs / numTriStorages, duplication by spatial splits.
+    float splitDuplicationRatio;
+    // EN: Ratio of the surface area of quantized child boxes to the exact ones minus 1.
+    float avgQuantizationAreaOverhead;
+    float maxQuantizationAreaOverhead;
+    // EN: Indexed by the number of primitive references in a leaf.
+    std::vector<uint32_t> leafSizeHistogram;
+    // EN: Indexed by depth, the root is at depth 0 and a leaf child of the root at depth 1.
+    std::vector<uint32_t> leafDepthHistogram;
+    std::vector<uint32_t> intNodeDepthHistogram;
+    size_t intNodesMemorySize;
+    size_t triStoragesMemorySize;
+    size_t primRefsMemorySize;
+    size_t parentPointersMemorySize;
+    size_t leafTrianglesMemorySize;
+};
+
+// EN: Analyze the quality of a built BVH. The costs are taken from the config.
+//     EPO queries the BVH itself for each node and takes a while for large BVHs.
+template <uint32_t arity>
+GeometryBVHAnalysis analyze(const GeometryBVH<arity> &bvh, const GeometryBVHBuildConfig &config);
+
+// EN: Machine-readable report of the analysis together with the build config.
+std::string toJson(const GeometryBVHAnalysis &analysis, const GeometryBVHBuildConfig &config);
+
+
+
+// EN: Read-only view of a GeometryBVH, either built in memory or mapped from a cache file.
+template <uint32_t arity>
+struct GeometryBVHView {
+    std::span<const shared::InternalNode_T<arity>> intNodes;
+    std::span<const shared::TriangleStorage> triStorages;
+    std::span<const shared::PrimitiveReference> primRefs;
+    std::span<const shared::ParentPointer> parentPointers;
+    uint32_t numGeoms;
+    uint32_t totalNumPrims;
+    float sahCostAtBuild;
+
+    GeometryBVHView() : numGeoms(0), totalNumPrims(0), sahCostAtBuild(0.0f) {}
+    GeometryBVHView(const GeometryBVH<arity> &bvh) :
+        intNodes(bvh.intNodes), triStorages(bvh.triStorages),
+        primRefs(bvh.primRefs), parentPointers(bvh.parentPointers),
+        numGeoms(bvh.numGeoms), totalNumPrims(bvh.totalNumPrims),
+        sahCostAtBuild(bvh.sahCostAtBuild) {}
+};
+
+// EN: Hashes to validate a BVH cache file.
+//     The config hash doesn't include numThreads since the result doesn't depend on it.
+inline uint64_t calcHash(const void* const data, const size_t size, const uint64_t seed = 0xCBF2'9CE4'8422'2325) {
+    // EN: FNV-1a
+    const uint8_t* const bytes = reinterpret_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x0000'0100'0000'01B3;
+    }
+    return hash;
+}
+uint64_t calcFileHash(const std::filesystem::path &filePath);
+uint64_t calcConfigHash(const GeometryBVHBuildConfig &config);
+
+// EN: Write a BVH into a versioned binary cache file with the hashes of the build config and the source.
+template <uint32_t arity>
+bool writeGeometryBVHCache(
+    const std::filesystem::path &filePath, const GeometryBVH<arity> &bvh,
+    const uint64_t configHash, const uint64_t sourceHash);
+
+// EN: BVH cache file mapped into memory. The view refers to the mapped file directly without copying.
+template <uint32_t arity>
+class MappedGeometryBVH {
+    MappedFile m_file;
+    GeometryBVHView<arity> m_view;
+
+public:
+    MappedGeometryBVH() {}
+    MappedGeometryBVH(const MappedGeometryBVH &) = delete;
+    MappedGeometryBVH &operator=(const MappedGeometryBVH &) = delete;
+    MappedGeometryBVH(MappedGeometryBVH &&b) noexcept :
+        m_file(std::move(b.m_file)), m_view(b.m_view) {
+        b.m_view = {};
+    }
+    MappedGeometryBVH &operator=(MappedGeometryBVH &&b) noexcept {
+        m_file = std::move(b.m_file);
+        m_view = b.m_view;
+        b.m_view = {};
+        return *this;
+    }
+
+    // EN: Returns false when the file doesn't exist, is broken or doesn't match the given hashes.
+    bool open(const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash);
+
+    bool isValid() const {
+        return m_file.getData() != nullptr;
+    }
+    const GeometryBVHView<arity> &getView() const {
+        return m_view;
+    }
+};
+
+// EN: Source of the triangles for the out-of-core build, read twice from the beginning.
+//     readTriangles fills up to maxNumTriangles storages (vertices, geomIndex and primIndex)
+//     and returns the number of filled ones, 0 at the end of the source.
+struct TriangleStream {
+    std::function<uint32_t(shared::TriangleStorage* triStorages, uint32_t maxNumTriangles)> readTriangles;
+    std::function<void()> rewind;
+};
+
+struct OutOfCoreBuildConfig {
+    // EN: Config of the in-memory build of each cluster. numThreads and leafTriangleFormat are ignored.
+    GeometryBVHBuildConfig clusterBuildConfig;
+    // EN: Directory for the spilled clusters and sections, the files are removed after the build.
+    std::filesystem::path tempDirectory;
+    // EN: Upper bound of the number of triangles in a cluster, which bounds the memory of a cluster build.
+    uint32_t maxNumTrianglesPerCluster;
+    // EN: Number of clusters built in parallel. 0 means the number of hardware threads.
+    uint32_t numThreads;
+};
+
+// EN: Build a BVH of a mesh larger than the memory directly into a cache file, open it by MappedGeometryBVH.
+//     Triangle centroids are binned into spatial clusters spilled to the temporary directory,
+//     the clusters are built in memory in parallel and combined under a top-level tree.
+//     The quality is slightly lower than an in-memory build since the top levels are split by the clusters.
+//     Returns false when the source is empty or a file can't be written.
+template <uint32_t arity>
+bool buildGeometryBVHOutOfCore(
+    const TriangleStream &stream, const OutOfCoreBuildConfig &config,
+    const std::filesystem::path &filePath, const uint64_t configHash, const uint64_t sourceHash);
+
 
 
 template <uint32_t arity>
@@ -65,14 +317,19 @@ struct Instance {
     uint32_t userData;
 };
 
+// EN: Each instance refers to a GeometryBVH with the same arity via bvhAddress.
+//     rebraidingBudget is the ratio of additional instance references against the number of instances,
+//     used to open BLAS nodes of large (likely overlapping) instances into their children.
 struct InstanceBVHBuildConfig {
     float rebraidingBudget;
+    uint32_t numThreads;
 };
 
 template <uint32_t arity>
 void buildInstanceBVH(
     const Instance* const insts, const uint32_t numInsts,
-    const InstanceBVHBuildConfig &config, InstanceBVH<arity>* const bvh);
+    const InstanceBVHBuildConfig &config, InstanceBVH<arity>* const bvh,
+    BuildMemoryStatistics* const memStats = nullptr);
 
 
 
@@ -83,6 +340,10 @@ struct TraversalStatistics {
     int32_t maxStackDepth;
     int32_t fastStackDepthLimit; // input
     uint32_t stackMemoryAccessAmount;
+    // EN: Optional inputs for node layout analysis, updated on each internal node visit by traverse()
+    //     of a geometry BVH. Other traversal functions and two-level traversal ignore them.
+    uint32_t* intNodeAccessCounts;
+    std::vector<uint32_t>* intNodeAccessTrace;
 };
 
 template <uint32_t arity>
@@ -91,4 +352,229 @@ shared::HitObject traverse(
     const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
     TraversalStatistics* const stats = nullptr, const bool debugPrint = false);
 
+// EN: Traversal of a view using the raw leaf triangles.
+//     With a mapped cache file, only the pages of the visited nodes and leaves are read from the file.
+template <uint32_t arity>
+shared::HitObject traverse(
+    const GeometryBVHView<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats = nullptr, const bool debugPrint = false);
+
+// EN: Two-level traversal. Descends into the BLAS of each instance reference from the referenced node.
+template <uint32_t arity>
+shared::HitObject traverse(
+    const InstanceBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats = nullptr, const bool debugPrint = false);
+
+// EN: Occlusion (any-hit) query for shadow and visibility rays.
+//     Returns true as soon as any intersection in (distMin, distMax) is found.
+template <uint32_t arity>
+bool occluded(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats = nullptr);
+
+// EN: Decides whether a candidate hit is accepted, e.g. by alpha testing. A rejected hit doesn't shorten the ray.
+//     Candidates come in no particular order along the ray, and a triangle referenced from multiple leaves
+//     may be tested more than once.
+using AnyHitFilter = std::function<bool(const shared::HitObject &hitObj)>;
+
+// EN: Multi-hit traversal for transparency or layered geometries.
+//     Gathers the up to maxNumHits closest accepted hits in (distMin, distMax) into hitObjs sorted by distance
+//     in a single traversal and returns the number of them. Each triangle is reported at most once,
+//     including hits at the same distance which re-launching the closest hit traversal from a hit would skip.
+//     Triangles are tested with the raw triangle storages regardless of the leaf triangle format.
+template <uint32_t arity>
+uint32_t traverseMultiHit(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    const uint32_t maxNumHits, shared::HitObject* const hitObjs,
+    const AnyHitFilter &anyHitFilter = nullptr, TraversalStatistics* const stats = nullptr);
+
+// EN: Closest hit traversal with bounded memory, a short stack of shortStackSize (1, 2, 4 or 8) entries and
+//     backtracking via the parent pointers (see shared::traverseWithShortStack).
+//     stackMemoryAccessAmount in the statistics reports the bytes of parent pointers and revisited nodes fetched
+//     because of the bounded stack.
+template <uint32_t arity, uint32_t shortStackSize>
+shared::HitObject traverseWithShortStack(
+    const GeometryBVH<arity> &bvh,
+    const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+    TraversalStatistics* const stats = nullptr);
+
+struct Ray {
+    Point3D org;
+    Vector3D dir;
+    float distMin;
+    float distMax;
+};
+
+// EN: Packet traversal for up to packetSize (4, 8 or 16) coherent rays sharing a node stack.
+//     Child boxes are culled against the frustum of the packet first when all the rays are in the same octant.
+//     Each hit object is the same as the result of traversing the ray individually.
+template <uint32_t arity, uint32_t packetSize>
+void traversePacket(
+    const GeometryBVH<arity> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats = nullptr);
+
+// EN: Stream traversal for an arbitrary number of rays.
+//     The rays are reordered by direction octant (keeping the original order in each octant)
+//     and traversed as packets. hitObjs is in the same order as rays.
+template <uint32_t arity>
+void traverseStream(
+    const GeometryBVH<arity> &bvh,
+    const Ray* const rays, const uint32_t numRays,
+    shared::HitObject* const hitObjs, TraversalStatistics* const stats = nullptr);
+
+
+
+struct DynamicGeometryBVHConfig {
+    float intNodeTravCost;
+    float primIntersectCost;
+    // EN: Number of primitive insertions and removals after which optimize() runs automatically.
+    //     0 disables the automatic optimization.
+    uint32_t optimizationInterval;
+    // EN: Ratio of the internal nodes reinserted by an automatic optimization.
+    float optimizationRatio;
+};
+
+// EN: Binary BVH with a primitive per leaf that is updated by inserting and removing primitives
+//     instead of rebuilding, for scenes whose geometries change at runtime.
+//     An insertion searches the sibling with the minimum SAH cost increase by branch and bound [Bittner 2012]
+//     and refits the ancestors with local tree rotations [Kopta 2012], so a mutation costs O(log n)
+//     for a reasonably balanced tree.
+//     The quality slowly degrades with mutations. optimize() recovers it by removing and reinserting
+//     the most inefficient nodes, and is called periodically by the mutations themselves.
+//     Vertices and triangles are read from the memory of the added geometries, which must stay valid.
+//     Call updatePrimitive() after moving vertices of a primitive in the BVH.
+class DynamicGeometryBVH {
+public:
+    struct Node {
+        AABB aabb;
+        uint32_t parentIndex;
+        // EN: Both are UINT32_MAX for a leaf.
+        uint32_t childIndices[2];
+        // EN: The primitive of a leaf. geomIndex is UINT32_MAX for an unused node.
+        uint32_t geomIndex;
+        uint32_t primIndex;
+
+        bool isLeaf() const {
+            return childIndices[0] == UINT32_MAX;
+        }
+    };
+
+private:
+    struct GeometrySlot {
+        Geometry geom;
+        // EN: Leaf node of each primitive, UINT32_MAX when the primitive isn't in the BVH.
+        std::vector<uint32_t> leafIndices;
+        bool isUsed;
+    };
+
+    DynamicGeometryBVHConfig m_config;
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_freeNodeIndices;
+    std::vector<GeometrySlot> m_geomSlots;
+    std::vector<uint32_t> m_freeGeomSlotIndices;
+    uint32_t m_rootIndex;
+    uint32_t m_numPrims;
+    uint32_t m_numMutationsSinceOptimization;
+
+    uint32_t allocateNode();
+    void freeNode(const uint32_t nodeIdx);
+    uint32_t findBestSibling(const AABB &aabb) const;
+    void insertNode(const uint32_t nodeIdx, const uint32_t newParentIdx);
+    uint32_t detachNode(const uint32_t nodeIdx);
+    void rotate(const uint32_t nodeIdx);
+    void refitAncestors(uint32_t nodeIdx);
+    void countMutation();
+
+public:
+    DynamicGeometryBVH(const DynamicGeometryBVHConfig &config);
+
+    // EN: Returns the geometry index reported in hit objects. Indices of removed geometries are reused.
+    uint32_t addGeometry(const Geometry &geom, const bool insertPrimitives = true);
+    void removeGeometry(const uint32_t geomIndex);
+
+    void insertPrimitive(const uint32_t geomIndex, const uint32_t primIndex);
+    void removePrimitive(const uint32_t geomIndex, const uint32_t primIndex);
+    void updatePrimitive(const uint32_t geomIndex, const uint32_t primIndex);
+
+    // EN: Removes and reinserts up to maxNumReinsertions internal nodes with the largest inefficiency
+    //     [Bittner 2013]. Returns the number of reinserted nodes.
+    uint32_t optimize(const uint32_t maxNumReinsertions);
+
+    // EN: Normalized SAH cost comparable with calcSahCost() of a GeometryBVH.
+    float calcSahCost() const;
+
+    uint32_t getNumPrimitives() const {
+        return m_numPrims;
+    }
+    uint32_t getNumNodes() const {
+        return static_cast<uint32_t>(m_nodes.size() - m_freeNodeIndices.size());
+    }
+    const std::vector<Node> &getNodes() const {
+        return m_nodes;
+    }
+    uint32_t getRootIndex() const {
+        return m_rootIndex;
+    }
+
+    shared::HitObject traverse(
+        const Point3D &rayOrg, const Vector3D &rayDir, const float distMin, const float distMax,
+        TraversalStatistics* const stats = nullptr) const;
+};
+
+
+
+// EN: Pixel rectangle of a tile.
+struct RenderTile {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct TiledRenderConfig {
+    uint32_t width;
+    uint32_t height;
+    // EN: Tile edge length in pixels. 0 means 16.
+    uint32_t tileSize;
+    // EN: Number of threads including the calling thread. 0 means the number of hardware threads.
+    uint32_t numThreads;
+    int32_t fastStackDepthLimit;
+    // EN: Returns the primary ray of a pixel. Called concurrently.
+    std::function<Ray(uint32_t px, uint32_t py)> generateRay;
+    // EN: Consumes the result of a pixel. Called concurrently but never twice for the same pixel.
+    //     The statistics are zero unless renderTiled() is asked for statistics.
+    std::function<void(
+        uint32_t px, uint32_t py, const Ray &ray,
+        const shared::HitObject &hitObj, const TraversalStatistics &stats)> shadePixel;
+    // EN: Optional, called after each tile is finished for progressive output.
+    //     Calls are serialized, numFinishedTiles counts up to numTiles.
+    std::function<void(const RenderTile &tile, uint32_t numFinishedTiles, uint32_t numTiles)> onTileFinished;
+};
+
+struct TiledRenderStatistics {
+    uint64_t numRays;
+    uint64_t numHits;
+    uint64_t numAabbTests;
+    uint64_t numTriTests;
+    double sumMaxStackDepth;
+    int32_t maxMaxStackDepth;
+    double sumAvgStackAccessDepth;
+    float maxAvgStackAccessDepth;
+    uint64_t stackMemoryAccessAmount;
+};
+
+// EN: Traces a primary ray per pixel with closest hit traversal on a thread pool.
+//     The image is split into tiles processed in Morton order so that neighboring tiles, which touch
+//     mostly the same nodes, are traced close in time.
+//     Statistics are accumulated per tile and merged in a fixed order, so they don't depend on the threads.
+template <uint32_t arity>
+void renderTiled(
+    const GeometryBVH<arity> &bvh, const TiledRenderConfig &config,
+    TiledRenderStatistics* const stats = nullptr);
+
 }
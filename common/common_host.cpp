@@ -3,10 +3,13 @@
 #include <assimp/scene.h>
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
+#include <assimp/DefaultIOSystem.h>
 #include "../common/dds_loader.h"
 #include "../../ext/stb_image.h"
 #include "tinyexr.h"
 #include "../ext/stb_image_write.h"
+#include "bvh_builder.h"
+#include "mapped_file.h"
 
 void devPrintf(const char* fmt, ...) {
     va_list args;
@@ -734,30 +737,950 @@ void SlotFinder::debugPrint() const {
 
 
 
-struct FlattenedNode {
-    Matrix4x4 transform;
-    std::vector<uint32_t> meshIndices;
+// EN: Post-process of Assimp for the scene loaders. The scene cache depends on the flags too.
+static constexpr uint32_t sceneImportFlags =
+    aiProcess_Triangulate |
+    aiProcess_GenNormals |
+    aiProcess_CalcTangentSpace |
+    aiProcess_FlipUVs;
+
+constexpr char sceneCacheMagic[8] = { 'G', 'F', 'X', 'S', 'C', 'N', '\0', '\0' };
+constexpr uint32_t sceneCacheVersion = 3;
+constexpr uint64_t sceneCacheSectionAlignment = 64;
+
+struct SceneCacheMaterial {
+    // EN: Offsets of null-terminated strings in the string table, 0 is the empty string.
+    uint32_t nameOffset;
+    uint32_t diffuseTextureOffset;
+    uint32_t specularTextureOffset;
+    uint32_t normalTextureOffset;
+    uint32_t emittanceTextureOffset;
+    RGB diffuseColor;
+    RGB specularColor;
+    RGB emittance;
+    float shininess;
+    uint32_t hasDiffuseColor : 1;
+    uint32_t hasSpecularColor : 1;
+    uint32_t hasEmittance : 1;
 };
 
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    // EN: Guards against layout changes of the vertex and node types.
+    uint32_t vertexSize;
+    uint32_t nodeSize;
+    uint32_t numMaterials;
+    uint64_t settingsHash;
+    uint32_t numMeshes;
+    uint32_t numNodes;
+    uint32_t numNodeMeshIndices;
+    uint32_t numDependencies;
+    uint64_t numVertices;
+    uint64_t numTriangles;
+    uint64_t numTriangles16;
+    uint64_t stringTableSize;
+    uint64_t materialsOffset;
+    uint64_t meshesOffset;
+    uint64_t nodesOffset;
+    uint64_t nodeMeshIndicesOffset;
+    uint64_t verticesOffset;
+    uint64_t trianglesOffset;
+    uint64_t triangles16Offset;
+    uint64_t dependenciesOffset;
+    uint64_t stringTableOffset;
+    uint64_t fileSize;
+};
+
+// EN: A file read by Assimp to make the cache. The cache is valid while the size and the modification time of
+//     every dependency are unchanged, which avoids reading the scene file on a warm start.
+struct SceneCacheDependency {
+    uint32_t pathOffset;
+    uint32_t __padding;
+    uint64_t fileSize;
+    int64_t lastWriteTime;
+};
+
+struct SceneSourceFile {
+    std::filesystem::path path;
+    uint64_t fileSize;
+    int64_t lastWriteTime;
+};
+
+static bool getSceneSourceFileStatus(
+    const std::filesystem::path &filePath, uint64_t* fileSize, int64_t* lastWriteTime) {
+    std::error_code errorCode;
+    *fileSize = std::filesystem::file_size(filePath, errorCode);
+    if (errorCode)
+        return false;
+    *lastWriteTime = std::filesystem::last_write_time(filePath, errorCode).time_since_epoch().count();
+    return !errorCode;
+}
+
+// EN: Record the files Assimp opens, that is the scene file and the files it refers to like .mtl and .bin.
+//     Textures are not recorded since they are read from their paths every time a scene is used.
+class SceneSourceFileRecorder : public Assimp::DefaultIOSystem {
+    std::vector<SceneSourceFile>* m_sourceFiles;
+
+public:
+    SceneSourceFileRecorder(std::vector<SceneSourceFile>* sourceFiles) :
+        m_sourceFiles(sourceFiles) {}
+
+    Assimp::IOStream* Open(const char* pFile, const char* pMode) override {
+        // EN: Take the status before reading so that an edit during the import invalidates the cache.
+        SceneSourceFile sourceFile;
+        sourceFile.path = std::filesystem::absolute(pFile).lexically_normal();
+        const bool statusIsValid = getSceneSourceFileStatus(
+            sourceFile.path, &sourceFile.fileSize, &sourceFile.lastWriteTime);
+        Assimp::IOStream* const stream = Assimp::DefaultIOSystem::Open(pFile, pMode);
+        if (stream && statusIsValid) {
+            const auto it = std::find_if(
+                m_sourceFiles->cbegin(), m_sourceFiles->cend(),
+                [&sourceFile](const SceneSourceFile &file) {
+                    return file.path == sourceFile.path;
+                });
+            if (it == m_sourceFiles->cend())
+                m_sourceFiles->push_back(std::move(sourceFile));
+        }
+        return stream;
+    }
+};
+
+// EN: The hash covers the import settings. The source files are validated by the dependencies.
+static uint64_t calcSceneSettingsHash(const uint32_t postProcessFlags, const bool optimizeMeshes) {
+    uint64_t hash = bvh::calcHash(&sceneCacheVersion, sizeof(sceneCacheVersion));
+    hash = bvh::calcHash(&postProcessFlags, sizeof(postProcessFlags), hash);
+    hash = bvh::calcHash(&optimizeMeshes, sizeof(optimizeMeshes), hash);
+    return hash;
+}
+
+// EN: Each set of the settings has its own cache file so that users with different settings
+//     don't overwrite each other.
+static std::filesystem::path getSceneCacheFilePath(
+    const std::filesystem::path &filePath, const uint64_t settingsHash) {
+    const std::string filePathStr = filePath.string();
+    char cacheFileName[256];
+    snprintf(
+        cacheFileName, sizeof(cacheFileName), "%s_%016llx.scene",
+        filePath.stem().string().c_str(),
+        static_cast<unsigned long long>(bvh::calcHash(filePathStr.c_str(), filePathStr.size(), settingsHash)));
+    return getExecutableDirectory() / "scene_cache" / cacheFileName;
+}
+
+// EN: Make the image of a cache file. The sections are aligned so that the mapped arrays can be used in place.
+static void serializeSceneCache(
+    const std::vector<ImportedMaterial> &materials,
+    const std::vector<ImportedMesh> &meshes,
+    const std::vector<ImportedNode> &nodes,
+    const std::vector<uint32_t> &nodeMeshIndices,
+    const std::vector<shared::Vertex> &vertices,
+    const std::vector<shared::Triangle> &triangles,
+    const std::vector<ImportedTriangle16> &triangles16,
+    const std::vector<SceneSourceFile> &sourceFiles,
+    const uint64_t settingsHash,
+    std::vector<uint8_t>* fileImage) {
+    std::vector<char> stringTable(1, '\0');
+    const auto addString = [&stringTable](const std::string &str) {
+        if (str.empty())
+            return 0u;
+        const uint32_t offset = static_cast<uint32_t>(stringTable.size());
+        stringTable.insert(stringTable.end(), str.c_str(), str.c_str() + str.size() + 1);
+        return offset;
+    };
+
+    std::vector<SceneCacheMaterial> cacheMaterials(materials.size());
+    for (uint32_t matIdx = 0; matIdx < materials.size(); ++matIdx) {
+        const ImportedMaterial &mat = materials[matIdx];
+        SceneCacheMaterial &cacheMat = cacheMaterials[matIdx];
+        cacheMat = {};
+        cacheMat.nameOffset = addString(mat.name);
+        cacheMat.diffuseTextureOffset = addString(mat.diffuseTexture);
+        cacheMat.specularTextureOffset = addString(mat.specularTexture);
+        cacheMat.normalTextureOffset = addString(mat.normalTexture);
+        cacheMat.emittanceTextureOffset = addString(mat.emittanceTexture);
+        cacheMat.diffuseColor = mat.diffuseColor;
+        cacheMat.specularColor = mat.specularColor;
+        cacheMat.emittance = mat.emittance;
+        cacheMat.shininess = mat.shininess;
+        cacheMat.hasDiffuseColor = mat.hasDiffuseColor;
+        cacheMat.hasSpecularColor = mat.hasSpecularColor;
+        cacheMat.hasEmittance = mat.hasEmittance;
+    }
+
+    std::vector<SceneCacheDependency> dependencies(sourceFiles.size());
+    for (uint32_t depIdx = 0; depIdx < sourceFiles.size(); ++depIdx) {
+        const SceneSourceFile &sourceFile = sourceFiles[depIdx];
+        SceneCacheDependency &dependency = dependencies[depIdx];
+        dependency = {};
+        dependency.pathOffset = addString(sourceFile.path.string());
+        dependency.fileSize = sourceFile.fileSize;
+        dependency.lastWriteTime = sourceFile.lastWriteTime;
+    }
+
+    SceneCacheHeader header = {};
+    std::copy_n(sceneCacheMagic, sizeof(sceneCacheMagic), header.magic);
+    header.version = sceneCacheVersion;
+    header.vertexSize = sizeof(shared::Vertex);
+    header.nodeSize = sizeof(ImportedNode);
+    header.settingsHash = settingsHash;
+    header.numMaterials = static_cast<uint32_t>(cacheMaterials.size());
+    header.numMeshes = static_cast<uint32_t>(meshes.size());
+    header.numNodes = static_cast<uint32_t>(nodes.size());
+    header.numNodeMeshIndices = static_cast<uint32_t>(nodeMeshIndices.size());
+    header.numVertices = vertices.size();
+    header.numTriangles = triangles.size();
+    header.numTriangles16 = triangles16.size();
+    header.numDependencies = static_cast<uint32_t>(dependencies.size());
+    header.stringTableSize = stringTable.size();
+    header.materialsOffset = alignUp<uint64_t>(sizeof(header), sceneCacheSectionAlignment);
+    header.meshesOffset = alignUp(
+        header.materialsOffset + sizeof(SceneCacheMaterial) * header.numMaterials,
+        sceneCacheSectionAlignment);
+    header.nodesOffset = alignUp(
+        header.meshesOffset + sizeof(ImportedMesh) * header.numMeshes,
+        sceneCacheSectionAlignment);
+    header.nodeMeshIndicesOffset = alignUp(
+        header.nodesOffset + sizeof(ImportedNode) * header.numNodes,
+        sceneCacheSectionAlignment);
+    header.verticesOffset = alignUp(
+        header.nodeMeshIndicesOffset + sizeof(uint32_t) * header.numNodeMeshIndices,
+        sceneCacheSectionAlignment);
+    header.trianglesOffset = alignUp(
+        header.verticesOffset + sizeof(shared::Vertex) * header.numVertices,
+        sceneCacheSectionAlignment);
+    header.triangles16Offset = alignUp(
+        header.trianglesOffset + sizeof(shared::Triangle) * header.numTriangles,
+        sceneCacheSectionAlignment);
+    header.dependenciesOffset = alignUp(
+        header.triangles16Offset + sizeof(ImportedTriangle16) * header.numTriangles16,
+        sceneCacheSectionAlignment);
+    header.stringTableOffset = alignUp(
+        header.dependenciesOffset + sizeof(SceneCacheDependency) * header.numDependencies,
+        sceneCacheSectionAlignment);
+    header.fileSize = header.stringTableOffset + header.stringTableSize;
+
+    fileImage->assign(header.fileSize, 0);
+    uint8_t* const data = fileImage->data();
+    std::memcpy(data, &header, sizeof(header));
+    std::memcpy(
+        data + header.materialsOffset, cacheMaterials.data(),
+        sizeof(SceneCacheMaterial) * header.numMaterials);
+    std::memcpy(
+        data + header.meshesOffset, meshes.data(),
+        sizeof(ImportedMesh) * header.numMeshes);
+    std::memcpy(
+        data + header.nodesOffset, nodes.data(),
+        sizeof(ImportedNode) * header.numNodes);
+    std::memcpy(
+        data + header.nodeMeshIndicesOffset, nodeMeshIndices.data(),
+        sizeof(uint32_t) * header.numNodeMeshIndices);
+    std::memcpy(
+        data + header.verticesOffset, vertices.data(),
+        sizeof(shared::Vertex) * header.numVertices);
+    std::memcpy(
+        data + header.trianglesOffset, triangles.data(),
+        sizeof(shared::Triangle) * header.numTriangles);
+    std::memcpy(
+        data + header.triangles16Offset, triangles16.data(),
+        sizeof(ImportedTriangle16) * header.numTriangles16);
+    std::memcpy(
+        data + header.dependenciesOffset, dependencies.data(),
+        sizeof(SceneCacheDependency) * header.numDependencies);
+    std::memcpy(
+        data + header.stringTableOffset, stringTable.data(),
+        header.stringTableSize);
+}
+
+// EN: Set up the scene arrays referring to a cache file image.
+//     Returns false when the image is broken, doesn't match the settings or a source file has changed.
+static bool deserializeSceneCache(
+    const uint8_t* const data, const size_t size, const uint64_t settingsHash,
+    ImportedScene* scene) {
+    SceneCacheHeader header;
+    if (size < sizeof(header))
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+    const auto sectionIsValid = [&](const uint64_t offset, const uint64_t numElems, const uint64_t elemSize) {
+        return offset % sceneCacheSectionAlignment == 0 && offset + numElems * elemSize <= size;
+    };
+    const bool headerIsValid =
+        std::equal(sceneCacheMagic, sceneCacheMagic + sizeof(sceneCacheMagic), header.magic) &&
+        header.version == sceneCacheVersion &&
+        header.vertexSize == sizeof(shared::Vertex) &&
+        header.nodeSize == sizeof(ImportedNode) &&
+        header.settingsHash == settingsHash &&
+        header.fileSize == size &&
+        sectionIsValid(header.materialsOffset, header.numMaterials, sizeof(SceneCacheMaterial)) &&
+        sectionIsValid(header.meshesOffset, header.numMeshes, sizeof(ImportedMesh)) &&
+        sectionIsValid(header.nodesOffset, header.numNodes, sizeof(ImportedNode)) &&
+        sectionIsValid(header.nodeMeshIndicesOffset, header.numNodeMeshIndices, sizeof(uint32_t)) &&
+        sectionIsValid(header.verticesOffset, header.numVertices, sizeof(shared::Vertex)) &&
+        sectionIsValid(header.trianglesOffset, header.numTriangles, sizeof(shared::Triangle)) &&
+        sectionIsValid(header.triangles16Offset, header.numTriangles16, sizeof(ImportedTriangle16)) &&
+        sectionIsValid(header.dependenciesOffset, header.numDependencies, sizeof(SceneCacheDependency)) &&
+        sectionIsValid(header.stringTableOffset, header.stringTableSize, 1) &&
+        header.stringTableSize > 0 &&
+        data[header.stringTableOffset + header.stringTableSize - 1] == '\0';
+    if (!headerIsValid)
+        return false;
+
+    const std::span<const ImportedMesh> meshes(
+        reinterpret_cast<const ImportedMesh*>(data + header.meshesOffset), header.numMeshes);
+    const std::span<const ImportedNode> nodes(
+        reinterpret_cast<const ImportedNode*>(data + header.nodesOffset), header.numNodes);
+    const std::span<const uint32_t> nodeMeshIndices(
+        reinterpret_cast<const uint32_t*>(data + header.nodeMeshIndicesOffset), header.numNodeMeshIndices);
+    for (const ImportedMesh &mesh : meshes) {
+        uint64_t numTriangles;
+        if (mesh.indexFormat == ImportedIndexFormat::UI32x3)
+            numTriangles = header.numTriangles;
+        else if (mesh.indexFormat == ImportedIndexFormat::UI16x3 && mesh.numVertices <= 65536)
+            numTriangles = header.numTriangles16;
+        else
+            return false;
+        if (static_cast<uint64_t>(mesh.vertexOffset) + mesh.numVertices > header.numVertices ||
+            static_cast<uint64_t>(mesh.triangleOffset) + mesh.numTriangles > numTriangles ||
+            mesh.materialIndex >= header.numMaterials)
+            return false;
+    }
+    for (const ImportedNode &node : nodes) {
+        if (static_cast<uint64_t>(node.meshIndexOffset) + node.numMeshes > header.numNodeMeshIndices)
+            return false;
+    }
+    for (const uint32_t meshIdx : nodeMeshIndices) {
+        if (meshIdx >= header.numMeshes)
+            return false;
+    }
+
+    const char* const stringTable = reinterpret_cast<const char*>(data + header.stringTableOffset);
+    const auto getString = [&](const uint32_t offset, std::string* str) {
+        if (offset >= header.stringTableSize)
+            return false;
+        *str = stringTable + offset;
+        return true;
+    };
+
+    // EN: A cache without dependencies can't be validated.
+    if (header.numDependencies == 0)
+        return false;
+    const SceneCacheDependency* const dependencies =
+        reinterpret_cast<const SceneCacheDependency*>(data + header.dependenciesOffset);
+    for (uint32_t depIdx = 0; depIdx < header.numDependencies; ++depIdx) {
+        const SceneCacheDependency &dependency = dependencies[depIdx];
+        std::string path;
+        uint64_t fileSize;
+        int64_t lastWriteTime;
+        if (!getString(dependency.pathOffset, &path) ||
+            !getSceneSourceFileStatus(path, &fileSize, &lastWriteTime) ||
+            fileSize != dependency.fileSize || lastWriteTime != dependency.lastWriteTime)
+            return false;
+    }
+    const SceneCacheMaterial* const cacheMaterials =
+        reinterpret_cast<const SceneCacheMaterial*>(data + header.materialsOffset);
+    std::vector<ImportedMaterial> materials(header.numMaterials);
+    for (uint32_t matIdx = 0; matIdx < header.numMaterials; ++matIdx) {
+        const SceneCacheMaterial &cacheMat = cacheMaterials[matIdx];
+        ImportedMaterial &mat = materials[matIdx];
+        if (!getString(cacheMat.nameOffset, &mat.name) ||
+            !getString(cacheMat.diffuseTextureOffset, &mat.diffuseTexture) ||
+            !getString(cacheMat.specularTextureOffset, &mat.specularTexture) ||
+            !getString(cacheMat.normalTextureOffset, &mat.normalTexture) ||
+            !getString(cacheMat.emittanceTextureOffset, &mat.emittanceTexture))
+            return false;
+        mat.diffuseColor = cacheMat.diffuseColor;
+        mat.specularColor = cacheMat.specularColor;
+        mat.emittance = cacheMat.emittance;
+        mat.shininess = cacheMat.shininess;
+        mat.hasDiffuseColor = cacheMat.hasDiffuseColor;
+        mat.hasSpecularColor = cacheMat.hasSpecularColor;
+        mat.hasEmittance = cacheMat.hasEmittance;
+    }
+
+    scene->materials = std::move(materials);
+    scene->meshes = meshes;
+    scene->nodes = nodes;
+    scene->nodeMeshIndices = nodeMeshIndices;
+    scene->vertices = std::span(
+        reinterpret_cast<const shared::Vertex*>(data + header.verticesOffset), header.numVertices);
+    scene->triangles = std::span(
+        reinterpret_cast<const shared::Triangle*>(data + header.trianglesOffset), header.numTriangles);
+    scene->triangles16 = std::span(
+        reinterpret_cast<const ImportedTriangle16*>(data + header.triangles16Offset), header.numTriangles16);
+
+    return true;
+}
+
+// EN: Write to a temporary file first so that other processes never see a partially written cache.
+//     The temporary file has a random name so that concurrent writers of the same cache don't mix their contents.
+static bool writeSceneCache(const std::filesystem::path &filePath, const std::vector<uint8_t> &fileImage) {
+    std::error_code errorCode;
+    std::filesystem::create_directories(filePath.parent_path(), errorCode);
+    std::random_device randomDevice;
+    char tempSuffix[32];
+    snprintf(tempSuffix, sizeof(tempSuffix), ".%08x%08x.tmp", randomDevice(), randomDevice());
+    std::filesystem::path tempFilePath = filePath;
+    tempFilePath += tempSuffix;
+    {
+        std::ofstream ofs(tempFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open())
+            return false;
+        ofs.write(reinterpret_cast<const char*>(fileImage.data()), fileImage.size());
+        if (!ofs) {
+            ofs.close();
+            std::filesystem::remove(tempFilePath, errorCode);
+            return false;
+        }
+    }
+    std::filesystem::rename(tempFilePath, filePath, errorCode);
+    if (errorCode) {
+        std::filesystem::remove(tempFilePath, errorCode);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+static void readImportedMaterial(const aiMaterial* aiMat, ImportedMaterial* mat) {
+    aiString strValue;
+    float color[3];
+
+    *mat = {};
+    if (aiMat->Get(AI_MATKEY_NAME, strValue) == aiReturn_SUCCESS)
+        mat->name = strValue.C_Str();
+
+    if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
+        mat->diffuseTexture = strValue.C_Str();
+    }
+    else if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) == aiReturn_SUCCESS) {
+        mat->diffuseColor = RGB(color[0], color[1], color[2]);
+        mat->hasDiffuseColor = true;
+    }
+
+    if (aiMat->Get(AI_MATKEY_TEXTURE_SPECULAR(0), strValue) == aiReturn_SUCCESS) {
+        mat->specularTexture = strValue.C_Str();
+    }
+    else if (aiMat->Get(AI_MATKEY_COLOR_SPECULAR, color, nullptr) == aiReturn_SUCCESS) {
+        mat->specularColor = RGB(color[0], color[1], color[2]);
+        mat->hasSpecularColor = true;
+    }
+
+    if (aiMat->Get(AI_MATKEY_SHININESS, &mat->shininess, nullptr) != aiReturn_SUCCESS)
+        mat->shininess = 0.0f;
+
+    if (aiMat->Get(AI_MATKEY_TEXTURE_HEIGHT(0), strValue) == aiReturn_SUCCESS)
+        mat->normalTexture = strValue.C_Str();
+    else if (aiMat->Get(AI_MATKEY_TEXTURE_NORMALS(0), strValue) == aiReturn_SUCCESS)
+        mat->normalTexture = strValue.C_Str();
+
+    if (aiMat->Get(AI_MATKEY_TEXTURE_EMISSIVE(0), strValue) == aiReturn_SUCCESS) {
+        mat->emittanceTexture = strValue.C_Str();
+    }
+    else if (aiMat->Get(AI_MATKEY_COLOR_EMISSIVE, color, nullptr) == aiReturn_SUCCESS) {
+        mat->emittance = RGB(color[0], color[1], color[2]);
+        mat->hasEmittance = true;
+    }
+}
+
+// EN: Convert a range of the vertices of a mesh into the object space vertex format.
+static void convertVertices(
+    const aiMesh* aiMesh, const uint32_t beginIdx, const uint32_t endIdx,
+    shared::Vertex* vertices) {
+    for (uint32_t vIdx = beginIdx; vIdx < endIdx; ++vIdx) {
+        const aiVector3D &aip = aiMesh->mVertices[vIdx];
+        const aiVector3D &ain = aiMesh->mNormals[vIdx];
+        aiVector3D aitc0dir;
+        if (aiMesh->mTangents)
+            aitc0dir = aiMesh->mTangents[vIdx];
+        if (!aiMesh->mTangents || !std::isfinite(aitc0dir.x)) {
+            const auto makeCoordinateSystem = []
+            (const Normal3D &normal, Vector3D* tangent, Vector3D* bitangent) {
+                float sign = normal.z >= 0 ? 1.0f : -1.0f;
+                const float a = -1 / (sign + normal.z);
+                const float b = normal.x * normal.y * a;
+                *tangent = Vector3D(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+                *bitangent = Vector3D(b, sign + normal.y * normal.y * a, -normal.y);
+            };
+            Vector3D tangent, bitangent;
+            makeCoordinateSystem(Normal3D(ain.x, ain.y, ain.z), &tangent, &bitangent);
+            aitc0dir = aiVector3D(tangent.x, tangent.y, tangent.z);
+        }
+        const aiVector3D ait = aiMesh->mTextureCoords[0] ?
+            aiMesh->mTextureCoords[0][vIdx] :
+            aiVector3D(0.0f, 0.0f, 0.0f);
+
+        shared::Vertex v;
+        v.position = Point3D(aip.x, aip.y, aip.z);
+        v.normal = normalize(Normal3D(ain.x, ain.y, ain.z));
+        v.texCoord0Dir = normalize(Vector3D(aitc0dir.x, aitc0dir.y, aitc0dir.z));
+        v.texCoord = Point2D(ait.x, ait.y);
+        vertices[vIdx] = v;
+    }
+}
+
+// EN: Point and line primitives can remain after triangulation, they are skipped.
+static uint32_t countTriangles(const aiMesh* aiMesh) {
+    if (aiMesh->mPrimitiveTypes == aiPrimitiveType_TRIANGLE)
+        return aiMesh->mNumFaces;
+    uint32_t numTriangles = 0;
+    for (uint32_t fIdx = 0; fIdx < aiMesh->mNumFaces; ++fIdx)
+        numTriangles += aiMesh->mFaces[fIdx].mNumIndices == 3;
+    return numTriangles;
+}
+
+static void convertTriangles(const aiMesh* aiMesh, shared::Triangle* triangles) {
+    uint32_t triIdx = 0;
+    for (uint32_t fIdx = 0; fIdx < aiMesh->mNumFaces; ++fIdx) {
+        const aiFace &aif = aiMesh->mFaces[fIdx];
+        if (aif.mNumIndices != 3)
+            continue;
+        shared::Triangle tri;
+        tri.index0 = aif.mIndices[0];
+        tri.index1 = aif.mIndices[1];
+        tri.index2 = aif.mIndices[2];
+        triangles[triIdx++] = tri;
+    }
+}
+
 static void computeFlattenedNodes(
     const aiScene* scene, const Matrix4x4 &parentXfm, const aiNode* curNode,
-    std::vector<FlattenedNode> &flattenedNodes) {
+    std::vector<ImportedNode>* flattenedNodes, std::vector<uint32_t>* nodeMeshIndices) {
     aiMatrix4x4 curAiXfm = curNode->mTransformation;
     Matrix4x4 curXfm = Matrix4x4(
         Vector4D(curAiXfm.a1, curAiXfm.a2, curAiXfm.a3, curAiXfm.a4),
         Vector4D(curAiXfm.b1, curAiXfm.b2, curAiXfm.b3, curAiXfm.b4),
         Vector4D(curAiXfm.c1, curAiXfm.c2, curAiXfm.c3, curAiXfm.c4),
         Vector4D(curAiXfm.d1, curAiXfm.d2, curAiXfm.d3, curAiXfm.d4));
-    FlattenedNode flattenedNode;
+    ImportedNode flattenedNode = {};
     flattenedNode.transform = parentXfm * transpose(curXfm);
-    flattenedNode.meshIndices.resize(curNode->mNumMeshes);
     if (curNode->mNumMeshes > 0) {
-        std::copy_n(curNode->mMeshes, curNode->mNumMeshes, flattenedNode.meshIndices.data());
-        flattenedNodes.push_back(flattenedNode);
+        flattenedNode.meshIndexOffset = static_cast<uint32_t>(nodeMeshIndices->size());
+        flattenedNode.numMeshes = curNode->mNumMeshes;
+        nodeMeshIndices->insert(
+            nodeMeshIndices->end(), curNode->mMeshes, curNode->mMeshes + curNode->mNumMeshes);
+        flattenedNodes->push_back(flattenedNode);
     }
 
-    for (uint32_t cIdx = 0; cIdx < curNode->mNumChildren; ++cIdx)
-        computeFlattenedNodes(scene, flattenedNode.transform, curNode->mChildren[cIdx], flattenedNodes);
+    for (uint32_t cIdx = 0; cIdx < curNode->mNumChildren; ++cIdx) {
+        computeFlattenedNodes(
+            scene, flattenedNode.transform, curNode->mChildren[cIdx],
+            flattenedNodes, nodeMeshIndices);
+    }
+}
+
+// EN: Vertex cache optimization by Tom Forsyth's linear-speed algorithm.
+//     Greedily emits the triangle whose vertices score highest in a simulated LRU cache.
+static void optimizeTriangleOrder(const uint32_t numVertices, std::vector<shared::Triangle>* triangles) {
+    constexpr uint32_t cacheSize = 32;
+    constexpr uint32_t maxValence = 32;
+    constexpr uint32_t invalidIndex = 0xFFFF'FFFF;
+    const uint32_t numTriangles = static_cast<uint32_t>(triangles->size());
+    if (numTriangles == 0)
+        return;
+
+    float cachePositionScores[cacheSize];
+    for (uint32_t pos = 0; pos < cacheSize; ++pos) {
+        cachePositionScores[pos] = pos < 3 ?
+            0.75f :
+            std::pow(1.0f - (pos - 3) / static_cast<float>(cacheSize - 3), 1.5f);
+    }
+    float valenceScores[maxValence + 1];
+    valenceScores[0] = 0.0f;
+    for (uint32_t valence = 1; valence <= maxValence; ++valence)
+        valenceScores[valence] = 2.0f / std::sqrt(static_cast<float>(valence));
+
+    // EN: Triangles adjacent to each vertex. The live (not yet emitted) ones are kept at the front.
+    std::vector<uint32_t> adjOffsets(numVertices + 1, 0);
+    for (const shared::Triangle &tri : *triangles) {
+        ++adjOffsets[tri.index0 + 1];
+        ++adjOffsets[tri.index1 + 1];
+        ++adjOffsets[tri.index2 + 1];
+    }
+    for (uint32_t vIdx = 0; vIdx < numVertices; ++vIdx)
+        adjOffsets[vIdx + 1] += adjOffsets[vIdx];
+    std::vector<uint32_t> adjTriangles(3 * numTriangles);
+    std::vector<uint32_t> numLiveTriangles(numVertices, 0);
+    for (uint32_t triIdx = 0; triIdx < numTriangles; ++triIdx) {
+        const shared::Triangle &tri = (*triangles)[triIdx];
+        for (const uint32_t vIdx : { tri.index0, tri.index1, tri.index2 })
+            adjTriangles[adjOffsets[vIdx] + numLiveTriangles[vIdx]++] = triIdx;
+    }
+
+    std::vector<int32_t> cachePositions(numVertices, -1);
+    const auto calcVertexScore = [&](const uint32_t vIdx) {
+        const uint32_t numLive = numLiveTriangles[vIdx];
+        if (numLive == 0)
+            return -1.0f;
+        float score = valenceScores[std::min(numLive, maxValence)];
+        if (cachePositions[vIdx] >= 0)
+            score += cachePositionScores[cachePositions[vIdx]];
+        return score;
+    };
+
+    std::vector<float> vertexScores(numVertices);
+    for (uint32_t vIdx = 0; vIdx < numVertices; ++vIdx)
+        vertexScores[vIdx] = calcVertexScore(vIdx);
+    std::vector<float> triangleScores(numTriangles);
+    uint32_t bestTriIdx = 0;
+    for (uint32_t triIdx = 0; triIdx < numTriangles; ++triIdx) {
+        const shared::Triangle &tri = (*triangles)[triIdx];
+        triangleScores[triIdx] =
+            vertexScores[tri.index0] + vertexScores[tri.index1] + vertexScores[tri.index2];
+        if (triangleScores[triIdx] > triangleScores[bestTriIdx])
+            bestTriIdx = triIdx;
+    }
+
+    const std::vector<shared::Triangle> srcTriangles = std::move(*triangles);
+    triangles->clear();
+    triangles->reserve(numTriangles);
+    std::vector<uint8_t> triIsEmitted(numTriangles, 0);
+    uint32_t cache[cacheSize + 3];
+    uint32_t curCacheSize = 0;
+    uint32_t fallbackTriIdx = 0;
+    for (uint32_t i = 0; i < numTriangles; ++i) {
+        // EN: Continue from the next remaining triangle in the input order when the cache has no candidate.
+        if (bestTriIdx == invalidIndex) {
+            while (triIsEmitted[fallbackTriIdx])
+                ++fallbackTriIdx;
+            bestTriIdx = fallbackTriIdx;
+        }
+
+        const shared::Triangle &tri = srcTriangles[bestTriIdx];
+        triangles->push_back(tri);
+        triIsEmitted[bestTriIdx] = 1;
+        const uint32_t triVertices[3] = { tri.index0, tri.index1, tri.index2 };
+        for (const uint32_t vIdx : triVertices) {
+            uint32_t* const adjBegin = adjTriangles.data() + adjOffsets[vIdx];
+            uint32_t* const adjEnd = adjBegin + numLiveTriangles[vIdx];
+            std::iter_swap(std::find(adjBegin, adjEnd, bestTriIdx), adjEnd - 1);
+            --numLiveTriangles[vIdx];
+        }
+
+        // EN: Move the vertices of the emitted triangle to the front of the cache.
+        uint32_t newCache[cacheSize + 3];
+        uint32_t newCacheSize = 0;
+        for (const uint32_t vIdx : triVertices) {
+            if (std::find(newCache, newCache + newCacheSize, vIdx) == newCache + newCacheSize)
+                newCache[newCacheSize++] = vIdx;
+        }
+        for (uint32_t pos = 0; pos < curCacheSize; ++pos) {
+            const uint32_t vIdx = cache[pos];
+            if (vIdx != triVertices[0] && vIdx != triVertices[1] && vIdx != triVertices[2])
+                newCache[newCacheSize++] = vIdx;
+        }
+        for (uint32_t pos = 0; pos < newCacheSize; ++pos)
+            cachePositions[newCache[pos]] = pos < cacheSize ? pos : -1;
+
+        // EN: Propagate the score changes of the cached and evicted vertices to their live triangles.
+        for (uint32_t pos = 0; pos < newCacheSize; ++pos) {
+            const uint32_t vIdx = newCache[pos];
+            const float newScore = calcVertexScore(vIdx);
+            const float deltaScore = newScore - vertexScores[vIdx];
+            vertexScores[vIdx] = newScore;
+            for (uint32_t adjIdx = 0; adjIdx < numLiveTriangles[vIdx]; ++adjIdx)
+                triangleScores[adjTriangles[adjOffsets[vIdx] + adjIdx]] += deltaScore;
+        }
+
+        curCacheSize = std::min(newCacheSize, cacheSize);
+        std::copy_n(newCache, curCacheSize, cache);
+        bestTriIdx = invalidIndex;
+        float bestScore = -1.0f;
+        for (uint32_t pos = 0; pos < curCacheSize; ++pos) {
+            const uint32_t vIdx = cache[pos];
+            for (uint32_t adjIdx = 0; adjIdx < numLiveTriangles[vIdx]; ++adjIdx) {
+                const uint32_t triIdx = adjTriangles[adjOffsets[vIdx] + adjIdx];
+                if (triangleScores[triIdx] > bestScore) {
+                    bestTriIdx = triIdx;
+                    bestScore = triangleScores[triIdx];
+                }
+            }
+        }
+    }
+}
+
+// EN: Weld bitwise identical vertices, reorder the triangles for the vertex cache,
+//     then reorder the vertices by first use for fetch locality. Unreferenced vertices are removed.
+static void optimizeMesh(
+    const std::span<const shared::Vertex> srcVertices, const std::span<const shared::Triangle> srcTriangles,
+    std::vector<shared::Vertex>* vertices, std::vector<shared::Triangle>* triangles) {
+    constexpr uint32_t invalidIndex = 0xFFFF'FFFF;
+
+    const auto hashVertex = [&srcVertices](const uint32_t vIdx) {
+        return static_cast<size_t>(bvh::calcHash(&srcVertices[vIdx], sizeof(shared::Vertex)));
+    };
+    const auto vertexIsEqual = [&srcVertices](const uint32_t vIdxA, const uint32_t vIdxB) {
+        return std::memcmp(&srcVertices[vIdxA], &srcVertices[vIdxB], sizeof(shared::Vertex)) == 0;
+    };
+    std::unordered_map<uint32_t, uint32_t, decltype(hashVertex), decltype(vertexIsEqual)> uniqueVertexMap(
+        srcVertices.size(), hashVertex, vertexIsEqual);
+    std::vector<uint32_t> weldMap(srcVertices.size());
+    std::vector<uint32_t> uniqueVertexIndices;
+    for (uint32_t vIdx = 0; vIdx < srcVertices.size(); ++vIdx) {
+        const auto [it, isNew] = uniqueVertexMap.try_emplace(
+            vIdx, static_cast<uint32_t>(uniqueVertexIndices.size()));
+        if (isNew)
+            uniqueVertexIndices.push_back(vIdx);
+        weldMap[vIdx] = it->second;
+    }
+
+    triangles->resize(srcTriangles.size());
+    for (uint32_t triIdx = 0; triIdx < srcTriangles.size(); ++triIdx) {
+        const shared::Triangle &srcTri = srcTriangles[triIdx];
+        (*triangles)[triIdx] = shared::Triangle{
+            weldMap[srcTri.index0], weldMap[srcTri.index1], weldMap[srcTri.index2] };
+    }
+    optimizeTriangleOrder(static_cast<uint32_t>(uniqueVertexIndices.size()), triangles);
+
+    std::vector<uint32_t> vertexRemap(uniqueVertexIndices.size(), invalidIndex);
+    vertices->clear();
+    vertices->reserve(uniqueVertexIndices.size());
+    const auto remapVertex = [&](uint32_t &vIdx) {
+        if (vertexRemap[vIdx] == invalidIndex) {
+            vertexRemap[vIdx] = static_cast<uint32_t>(vertices->size());
+            vertices->push_back(srcVertices[uniqueVertexIndices[vIdx]]);
+        }
+        vIdx = vertexRemap[vIdx];
+    };
+    for (shared::Triangle &tri : *triangles) {
+        remapVertex(tri.index0);
+        remapVertex(tri.index1);
+        remapVertex(tri.index2);
+    }
+}
+
+// EN: Optimize the meshes in parallel and rebuild the scene arrays.
+//     Meshes with up to 65536 vertices move to the 16-bit triangle array. The 16-bit triangles save memory of
+//     the host scene data and the cache only, they are expanded to 32-bit when uploaded to the device.
+static void optimizeSceneMeshes(
+    ThreadPool* threadPool,
+    std::vector<ImportedMesh>* meshes,
+    std::vector<shared::Vertex>* vertices,
+    std::vector<shared::Triangle>* triangles,
+    std::vector<ImportedTriangle16>* triangles16) {
+    const uint32_t numMeshes = static_cast<uint32_t>(meshes->size());
+    std::vector<std::vector<shared::Vertex>> meshVertices(numMeshes);
+    std::vector<std::vector<shared::Triangle>> meshTriangles(numMeshes);
+    parallelFor(
+        threadPool, 0, numMeshes, 1,
+        [&](const uint32_t beginMeshIdx, const uint32_t endMeshIdx) {
+        for (uint32_t meshIdx = beginMeshIdx; meshIdx < endMeshIdx; ++meshIdx) {
+            const ImportedMesh &mesh = (*meshes)[meshIdx];
+            optimizeMesh(
+                std::span(*vertices).subspan(mesh.vertexOffset, mesh.numVertices),
+                std::span(*triangles).subspan(mesh.triangleOffset, mesh.numTriangles),
+                &meshVertices[meshIdx], &meshTriangles[meshIdx]);
+        }
+    });
+
+    const uint32_t oldNumVertices = static_cast<uint32_t>(vertices->size());
+    const size_t oldSize =
+        sizeof(shared::Vertex) * vertices->size() +
+        sizeof(shared::Triangle) * triangles->size();
+
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
+    uint32_t numTriangles16 = 0;
+    for (uint32_t meshIdx = 0; meshIdx < numMeshes; ++meshIdx) {
+        ImportedMesh &mesh = (*meshes)[meshIdx];
+        mesh.vertexOffset = numVertices;
+        mesh.numVertices = static_cast<uint32_t>(meshVertices[meshIdx].size());
+        mesh.numTriangles = static_cast<uint32_t>(meshTriangles[meshIdx].size());
+        mesh.indexFormat = mesh.numVertices <= 65536 ?
+            ImportedIndexFormat::UI16x3 : ImportedIndexFormat::UI32x3;
+        uint32_t &curNumTriangles = mesh.indexFormat == ImportedIndexFormat::UI16x3 ?
+            numTriangles16 : numTriangles;
+        mesh.triangleOffset = curNumTriangles;
+        numVertices += mesh.numVertices;
+        curNumTriangles += mesh.numTriangles;
+    }
+
+    vertices->resize(numVertices);
+    triangles->resize(numTriangles);
+    triangles16->resize(numTriangles16);
+    for (uint32_t meshIdx = 0; meshIdx < numMeshes; ++meshIdx) {
+        const ImportedMesh &mesh = (*meshes)[meshIdx];
+        std::copy(
+            meshVertices[meshIdx].cbegin(), meshVertices[meshIdx].cend(),
+            vertices->begin() + mesh.vertexOffset);
+        if (mesh.indexFormat == ImportedIndexFormat::UI16x3) {
+            ImportedTriangle16* const dstTriangles = triangles16->data() + mesh.triangleOffset;
+            for (uint32_t triIdx = 0; triIdx < mesh.numTriangles; ++triIdx) {
+                const shared::Triangle &tri = meshTriangles[meshIdx][triIdx];
+                dstTriangles[triIdx] = ImportedTriangle16{
+                    static_cast<uint16_t>(tri.index0),
+                    static_cast<uint16_t>(tri.index1),
+                    static_cast<uint16_t>(tri.index2) };
+            }
+        }
+        else {
+            std::copy(
+                meshTriangles[meshIdx].cbegin(), meshTriangles[meshIdx].cend(),
+                triangles->begin() + mesh.triangleOffset);
+        }
+    }
+
+    const size_t newSize =
+        sizeof(shared::Vertex) * vertices->size() +
+        sizeof(shared::Triangle) * triangles->size() +
+        sizeof(ImportedTriangle16) * triangles16->size();
+    hpprintf(
+        "(mesh optimization: %u -> %u vertices, %.2f MiB saved in the host scene data) ",
+        oldNumVertices, numVertices, (oldSize - newSize) / (1024.0 * 1024.0));
+}
+
+static bool importSceneWithAssimp(
+    const std::filesystem::path &filePath, const uint32_t postProcessFlags, const bool optimizeMeshes,
+    const uint64_t settingsHash,
+    std::vector<uint8_t>* fileImage) {
+    std::vector<SceneSourceFile> sourceFiles;
+    Assimp::Importer importer;
+    // EN: The importer takes the ownership of the IO system.
+    importer.SetIOHandler(new SceneSourceFileRecorder(&sourceFiles));
+    const aiScene* aiscene = importer.ReadFile(filePath.string(), postProcessFlags);
+    if (!aiscene)
+        return false;
+
+    std::vector<ImportedMaterial> materials(aiscene->mNumMaterials);
+    for (uint32_t matIdx = 0; matIdx < aiscene->mNumMaterials; ++matIdx)
+        readImportedMaterial(aiscene->mMaterials[matIdx], &materials[matIdx]);
+
+    // EN: Determine the exact output ranges first so that the meshes are converted into place in parallel.
+    std::vector<ImportedMesh> meshes(aiscene->mNumMeshes);
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
+    for (uint32_t meshIdx = 0; meshIdx < aiscene->mNumMeshes; ++meshIdx) {
+        const aiMesh* aiMesh = aiscene->mMeshes[meshIdx];
+
+        ImportedMesh &mesh = meshes[meshIdx];
+        mesh.vertexOffset = numVertices;
+        mesh.numVertices = aiMesh->mNumVertices;
+        mesh.triangleOffset = numTriangles;
+        mesh.numTriangles = countTriangles(aiMesh);
+        mesh.materialIndex = aiMesh->mMaterialIndex;
+        mesh.indexFormat = ImportedIndexFormat::UI32x3;
+        numVertices += mesh.numVertices;
+        numTriangles += mesh.numTriangles;
+    }
+
+    std::vector<shared::Vertex> vertices(numVertices);
+    std::vector<shared::Triangle> triangles(numTriangles);
+    ThreadPool threadPool;
+    {
+        constexpr uint32_t vertexGrainSize = 16384;
+        TaskGroup taskGroup(threadPool);
+        for (uint32_t meshIdx = 0; meshIdx < aiscene->mNumMeshes; ++meshIdx) {
+            const aiMesh* aiMesh = aiscene->mMeshes[meshIdx];
+            const ImportedMesh &mesh = meshes[meshIdx];
+            shared::Vertex* const meshVertices = vertices.data() + mesh.vertexOffset;
+            for (uint32_t beginIdx = 0; beginIdx < mesh.numVertices; beginIdx += vertexGrainSize) {
+                const uint32_t endIdx = std::min(beginIdx + vertexGrainSize, mesh.numVertices);
+                taskGroup.run([aiMesh, beginIdx, endIdx, meshVertices]() {
+                    convertVertices(aiMesh, beginIdx, endIdx, meshVertices);
+                });
+            }
+            shared::Triangle* const meshTriangles = triangles.data() + mesh.triangleOffset;
+            taskGroup.run([aiMesh, meshTriangles]() {
+                convertTriangles(aiMesh, meshTriangles);
+            });
+        }
+        taskGroup.wait();
+    }
+
+    std::vector<ImportedTriangle16> triangles16;
+    if (optimizeMeshes)
+        optimizeSceneMeshes(&threadPool, &meshes, &vertices, &triangles, &triangles16);
+
+    std::vector<ImportedNode> nodes;
+    std::vector<uint32_t> nodeMeshIndices;
+    computeFlattenedNodes(aiscene, Matrix4x4(), aiscene->mRootNode, &nodes, &nodeMeshIndices);
+
+    serializeSceneCache(
+        materials, meshes, nodes, nodeMeshIndices, vertices, triangles, triangles16, sourceFiles, settingsHash,
+        fileImage);
+
+    return true;
+}
+
+// EN: Load a scene through the binary scene cache next to the executable.
+//     Assimp is used only when the cache is missing or a file read to make it has changed.
+static std::shared_ptr<const ImportedScene> loadImportedScene(
+    const std::filesystem::path &filePath, const uint32_t postProcessFlags, const bool optimizeMeshes) {
+    hpprintf("Reading: %s ... ", filePath.string().c_str());
+    fflush(stdout);
+    const uint64_t settingsHash = calcSceneSettingsHash(postProcessFlags, optimizeMeshes);
+
+    auto scene = std::make_shared<ImportedScene>();
+    auto mappedFile = std::make_shared<MappedFile>();
+    const std::filesystem::path cacheFilePath = getSceneCacheFilePath(filePath, settingsHash);
+    if (mappedFile->open(cacheFilePath)) {
+        if (deserializeSceneCache(mappedFile->getData(), mappedFile->getSize(), settingsHash, scene.get())) {
+            scene->storage = mappedFile;
+            hpprintf("done (cached).\n");
+            return scene;
+        }
+        // EN: Unmap the stale cache before it is replaced.
+        mappedFile->close();
+    }
+
+    auto fileImage = std::make_shared<std::vector<uint8_t>>();
+    if (!importSceneWithAssimp(filePath, postProcessFlags, optimizeMeshes, settingsHash, fileImage.get())) {
+        hpprintf("Failed to load %s.\n", filePath.string().c_str());
+        return nullptr;
+    }
+    hpprintf("done.\n");
+
+    // EN: Refer to the written cache file rather than the image so that a scene kept for the process lifetime
+    //     holds only evictable file pages instead of a heap copy.
+    if (writeSceneCache(cacheFilePath, *fileImage)) {
+        if (mappedFile->open(cacheFilePath) &&
+            deserializeSceneCache(mappedFile->getData(), mappedFile->getSize(), settingsHash, scene.get())) {
+            scene->storage = mappedFile;
+            return scene;
+        }
+    }
+    else {
+        hpprintf("Failed to write the scene cache: %s\n", cacheFilePath.string().c_str());
+    }
+    const bool isValid = deserializeSceneCache(fileImage->data(), fileImage->size(), settingsHash, scene.get());
+    Assert_Release(isValid, "Invalid scene cache image.");
+    scene->storage = fileImage;
+
+    return scene;
+}
+
+// EN: The entries don't own the scenes, a scene and its storage are released when the last user drops it.
+//     Loading is serialized per entry so that concurrent users of a file import it only once
+//     while different files load in parallel.
+struct ImportedSceneCacheEntry {
+    std::mutex mutex;
+    std::weak_ptr<const ImportedScene> scene;
+};
+
+static std::map<std::pair<std::filesystem::path, bool>, std::shared_ptr<ImportedSceneCacheEntry>> s_importedSceneCache;
+static std::mutex s_importedSceneCacheMutex;
+
+std::shared_ptr<const ImportedScene> getImportedScene(const std::filesystem::path &filePath, const bool optimizeMeshes) {
+    const std::pair<std::filesystem::path, bool> key(
+        std::filesystem::absolute(filePath).lexically_normal(), optimizeMeshes);
+
+    std::shared_ptr<ImportedSceneCacheEntry> entry;
+    {
+        std::lock_guard lock(s_importedSceneCacheMutex);
+        std::shared_ptr<ImportedSceneCacheEntry> &slot = s_importedSceneCache[key];
+        if (!slot)
+            slot = std::make_shared<ImportedSceneCacheEntry>();
+        entry = slot;
+    }
+
+    std::lock_guard lock(entry->mutex);
+    std::shared_ptr<const ImportedScene> scene = entry->scene.lock();
+    if (!scene) {
+        scene = loadImportedScene(filePath, sceneImportFlags, optimizeMeshes);
+        entry->scene = scene;
+    }
+
+    return scene;
 }
 
 static void translate(
@@ -1801,10 +2724,27 @@ void createSimplePBRMaterial(
     scene->materials.push_back(mat);
 }
 
+static void convertVertex(const shared::Vertex &src, shared::Vertex* dst) {
+    *dst = src;
+}
+
+static void convertVertex(const shared::Vertex &src, shared::PackedVertex* dst) {
+    *dst = shared::packVertex(src);
+}
+
+void initializeVertexBuffer(
+    CUcontext cuContext, std::span<const shared::Vertex> vertices,
+    cudau::TypedBuffer<shared::VertexBufferElement>* vertexBuffer) {
+    std::vector<shared::VertexBufferElement> elements(vertices.size());
+    for (uint32_t vIdx = 0; vIdx < vertices.size(); ++vIdx)
+        convertVertex(vertices[vIdx], &elements[vIdx]);
+    vertexBuffer->initialize(cuContext, Scene::bufferType, elements);
+}
+
 GeometryInstance* createGeometryInstance(
     CUcontext cuContext, Scene* scene,
-    const std::vector<shared::Vertex> &vertices,
-    const std::vector<shared::Triangle> &triangles,
+    std::span<const shared::Vertex> vertices,
+    std::span<const shared::Triangle> triangles,
     const Material* mat, optixu::Material optixMat,
     bool allocateGfxResource) {
     shared::GeometryInstanceData* geomInstDataOnHost = scene->geomInstDataBuffer.getMappedPointer();
@@ -1830,10 +2770,10 @@ GeometryInstance* createGeometryInstance(
     if (allocateGfxResource) {
         geom.gfxVertexBuffer.initialize(
             sizeof(shared::Vertex), vertices.size(), glu::Buffer::Usage::StaticDraw);
-        geom.gfxVertexBuffer.write(vertices);
+        geom.gfxVertexBuffer.write(vertices.data(), vertices.size());
         geom.gfxTriangleBuffer.initialize(
             sizeof(shared::Triangle), triangles.size(), glu::Buffer::Usage::StaticDraw);
-        geom.gfxTriangleBuffer.write(triangles);
+        geom.gfxTriangleBuffer.write(triangles.data(), triangles.size());
 
         geom.gfxVertexArray.initialize();
         {
@@ -1858,8 +2798,8 @@ GeometryInstance* createGeometryInstance(
             glVertexArrayElementBuffer(vaoHandle, geom.gfxTriangleBuffer.getHandle());
         }
     }
-    geom.vertexBuffer.initialize(cuContext, Scene::bufferType, vertices);
-    geom.triangleBuffer.initialize(cuContext, Scene::bufferType, triangles);
+    initializeVertexBuffer(cuContext, vertices, &geom.vertexBuffer);
+    geom.triangleBuffer.initialize(cuContext, Scene::bufferType, triangles.data(), triangles.size());
     if (mat->texEmittance.cudaArray) {
 #if USE_PROBABILITY_TEXTURE
         geom.emitterPrimDist.initialize(
@@ -1915,7 +2855,7 @@ GeometryInstance* createTFDMGeometryInstance(
     }
 
     geomInst->mat = mat;
-    geom.vertexBuffer.initialize(cuContext, Scene::bufferType, vertices);
+    initializeVertexBuffer(cuContext, vertices, &geom.vertexBuffer);
     geom.triangleBuffer.initialize(cuContext, Scene::bufferType, triangles);
     geomInst->geomInstSlot = scene->geomInstSlotFinder.getFirstAvailableSlot();
     scene->geomInstSlotFinder.setInUse(geomInst->geomInstSlot);
@@ -1960,7 +2900,7 @@ GeometryInstance* createNRTDSMGeometryInstance(
     }
 
     geomInst->mat = mat;
-    geom.vertexBuffer.initialize(cuContext, Scene::bufferType, vertices);
+    initializeVertexBuffer(cuContext, vertices, &geom.vertexBuffer);
     geom.triangleBuffer.initialize(cuContext, Scene::bufferType, triangles);
     geomInst->geomInstSlot = scene->geomInstSlotFinder.getFirstAvailableSlot();
     scene->geomInstSlotFinder.setInUse(geomInst->geomInstSlot);
@@ -2059,73 +2999,149 @@ GeometryGroup* createGeometryGroup(
     return geomGroup;
 }
 
-static void computeFlattenedMesh(
-    const aiScene* scene, const Matrix4x4 &parentXfm, const aiNode* curNode,
-    std::vector<TriangleGeometryOnCPU>* geometries,
-    AABB* const aabb) {
-    const aiMatrix4x4 &nodeAiXfm = curNode->mTransformation;
-    const Matrix4x4 nodeXfm = Matrix4x4(
-        Vector4D(nodeAiXfm.a1, nodeAiXfm.a2, nodeAiXfm.a3, nodeAiXfm.a4),
-        Vector4D(nodeAiXfm.b1, nodeAiXfm.b2, nodeAiXfm.b3, nodeAiXfm.b4),
-        Vector4D(nodeAiXfm.c1, nodeAiXfm.c2, nodeAiXfm.c3, nodeAiXfm.c4),
-        Vector4D(nodeAiXfm.d1, nodeAiXfm.d2, nodeAiXfm.d3, nodeAiXfm.d4));
-    const Matrix4x4 curXfm = parentXfm * transpose(nodeXfm);
-    const Matrix3x3 curNormXfm = curXfm.getUpperLeftMatrix().invert().transpose();
-    for (uint32_t meshIdx = 0; meshIdx < curNode->mNumMeshes; ++meshIdx) {
-        const aiMesh* aiMesh = scene->mMeshes[curNode->mMeshes[meshIdx]];
-
-        TriangleGeometryOnCPU geom;
-
-        for (uint32_t vIdx = 0; vIdx < aiMesh->mNumVertices; ++vIdx) {
-            const aiVector3D &aip = aiMesh->mVertices[vIdx];
-            const aiVector3D &ain = aiMesh->mNormals[vIdx];
-            aiVector3D aitc0dir;
-            if (aiMesh->mTangents)
-                aitc0dir = aiMesh->mTangents[vIdx];
-            if (!aiMesh->mTangents || !std::isfinite(aitc0dir.x)) {
-                const auto makeCoordinateSystem = []
-                (const Normal3D &normal, Vector3D* tangent, Vector3D* bitangent) {
-                    float sign = normal.z >= 0 ? 1.0f : -1.0f;
-                    const float a = -1 / (sign + normal.z);
-                    const float b = normal.x * normal.y * a;
-                    *tangent = Vector3D(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
-                    *bitangent = Vector3D(b, sign + normal.y * normal.y * a, -normal.y);
-                };
-                Vector3D tangent, bitangent;
-                makeCoordinateSystem(Normal3D(ain.x, ain.y, ain.z), &tangent, &bitangent);
-                aitc0dir = aiVector3D(tangent.x, tangent.y, tangent.z);
-            }
-            const aiVector3D ait = aiMesh->mTextureCoords[0] ?
-                aiMesh->mTextureCoords[0][vIdx] :
-                aiVector3D(0.0f, 0.0f, 0.0f);
+// EN: SSE2 is a part of x64, the scalar path is for other targets.
+#if defined(__SSE2__) || defined(_M_X64)
+#   define VERTEX_TRANSFORM_USE_SSE 1
+#else
+#   define VERTEX_TRANSFORM_USE_SSE 0
+#endif
 
-            shared::Vertex v;
-            v.position = curXfm * Point3D(aip.x, aip.y, aip.z);
-            v.normal = normalize(curNormXfm * Normal3D(ain.x, ain.y, ain.z));
-            v.texCoord0Dir = normalize(curXfm * Vector3D(aitc0dir.x, aitc0dir.y, aitc0dir.z));
-            v.texCoord = Point2D(ait.x, ait.y);
+void transformVertices(
+    const Matrix4x4 &transform,
+    const std::span<const shared::Vertex> srcVertices, shared::Vertex* const dstVertices,
+    AABB* const aabb) {
+    const Matrix3x3 normalTransform = transform.getUpperLeftMatrix().invert().transpose();
+#if VERTEX_TRANSFORM_USE_SSE
+    // EN: Each attribute is loaded and stored as 4 floats. The extra lane overlaps the next attribute
+    //     of the same vertex, which is loaded beforehand and stored afterwards.
+    static_assert(
+        offsetof(shared::Vertex, normal) == 3 * sizeof(float) &&
+        offsetof(shared::Vertex, texCoord0Dir) == 6 * sizeof(float) &&
+        offsetof(shared::Vertex, texCoord) == 9 * sizeof(float),
+        "Unexpected vertex layout.");
+    const __m128 c0 = _mm_setr_ps(transform.m00, transform.m10, transform.m20, 0.0f);
+    const __m128 c1 = _mm_setr_ps(transform.m01, transform.m11, transform.m21, 0.0f);
+    const __m128 c2 = _mm_setr_ps(transform.m02, transform.m12, transform.m22, 0.0f);
+    const __m128 c3 = _mm_setr_ps(transform.m03, transform.m13, transform.m23, 0.0f);
+    const __m128 nc0 = _mm_setr_ps(normalTransform.m00, normalTransform.m10, normalTransform.m20, 0.0f);
+    const __m128 nc1 = _mm_setr_ps(normalTransform.m01, normalTransform.m11, normalTransform.m21, 0.0f);
+    const __m128 nc2 = _mm_setr_ps(normalTransform.m02, normalTransform.m12, normalTransform.m22, 0.0f);
+    const auto transform3 = []
+    (const __m128 v, const __m128 col0, const __m128 col1, const __m128 col2) {
+        return _mm_add_ps(
+            _mm_add_ps(
+                _mm_mul_ps(col0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0))),
+                _mm_mul_ps(col1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)))),
+            _mm_mul_ps(col2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+    };
+    const auto normalize3 = [](const __m128 v) {
+        const __m128 sq = _mm_mul_ps(v, v);
+        const __m128 sqLength = _mm_add_ss(
+            _mm_add_ss(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1, 1, 1, 1))),
+            _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 2, 2, 2)));
+        const __m128 length = _mm_sqrt_ss(sqLength);
+        return _mm_div_ps(v, _mm_shuffle_ps(length, length, _MM_SHUFFLE(0, 0, 0, 0)));
+    };
 
-            geom.vertices.push_back(v);
+    __m128 aabbMin = _mm_set1_ps(INFINITY);
+    __m128 aabbMax = _mm_set1_ps(-INFINITY);
+    for (size_t vIdx = 0; vIdx < srcVertices.size(); ++vIdx) {
+        const float* const src = reinterpret_cast<const float*>(&srcVertices[vIdx]);
+        const __m128 position = _mm_loadu_ps(src + 0);
+        const __m128 normal = _mm_loadu_ps(src + 3);
+        const __m128 texCoord0Dir = _mm_loadu_ps(src + 6);
+        const Point2D texCoord = srcVertices[vIdx].texCoord;
+
+        const __m128 dstPosition = _mm_add_ps(transform3(position, c0, c1, c2), c3);
+        const __m128 dstNormal = normalize3(transform3(normal, nc0, nc1, nc2));
+        const __m128 dstTexCoord0Dir = normalize3(transform3(texCoord0Dir, c0, c1, c2));
+        aabbMin = _mm_min_ps(aabbMin, dstPosition);
+        aabbMax = _mm_max_ps(aabbMax, dstPosition);
+
+        float* const dst = reinterpret_cast<float*>(&dstVertices[vIdx]);
+        _mm_storeu_ps(dst + 0, dstPosition);
+        _mm_storeu_ps(dst + 3, dstNormal);
+        _mm_storeu_ps(dst + 6, dstTexCoord0Dir);
+        dstVertices[vIdx].texCoord = texCoord;
+    }
+
+    if (aabb && !srcVertices.empty()) {
+        float minP[4], maxP[4];
+        _mm_storeu_ps(minP, aabbMin);
+        _mm_storeu_ps(maxP, aabbMax);
+        aabb->unify(Point3D(minP[0], minP[1], minP[2]));
+        aabb->unify(Point3D(maxP[0], maxP[1], maxP[2]));
+    }
+#else
+    for (size_t vIdx = 0; vIdx < srcVertices.size(); ++vIdx) {
+        const shared::Vertex &srcV = srcVertices[vIdx];
+        shared::Vertex v;
+        v.position = transform * srcV.position;
+        v.normal = normalize(normalTransform * srcV.normal);
+        v.texCoord0Dir = normalize(transform * srcV.texCoord0Dir);
+        v.texCoord = srcV.texCoord;
+        dstVertices[vIdx] = v;
+        if (aabb)
             aabb->unify(v.position);
-        }
+    }
+#endif
+}
 
-        std::vector<shared::Triangle> triangles;
-        for (uint32_t fIdx = 0; fIdx < aiMesh->mNumFaces; ++fIdx) {
-            const aiFace &aif = aiMesh->mFaces[fIdx];
-            if (aif.mNumIndices != 3)
-                continue;
-            shared::Triangle tri;
-            tri.index0 = aif.mIndices[0];
-            tri.index1 = aif.mIndices[1];
-            tri.index2 = aif.mIndices[2];
-            geom.triangles.push_back(tri);
+static void computeFlattenedMesh(
+    const ImportedScene &scene, const Matrix4x4 &preTransform,
+    std::vector<TriangleGeometryOnCPU>* geometries,
+    AABB* const aabb) {
+    // EN: Allocate the exact outputs of all mesh instances first,
+    //     then transform vertex chunks of the instances in parallel.
+    struct VertexChunk {
+        uint32_t geomIdx;
+        uint32_t beginIdx;
+        uint32_t endIdx;
+        Matrix4x4 transform;
+        std::span<const shared::Vertex> srcVertices;
+    };
+    constexpr uint32_t vertexGrainSize = 16384;
+    std::vector<VertexChunk> chunks;
+    for (const ImportedNode &node : scene.nodes) {
+        const Matrix4x4 curXfm = preTransform * node.transform;
+        for (const uint32_t meshIdx : scene.getMeshIndices(node)) {
+            const ImportedMesh &mesh = scene.meshes[meshIdx];
+            std::vector<shared::Triangle> expandedTriangles;
+            const std::span<const shared::Triangle> srcTriangles = scene.getTriangles(mesh, &expandedTriangles);
+
+            const uint32_t geomIdx = static_cast<uint32_t>(geometries->size());
+            TriangleGeometryOnCPU &geom = geometries->emplace_back();
+            geom.vertices.resize(mesh.numVertices);
+            geom.triangles.assign(srcTriangles.begin(), srcTriangles.end());
+            for (uint32_t beginIdx = 0; beginIdx < mesh.numVertices; beginIdx += vertexGrainSize) {
+                VertexChunk chunk;
+                chunk.geomIdx = geomIdx;
+                chunk.beginIdx = beginIdx;
+                chunk.endIdx = std::min(beginIdx + vertexGrainSize, mesh.numVertices);
+                chunk.transform = curXfm;
+                chunk.srcVertices = scene.getVertices(mesh);
+                chunks.push_back(chunk);
+            }
         }
-
-        geometries->push_back(geom);
     }
 
-    for (uint32_t cIdx = 0; cIdx < curNode->mNumChildren; ++cIdx)
-        computeFlattenedMesh(scene, curXfm, curNode->mChildren[cIdx], geometries, aabb);
+    std::vector<AABB> chunkAabbs(chunks.size());
+    ThreadPool threadPool;
+    parallelFor(
+        &threadPool, 0, static_cast<uint32_t>(chunks.size()), 1,
+        [&](const uint32_t beginChunkIdx, const uint32_t endChunkIdx) {
+        for (uint32_t chunkIdx = beginChunkIdx; chunkIdx < endChunkIdx; ++chunkIdx) {
+            const VertexChunk &chunk = chunks[chunkIdx];
+            TriangleGeometryOnCPU &geom = (*geometries)[chunk.geomIdx];
+            transformVertices(
+                chunk.transform,
+                chunk.srcVertices.subspan(chunk.beginIdx, chunk.endIdx - chunk.beginIdx),
+                geom.vertices.data() + chunk.beginIdx,
+                &chunkAabbs[chunkIdx]);
+        }
+    });
+    for (const AABB &chunkAabb : chunkAabbs)
+        aabb->unify(chunkAabb);
 }
 
 void loadTriangleMeshGeometriesOnCPU(
@@ -2133,24 +3149,43 @@ void loadTriangleMeshGeometriesOnCPU(
     const Matrix4x4 &preTransform,
     std::vector<TriangleGeometryOnCPU>* geometries,
     AABB* aabb) {
-    hpprintf("Reading: %s ... ", filePath.string().c_str());
-    fflush(stdout);
-    Assimp::Importer importer;
-    const aiScene* aiscene = importer.ReadFile(
-        filePath.string(),
-        aiProcess_Triangulate |
-        aiProcess_GenNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_FlipUVs);
-    if (!aiscene) {
-        hpprintf("Failed to load %s.\n", filePath.string().c_str());
+    const std::shared_ptr<const ImportedScene> importedScene = getImportedScene(filePath);
+    if (!importedScene)
         return;
-    }
-    hpprintf("done.\n");
 
     geometries->clear();
     *aabb = AABB();
-    computeFlattenedMesh(aiscene, preTransform, aiscene->mRootNode, geometries, aabb);
+    computeFlattenedMesh(*importedScene, preTransform, geometries, aabb);
+}
+
+void createTriangleMeshBaseGeometry(
+    const std::filesystem::path &filePath,
+    const Matrix4x4 &preTransform,
+    std::vector<shared::Vertex>* vertices,
+    std::vector<shared::Triangle>* triangles) {
+    vertices->clear();
+    triangles->clear();
+    const std::shared_ptr<const ImportedScene> scene = getImportedScene(filePath);
+    if (!scene)
+        return;
+
+    // EN: Merge the mesh instances into a single geometry, transformed directly from the shared scene.
+    std::vector<shared::Triangle> expandedTriangles;
+    for (const ImportedNode &node : scene->nodes) {
+        const Matrix4x4 xfm = preTransform * node.transform;
+        for (const uint32_t meshIdx : scene->getMeshIndices(node)) {
+            const ImportedMesh &mesh = scene->meshes[meshIdx];
+            const uint32_t vtxBaseIdx = static_cast<uint32_t>(vertices->size());
+            vertices->resize(vtxBaseIdx + mesh.numVertices);
+            transformVertices(xfm, scene->getVertices(mesh), vertices->data() + vtxBaseIdx);
+            for (shared::Triangle tri : scene->getTriangles(mesh, &expandedTriangles)) {
+                tri.index0 += vtxBaseIdx;
+                tri.index1 += vtxBaseIdx;
+                tri.index2 += vtxBaseIdx;
+                triangles->push_back(tri);
+            }
+        }
+    }
 }
 
 constexpr bool useLambertMaterial = false;
@@ -2162,36 +3197,22 @@ void createTriangleMeshes(
     const Matrix4x4 &preTransform,
     CUcontext cuContext, Scene* scene, optixu::Material optixMat,
     bool allocateGfxResource) {
-    hpprintf("Reading: %s ... ", filePath.string().c_str());
-    fflush(stdout);
-    Assimp::Importer importer;
-    const aiScene* aiscene = importer.ReadFile(
-        filePath.string(),
-        aiProcess_Triangulate |
-        aiProcess_GenNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_FlipUVs);
-    if (!aiscene) {
-        hpprintf("Failed to load %s.\n", filePath.string().c_str());
+    const std::shared_ptr<const ImportedScene> importedScenePtr = getImportedScene(filePath);
+    if (!importedScenePtr)
         return;
-    }
-    hpprintf("done.\n");
+    const ImportedScene &importedScene = *importedScenePtr;
 
     std::filesystem::path dirPath = filePath;
     dirPath.remove_filename();
 
     uint32_t baseMatIndex = static_cast<uint32_t>(scene->materials.size());
-    for (uint32_t matIdx = 0; matIdx < aiscene->mNumMaterials; ++matIdx) {
+    for (uint32_t matIdx = 0; matIdx < importedScene.materials.size(); ++matIdx) {
         std::filesystem::path emittancePath;
         RGB immEmittance(0.0f);
 
-        const aiMaterial* aiMat = aiscene->mMaterials[matIdx];
-        aiString strValue;
-        float color[3];
+        const ImportedMaterial &srcMat = importedScene.materials[matIdx];
 
-        std::string matName;
-        if (aiMat->Get(AI_MATKEY_NAME, strValue) == aiReturn_SUCCESS)
-            matName = strValue.C_Str();
+        const std::string &matName = srcMat.name;
         hpprintf("%s:\n", matName.c_str());
 
         std::filesystem::path reflectancePath;
@@ -2202,17 +3223,10 @@ void createTriangleMeshes(
         RGB immSpecularColor;
         float immSmoothness;
         if constexpr (useLambertMaterial) {
-            if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
-                reflectancePath = dirPath / strValue.C_Str();
-            }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 1.0f;
-                    color[1] = 0.0f;
-                    color[2] = 1.0f;
-                }
-                immReflectance = RGB(color[0], color[1], color[2]);
-            }
+            if (!srcMat.diffuseTexture.empty())
+                reflectancePath = dirPath / srcMat.diffuseTexture;
+            else
+                immReflectance = srcMat.hasDiffuseColor ? srcMat.diffuseColor : RGB(1.0f, 0.0f, 1.0f);
             (void)diffuseColorPath;
             (void)immDiffuseColor;
             (void)specularColorPath;
@@ -2220,35 +3234,19 @@ void createTriangleMeshes(
             (void)immSmoothness;
         }
         else {
-            if (aiMat->Get(AI_MATKEY_TEXTURE_DIFFUSE(0), strValue) == aiReturn_SUCCESS) {
-                diffuseColorPath = dirPath / strValue.C_Str();
-            }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_DIFFUSE, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 0.0f;
-                    color[1] = 0.0f;
-                    color[2] = 0.0f;
-                }
-                immDiffuseColor = RGB(color[0], color[1], color[2]);
-            }
+            if (!srcMat.diffuseTexture.empty())
+                diffuseColorPath = dirPath / srcMat.diffuseTexture;
+            else
+                immDiffuseColor = srcMat.hasDiffuseColor ? srcMat.diffuseColor : RGB(0.0f);
 
-            if (aiMat->Get(AI_MATKEY_TEXTURE_SPECULAR(0), strValue) == aiReturn_SUCCESS) {
-                specularColorPath = dirPath / strValue.C_Str();
-            }
-            else {
-                if (aiMat->Get(AI_MATKEY_COLOR_SPECULAR, color, nullptr) != aiReturn_SUCCESS) {
-                    color[0] = 0.0f;
-                    color[1] = 0.0f;
-                    color[2] = 0.0f;
-                }
-                immSpecularColor = RGB(color[0], color[1], color[2]);
-            }
+            if (!srcMat.specularTexture.empty())
+                specularColorPath = dirPath / srcMat.specularTexture;
+            else
+                immSpecularColor = srcMat.hasSpecularColor ? srcMat.specularColor : RGB(0.0f);
 
             // JP: 極端に鋭いスペキュラーにするとNEEで寄与が一切サンプルできなくなってしまう。
             // EN: Exteremely sharp specular makes it impossible to sample a contribution with NEE.
-            if (aiMat->Get(AI_MATKEY_SHININESS, &immSmoothness, nullptr) != aiReturn_SUCCESS)
-                immSmoothness = 0.0f;
-            immSmoothness = std::sqrt(immSmoothness);
+            immSmoothness = std::sqrt(srcMat.shininess);
             immSmoothness = immSmoothness / 11.0f/*30.0f*/;
 
             (void)reflectancePath;
@@ -2256,10 +3254,8 @@ void createTriangleMeshes(
         }
 
         std::filesystem::path normalPath;
-        if (aiMat->Get(AI_MATKEY_TEXTURE_HEIGHT(0), strValue) == aiReturn_SUCCESS)
-            normalPath = dirPath / strValue.C_Str();
-        else if (aiMat->Get(AI_MATKEY_TEXTURE_NORMALS(0), strValue) == aiReturn_SUCCESS)
-            normalPath = dirPath / strValue.C_Str();
+        if (!srcMat.normalTexture.empty())
+            normalPath = dirPath / srcMat.normalTexture;
 
         if (matName == "Pavement_Cobblestone_Big_BLENDSHADER") {
             immSmoothness = 0.2f;
@@ -2274,10 +3270,10 @@ void createTriangleMeshes(
             immSmoothness = 0.2f;
         }
 
-        if (aiMat->Get(AI_MATKEY_TEXTURE_EMISSIVE(0), strValue) == aiReturn_SUCCESS)
-            emittancePath = dirPath / strValue.C_Str();
-        else if (aiMat->Get(AI_MATKEY_COLOR_EMISSIVE, color, nullptr) == aiReturn_SUCCESS)
-            immEmittance = RGB(color[0], color[1], color[2]);
+        if (!srcMat.emittanceTexture.empty())
+            emittancePath = dirPath / srcMat.emittanceTexture;
+        else if (srcMat.hasEmittance)
+            immEmittance = srcMat.emittance;
 
         if (matConv == MaterialConvention::Traditional) {
             if constexpr (useLambertMaterial) {
@@ -2312,82 +3308,24 @@ void createTriangleMeshes(
         }
     }
 
+    // EN: The device side reads 32-bit triangles, 16-bit triangles of the scene are expanded for upload.
     uint32_t baseGeomInstIndex = static_cast<uint32_t>(scene->geomInsts.size());
-    for (uint32_t meshIdx = 0; meshIdx < aiscene->mNumMeshes; ++meshIdx) {
-        const aiMesh* aiMesh = aiscene->mMeshes[meshIdx];
-
-        std::vector<shared::Vertex> vertices(aiMesh->mNumVertices);
-        for (int vIdx = 0; vIdx < vertices.size(); ++vIdx) {
-            const aiVector3D &aip = aiMesh->mVertices[vIdx];
-            const aiVector3D &ain = aiMesh->mNormals[vIdx];
-            aiVector3D aitc0dir;
-            if (aiMesh->mTangents)
-                aitc0dir = aiMesh->mTangents[vIdx];
-            if (!aiMesh->mTangents || !std::isfinite(aitc0dir.x)) {
-                const auto makeCoordinateSystem = []
-                (const Normal3D &normal, Vector3D* tangent, Vector3D* bitangent) {
-                    float sign = normal.z >= 0 ? 1.0f : -1.0f;
-                    const float a = -1 / (sign + normal.z);
-                    const float b = normal.x * normal.y * a;
-                    *tangent = Vector3D(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
-                    *bitangent = Vector3D(b, sign + normal.y * normal.y * a, -normal.y);
-                };
-                Vector3D tangent, bitangent;
-                makeCoordinateSystem(Normal3D(ain.x, ain.y, ain.z), &tangent, &bitangent);
-                aitc0dir = aiVector3D(tangent.x, tangent.y, tangent.z);
-            }
-            const aiVector3D ait = aiMesh->mTextureCoords[0] ?
-                aiMesh->mTextureCoords[0][vIdx] :
-                aiVector3D(0.0f, 0.0f, 0.0f);
-
-            shared::Vertex v;
-            v.position = Point3D(aip.x, aip.y, aip.z);
-            v.normal = normalize(Normal3D(ain.x, ain.y, ain.z));
-            v.texCoord0Dir = normalize(Vector3D(aitc0dir.x, aitc0dir.y, aitc0dir.z));
-            v.texCoord = Point2D(ait.x, ait.y);
-            vertices[vIdx] = v;
-        }
-
-        std::vector<shared::Triangle> triangles(aiMesh->mNumFaces);
-        for (int fIdx = 0; fIdx < triangles.size(); ++fIdx) {
-            const aiFace &aif = aiMesh->mFaces[fIdx];
-            if (aif.mNumIndices != 3)
-                continue;
-            shared::Triangle tri;
-            tri.index0 = aif.mIndices[0];
-            tri.index1 = aif.mIndices[1];
-            tri.index2 = aif.mIndices[2];
-            triangles[fIdx] = tri;
-        }
-
+    std::vector<shared::Triangle> expandedTriangles;
+    for (const ImportedMesh &srcMesh : importedScene.meshes) {
         scene->geomInsts.push_back(createGeometryInstance(
-            cuContext, scene, vertices, triangles,
-            scene->materials[baseMatIndex + aiMesh->mMaterialIndex], optixMat,
+            cuContext, scene,
+            importedScene.getVertices(srcMesh), importedScene.getTriangles(srcMesh, &expandedTriangles),
+            scene->materials[baseMatIndex + srcMesh.materialIndex], optixMat,
             allocateGfxResource));
     }
 
-    std::vector<FlattenedNode> flattenedNodes;
-    computeFlattenedNodes(aiscene, preTransform, aiscene->mRootNode, flattenedNodes);
-    //for (int i = 0; i < flattenedNodes.size(); ++i) {
-    //    const Matrix4x4 &mat = flattenedNodes[i].transform;
-    //    hpprintf("%8.5f, %8.5f, %8.5f, %8.5f\n", mat.m00, mat.m01, mat.m02, mat.m03);
-    //    hpprintf("%8.5f, %8.5f, %8.5f, %8.5f\n", mat.m10, mat.m11, mat.m12, mat.m13);
-    //    hpprintf("%8.5f, %8.5f, %8.5f, %8.5f\n", mat.m20, mat.m21, mat.m22, mat.m23);
-    //    hpprintf("%8.5f, %8.5f, %8.5f, %8.5f\n", mat.m30, mat.m31, mat.m32, mat.m33);
-    //    hpprintf("\n");
-    //}
-
     auto mesh = new Mesh();
     shared::InstanceData* instDataOnHost = scene->instDataBuffer[0].getMappedPointer();
     std::map<std::set<const GeometryInstance*>, GeometryGroup*> geomGroupMap;
-    for (int nodeIdx = 0; nodeIdx < flattenedNodes.size(); ++nodeIdx) {
-        const FlattenedNode &node = flattenedNodes[nodeIdx];
-        if (node.meshIndices.size() == 0)
-            continue;
-
+    for (const ImportedNode &node : importedScene.nodes) {
         std::set<const GeometryInstance*> srcGeomInsts;
-        for (int i = 0; i < node.meshIndices.size(); ++i)
-            srcGeomInsts.insert(scene->geomInsts[baseGeomInstIndex + node.meshIndices[i]]);
+        for (const uint32_t meshIdx : importedScene.getMeshIndices(node))
+            srcGeomInsts.insert(scene->geomInsts[baseGeomInstIndex + meshIdx]);
         GeometryGroup* geomGroup;
         if (geomGroupMap.count(srcGeomInsts) > 0) {
             geomGroup = geomGroupMap.at(srcGeomInsts);
@@ -2399,7 +3337,7 @@ void createTriangleMeshes(
 
         Mesh::GeometryGroupInstance g = {};
         g.geomGroup = geomGroup;
-        g.transform = node.transform;
+        g.transform = preTransform * node.transform;
         mesh->groupInsts.push_back(g);
     }
 
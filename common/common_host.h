@@ -11,10 +11,15 @@
 #include <set>
 #include <map>
 #include <unordered_set>
+#include <unordered_map>
 #include <random>
 #include <filesystem>
 #include <functional>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 #include <chrono>
 #include <variant>
 
@@ -591,6 +596,178 @@ public:
 
 
 
+// EN: Fixed-size thread pool for CPU-side parallel work (e.g. BVH build).
+//     A thread waiting for a task group executes pending jobs by itself,
+//     so nested parallelism does not dead-lock even with zero worker threads.
+//     It sleeps when there is no pending job until a job is enqueued or the group completes.
+class ThreadPool {
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_waiterCond;
+    uint32_t m_numWaiters;
+    bool m_terminate;
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void workerLoop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [this]() { return m_terminate || !m_jobs.empty(); });
+                if (m_jobs.empty())
+                    return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    // EN: numThreads includes the calling thread. 0 means the number of hardware threads.
+    explicit ThreadPool(uint32_t numThreads = 0) : m_numWaiters(0), m_terminate(false) {
+        if (numThreads == 0)
+            numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        m_workers.reserve(numThreads - 1);
+        for (uint32_t i = 1; i < numThreads; ++i)
+            m_workers.emplace_back([this]() { workerLoop(); });
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_terminate = true;
+        }
+        m_cond.notify_all();
+        for (std::thread &worker : m_workers)
+            worker.join();
+    }
+
+    uint32_t getNumThreads() const {
+        return static_cast<uint32_t>(m_workers.size()) + 1;
+    }
+
+    void enqueue(std::function<void()> &&job) {
+        bool hasWaiters;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+            hasWaiters = m_numWaiters > 0;
+        }
+        m_cond.notify_one();
+        if (hasWaiters)
+            m_waiterCond.notify_all();
+    }
+
+    bool runPendingJob() {
+        std::function<void()> job;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_jobs.empty())
+                return false;
+            job = std::move(m_jobs.back());
+            m_jobs.pop_back();
+        }
+        job();
+        return true;
+    }
+
+    // EN: Block until a job is pending or isDone() holds. isDone() must be signaled by notifyWaiters().
+    template <typename Pred>
+    void waitForJobOr(const Pred &isDone) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_numWaiters;
+        m_waiterCond.wait(lock, [this, &isDone]() { return !m_jobs.empty() || isDone(); });
+        --m_numWaiters;
+    }
+
+    void notifyWaiters() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_waiterCond.notify_all();
+    }
+};
+
+// EN: An exception thrown by a job is rethrown from wait(). Only the first one is kept.
+class TaskGroup {
+    ThreadPool &m_pool;
+    std::atomic<uint32_t> m_numPendingJobs;
+    std::mutex m_exceptionMutex;
+    std::exception_ptr m_exception;
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void waitForJobs() {
+        const auto isDone = [this]() { return m_numPendingJobs.load() == 0; };
+        while (!isDone()) {
+            if (!m_pool.runPendingJob())
+                m_pool.waitForJobOr(isDone);
+        }
+    }
+
+public:
+    TaskGroup(ThreadPool &pool) : m_pool(pool), m_numPendingJobs(0) {}
+    ~TaskGroup() {
+        waitForJobs();
+    }
+
+    template <typename Func>
+    void run(Func &&func) {
+        ++m_numPendingJobs;
+        m_pool.enqueue([this, &pool = m_pool, func = std::forward<Func>(func)]() mutable {
+            try {
+                func();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m_exceptionMutex);
+                if (!m_exception)
+                    m_exception = std::current_exception();
+            }
+            // EN: The group can be destroyed as soon as the count reaches zero.
+            if (--m_numPendingJobs == 0)
+                pool.notifyWaiters();
+        });
+    }
+
+    void wait() {
+        waitForJobs();
+        std::exception_ptr exception;
+        {
+            std::lock_guard<std::mutex> lock(m_exceptionMutex);
+            exception = m_exception;
+            m_exception = nullptr;
+        }
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+// EN: Calls func(beginIdx, endIdx) for sub-ranges of [begin, end) in parallel.
+template <typename Func>
+void parallelFor(
+    ThreadPool* const pool, const uint32_t begin, const uint32_t end, const uint32_t grainSize,
+    const Func &func) {
+    if (begin >= end)
+        return;
+    if (pool == nullptr || pool->getNumThreads() == 1 || end - begin <= grainSize) {
+        func(begin, end);
+        return;
+    }
+    TaskGroup taskGroup(*pool);
+    for (uint32_t chunkBegin = begin; chunkBegin < end; chunkBegin += grainSize) {
+        const uint32_t chunkEnd = std::min(chunkBegin + grainSize, end);
+        taskGroup.run([&func, chunkBegin, chunkEnd]() { func(chunkBegin, chunkEnd); });
+    }
+    taskGroup.wait();
+}
+
+
+
 enum class MaterialConvention {
     Traditional = 0,
     SimplePBR,
@@ -651,7 +828,7 @@ struct TriangleGeometry {
     glu::Buffer gfxVertexBuffer;
     glu::Buffer gfxTriangleBuffer;
     glu::VertexArray gfxVertexArray;
-    cudau::TypedBuffer<shared::Vertex> vertexBuffer;
+    cudau::TypedBuffer<shared::VertexBufferElement> vertexBuffer;
     cudau::TypedBuffer<shared::Triangle> triangleBuffer;
     LightDistribution emitterPrimDist;
 };
@@ -662,7 +839,7 @@ struct CurveGeometry {
 };
 
 struct TFDMGeometry {
-    cudau::TypedBuffer<shared::Vertex> vertexBuffer;
+    cudau::TypedBuffer<shared::VertexBufferElement> vertexBuffer;
     cudau::TypedBuffer<shared::Triangle> triangleBuffer;
     cudau::TypedBuffer<AABB> aabbBuffer;
     Texture texHeight;
@@ -701,7 +878,7 @@ struct ShellBVH {
 };
 
 struct NRTDSMGeometry {
-    cudau::TypedBuffer<shared::Vertex> vertexBuffer;
+    cudau::TypedBuffer<shared::VertexBufferElement> vertexBuffer;
     cudau::TypedBuffer<shared::Triangle> triangleBuffer;
     cudau::TypedBuffer<AABB> aabbBuffer;
     cudau::TypedBuffer<shared::NRTDSMTriangleAuxInfo> triAuxInfoBuffer;
@@ -1426,10 +1603,15 @@ void createSimplePBRMaterial(
     const std::filesystem::path &normalPath,
     const std::filesystem::path &emittancePath, const RGB &immEmittance);
 
+// EN: Upload vertices converting to the device vertex format.
+void initializeVertexBuffer(
+    CUcontext cuContext, std::span<const shared::Vertex> vertices,
+    cudau::TypedBuffer<shared::VertexBufferElement>* vertexBuffer);
+
 GeometryInstance* createGeometryInstance(
     CUcontext cuContext, Scene* scene,
-    const std::vector<shared::Vertex> &vertices,
-    const std::vector<shared::Triangle> &triangles,
+    std::span<const shared::Vertex> vertices,
+    std::span<const shared::Triangle> triangles,
     const Material* mat, optixu::Material optixMat,
     bool allocateGfxResource);
 
@@ -1460,12 +1642,114 @@ struct TriangleGeometryOnCPU {
     std::vector<shared::Triangle> triangles;
 };
 
+// EN: Transform positions and tangents by a matrix and normals by its inverse transpose, then renormalize.
+//     The AABB is expanded by the transformed positions when given. In-place transform is allowed.
+void transformVertices(
+    const Matrix4x4 &transform,
+    std::span<const shared::Vertex> srcVertices, shared::Vertex* dstVertices,
+    AABB* aabb = nullptr);
+
+// EN: Material parameters read from an Assimp material. Texture paths are relative to the scene file.
+struct ImportedMaterial {
+    std::string name;
+    std::string diffuseTexture;
+    std::string specularTexture;
+    std::string normalTexture;
+    std::string emittanceTexture;
+    RGB diffuseColor;
+    RGB specularColor;
+    RGB emittance;
+    float shininess;
+    bool hasDiffuseColor;
+    bool hasSpecularColor;
+    bool hasEmittance;
+};
+
+enum class ImportedIndexFormat : uint32_t {
+    UI32x3 = 0,
+    UI16x3,
+};
+
+struct ImportedTriangle16 {
+    uint16_t index0, index1, index2;
+};
+
+// EN: Object space vertices and triangles of a mesh as ranges in the scene arrays.
+//     The triangle range is in the 16-bit triangle array when the index format is UI16x3.
+struct ImportedMesh {
+    uint32_t vertexOffset;
+    uint32_t numVertices;
+    uint32_t triangleOffset;
+    uint32_t numTriangles;
+    uint32_t materialIndex;
+    ImportedIndexFormat indexFormat;
+};
+
+// EN: Node with meshes in the pre-order of the node hierarchy. The transform is relative to the scene root.
+struct ImportedNode {
+    Matrix4x4 transform;
+    uint32_t meshIndexOffset;
+    uint32_t numMeshes;
+};
+
+// EN: Scene converted from Assimp output. The arrays refer to the storage,
+//     the mapped scene cache file or the in-memory image of the cache file made by a fresh import.
+struct ImportedScene {
+    std::vector<ImportedMaterial> materials;
+    std::span<const ImportedMesh> meshes;
+    std::span<const ImportedNode> nodes;
+    std::span<const uint32_t> nodeMeshIndices;
+    std::span<const shared::Vertex> vertices;
+    std::span<const shared::Triangle> triangles;
+    std::span<const ImportedTriangle16> triangles16;
+    std::shared_ptr<const void> storage;
+
+    std::span<const shared::Vertex> getVertices(const ImportedMesh &mesh) const {
+        return vertices.subspan(mesh.vertexOffset, mesh.numVertices);
+    }
+    // EN: Triangles with 16-bit indices are expanded into the given storage.
+    std::span<const shared::Triangle> getTriangles(
+        const ImportedMesh &mesh, std::vector<shared::Triangle>* expandedTriangles) const {
+        if (mesh.indexFormat == ImportedIndexFormat::UI32x3)
+            return triangles.subspan(mesh.triangleOffset, mesh.numTriangles);
+        const std::span<const ImportedTriangle16> srcTriangles = getTriangles16(mesh);
+        expandedTriangles->resize(srcTriangles.size());
+        for (uint32_t triIdx = 0; triIdx < srcTriangles.size(); ++triIdx) {
+            const ImportedTriangle16 &srcTri = srcTriangles[triIdx];
+            (*expandedTriangles)[triIdx] = shared::Triangle{ srcTri.index0, srcTri.index1, srcTri.index2 };
+        }
+        return *expandedTriangles;
+    }
+    std::span<const ImportedTriangle16> getTriangles16(const ImportedMesh &mesh) const {
+        Assert(mesh.indexFormat == ImportedIndexFormat::UI16x3, "The mesh doesn't have 16-bit indices.");
+        return triangles16.subspan(mesh.triangleOffset, mesh.numTriangles);
+    }
+    std::span<const uint32_t> getMeshIndices(const ImportedNode &node) const {
+        return nodeMeshIndices.subspan(node.meshIndexOffset, node.numMeshes);
+    }
+};
+
+// EN: Import a scene file once while any user holds it, keyed by the path and the options.
+//     The scene is immutable and shared by all users including the loaders below,
+//     use it directly instead of a transformed copy where possible. Returns nullptr when loading fails.
+//     optimizeMeshes welds identical vertices, reorders triangles and vertices for locality and
+//     uses 16-bit triangles for small meshes when the scene is converted into the cache.
+std::shared_ptr<const ImportedScene> getImportedScene(
+    const std::filesystem::path &filePath, bool optimizeMeshes = false);
+
 void loadTriangleMeshGeometriesOnCPU(
     const std::filesystem::path &filePath,
     const Matrix4x4 &preTransform,
     std::vector<TriangleGeometryOnCPU>* geometries,
     AABB* aabb);
 
+// EN: Merge all the mesh instances of a scene file into a single triangle list with 32-bit indices.
+void createTriangleMeshBaseGeometry(
+    const std::filesystem::path &filePath,
+    const Matrix4x4 &preTransform,
+    std::vector<shared::Vertex>* vertices,
+    std::vector<shared::Triangle>* triangles);
+
 void createTriangleMeshes(
     const std::string &meshName,
     const std::filesystem::path &filePath,
@@ -1030,9 +1030,10 @@ namespace shared {
             uint32_t slot : 3;
         };
         uint32_t asUInt;
-        ParentPointer() {}
-        ParentPointer(const uint32_t v) : asUInt(v) {}
-        ParentPointer(const uint32_t _index, const uint32_t _slot) : index(_index), slot(_slot) {}
+        CUDA_COMMON_FUNCTION CUDA_INLINE ParentPointer() {}
+        CUDA_COMMON_FUNCTION CUDA_INLINE ParentPointer(const uint32_t v) : asUInt(v) {}
+        CUDA_COMMON_FUNCTION CUDA_INLINE ParentPointer(const uint32_t _index, const uint32_t _slot) :
+            index(_index), slot(_slot) {}
     };
 
     template <uint32_t arity>
@@ -1043,6 +1044,164 @@ namespace shared {
         ROBuffer<ParentPointer> parentPointers;
     };
 
+    struct ShortStackTraversalStatistics {
+        uint32_t numStackSpills;
+        uint32_t numParentPointerAccesses;
+        uint32_t numNodeRevisits;
+    };
+
+    // EN: Bounded memory traversal using a short stack of fixed size and backtracking via parent pointers.
+    //     The short stack only caches the remaining child order of ancestor nodes.
+    //     When it overflows, the oldest entry is dropped and the children of that node are tested again
+    //     when the traversal climbs back to it through the parent pointers.
+    //     To be able to reconstruct the visiting order, the order key of a child must not depend on
+    //     the current max distance.
+    //     testChild(intNode, slot, &entryDist) must return whether the ray hits the child ignoring the max distance
+    //     and set the entry distance used both as the order key and for culling by curDistMax.
+    //     It must return the same result for the same child.
+    //     testLeafItem(primRefIdx) tests an item in a leaf and returns whether the item is the end of the leaf.
+    //     The hit leaves of a node are tested before descending to its internal children.
+    //     IntNodeBuffer and ParentPointerBuffer can be anything with operator[] (raw pointers, spans, ROBuffers).
+    template <
+        uint32_t arity, uint32_t shortStackSize,
+        typename IntNodeBuffer, typename ParentPointerBuffer, typename ChildTestFunc, typename LeafFunc>
+    CUDA_COMMON_FUNCTION CUDA_INLINE void traverseWithShortStack(
+        const IntNodeBuffer &intNodes, const ParentPointerBuffer &parentPointers, const uint32_t rootNodeIndex,
+        const float &curDistMax, ChildTestFunc &testChild, LeafFunc &testLeafItem,
+        ShortStackTraversalStatistics* const stats = nullptr) {
+        static_assert(shortStackSize > 0, "Short stack size must be positive.");
+        static_assert(arity <= 8, "Arity larger than 8 is not supported.");
+        constexpr uint32_t orderBitWidth = tzcntConst(arity);
+        constexpr uint32_t orderMask = (1 << orderBitWidth) - 1;
+        constexpr uint32_t noSlot = arity;
+
+        struct Entry {
+            uint32_t nodeIndex;
+            uint32_t orderInfo : 28;
+            uint32_t numItems : 4;
+        };
+        // EN: A ring buffer so that an overflow drops the oldest entry.
+        Entry stack[shortStackSize] = {};
+        uint32_t stackBase = 0;
+        uint32_t stackCount = 0;
+        bool stackSpilled = false;
+
+        uint32_t nodeIndex = rootNodeIndex;
+        // EN: The slot of the child from which the traversal climbed back, noSlot when entering a node freshly.
+        uint32_t returnedSlot = noSlot;
+        while (true) {
+            const auto &intNode = intNodes[nodeIndex];
+
+            uint32_t orderInfo = 0;
+            uint32_t numItems = 0;
+            if (returnedSlot != noSlot &&
+                stackCount > 0 &&
+                stack[(stackBase + stackCount - 1) % shortStackSize].nodeIndex == nodeIndex) {
+                const Entry &entry = stack[(stackBase + stackCount - 1) % shortStackSize];
+                orderInfo = entry.orderInfo;
+                numItems = entry.numItems;
+                --stackCount;
+            }
+            // EN: The remaining children are not cached. This happens for a fresh node or for a node whose
+            //     stack entry might have been dropped.
+            //     A node with remaining children is always newer than the entries in the stack,
+            //     so the entry can only be lost when the stack is empty.
+            else if (returnedSlot == noSlot || (stackCount == 0 && stackSpilled)) {
+                const bool revisit = returnedSlot != noSlot;
+                uint32_t returnedKey = 0;
+                if (revisit) {
+                    float entryDist;
+                    testChild(intNode, returnedSlot, &entryDist);
+                    returnedKey = floatToOrderedUInt(entryDist);
+                    if (stats)
+                        ++stats->numNodeRevisits;
+                }
+
+                uint32_t keys[arity];
+                uint32_t slots[arity];
+                uint32_t numHits = 0;
+                for (uint32_t slot = 0; slot < arity; ++slot) {
+                    if (!intNode.getChildIsValid(slot))
+                        break;
+                    const bool isLeaf = intNode.getChildIsLeaf(slot);
+                    // EN: Leaves have already been tested when visiting the node first.
+                    if (revisit && isLeaf)
+                        continue;
+                    float entryDist;
+                    if (!testChild(intNode, slot, &entryDist) || entryDist > curDistMax)
+                        continue;
+                    const uint32_t key = floatToOrderedUInt(entryDist);
+                    if (revisit &&
+                        (key < returnedKey || (key == returnedKey && slot <= returnedSlot)))
+                        continue;
+
+                    // EN: Leaves come first, then (key, slot) in ascending order.
+                    uint32_t pos = numHits;
+                    while (pos > 0) {
+                        const uint32_t prevSlot = slots[pos - 1];
+                        const bool prevIsLeaf = intNode.getChildIsLeaf(prevSlot);
+                        const bool prevIsLater =
+                            prevIsLeaf == isLeaf ?
+                            (keys[pos - 1] > key || (keys[pos - 1] == key && prevSlot > slot)) :
+                            !prevIsLeaf;
+                        if (!prevIsLater)
+                            break;
+                        keys[pos] = keys[pos - 1];
+                        slots[pos] = slots[pos - 1];
+                        --pos;
+                    }
+                    keys[pos] = key;
+                    slots[pos] = slot;
+                    ++numHits;
+                }
+
+                for (uint32_t hitIdx = 0; hitIdx < numHits; ++hitIdx) {
+                    const uint32_t slot = slots[hitIdx];
+                    if (intNode.getChildIsLeaf(slot)) {
+                        uint32_t primRefIdx = intNode.leafBaseIndex + intNode.getLeafOffset(slot);
+                        while (true) {
+                            if (testLeafItem(primRefIdx++))
+                                break;
+                        }
+                    }
+                    else {
+                        orderInfo |= slot << (orderBitWidth * numItems);
+                        ++numItems;
+                    }
+                }
+            }
+
+            if (numItems > 0) {
+                const uint32_t slot = orderInfo & orderMask;
+                if (numItems > 1) {
+                    if (stackCount == shortStackSize) {
+                        stackBase = (stackBase + 1) % shortStackSize;
+                        --stackCount;
+                        stackSpilled = true;
+                        if (stats)
+                            ++stats->numStackSpills;
+                    }
+                    Entry &entry = stack[(stackBase + stackCount) % shortStackSize];
+                    entry.nodeIndex = nodeIndex;
+                    entry.orderInfo = orderInfo >> orderBitWidth;
+                    entry.numItems = numItems - 1;
+                    ++stackCount;
+                }
+                nodeIndex = intNode.intNodeChildBaseIndex + intNode.getInternalChildNumber(slot);
+                returnedSlot = noSlot;
+            }
+            else {
+                if (nodeIndex == rootNodeIndex)
+                    break;
+                const ParentPointer parent = parentPointers[nodeIndex];
+                if (stats)
+                    ++stats->numParentPointerAccesses;
+                nodeIndex = parent.index;
+                returnedSlot = parent.slot;
+            }
+        }
+    }
+
     struct InstanceReference {
         Matrix3x3 rotToObj;
         Vector3D transToObj;
@@ -1122,6 +1281,96 @@ namespace shared {
         uint32_t index0, index1, index2;
     };
 
+    // EN: Octahedral encoding of a direction into two snorm16 values (x in the lower 16 bits).
+    CUDA_COMMON_FUNCTION CUDA_INLINE uint32_t encodeOctahedralDirection(const Vector3D &v) {
+        const float l1Norm = std::fabs(v.x) + std::fabs(v.y) + std::fabs(v.z);
+        if (l1Norm == 0.0f)
+            return 0;
+        float px = v.x / l1Norm;
+        float py = v.y / l1Norm;
+        if (v.z < 0.0f) {
+            const float foldedX = (1.0f - std::fabs(py)) * (px >= 0.0f ? 1.0f : -1.0f);
+            const float foldedY = (1.0f - std::fabs(px)) * (py >= 0.0f ? 1.0f : -1.0f);
+            px = foldedX;
+            py = foldedY;
+        }
+        const int32_t ix = static_cast<int32_t>(std::round(stc::clamp(px, -1.0f, 1.0f) * 32767.0f));
+        const int32_t iy = static_cast<int32_t>(std::round(stc::clamp(py, -1.0f, 1.0f) * 32767.0f));
+        return (static_cast<uint32_t>(ix) & 0xFFFF) | (static_cast<uint32_t>(iy) << 16);
+    }
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE Vector3D decodeOctahedralDirection(const uint32_t packed) {
+        const float px = stc::max(static_cast<int16_t>(packed & 0xFFFF) / 32767.0f, -1.0f);
+        const float py = stc::max(static_cast<int16_t>(packed >> 16) / 32767.0f, -1.0f);
+        Vector3D v(px, py, 1.0f - std::fabs(px) - std::fabs(py));
+        const float t = stc::max(-v.z, 0.0f);
+        v.x += v.x >= 0.0f ? -t : t;
+        v.y += v.y >= 0.0f ? -t : t;
+        return normalize(v);
+    }
+
+    // EN: Conversion between float and IEEE half, rounding to nearest even.
+    CUDA_COMMON_FUNCTION CUDA_INLINE uint32_t encodeHalf(const float x) {
+        uint32_t bits = stc::bit_cast<uint32_t>(x);
+        const uint32_t sign = bits & 0x8000'0000;
+        bits ^= sign;
+        uint32_t ret;
+        if (bits >= 0x4780'0000) { // inf, nan or overflow
+            ret = bits > 0x7F80'0000 ? 0x7E00 : 0x7C00;
+        }
+        else if (bits < 0x3880'0000) { // denormal or zero
+            ret = stc::bit_cast<uint32_t>(stc::bit_cast<float>(bits) + 0.5f) - 0x3F00'0000;
+        }
+        else {
+            const uint32_t mantissaIsOdd = (bits >> 13) & 1;
+            bits += (static_cast<uint32_t>(15 - 127) << 23) + 0xFFF + mantissaIsOdd;
+            ret = bits >> 13;
+        }
+        return ret | (sign >> 16);
+    }
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE float decodeHalf(const uint32_t half) {
+        uint32_t bits = (half & 0x7FFF) << 13;
+        if (bits >= 0x0F80'0000) // inf or nan
+            bits |= 0x7000'0000;
+        const float ret = stc::bit_cast<float>(bits) * stc::bit_cast<float>(0x7780'0000u); // 2^112
+        return (half & 0x8000) ? -ret : ret;
+    }
+
+    // EN: 24-byte vertex for the device vertex buffers.
+    //     The position stays in full precision at the head since the acceleration structure builds read it in place.
+    struct PackedVertex {
+        Point3D position;
+        uint32_t normal; // octahedral
+        uint32_t texCoord0Dir; // octahedral
+        uint32_t texCoord; // half2
+
+        CUDA_COMMON_FUNCTION CUDA_INLINE operator Vertex() const {
+            Vertex v;
+            v.position = position;
+            v.normal = Normal3D(decodeOctahedralDirection(normal));
+            v.texCoord0Dir = decodeOctahedralDirection(texCoord0Dir);
+            v.texCoord = Point2D(decodeHalf(texCoord & 0xFFFF), decodeHalf(texCoord >> 16));
+            return v;
+        }
+    };
+
+    CUDA_COMMON_FUNCTION CUDA_INLINE PackedVertex packVertex(const Vertex &v) {
+        PackedVertex ret;
+        ret.position = v.position;
+        ret.normal = encodeOctahedralDirection(Vector3D(v.normal));
+        ret.texCoord0Dir = encodeOctahedralDirection(v.texCoord0Dir);
+        ret.texCoord = encodeHalf(v.texCoord.x) | (encodeHalf(v.texCoord.y) << 16);
+        return ret;
+    }
+
+    // EN: Switch the device vertex buffers between Vertex (44 bytes) and PackedVertex (24 bytes)
+    //     to compare the memory footprint, bandwidth and frame time.
+    //     Kernels read either through Vertex since PackedVertex decodes on conversion.
+    //     PackedVertex is lossy, half texture coordinates have a step of 0.06 at |uv| = 100 for example.
+    static constexpr bool usePackedVertices = false;
+    using VertexBufferElement = std::conditional_t<usePackedVertices, PackedVertex, Vertex>;
+
     struct MaterialData;
 
     struct BSDFFlags {
@@ -1179,7 +1428,7 @@ namespace shared {
     struct GeometryInstanceData {
         union {
             struct {
-                ROBuffer<Vertex> vertexBuffer;
+                ROBuffer<VertexBufferElement> vertexBuffer;
                 ROBuffer<Triangle> triangleBuffer;
             };
             struct {
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "basic_types.h"
+#include <filesystem>
+#if !defined(HP_Platform_Windows_MSVC)
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+// EN: Read-only file mapping. The mapping stays valid after closing the file handles.
+class MappedFile {
+    const uint8_t* m_data;
+    size_t m_size;
+
+public:
+    MappedFile() : m_data(nullptr), m_size(0) {}
+    ~MappedFile() {
+        close();
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&b) noexcept : m_data(b.m_data), m_size(b.m_size) {
+        b.m_data = nullptr;
+        b.m_size = 0;
+    }
+    MappedFile &operator=(MappedFile &&b) noexcept {
+        if (this != &b) {
+            close();
+            m_data = b.m_data;
+            m_size = b.m_size;
+            b.m_data = nullptr;
+            b.m_size = 0;
+        }
+        return *this;
+    }
+
+    bool open(const std::filesystem::path &filePath) {
+        close();
+
+#if defined(HP_Platform_Windows_MSVC)
+        const HANDLE fileHandle = CreateFileW(
+            filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(fileHandle, &fileSize) && fileSize.QuadPart > 0) {
+            const HANDLE mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mappingHandle) {
+                m_data = reinterpret_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+                m_size = m_data ? static_cast<size_t>(fileSize.QuadPart) : 0;
+                CloseHandle(mappingHandle);
+            }
+        }
+        CloseHandle(fileHandle);
+#else
+        const int fd = ::open(filePath.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+            void* const addr = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                m_data = reinterpret_cast<const uint8_t*>(addr);
+                m_size = static_cast<size_t>(fileStat.st_size);
+            }
+        }
+        ::close(fd);
+#endif
+
+        return m_data != nullptr;
+    }
+    void close() {
+        if (!m_data)
+            return;
+#if defined(HP_Platform_Windows_MSVC)
+        UnmapViewOfFile(m_data);
+#else
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const uint8_t* getData() const {
+        return m_data;
+    }
+    size_t getSize() const {
+        return m_size;
+    }
+};
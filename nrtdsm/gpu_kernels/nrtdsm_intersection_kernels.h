@@ -6,6 +6,11 @@ using namespace shared;
 
 #define DEBUG_TRAVERSAL 0
 
+// EN: Traverse the shell BVH with a short stack and backtracking via the parent pointers
+//     instead of the full compressed stack, bounding the per-thread stack memory.
+#define USE_SHORT_STACK_SHELL_BVH_TRAVERSAL 0
+static constexpr uint32_t shellBvhShortStackSize = 2;
+
 CUDA_DEVICE_FUNCTION CUDA_INLINE bool isDebugPixel() {
     //return optixGetLaunchIndex().x == 935 && optixGetLaunchIndex().y == 358;
     return isCursorPixel();
@@ -1265,6 +1270,72 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE bool testNonlinearRayVsShellBvh(
 
     *hitDist = distMax;
 
+#if USE_SHORT_STACK_SHELL_BVH_TRAVERSAL
+    // EN: The entry distance is computed against the initial max distance so that it can serve as
+    //     a stable order key when the traversal revisits a node.
+    const auto testChild = [&]
+    (const InternalNode &intNode, const uint32_t slot, float* const entryDist) {
+        AABB aabb = intNode.getChildAabb(slot);
+        aabb.minP.x += bvhShift.x;
+        aabb.minP.y += bvhShift.y;
+        aabb.maxP.x += bvhShift.x;
+        aabb.maxP.y += bvhShift.y;
+        const Point2D minP = aabb.minP.xy();
+        const Point2D maxP = aabb.maxP.xy();
+        const TriangleSquareIntersection2DResult isectResult =
+            testTriangleRectangleIntersection2D(
+                tcA, tcB, tcC, tcFlipped, texTriEdgeNormals, texTriAabbMinP, texTriAabbMaxP,
+                0.5f * (minP + maxP), 0.5f * (maxP - minP));
+        if (isectResult == TriangleSquareIntersection2DResult::SquareOutsideTriangle)
+            return false;
+        if constexpr (outputTravStats)
+            ++travStats->numAabbTests;
+        float aabbHitDistMax;
+        return testNonlinearRayVsAabb(
+            pA, pB, pC, nA, nB, nC,
+            aabb,
+            rayOrg, rayDir, recSqRayLength, distMin, distMax,
+            bc2, bc1, bc0, denom2, denom1, denom0,
+            tc2, tc1, tc0,
+            entryDist, &aabbHitDistMax);
+    };
+    const auto testLeafItem = [&]
+    (const uint32_t primRefIdx) {
+        const shared::PrimitiveReference primRef = shellBvh.primRefs[primRefIdx];
+        const TriangleStorage &triStorage = shellBvh.triStorages[primRef.storageIndex];
+        float tt;
+        Normal3D nn;
+        Point3D hpInCan;
+        const Vector3D triShift(bvhShift, 0.0f);
+        const Point3D mpA = triStorage.pA + triShift;
+        const Point3D mpB = triStorage.pB + triShift;
+        const Point3D mpC = triStorage.pC + triShift;
+        const bool triHit = testNonlinearRayVsMicroTriangle(
+            pA, pB, pC,
+            nA, nB, nC,
+            tcA, tcB, tcC,
+            mpA, mpB, mpC,
+            rayOrg, rayDir, recSqRayLength,
+            distMin, *hitDist,
+            e0, e1,
+            tc2, tc1, tc0,
+            denom2, denom1, denom0,
+            &hpInCan, &tt, &nn);
+        if (triHit) {
+            *hitDist = tt;
+            *hitPointInCan = hpInCan;
+            *hitNormalInObj = nn;
+            *hitGeomIndex = triStorage.geomIndex;
+        }
+        if constexpr (outputTravStats)
+            ++travStats->numLeafTests;
+        return static_cast<bool>(primRef.isLeafEnd);
+    };
+
+    traverseWithShortStack<shellBvhArity, shellBvhShortStackSize>(
+        shellBvh.intNodes, shellBvh.parentPointers, 0,
+        *hitDist, testChild, testLeafItem);
+#else
     union Entry {
         struct {
             uint32_t baseIndex : 31;
@@ -1486,6 +1557,7 @@ CUDA_DEVICE_FUNCTION CUDA_INLINE bool testNonlinearRayVsShellBvh(
             }
         }
     }
+#endif
 
     if (*hitDist == distMax)
         return false;
@@ -717,51 +717,6 @@ static void createSphereBaseGeometry(
     //(*triangles)[1] = shared::Triangle{ 0, 3, 1 };
 }
 
-struct BaseGeometry {
-    std::vector<shared::Vertex> vertices;
-    std::vector<shared::Triangle> triangles;
-};
-
-static std::map<std::filesystem::path, BaseGeometry> g_baseGeomCache;
-
-static void createTriangleMeshBaseGeometry(
-    const std::filesystem::path &filePath,
-    const Matrix4x4 &preTransform,
-    std::vector<shared::Vertex>* vertices,
-    std::vector<shared::Triangle>* triangles) {
-    if (!g_baseGeomCache.contains(filePath)) {
-        BaseGeometry baseGeom;
-
-        std::vector<TriangleGeometryOnCPU> geometries;
-        AABB aabb;
-        loadTriangleMeshGeometriesOnCPU(
-            filePath,
-            preTransform,
-            &geometries, &aabb);
-
-        uint32_t vtxBaseIdx = 0;
-        for (uint32_t geomIdx = 0; geomIdx < geometries.size(); ++geomIdx) {
-            const TriangleGeometryOnCPU &srcGeom = geometries[geomIdx];
-            baseGeom.vertices.insert(
-                baseGeom.vertices.end(), srcGeom.vertices.begin(), srcGeom.vertices.end());
-            for (uint32_t triIdx = 0; triIdx < srcGeom.triangles.size(); ++triIdx) {
-                shared::Triangle tri = srcGeom.triangles[triIdx];
-                tri.index0 += vtxBaseIdx;
-                tri.index1 += vtxBaseIdx;
-                tri.index2 += vtxBaseIdx;
-                baseGeom.triangles.push_back(tri);
-            }
-            vtxBaseIdx += srcGeom.vertices.size();
-        }
-
-        g_baseGeomCache[filePath] = std::move(baseGeom);
-    }
-
-    const BaseGeometry &baseGeom = g_baseGeomCache.at(filePath);
-    *vertices = baseGeom.vertices;
-    *triangles = baseGeom.triangles;
-}
-
 // END: Base Geometries
 // ----------------------------------------------------------------
 
@@ -821,21 +776,62 @@ static void buildOneBoxShellBvh(
     *retBvh = bvh;
 }
 
-static std::map<std::filesystem::path, bvh::GeometryBVH<shared::shellBvhArity>> g_shellBvhCache;
+// EN: A shell BVH is either mapped from the on-disk cache or built in this process.
+struct ShellBvhCacheEntry {
+    bvh::MappedGeometryBVH<shared::shellBvhArity> mappedBvh;
+    bvh::GeometryBVH<shared::shellBvhArity> bvh;
+};
+
+static std::map<std::filesystem::path, ShellBvhCacheEntry> g_shellBvhCache;
 
 static void buildTriangleMeshShellBvh(
     const std::filesystem::path &filePath,
     bool isYup,
-    bvh::GeometryBVH<shared::shellBvhArity>* retBvh) {
+    bvh::GeometryBVHView<shared::shellBvhArity>* retBvh) {
     if (!g_shellBvhCache.contains(filePath)) {
-        std::vector<bvh::Geometry> bvhGeometries;
+        bvh::GeometryBVHBuildConfig config = {};
+        config.splittingBudget = 0.3f;
+        config.intNodeTravCost = 1.2f;
+        config.primIntersectCost = 1.0f;
+        config.minNumPrimsPerLeaf = 1;
+        config.maxNumPrimsPerLeaf = 128;
+        config.builder = bvh::GeometryBVHBuilder::SBVH;
+
+        // EN: Skip Assimp and the build when the on-disk cache matches the config and the source file.
+        const uint64_t configHash = bvh::calcHash(&isYup, sizeof(isYup), bvh::calcConfigHash(config));
+        const uint64_t sourceHash = bvh::calcFileHash(filePath);
+        const std::string filePathStr = filePath.string();
+        char cacheFileName[256];
+        snprintf(
+            cacheFileName, sizeof(cacheFileName), "%s_%016llx.bvh",
+            filePath.stem().string().c_str(),
+            static_cast<unsigned long long>(bvh::calcHash(filePathStr.c_str(), filePathStr.size())));
+        const std::filesystem::path cacheFilePath =
+            getExecutableDirectory() / "nrtdsm/bvh_cache" / cacheFileName;
+
+        ShellBvhCacheEntry &entry = g_shellBvhCache[filePath];
+        if (entry.mappedBvh.open(cacheFilePath, configHash, sourceHash)) {
+            *retBvh = entry.mappedBvh.getView();
+            return;
+        }
 
-        std::vector<TriangleGeometryOnCPU> geometries;
+        // EN: The BVH geometries refer to the object space meshes of the shared scene without copying.
+        const std::shared_ptr<const ImportedScene> scene = getImportedScene(filePath);
+        if (!scene) {
+            // EN: Drop the empty entry so that a later call retries instead of returning an empty BVH.
+            g_shellBvhCache.erase(filePath);
+            *retBvh = {};
+            return;
+        }
+        const Matrix4x4 sceneXfm = isYup ? rotate3DX_4x4(0.5f * pi_v<float>) : Matrix4x4();
         AABB aabb;
-        loadTriangleMeshGeometriesOnCPU(
-            filePath,
-            isYup ? rotate3DX_4x4(0.5f * pi_v<float>) : Matrix4x4(),
-            &geometries, &aabb);
+        for (const ImportedNode &node : scene->nodes) {
+            const Matrix4x4 xfm = sceneXfm * node.transform;
+            for (const uint32_t meshIdx : scene->getMeshIndices(node)) {
+                for (const shared::Vertex &v : scene->getVertices(scene->meshes[meshIdx]))
+                    aabb.unify(xfm * v.position);
+            }
+        }
         const Point3D aabbCenter = aabb.getCenter();
         const Vector3D aabbDim = aabb.maxP - aabb.minP;
 
@@ -844,35 +840,45 @@ static void buildTriangleMeshShellBvh(
             scale3D_4x4(1.0f / stc::max(aabbDim.x, aabbDim.y)) *
             translate3D_4x4(Point3D(-aabbCenter.xy(), -aabb.minP.z));
 
-        for (uint32_t geomIdx = 0; geomIdx < geometries.size(); ++geomIdx) {
-            const TriangleGeometryOnCPU &srcGeom = geometries[geomIdx];
-            bvh::Geometry bvhGeom = {};
-            bvhGeom.vertices = srcGeom.vertices.data();
-            bvhGeom.vertexStride = sizeof(srcGeom.vertices[0]);
-            bvhGeom.vertexFormat = bvh::VertexFormat::Fp32x3;
-            bvhGeom.numVertices = srcGeom.vertices.size();
-            bvhGeom.triangles = srcGeom.triangles.data();
-            bvhGeom.triangleStride = sizeof(srcGeom.triangles[0]);
-            bvhGeom.triangleFormat = bvh::TriangleFormat::UI32x3;
-            bvhGeom.numTriangles = srcGeom.triangles.size();
-            bvhGeom.preTransform = preTransform;
-            bvhGeometries.push_back(bvhGeom);
+        std::vector<bvh::Geometry> bvhGeometries;
+        for (const ImportedNode &node : scene->nodes) {
+            for (const uint32_t meshIdx : scene->getMeshIndices(node)) {
+                const ImportedMesh &mesh = scene->meshes[meshIdx];
+                const std::span<const shared::Vertex> srcVertices = scene->getVertices(mesh);
+                bvh::Geometry bvhGeom = {};
+                bvhGeom.vertices = srcVertices.data();
+                bvhGeom.vertexStride = sizeof(srcVertices[0]);
+                bvhGeom.vertexFormat = bvh::VertexFormat::Fp32x3;
+                bvhGeom.numVertices = srcVertices.size();
+                if (mesh.indexFormat == ImportedIndexFormat::UI16x3) {
+                    const std::span<const ImportedTriangle16> srcTriangles = scene->getTriangles16(mesh);
+                    bvhGeom.triangles = srcTriangles.data();
+                    bvhGeom.triangleStride = sizeof(srcTriangles[0]);
+                    bvhGeom.triangleFormat = bvh::TriangleFormat::UI16x3;
+                    bvhGeom.numTriangles = srcTriangles.size();
+                }
+                else {
+                    const std::span<const shared::Triangle> srcTriangles = scene->getTriangles(mesh, nullptr);
+                    bvhGeom.triangles = srcTriangles.data();
+                    bvhGeom.triangleStride = sizeof(srcTriangles[0]);
+                    bvhGeom.triangleFormat = bvh::TriangleFormat::UI32x3;
+                    bvhGeom.numTriangles = srcTriangles.size();
+                }
+                bvhGeom.preTransform = preTransform * sceneXfm * node.transform;
+                bvhGeometries.push_back(bvhGeom);
+            }
         }
 
-        bvh::GeometryBVHBuildConfig config = {};
-        config.splittingBudget = 0.3f;
-        config.intNodeTravCost = 1.2f;
-        config.primIntersectCost = 1.0f;
-        config.minNumPrimsPerLeaf = 1;
-        config.maxNumPrimsPerLeaf = 128;
-
-        bvh::GeometryBVH<shared::shellBvhArity> bvh;
-        bvh::buildGeometryBVH(bvhGeometries.data(), bvhGeometries.size(), config, &bvh);
-
-        g_shellBvhCache[filePath] = std::move(bvh);
+        bvh::buildGeometryBVH(bvhGeometries.data(), bvhGeometries.size(), config, &entry.bvh);
+        if (!bvh::writeGeometryBVHCache(cacheFilePath, entry.bvh, configHash, sourceHash))
+            hpprintf("Failed to write the BVH cache: %s\n", cacheFilePath.string().c_str());
     }
 
-    *retBvh = g_shellBvhCache.at(filePath);
+    const ShellBvhCacheEntry &entry = g_shellBvhCache.at(filePath);
+    if (entry.mappedBvh.isValid())
+        *retBvh = entry.mappedBvh.getView();
+    else
+        *retBvh = bvh::GeometryBVHView<shared::shellBvhArity>(entry.bvh);
 }
 
 // END: Shell Geometries
@@ -2084,7 +2090,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
                             auto &geom = std::get<TriangleGeometry>(baseMeshGeomInst->geometry);
 
                             geom.vertexBuffer.finalize();
-                            geom.vertexBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, vertices);
+                            initializeVertexBuffer(gpuEnv.cuContext, vertices, &geom.vertexBuffer);
                             geom.triangleBuffer.finalize();
                             geom.triangleBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, triangles);
 
@@ -2112,7 +2118,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
                             auto &geom = std::get<NRTDSMGeometry>(displacedMeshGeomInst->geometry);
 
                             geom.vertexBuffer.finalize();
-                            geom.vertexBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, vertices);
+                            initializeVertexBuffer(gpuEnv.cuContext, vertices, &geom.vertexBuffer);
                             geom.triangleBuffer.finalize();
                             geom.triangleBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, triangles);
 
@@ -2370,9 +2376,11 @@ int32_t main(int32_t argc, const char* argv[]) try {
                             shared::GeometryInstanceDataForNRTDSM nrtdsmData = {};
                             CUDADRV_CHECK(cuMemcpyDtoH(&nrtdsmData, addrOnDevice, sizeof(nrtdsmData)));
 
-                            bvh::GeometryBVH<shared::shellBvhArity> bvh;
+                            bvh::GeometryBVH<shared::shellBvhArity> boxBvh;
+                            bvh::GeometryBVHView<shared::shellBvhArity> bvh;
                             if (shellGeomIndex == 0) {
-                                buildOneBoxShellBvh(&bvh);
+                                buildOneBoxShellBvh(&boxBvh);
+                                bvh = bvh::GeometryBVHView<shared::shellBvhArity>(boxBvh);
                                 nrtdsmData.materialSlots[0] = shellBvhMatSlots[ShellBVHMaterial_White];
                             }
                             else if (shellGeomIndex == 1) {
@@ -2978,6 +2978,37 @@ static void calcTriangleVertices(
     *pC = geom.preTransform * ps[2];
 }
 
+// EN: A primary ray through the center of a pixel of the pinhole camera shared by the benchmarks.
+static bvh::Ray generatePrimaryRay(
+    const Matrix4x4 &camXfm, const uint32_t width, const uint32_t height,
+    const uint32_t ipx, const uint32_t ipy) {
+    const float aspect = static_cast<float>(width) / height;
+    const float fovY = 45 * pi_v<float> / 180;
+    const float px = ipx + 0.5f;
+    const float py = ipy + 0.5f;
+
+    const Vector3D rayDirInLocal(
+        aspect * tan(fovY * 0.5f) * (1 - 2 * px / width),
+        tan(fovY * 0.5f) * (1 - 2 * py / height),
+        1);
+    bvh::Ray ray;
+    ray.org = camXfm * Point3D(0, 0, 0);
+    ray.dir = camXfm * rayDirInLocal;
+    ray.distMin = 0.0f;
+    ray.distMax = 1e+10f;
+    return ray;
+}
+
+static std::vector<bvh::Ray> generatePrimaryRays(
+    const Matrix4x4 &camXfm, const uint32_t width, const uint32_t height) {
+    std::vector<bvh::Ray> rays(width * height);
+    for (uint32_t ipy = 0; ipy < height; ++ipy) {
+        for (uint32_t ipx = 0; ipx < width; ++ipx)
+            rays[width * ipy + ipx] = generatePrimaryRay(camXfm, width, height, ipx, ipy);
+    }
+    return rays;
+}
+
 void testBvhBuilder() {
     struct TestScene {
         std::filesystem::path filePath;
@@ -3175,13 +3206,18 @@ void testBvhBuilder() {
     constexpr bool visStats = false;
 
     constexpr uint32_t arity = 8;
+    // EN: 0 selects PLOC, a positive budget selects SBVH with spatial splits.
+    constexpr float splittingBudget = 0.3f;
 
     bvh::GeometryBVHBuildConfig config = {};
-    config.splittingBudget = 0.3f;
+    config.splittingBudget = splittingBudget;
     config.intNodeTravCost = 1.2f;
     config.primIntersectCost = 1.0f;
     config.minNumPrimsPerLeaf = 1;
     config.maxNumPrimsPerLeaf = 128;
+    config.builder = splittingBudget > 0.0f ?
+        bvh::GeometryBVHBuilder::SBVH : bvh::GeometryBVHBuilder::PLOC;
+    config.leafTriangleFormat = bvh::LeafTriangleFormat::Raw;
 
     hpprintf("Reading: %s ... ", scene.filePath.string().c_str());
     fflush(stdout);
@@ -3278,9 +3314,83 @@ void testBvhBuilder() {
     }
 
     bvh::GeometryBVH<arity> bvh;
-    bvh::buildGeometryBVH(
-        bvhGeoms.data(), static_cast<uint32_t>(bvhGeoms.size()),
-        config, &bvh);
+    static bool useBvhCache = true;
+    const uint64_t configHash = bvh::calcHash(
+        &scene.transform, sizeof(scene.transform), bvh::calcConfigHash(config));
+    const uint64_t sourceHash = useBvhCache ? bvh::calcFileHash(scene.filePath) : 0;
+    const std::filesystem::path bvhCacheFilePath =
+        getExecutableDirectory() / "nrtdsm/bvh_cache" / (scene.filePath.stem().string() + "_sandbox.bvh");
+    bvh::MappedGeometryBVH<arity> mappedBvh;
+    if (useBvhCache && mappedBvh.open(bvhCacheFilePath, configHash, sourceHash)) {
+        // EN: The code below expects a GeometryBVH so copy from the mapped file.
+        //     This is still much faster than the build itself.
+        const bvh::GeometryBVHView<arity> &view = mappedBvh.getView();
+        bvh.intNodes.assign(view.intNodes.begin(), view.intNodes.end());
+        bvh.triStorages.assign(view.triStorages.begin(), view.triStorages.end());
+        bvh.primRefs.assign(view.primRefs.begin(), view.primRefs.end());
+        bvh.parentPointers.assign(view.parentPointers.begin(), view.parentPointers.end());
+        bvh.numGeoms = view.numGeoms;
+        bvh.totalNumPrims = view.totalNumPrims;
+        bvh.sahCostAtBuild = view.sahCostAtBuild;
+        bvh::precomputeLeafTriangles(config.leafTriangleFormat, &bvh);
+        hpprintf("Loaded the BVH cache: %s\n", bvhCacheFilePath.string().c_str());
+    }
+    else {
+        bvh::buildGeometryBVH(
+            bvhGeoms.data(), static_cast<uint32_t>(bvhGeoms.size()),
+            config, &bvh);
+        if (useBvhCache)
+            bvh::writeGeometryBVHCache(bvhCacheFilePath, bvh, configHash, sourceHash);
+    }
+
+    // EN: Write a machine-readable quality report so that the build config can be tuned per scene.
+    static bool writeBvhAnalysis = false;
+    if (writeBvhAnalysis) {
+        const std::filesystem::path reportFilePath =
+            getExecutableDirectory() / "nrtdsm/bvh_analysis" /
+            (scene.filePath.stem().string() + "_arity" + std::to_string(arity) + ".json");
+        std::error_code errorCode;
+        std::filesystem::create_directories(reportFilePath.parent_path(), errorCode);
+        std::ofstream reportFile(reportFilePath);
+        reportFile << bvh::toJson(bvh::analyze(bvh, config), config);
+        hpprintf("Wrote the BVH analysis: %s\n", reportFilePath.string().c_str());
+    }
+
+    // EN: Compare build time and quality between the builders.
+    static bool compareBuilders = false;
+    if (compareBuilders) {
+        struct BuilderSetting {
+            bvh::GeometryBVHBuilder builder;
+            uint32_t numTreeletOptimizationPasses;
+            const char* name;
+        };
+        const BuilderSetting builders[] = {
+            { bvh::GeometryBVHBuilder::SBVH, 0, "SBVH" },
+            { bvh::GeometryBVHBuilder::LBVH, 0, "LBVH" },
+            { bvh::GeometryBVHBuilder::LBVH, 3, "LBVH + Treelet Restructuring" },
+            { bvh::GeometryBVHBuilder::PLOC, 0, "PLOC" },
+            { bvh::GeometryBVHBuilder::PLOC, 3, "PLOC + Treelet Restructuring" },
+        };
+        for (const BuilderSetting &builder : builders) {
+            bvh::GeometryBVHBuildConfig cmpConfig = config;
+            cmpConfig.builder = builder.builder;
+            cmpConfig.numTreeletOptimizationPasses = builder.numTreeletOptimizationPasses;
+            bvh::GeometryBVH<arity> cmpBvh;
+            bvh::BuildMemoryStatistics memStats = {};
+            StopWatchHiRes sw;
+            sw.start();
+            bvh::buildGeometryBVH(
+                bvhGeoms.data(), static_cast<uint32_t>(bvhGeoms.size()),
+                cmpConfig, &cmpBvh, &memStats);
+            const uint32_t mIdx = sw.stop();
+            hpprintf(
+                "%s: %.3f [ms], SAH cost: %.3f, %zu nodes, %.3f/%.3f [MiB] (peak/output)\n", builder.name,
+                sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds) * 1e-3f,
+                bvh::calcSahCost(cmpBvh, config.intNodeTravCost, config.primIntersectCost),
+                cmpBvh.intNodes.size(),
+                memStats.peakMemorySize / (1024.0 * 1024.0), memStats.outputMemorySize / (1024.0 * 1024.0));
+        }
+    }
 
     static bool enableVdbViz = false;
     if (enableVdbViz) {
@@ -3371,12 +3481,374 @@ void testBvhBuilder() {
         }
     }
 
+    // EN: Compare the single-ray, packet and stream traversals on primary rays and diffuse secondary rays.
+    static bool enableRayStreamBenchmark = false;
+    if (enableRayStreamBenchmark) {
+        constexpr uint32_t width = 1024;
+        constexpr uint32_t height = 1024;
+        constexpr uint32_t packetSize = 8;
+
+        const std::vector<bvh::Ray> primaryRays = generatePrimaryRays(scene.cameraTransform, width, height);
+
+        const auto benchmark = [&]
+        (const char* name, const std::vector<bvh::Ray> &rays, std::vector<shared::HitObject>* hitObjs) {
+            hitObjs->resize(rays.size());
+            StopWatchHiRes sw;
+            sw.start();
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+                const bvh::Ray &ray = rays[rayIdx];
+                (*hitObjs)[rayIdx] = bvh::traverse(bvh, ray.org, ray.dir, ray.distMin, ray.distMax);
+            }
+            const uint32_t singleIdx = sw.stop();
+
+            std::vector<shared::HitObject> packetHitObjs(rays.size());
+            sw.start();
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); rayIdx += packetSize) {
+                const uint32_t numRays = std::min(static_cast<uint32_t>(rays.size()) - rayIdx, packetSize);
+                bvh::traversePacket<arity, packetSize>(bvh, &rays[rayIdx], numRays, &packetHitObjs[rayIdx]);
+            }
+            const uint32_t packetIdx = sw.stop();
+
+            std::vector<shared::HitObject> streamHitObjs(rays.size());
+            sw.start();
+            bvh::traverseStream(bvh, rays.data(), static_cast<uint32_t>(rays.size()), streamHitObjs.data());
+            const uint32_t streamIdx = sw.stop();
+
+            uint32_t numMismatches = 0;
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+                const shared::HitObject &hitObj = (*hitObjs)[rayIdx];
+                if (packetHitObjs[rayIdx].dist != hitObj.dist || streamHitObjs[rayIdx].dist != hitObj.dist)
+                    ++numMismatches;
+            }
+            const auto calcMraysPerSec = [&](const uint32_t mIdx) {
+                return rays.size() / static_cast<double>(
+                    sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds));
+            };
+            hpprintf(
+                "%s (%zu rays): single %.2f, packet %.2f, stream %.2f [Mrays/s], %u mismatches\n",
+                name, rays.size(),
+                calcMraysPerSec(singleIdx), calcMraysPerSec(packetIdx), calcMraysPerSec(streamIdx),
+                numMismatches);
+        };
+
+        std::vector<shared::HitObject> primaryHitObjs;
+        benchmark("Primary", primaryRays, &primaryHitObjs);
+
+        std::mt19937 rng(591731);
+        std::uniform_real_distribution<float> u01;
+        std::vector<bvh::Ray> secondaryRays;
+        for (uint32_t rayIdx = 0; rayIdx < primaryRays.size(); ++rayIdx) {
+            const shared::HitObject &hitObj = primaryHitObjs[rayIdx];
+            if (!hitObj.isHit())
+                continue;
+            const bvh::Ray &primaryRay = primaryRays[rayIdx];
+            const bvh::Geometry &geom = bvhGeoms[hitObj.geomIndex];
+            Point3D pA, pB, pC;
+            calcTriangleVertices(geom, hitObj.primIndex, &pA, &pB, &pC);
+            Vector3D geomNormal = normalize(cross(pB - pA, pC - pA));
+            if (dot(geomNormal, primaryRay.dir) > 0)
+                geomNormal = -geomNormal;
+            Vector3D dir;
+            do {
+                dir = Vector3D(2 * u01(rng) - 1, 2 * u01(rng) - 1, 2 * u01(rng) - 1);
+            } while (dir.sqLength() > 1.0f || dir.sqLength() == 0.0f);
+            dir = normalize(normalize(dir) + geomNormal);
+
+            bvh::Ray ray;
+            ray.org = primaryRay.org + hitObj.dist * primaryRay.dir + 1e-4f * geomNormal;
+            ray.dir = dir;
+            ray.distMin = 0.0f;
+            ray.distMax = 1e+10f;
+            secondaryRays.push_back(ray);
+        }
+        std::vector<shared::HitObject> secondaryHitObjs;
+        benchmark("Secondary", secondaryRays, &secondaryHitObjs);
+    }
+
+    // EN: Compare the memory and the throughput of the leaf triangle formats on primary rays.
+    static bool enableLeafTriangleFormatBenchmark = false;
+    if (enableLeafTriangleFormatBenchmark) {
+        constexpr uint32_t width = 1024;
+        constexpr uint32_t height = 1024;
+
+        struct FormatSetting {
+            bvh::LeafTriangleFormat format;
+            const char* name;
+        };
+        const FormatSetting formats[] = {
+            { bvh::LeafTriangleFormat::Raw, "Raw" },
+            { bvh::LeafTriangleFormat::Woop, "Woop" },
+            { bvh::LeafTriangleFormat::WoopSoA4, "Woop SoA4" },
+            { bvh::LeafTriangleFormat::WoopSoA8, "Woop SoA8" },
+        };
+        bvh::GeometryBVH<arity> formatBvh = bvh;
+        for (const FormatSetting &setting : formats) {
+            bvh::precomputeLeafTriangles(setting.format, &formatBvh);
+            const size_t triMemSize =
+                sizeof(formatBvh.triStorages[0]) * formatBvh.triStorages.size() +
+                sizeof(formatBvh.woopTris[0]) * formatBvh.woopTris.size() +
+                sizeof(formatBvh.woopTriBlocks4[0]) * formatBvh.woopTriBlocks4.size() +
+                sizeof(formatBvh.woopTriBlocks8[0]) * formatBvh.woopTriBlocks8.size() +
+                sizeof(formatBvh.leafTriBlockIndices[0]) * formatBvh.leafTriBlockIndices.size();
+
+            StopWatchHiRes sw;
+            sw.start();
+            uint32_t numHits = 0;
+            for (uint32_t ipy = 0; ipy < height; ++ipy) {
+                for (uint32_t ipx = 0; ipx < width; ++ipx) {
+                    const bvh::Ray ray = generatePrimaryRay(scene.cameraTransform, width, height, ipx, ipy);
+                    const shared::HitObject hitObj = bvh::traverse(
+                        formatBvh, ray.org, ray.dir, ray.distMin, ray.distMax);
+                    if (hitObj.isHit())
+                        ++numHits;
+                }
+            }
+            const uint32_t mIdx = sw.stop();
+            hpprintf(
+                "%s: %.2f [Mrays/s], %.3f [MiB] triangles, %u hits\n",
+                setting.name,
+                width * height / static_cast<double>(
+                    sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds)),
+                triMemSize / (1024.0 * 1024.0), numHits);
+        }
+    }
+
+    // EN: Compare node orderings by L1/L2 misses of node fetches and the throughput on primary rays.
+    //     Hardware counters are not accessible without a driver on Windows, so the node access trace is replayed
+    //     on a model of LRU set associative caches instead (32 KiB 8-way L1, 1 MiB 16-way L2, 64 B lines).
+    static bool enableNodeOrderBenchmark = false;
+    if (enableNodeOrderBenchmark) {
+        constexpr uint32_t width = 1024;
+        constexpr uint32_t height = 1024;
+
+        struct CacheModel {
+            uint32_t numSets;
+            uint32_t numWays;
+            std::vector<uint64_t> tags;
+            std::vector<uint64_t> lastUses;
+            uint64_t time;
+            uint64_t numMisses;
+
+            CacheModel(const uint32_t size, const uint32_t _numWays) :
+                numSets(size / 64 / _numWays), numWays(_numWays),
+                tags(numSets * numWays, UINT64_MAX), lastUses(numSets * numWays, 0),
+                time(0), numMisses(0) {}
+
+            // EN: Returns whether the line hits.
+            bool access(const uint64_t line) {
+                const uint32_t baseIdx = (line % numSets) * numWays;
+                ++time;
+                uint32_t lruIdx = baseIdx;
+                for (uint32_t wayIdx = baseIdx; wayIdx < baseIdx + numWays; ++wayIdx) {
+                    if (tags[wayIdx] == line) {
+                        lastUses[wayIdx] = time;
+                        return true;
+                    }
+                    if (lastUses[wayIdx] < lastUses[lruIdx])
+                        lruIdx = wayIdx;
+                }
+                ++numMisses;
+                tags[lruIdx] = line;
+                lastUses[lruIdx] = time;
+                return false;
+            }
+        };
+
+        const auto benchmark = [&]
+        (const char* name, const bvh::GeometryBVH<arity> &orderedBvh, std::vector<uint32_t>* accessCounts) {
+            if (accessCounts)
+                accessCounts->assign(orderedBvh.intNodes.size(), 0);
+            StopWatchHiRes sw;
+            sw.start();
+            for (uint32_t ipy = 0; ipy < height; ++ipy) {
+                for (uint32_t ipx = 0; ipx < width; ++ipx) {
+                    const bvh::Ray ray = generatePrimaryRay(scene.cameraTransform, width, height, ipx, ipy);
+                    bvh::traverse(orderedBvh, ray.org, ray.dir, ray.distMin, ray.distMax);
+                }
+            }
+            const uint32_t mIdx = sw.stop();
+
+            CacheModel l1(32 * 1024, 8);
+            CacheModel l2(1024 * 1024, 16);
+            std::vector<uint32_t> trace;
+            for (uint32_t ipy = 0; ipy < height; ++ipy) {
+                for (uint32_t ipx = 0; ipx < width; ++ipx) {
+                    const bvh::Ray ray = generatePrimaryRay(scene.cameraTransform, width, height, ipx, ipy);
+                    bvh::TraversalStatistics stats = {};
+                    stats.intNodeAccessCounts = accessCounts ? accessCounts->data() : nullptr;
+                    stats.intNodeAccessTrace = &trace;
+                    trace.clear();
+                    bvh::traverse(orderedBvh, ray.org, ray.dir, ray.distMin, ray.distMax, &stats);
+                    for (const uint32_t intNodeIdx : trace) {
+                        const uint64_t begin = sizeof(orderedBvh.intNodes[0]) * intNodeIdx;
+                        const uint64_t end = begin + sizeof(orderedBvh.intNodes[0]);
+                        for (uint64_t line = begin / 64; line < (end + 63) / 64; ++line) {
+                            if (!l1.access(line))
+                                l2.access(line);
+                        }
+                    }
+                }
+            }
+            const uint32_t numRays = width * height;
+            hpprintf(
+                "%s: %.3f L1 misses/ray, %.4f L2 misses/ray, %.2f [Mrays/s]\n",
+                name,
+                static_cast<double>(l1.numMisses) / numRays, static_cast<double>(l2.numMisses) / numRays,
+                numRays / static_cast<double>(sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds)));
+        };
+
+        std::vector<uint32_t> accessCounts;
+        benchmark("Build order", bvh, &accessCounts);
+
+        bvh::GeometryBVH<arity> orderedBvh = bvh;
+        bvh::reorderGeometryBVH(bvh::NodeOrder::SubtreeSize, nullptr, &orderedBvh);
+        benchmark("Subtree size order", orderedBvh, nullptr);
+
+        orderedBvh = bvh;
+        bvh::reorderGeometryBVH(bvh::NodeOrder::AccessFrequency, accessCounts.data(), &orderedBvh);
+        benchmark("Access frequency order", orderedBvh, nullptr);
+    }
+
+    // EN: Compare the memory traffic and the throughput of the short stack traversal with the full stack.
+    //     The memory traffic of the full stack is the spill beyond a fast stack of the same number of entries.
+    static bool enableShortStackBenchmark = false;
+    if (enableShortStackBenchmark) {
+        constexpr uint32_t width = 1024;
+        constexpr uint32_t height = 1024;
+
+        const std::vector<bvh::Ray> rays = generatePrimaryRays(scene.cameraTransform, width, height);
+
+        std::vector<shared::HitObject> refHitObjs(rays.size());
+        const auto benchmark = [&]
+        <uint32_t shortStackSize>() {
+            StopWatchHiRes sw;
+            uint64_t stackMemoryAccessAmount = 0;
+            sw.start();
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+                const bvh::Ray &ray = rays[rayIdx];
+                bvh::TraversalStatistics stats = {};
+                stats.fastStackDepthLimit = shortStackSize - 1;
+                refHitObjs[rayIdx] = bvh::traverse(bvh, ray.org, ray.dir, ray.distMin, ray.distMax, &stats);
+                stackMemoryAccessAmount += stats.stackMemoryAccessAmount;
+            }
+            const uint32_t fullIdx = sw.stop();
+
+            uint64_t shortStackMemoryAccessAmount = 0;
+            uint32_t numMismatches = 0;
+            sw.start();
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+                const bvh::Ray &ray = rays[rayIdx];
+                bvh::TraversalStatistics stats = {};
+                const shared::HitObject hitObj = bvh::traverseWithShortStack<arity, shortStackSize>(
+                    bvh, ray.org, ray.dir, ray.distMin, ray.distMax, &stats);
+                shortStackMemoryAccessAmount += stats.stackMemoryAccessAmount;
+                if (hitObj.dist != refHitObjs[rayIdx].dist)
+                    ++numMismatches;
+            }
+            const uint32_t shortIdx = sw.stop();
+
+            const auto calcMraysPerSec = [&](const uint32_t mIdx) {
+                return rays.size() / static_cast<double>(
+                    sw.getMeasurement(mIdx, StopWatchDurationType::Microseconds));
+            };
+            hpprintf(
+                "Stack size %u: full %.2f [Mrays/s] %.2f [B/ray], short %.2f [Mrays/s] %.2f [B/ray], "
+                "%u mismatches\n",
+                shortStackSize,
+                calcMraysPerSec(fullIdx), static_cast<double>(stackMemoryAccessAmount) / rays.size(),
+                calcMraysPerSec(shortIdx), static_cast<double>(shortStackMemoryAccessAmount) / rays.size(),
+                numMismatches);
+        };
+        benchmark.operator()<1>();
+        benchmark.operator()<2>();
+        benchmark.operator()<4>();
+        benchmark.operator()<8>();
+    }
+
+    // EN: Build the incremental BVH by inserting all the primitives, compare it with the full build,
+    //     then remove and reinsert a part of the primitives and optimize the tree.
+    static bool enableDynamicBvhTest = false;
+    if (enableDynamicBvhTest) {
+        constexpr uint32_t width = 256;
+        constexpr uint32_t height = 256;
+
+        const std::vector<bvh::Ray> rays = generatePrimaryRays(scene.cameraTransform, width, height);
+
+        bvh::DynamicGeometryBVHConfig dynConfig = {};
+        dynConfig.intNodeTravCost = 1.2f;
+        dynConfig.primIntersectCost = 1.0f;
+        dynConfig.optimizationInterval = 4096;
+        dynConfig.optimizationRatio = 0.01f;
+        bvh::DynamicGeometryBVH dynBvh(dynConfig);
+
+        StopWatchHiRes sw;
+        sw.start();
+        std::vector<uint32_t> dynGeomIndices(bvhGeoms.size());
+        for (uint32_t geomIdx = 0; geomIdx < bvhGeoms.size(); ++geomIdx)
+            dynGeomIndices[geomIdx] = dynBvh.addGeometry(bvhGeoms[geomIdx]);
+        const uint32_t numPrims = dynBvh.getNumPrimitives();
+        const uint64_t insertTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds);
+        hpprintf(
+            "Insert %u primitives: %.3f [us/prim], SAH %.2f (full build %.2f)\n",
+            numPrims, static_cast<double>(insertTime) / numPrims,
+            dynBvh.calcSahCost(), bvh.sahCostAtBuild);
+
+        const auto compareWithFullBuild = [&](const char* label) {
+            uint32_t numMismatches = 0;
+            uint64_t numAabbTests = 0;
+            for (uint32_t rayIdx = 0; rayIdx < rays.size(); ++rayIdx) {
+                const bvh::Ray &ray = rays[rayIdx];
+                const shared::HitObject refHitObj = bvh::traverse(
+                    bvh, ray.org, ray.dir, ray.distMin, ray.distMax);
+                bvh::TraversalStatistics stats = {};
+                const shared::HitObject hitObj = dynBvh.traverse(
+                    ray.org, ray.dir, ray.distMin, ray.distMax, &stats);
+                numAabbTests += stats.numAabbTests;
+                if (hitObj.dist != refHitObj.dist)
+                    ++numMismatches;
+            }
+            hpprintf(
+                "%s: %.2f AABB tests/ray, %u mismatches\n",
+                label, static_cast<double>(numAabbTests) / rays.size(), numMismatches);
+        };
+        compareWithFullBuild("Incremental");
+
+        // EN: Remove every other primitive and reinsert them.
+        uint32_t numMutatedPrims = 0;
+        sw.start();
+        for (uint32_t geomIdx = 0; geomIdx < bvhGeoms.size(); ++geomIdx) {
+            for (uint32_t primIdx = 0; primIdx < bvhGeoms[geomIdx].numTriangles; primIdx += 2) {
+                dynBvh.removePrimitive(dynGeomIndices[geomIdx], primIdx);
+                ++numMutatedPrims;
+            }
+        }
+        const uint64_t removeTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds);
+        sw.start();
+        for (uint32_t geomIdx = 0; geomIdx < bvhGeoms.size(); ++geomIdx) {
+            for (uint32_t primIdx = 0; primIdx < bvhGeoms[geomIdx].numTriangles; primIdx += 2)
+                dynBvh.insertPrimitive(dynGeomIndices[geomIdx], primIdx);
+        }
+        const uint64_t reinsertTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds);
+        hpprintf(
+            "Remove/reinsert %u primitives: %.3f/%.3f [us/prim], SAH %.2f\n",
+            numMutatedPrims,
+            static_cast<double>(removeTime) / numMutatedPrims,
+            static_cast<double>(reinsertTime) / numMutatedPrims,
+            dynBvh.calcSahCost());
+
+        sw.start();
+        const uint32_t numReinsertions = dynBvh.optimize(numPrims / 10);
+        const uint64_t optimizeTime = sw.getMeasurement(sw.stop(), StopWatchDurationType::Microseconds);
+        hpprintf(
+            "Optimize %u nodes: %.3f [ms], SAH %.2f\n",
+            numReinsertions, optimizeTime * 1e-3, dynBvh.calcSahCost());
+        compareWithFullBuild("Optimized");
+    }
+
     static bool enableTraversalTest = true;
     if (enableTraversalTest) {
         constexpr uint32_t width = 1024;
         constexpr uint32_t height = 1024;
-        const float aspect = static_cast<float>(width) / height;
-        const float fovY = 45 * pi_v<float> / 180;
 
         for (uint32_t camIdx = 0; camIdx < 30; ++camIdx) {
             if (camIdx != singleCamIdx && singleCamIdx != -1)
@@ -3386,66 +3858,69 @@ void testBvhBuilder() {
                 scene.cameraTransform;
 
             std::vector<float4> image(width * height);
-            double sumMaxStackDepth = 0;
-            int32_t maxMaxStackDepth = -1;
-            double sumAvgStackAccessDepth = 0;
-            float maxAvgStackAccessDepth = -INFINITY;
             constexpr int32_t fastStackDepthLimit = 12 - 1;
-            uint64_t stackMemoryAccessAmount = 0;
-            for (uint32_t ipy = 0; ipy < height; ++ipy) {
-                for (uint32_t ipx = 0; ipx < width; ++ipx) {
-                    const float px = ipx + 0.5f;
-                    const float py = ipy + 0.5f;
-
-                    const Vector3D rayDirInLocal(
-                        aspect * tan(fovY * 0.5f) * (1 - 2 * px / width),
-                        tan(fovY * 0.5f) * (1 - 2 * py / height),
-                        1);
-                    const Point3D rayOrg = camXfm * Point3D(0, 0, 0);
-                    const Vector3D rayDir = camXfm * rayDirInLocal;
-                    bvh::TraversalStatistics stats = {};
-                    stats.fastStackDepthLimit = fastStackDepthLimit;
-                    const shared::HitObject hitObj = bvh::traverse(
-                        bvh, rayOrg, rayDir, 0.0f, 1e+10f, &stats/*,
-                        ipx == 691 && ipy == 458*/);
-
-                    RGB color;
-                    if (visStats) {
-                        const float t = static_cast<float>(
-                            stc::min(stats.numAabbTests + stats.numTriTests, maxNumIntersections)) /
-                            maxNumIntersections;
-                        const RGB Red(1, 0, 0);
-                        const RGB Green(0, 1, 0);
-                        const RGB Blue(0, 0, 1);
-                        color = t < 0.5f ? lerp(Blue, Green, 2.0f * t) : lerp(Green, Red, 2.0f * t - 1.0);
-                    }
-                    else {
-                        if (hitObj.isHit()) {
-                            const bvh::Geometry &geom = bvhGeoms[hitObj.geomIndex];
-                            Point3D pA, pB, pC;
-                            calcTriangleVertices(geom, hitObj.primIndex, &pA, &pB, &pC);
-                            const Vector3D geomNormal = normalize(cross(pB - pA, pC - pA));
-                            color.r = 0.5f + 0.5f * geomNormal.x;
-                            color.g = 0.5f + 0.5f * geomNormal.y;
-                            color.b = 0.5f + 0.5f * geomNormal.z;
-                        }
-                    }
 
-                    image[width * ipy + ipx] = float4(color.toNative(), 1.0f);
-                    sumMaxStackDepth += stats.maxStackDepth;
-                    maxMaxStackDepth = std::max(stats.maxStackDepth, maxMaxStackDepth);
-                    sumAvgStackAccessDepth += stats.avgStackAccessDepth;
-                    maxAvgStackAccessDepth = std::max(stats.avgStackAccessDepth, maxAvgStackAccessDepth);
-                    stackMemoryAccessAmount += stats.stackMemoryAccessAmount;
+            bvh::TiledRenderConfig renderConfig = {};
+            renderConfig.width = width;
+            renderConfig.height = height;
+            renderConfig.tileSize = 16;
+            renderConfig.numThreads = 0;
+            renderConfig.fastStackDepthLimit = fastStackDepthLimit;
+            renderConfig.generateRay = [&]
+            (const uint32_t ipx, const uint32_t ipy) {
+                return generatePrimaryRay(camXfm, width, height, ipx, ipy);
+            };
+            renderConfig.shadePixel = [&]
+            (const uint32_t ipx, const uint32_t ipy, const bvh::Ray &ray,
+             const shared::HitObject &hitObj, const bvh::TraversalStatistics &stats) {
+                RGB color;
+                if (visStats) {
+                    const float t = static_cast<float>(
+                        stc::min(stats.numAabbTests + stats.numTriTests, maxNumIntersections)) /
+                        maxNumIntersections;
+                    const RGB Red(1, 0, 0);
+                    const RGB Green(0, 1, 0);
+                    const RGB Blue(0, 0, 1);
+                    color = t < 0.5f ? lerp(Blue, Green, 2.0f * t) : lerp(Green, Red, 2.0f * t - 1.0);
                 }
-            }
-            hpprintf("Avg Stack Access Depth - Avg: %.3f\n", sumAvgStackAccessDepth / (width * height));
-            hpprintf("                       - Max: %.3f\n", maxAvgStackAccessDepth);
-            hpprintf("Max Stack Depth - Avg: %.3f\n", sumMaxStackDepth / (width * height));
-            hpprintf("                - Max: %d\n", maxMaxStackDepth);
+                else {
+                    if (hitObj.isHit()) {
+                        const bvh::Geometry &geom = bvhGeoms[hitObj.geomIndex];
+                        Point3D pA, pB, pC;
+                        calcTriangleVertices(geom, hitObj.primIndex, &pA, &pB, &pC);
+                        const Vector3D geomNormal = normalize(cross(pB - pA, pC - pA));
+                        color.r = 0.5f + 0.5f * geomNormal.x;
+                        color.g = 0.5f + 0.5f * geomNormal.y;
+                        color.b = 0.5f + 0.5f * geomNormal.z;
+                    }
+                }
+
+                image[width * ipy + ipx] = float4(color.toNative(), 1.0f);
+            };
+            renderConfig.onTileFinished = [&]
+            (const bvh::RenderTile &tile, const uint32_t numFinishedTiles, const uint32_t numTiles) {
+                // EN: Report the progress in 10% steps.
+                if (10 * numFinishedTiles / numTiles != 10 * (numFinishedTiles - 1) / numTiles)
+                    hpprintf("Camera %u: %u%%\n", camIdx, 100 * numFinishedTiles / numTiles);
+            };
+
+            bvh::TiledRenderStatistics renderStats;
+            StopWatchHiRes sw;
+            sw.start();
+            bvh::renderTiled(bvh, renderConfig, &renderStats);
+            const uint32_t renderIdx = sw.stop();
+            hpprintf(
+                "Render: %.3f [ms], %.2f [Mrays/s]\n",
+                sw.getMeasurement(renderIdx, StopWatchDurationType::Microseconds) * 1e-3,
+                renderStats.numRays / static_cast<double>(
+                    sw.getMeasurement(renderIdx, StopWatchDurationType::Microseconds)));
+            hpprintf("Avg Stack Access Depth - Avg: %.3f\n", renderStats.sumAvgStackAccessDepth / (width * height));
+            hpprintf("                       - Max: %.3f\n", renderStats.maxAvgStackAccessDepth);
+            hpprintf("Max Stack Depth - Avg: %.3f\n", renderStats.sumMaxStackDepth / (width * height));
+            hpprintf("                - Max: %d\n", renderStats.maxMaxStackDepth);
             hpprintf(
                 "Stack Memory Access: %llu [B] (#FastStackEntry: %d)",
-                stackMemoryAccessAmount, fastStackDepthLimit + 1);
+                renderStats.stackMemoryAccessAmount, fastStackDepthLimit + 1);
 
             SDRImageSaverConfig imageSaveConfig = {};
             imageSaveConfig.applyToneMap = false;
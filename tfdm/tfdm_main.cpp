@@ -720,51 +720,6 @@ static void createSphereBaseGeometry(
     }
 }
 
-struct BaseGeometry {
-    std::vector<shared::Vertex> vertices;
-    std::vector<shared::Triangle> triangles;
-};
-
-static std::map<std::filesystem::path, BaseGeometry> g_baseGeomCache;
-
-static void createTriangleMeshBaseGeometry(
-    const std::filesystem::path &filePath,
-    const Matrix4x4 &preTransform,
-    std::vector<shared::Vertex>* vertices,
-    std::vector<shared::Triangle>* triangles) {
-    if (!g_baseGeomCache.contains(filePath)) {
-        BaseGeometry baseGeom;
-
-        std::vector<TriangleGeometryOnCPU> geometries;
-        AABB aabb;
-        loadTriangleMeshGeometriesOnCPU(
-            filePath,
-            preTransform,
-            &geometries, &aabb);
-
-        uint32_t vtxBaseIdx = 0;
-        for (uint32_t geomIdx = 0; geomIdx < geometries.size(); ++geomIdx) {
-            const TriangleGeometryOnCPU &srcGeom = geometries[geomIdx];
-            baseGeom.vertices.insert(
-                baseGeom.vertices.end(), srcGeom.vertices.begin(), srcGeom.vertices.end());
-            for (uint32_t triIdx = 0; triIdx < srcGeom.triangles.size(); ++triIdx) {
-                shared::Triangle tri = srcGeom.triangles[triIdx];
-                tri.index0 += vtxBaseIdx;
-                tri.index1 += vtxBaseIdx;
-                tri.index2 += vtxBaseIdx;
-                baseGeom.triangles.push_back(tri);
-            }
-            vtxBaseIdx += srcGeom.vertices.size();
-        }
-
-        g_baseGeomCache[filePath] = std::move(baseGeom);
-    }
-
-    const BaseGeometry &baseGeom = g_baseGeomCache.at(filePath);
-    *vertices = baseGeom.vertices;
-    *triangles = baseGeom.triangles;
-}
-
 static void computeDisplacedTriangleAuxiliaryInfos(
     const std::vector<shared::Vertex> &vertices,
     const std::vector<shared::Triangle> &triangles,
@@ -2016,7 +1971,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
                             auto &geom = std::get<TriangleGeometry>(baseMeshGeomInst->geometry);
 
                             geom.vertexBuffer.finalize();
-                            geom.vertexBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, vertices);
+                            initializeVertexBuffer(gpuEnv.cuContext, vertices, &geom.vertexBuffer);
                             geom.triangleBuffer.finalize();
                             geom.triangleBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, triangles);
 
@@ -2044,7 +1999,7 @@ int32_t main(int32_t argc, const char* argv[]) try {
                             auto &geom = std::get<TFDMGeometry>(displacedMeshGeomInst->geometry);
 
                             geom.vertexBuffer.finalize();
-                            geom.vertexBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, vertices);
+                            initializeVertexBuffer(gpuEnv.cuContext, vertices, &geom.vertexBuffer);
                             geom.triangleBuffer.finalize();
                             geom.triangleBuffer.initialize(gpuEnv.cuContext, Scene::bufferType, triangles);
 